@@ -1,5 +1,71 @@
 LOCAL_PATH := $(call my-dir)
 
+# Hardware AES backends. Each needs instruction set flags the rest of the
+# library mustn't be built with, so they're separate static libraries; aes.c
+# only calls into them after checking the CPU at runtime.
+# The ARMv8 one needs a 4.9 or clang toolchain; build with HLS_AES_ARMV8=0
+# on older ones.
+HLS_AES_ARMV8 ?= 1
+hls_hw_cflags :=
+hls_hw_libs :=
+
+ifneq ($(filter x86 x86_64,$(TARGET_ARCH_ABI)),)
+include $(CLEAR_VARS)
+LOCAL_MODULE    := HLSPlayerSDK_aesni
+LOCAL_SRC_FILES := aes_x86.c
+LOCAL_CFLAGS    += -O2 -maes -msse2
+include $(BUILD_STATIC_LIBRARY)
+hls_hw_cflags += -DHLS_AES_NI
+hls_hw_libs += HLSPlayerSDK_aesni
+endif
+
+ifeq ($(HLS_AES_ARMV8),1)
+ifneq ($(filter armeabi-v7a arm64-v8a,$(TARGET_ARCH_ABI)),)
+include $(CLEAR_VARS)
+LOCAL_MODULE    := HLSPlayerSDK_aesarmv8
+LOCAL_SRC_FILES := aes_armv8.c
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_ARM_MODE  := arm
+LOCAL_CFLAGS    += -O2 -march=armv8-a -mfpu=crypto-neon-fp-armv8 -mfloat-abi=softfp
+else
+LOCAL_CFLAGS    += -O2 -march=armv8-a+crypto
+endif
+include $(BUILD_STATIC_LIBRARY)
+hls_hw_cflags += -DHLS_AES_ARMV8
+hls_hw_libs += HLSPlayerSDK_aesarmv8
+endif
+endif
+
+# Bit-sliced NEON AES, for ARM CPUs without the AES instructions; like the
+# start code search below, it's only called once the NEON hwcap is seen.
+ifneq ($(filter armeabi-v7a arm64-v8a,$(TARGET_ARCH_ABI)),)
+include $(CLEAR_VARS)
+LOCAL_MODULE    := HLSPlayerSDK_aesneon
+LOCAL_SRC_FILES := aes_neon.c
+LOCAL_CFLAGS    += -O2
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_ARM_NEON  := true
+endif
+include $(BUILD_STATIC_LIBRARY)
+hls_hw_cflags += -DHLS_AES_NEON
+hls_hw_libs += HLSPlayerSDK_aesneon
+endif
+
+# NEON start code search; NEON is optional on armeabi-v7a, so it's built on
+# its own and StartCode.cpp checks for it at runtime.
+ifneq ($(filter armeabi-v7a arm64-v8a,$(TARGET_ARCH_ABI)),)
+include $(CLEAR_VARS)
+LOCAL_MODULE    := HLSPlayerSDK_startcode_neon
+LOCAL_SRC_FILES := mpeg2ts_parser/StartCode_neon.cpp
+LOCAL_CFLAGS    += -O2 -DHLS_STARTCODE_NEON
+ifeq ($(TARGET_ARCH_ABI),armeabi-v7a)
+LOCAL_ARM_NEON  := true
+endif
+include $(BUILD_STATIC_LIBRARY)
+hls_hw_cflags += -DHLS_STARTCODE_NEON
+hls_hw_libs += HLSPlayerSDK_startcode_neon
+endif
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE    := HLSPlayerSDK
@@ -26,13 +92,13 @@ sbrdec_sources := $(sbrdec_sources:$(LOCAL_PATH)/fdk-aac-master/libSBRdec/src/%=
 LOCAL_SRC_FILES += HLSPlayerSDK.cpp HLSSegment.cpp HLSPlayer.cpp AudioTrack.cpp  RefCounted.cpp 
 LOCAL_SRC_FILES += androidVideoShim.cpp androidVideoShim_ColorConverter.cpp androidVideoShim_ColorConverter444.cpp
 LOCAL_SRC_FILES += aes.c AudioPlayer.cpp AudioFDK.cpp ESDS.cpp
-LOCAL_SRC_FILES += HLSSegmentCache.cpp debug.cpp
+LOCAL_SRC_FILES += HLSSegmentCache.cpp HLSSegmentDiskCache.cpp HLSCryptoTable.cpp debug.cpp
 
 # MPEG 2 TS Extractor
 LOCAL_SRC_FILES += mpeg2ts_parser/AAtomizer.cpp mpeg2ts_parser/ABitReader.cpp mpeg2ts_parser/ABuffer.cpp mpeg2ts_parser/AMessage.cpp
 LOCAL_SRC_FILES += mpeg2ts_parser/AnotherPacketSource.cpp mpeg2ts_parser/AString.cpp mpeg2ts_parser/ATSParser.cpp mpeg2ts_parser/avc_utils.cpp
 LOCAL_SRC_FILES += mpeg2ts_parser/base64.cpp mpeg2ts_parser/ESQueue.cpp mpeg2ts_parser/hexdump.cpp mpeg2ts_parser/MPEG2TSExtractor.cpp 
-LOCAL_SRC_FILES += mpeg2ts_parser/SharedBuffer.cpp mpeg2ts_parser/VectorImpl.cpp
+LOCAL_SRC_FILES += mpeg2ts_parser/SharedBuffer.cpp mpeg2ts_parser/VectorImpl.cpp mpeg2ts_parser/StartCode.cpp mpeg2ts_parser/AccessUnitPool.cpp
 
 # AACDEC
 LOCAL_SRC_FILES += $(aacdec_sources:%=fdk-aac-master/libAACdec/src/%)
@@ -43,6 +109,8 @@ LOCAL_SRC_FILES += $(sbrdec_sources:%=fdk-aac-master/libSBRdec/src/%)
 LOCAL_SRC_FILES += $(pcmutils_sources:%=fdk-aac-master/libPCMutils/src/%)
 
 LOCAL_CFLAGS += -DHAVE_SYS_UIO_H -Wno-multichar -Wno-pmf-conversions -g
+LOCAL_CFLAGS += $(hls_hw_cflags)
+LOCAL_STATIC_LIBRARIES += $(hls_hw_libs)
 
 # -fdump-class-hierarchy
 LOCAL_C_INCLUDES += $(TOP)/system/core/include ./libyuv/
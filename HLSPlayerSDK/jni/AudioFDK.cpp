@@ -262,6 +262,8 @@ bool AudioFDK::Start()
 
 	if (!mPlayingSilence)
 	{
+		// A seek within the buffer starts us again without stopping us first.
+		if (mAACDecoder) aacDecoder_Close(mAACDecoder);
 		mAACDecoder = aacDecoder_Open(TT_MP4_ADIF, 1); // This is what SoftAAC2 does in initDecoder()
 		if (mAACDecoder != NULL)
 		{
@@ -491,6 +493,18 @@ void AudioFDK::Flush()
 
 }
 
+void AudioFDK::FlushDecoder(double timeSecs)
+{
+	LOGTRACE("%s", __func__);
+
+	// We decode the access units ourselves, so only our decoder's input
+	// buffer has anything from before the move. Wait out a decode in
+	// progress on the update thread first.
+	pthread_mutex_lock(&updateMutex);
+	if (mAACDecoder) aacDecoder_SetParam(mAACDecoder, AAC_TPDEC_CLEAR_BUFFER, 1);
+	pthread_mutex_unlock(&updateMutex);
+}
+
 void AudioFDK::forceTimeStampUpdate()
 {
 	LOGTRACE("%s", __func__);
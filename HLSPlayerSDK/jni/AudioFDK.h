@@ -29,6 +29,7 @@ public:
 	void Play();
 	void Pause();
 	void Flush();
+	void FlushDecoder(double timeSecs);
 	bool Stop(bool seeking = false);
 
 	bool Set(android_video_shim::sp<android_video_shim::MediaSource> audioSource, bool alreadyStarted = false);
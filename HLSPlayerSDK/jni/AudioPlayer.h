@@ -52,6 +52,7 @@ public:
 	virtual void Play() = 0; // begins playback
 	virtual void Pause() = 0; // pauses playback
 	virtual void Flush() = 0; // Flushes any buffers
+	virtual void FlushDecoder(double timeSecs) = 0; // Drops what the decoder holds from before its source was moved to timeSecs; call while paused
 	virtual bool Stop(bool seeking = false) = 0; // Stops playback completely.
 
 	virtual bool Set(android_video_shim::sp<android_video_shim::MediaSource> audioSource, bool alreadyStarted = false) = 0; // Set a DataSource from 4.0 android and later
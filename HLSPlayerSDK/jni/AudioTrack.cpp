@@ -398,6 +398,18 @@ void AudioTrack::Flush()
 
 }
 
+void AudioTrack::FlushDecoder(double timeSecs)
+{
+	LOGTRACE("%s", __func__);
+
+	// Let a read in progress on the update thread finish; the next read has
+	// the decoder flush before it decodes anything from the new position.
+	pthread_mutex_lock(&updateMutex);
+	mReadOptions.setSeekTo((int64_t)(timeSecs * 1000000.0));
+	mReadOptions23.setSeekTo((int64_t)(timeSecs * 1000000.0));
+	pthread_mutex_unlock(&updateMutex);
+}
+
 void AudioTrack::forceTimeStampUpdate()
 {
 	LOGTRACE("%s", __func__);
@@ -444,9 +456,9 @@ bool AudioTrack::ReadUntilTime(double timeSecs)
 	while (timeUs < targetTimeUs)
 	{
 		if(mAudioSource.get())
-			res = mAudioSource->read(&mediaBuffer, NULL);
+			res = mAudioSource->read(&mediaBuffer, &mReadOptions);
 		else if(mAudioSource23.get())
-			res = mAudioSource23->read(&mediaBuffer, NULL);
+			res = mAudioSource23->read(&mediaBuffer, &mReadOptions23);
 		else
 		{
 			// Set timeUs to our target, and let the loop fall out so that we can get the timestamp
@@ -456,6 +468,9 @@ bool AudioTrack::ReadUntilTime(double timeSecs)
 		}
 
 
+		mReadOptions.clearSeekTo();
+		mReadOptions23.clearSeekTo();
+
 		if (res == OK)
 		{
 			bool rval = mediaBuffer->meta_data()->findInt64(kKeyTime, &timeUs);
@@ -540,13 +555,15 @@ int AudioTrack::Update()
 	status_t res = OK;
 
 	if(mAudioSource.get())
-		res = mAudioSource->read(&mediaBuffer, NULL);
+		res = mAudioSource->read(&mediaBuffer, &mReadOptions);
 	else if(mAudioSource23.get())
-		res = mAudioSource23->read(&mediaBuffer, NULL);
+		res = mAudioSource23->read(&mediaBuffer, &mReadOptions23);
 	else
 	{
 		res = OK;
 	}
+	mReadOptions.clearSeekTo();
+	mReadOptions23.clearSeekTo();
 
 
 
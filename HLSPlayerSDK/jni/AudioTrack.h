@@ -28,6 +28,7 @@ public:
 	void Play();
 	void Pause();
 	void Flush();
+	void FlushDecoder(double timeSecs);
 	bool Stop(bool seeking = false);
 
 	bool Set(android_video_shim::sp<android_video_shim::MediaSource> audioSource, bool alreadyStarted = false);
@@ -68,6 +69,8 @@ private:
 
 	android_video_shim::sp<android_video_shim::MediaSource> mAudioSource;
 	android_video_shim::sp<android_video_shim::MediaSource23> mAudioSource23;
+	android_video_shim::MediaSource::ReadOptions mReadOptions;
+	android_video_shim::MediaSource23::ReadOptions mReadOptions23;
 
 	int mSampleRate;
 	int mNumChannels;
@@ -0,0 +1,177 @@
+#include <string.h>
+#include "HLSCryptoTable.h"
+#include "androidVideoShim.h"
+
+HLSCryptoTable::Slot * volatile HLSCryptoTable::mChunks[kMaxChunks];
+int HLSCryptoTable::mChunkCount = 0;
+std::vector<int> HLSCryptoTable::mFree;
+std::vector<int> HLSCryptoTable::mRetired;
+std::map<std::string, int> HLSCryptoTable::mLive;
+pthread_mutex_t HLSCryptoTable::mLock = PTHREAD_MUTEX_INITIALIZER;
+
+HLSCryptoTable::Slot *HLSCryptoTable::slotFor(int handle)
+{
+	if (handle < 0)
+		return NULL;
+
+	int index = handle & kIndexMask;
+	Slot *chunk = mChunks[index >> kChunkBits];
+	if (chunk == NULL)
+		return NULL;
+
+	return &chunk[index & (kChunkSize - 1)];
+}
+
+std::string HLSCryptoTable::liveKey(const unsigned char *key, const unsigned char *iv, bool sampleAes)
+{
+	std::string id((const char*)key, 16);
+	id.append((const char*)iv, 16);
+	id.push_back(sampleAes ? 1 : 0);
+	return id;
+}
+
+int HLSCryptoTable::alloc(const unsigned char *key, const unsigned char *iv, bool sampleAes)
+{
+	AutoLock locker(&mLock, __func__);
+
+	std::string id = liveKey(key, iv, sampleAes);
+	std::map<std::string, int>::iterator live = mLive.find(id);
+	if (live != mLive.end())
+	{
+		++slotFor(live->second)->refs;
+		return live->second;
+	}
+
+	// Slots freed while a decrypt had them pinned become reusable once the
+	// decrypt lets go.
+	for (size_t i = 0; i < mRetired.size(); )
+	{
+		Slot *slot = slotFor(mRetired[i]);
+		if (slot->users == 0)
+		{
+			mFree.push_back(mRetired[i]);
+			mRetired[i] = mRetired.back();
+			mRetired.pop_back();
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	if (mFree.empty())
+	{
+		if (mChunkCount == kMaxChunks)
+		{
+			LOGE("Out of crypto states (%d in use)", (int)mLive.size());
+			return -1;
+		}
+
+		Slot *chunk = new Slot[kChunkSize];
+		memset(chunk, 0, sizeof(Slot) * kChunkSize);
+		for (int i = kChunkSize - 1; i >= 0; --i)
+			mFree.push_back((mChunkCount << kChunkBits) + i);
+
+		// The chunk must be visible in full before lookups can reach it.
+		__sync_synchronize();
+		mChunks[mChunkCount++] = chunk;
+	}
+
+	int index = mFree.back();
+	mFree.pop_back();
+	Slot *slot = slotFor(index);
+
+	int32_t generation = ((slot->state >> 1) + 1) & kGenerationMask;
+	if (generation == 0)
+		generation = 1;
+
+	// Nobody can be using the context: stale lookups fail the generation
+	// check before they touch it.
+	AesCtxIni(&slot->ctx, (unsigned char*)iv, (unsigned char*)key, KEY128, CBC);
+	memcpy(slot->iv, iv, sizeof(slot->iv));
+	memcpy(slot->key, key, sizeof(slot->key));
+	slot->sampleAes = sampleAes;
+	slot->refs = 1;
+	__sync_synchronize();
+	slot->state = (generation << 1) | 1;
+
+	int handle = (generation << kIndexBits) | index;
+	mLive[id] = handle;
+	return handle;
+}
+
+bool HLSCryptoTable::retain(int handle)
+{
+	AutoLock locker(&mLock, __func__);
+
+	Slot *slot = slotFor(handle);
+	if (slot == NULL || slot->state != (((handle >> kIndexBits) << 1) | 1))
+		return false;
+
+	++slot->refs;
+	return true;
+}
+
+void HLSCryptoTable::free(int handle)
+{
+	AutoLock locker(&mLock, __func__);
+
+	Slot *slot = slotFor(handle);
+	int32_t live = ((handle >> kIndexBits) << 1) | 1;
+	if (slot == NULL || slot->state != live || slot->refs <= 0)
+	{
+		LOGE("Failed to locate cryptostate %d! Ignoring free request...", handle);
+		return;
+	}
+
+	if (--slot->refs > 0)
+		return;
+
+	mLive.erase(liveKey(slot->key, slot->iv, slot->sampleAes));
+
+	// Full barrier: an acquire() that pins after this sees the slot dead.
+	__sync_bool_compare_and_swap(&slot->state, live, live & ~1);
+
+	int index = handle & kIndexMask;
+	if (slot->users == 0)
+		mFree.push_back(index);
+	else
+		mRetired.push_back(index);
+}
+
+const AesCtx *HLSCryptoTable::acquire(int handle, const unsigned char **iv)
+{
+	Slot *slot = slotFor(handle);
+	if (slot == NULL)
+		return NULL;
+
+	// Pin first, then check; a free() that lands in between can't hand the
+	// slot out again while we hold the pin.
+	__sync_fetch_and_add(&slot->users, 1);
+	if (slot->state != (((handle >> kIndexBits) << 1) | 1))
+	{
+		__sync_fetch_and_sub(&slot->users, 1);
+		return NULL;
+	}
+
+	if (iv != NULL)
+		*iv = slot->iv;
+	return &slot->ctx;
+}
+
+void HLSCryptoTable::release(int handle)
+{
+	Slot *slot = slotFor(handle);
+	if (slot != NULL)
+		__sync_fetch_and_sub(&slot->users, 1);
+}
+
+bool HLSCryptoTable::isSampleAes(int handle)
+{
+	if (acquire(handle) == NULL)
+		return false;
+
+	bool sampleAes = slotFor(handle)->sampleAes;
+	release(handle);
+	return sampleAes;
+}
@@ -0,0 +1,88 @@
+#ifndef _HLSCRYPTOTABLE_H_
+#define _HLSCRYPTOTABLE_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "aes.h"
+#include "debug.h"
+
+// AES contexts handed to Java as integer handles. A handle is a slot index
+// tagged with the slot's generation, so a handle that has been freed (and
+// its slot reused) is recognised as stale instead of decrypting with
+// somebody else's key.
+//
+// Lookups are wait-free: acquire() pins the slot with an atomic increment
+// and checks the generation, and release() drops the pin. A freed slot is
+// only reused once every pin on it is gone. Allocation and freeing are rare
+// and take a lock.
+//
+// Each (key, IV) pair gets one reference counted slot however many segments
+// use it, and the slot is freed with its last reference. Contexts are never
+// changed after alloc(), so users decrypt with a copy and keep their own CBC
+// chain.
+//
+// Contexts live in chunks that are allocated on demand and never returned,
+// so a freed context is recycled rather than deleted.
+class HLSCryptoTable
+{
+private:
+	enum
+	{
+		kChunkBits = 6,
+		kChunkSize = 1 << kChunkBits,
+		kMaxChunks = 256,
+		kIndexBits = 14,            // kChunkSize * kMaxChunks slots.
+		kIndexMask = (1 << kIndexBits) - 1,
+		kGenerationMask = 0x1FFFF,  // Keeps handles positive.
+	};
+
+	struct Slot
+	{
+		volatile int32_t state; // Generation << 1, low bit set while live.
+		volatile int32_t users; // Pins held by acquire().
+		int32_t refs;           // alloc() and retain() calls not yet freed; under mLock.
+		AesCtx ctx;
+		unsigned char iv[16];   // As given to alloc().
+		unsigned char key[16];
+		bool sampleAes;
+	};
+
+	static Slot * volatile mChunks[kMaxChunks];
+	static int mChunkCount;
+	static std::vector<int> mFree;    // Dead and unpinned.
+	static std::vector<int> mRetired; // Dead, possibly still pinned.
+	static std::map<std::string, int> mLive; // Key, IV and mode to handle.
+	static pthread_mutex_t mLock;
+
+	static Slot *slotFor(int handle);
+	static std::string liveKey(const unsigned char *key, const unsigned char *iv, bool sampleAes);
+
+public:
+	// Returns a reference to the CBC context for key and iv, creating it if
+	// needed, or -1 if the table is full. SAMPLE-AES contexts are used by
+	// the demuxer on individual samples rather than on whole segments.
+	static int alloc(const unsigned char *key, const unsigned char *iv, bool sampleAes = false);
+
+	// Adds a reference to a live handle. Returns false if it has been freed.
+	static bool retain(int handle);
+
+	// Drops a reference. The last one invalidates the handle; decryption
+	// already running on it finishes.
+	static void free(int handle);
+
+	// Pins the context for handle. Returns NULL for an unknown or freed
+	// handle. Every non-NULL result must be matched by release(handle).
+	// If iv is given it is pointed at the context's initial IV, which stays
+	// valid while the context is pinned.
+	static const AesCtx *acquire(int handle, const unsigned char **iv = NULL);
+	static void release(int handle);
+
+	static bool isSampleAes(int handle);
+};
+
+#endif
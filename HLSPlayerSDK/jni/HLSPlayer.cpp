@@ -727,6 +727,20 @@ bool HLSPlayer::InitTracks()
 				mActiveAudioTrackIndex = i; // TODO: This is probably questionable.
 
 				mAudioTrack_md = meta;
+
+				// Nothing reads the main stream's own audio or this stream's
+				// video now, so have the demuxers drop them.
+				for (size_t j = 0; j < mExtractor->countTracks(); ++j)
+				{
+					const char* mainMime;
+					if (mExtractor->getTrackMetaData(j)->findCString(kKeyMIMEType, &mainMime) && !strncasecmp(mainMime, "audio/", 6))
+						mExtractor->discardTrack(j);
+				}
+				for (size_t j = 0; j < mAlternateAudioExtractor->countTracks(); ++j)
+				{
+					if (j != i)
+						mAlternateAudioExtractor->discardTrack(j);
+				}
 				break;
 			}
 		}
@@ -1052,6 +1066,7 @@ bool HLSPlayer::Play(double time)
 
 	if (time > 0)
 	{
+		DropUntilTime(time);
 		ReadUntilTime(time);
 		if (mAudioPlayer) mAudioPlayer->ReadUntilTime(time);
 	}
@@ -1237,6 +1252,8 @@ int HLSPlayer::Update()
 				err = mVideoSource->read(&mVideoBuffer, &mOptions);
 			if(mVideoSource23.get())
 				err = mVideoSource23->read(&mVideoBuffer, &mOptions23);
+			mOptions.clearSeekTo();
+			mOptions23.clearSeekTo();
 
 			if (err == OK && mVideoBuffer->range_length() != 0) ++mFrameCount;
 		}
@@ -2515,6 +2532,12 @@ void HLSPlayer::Seek(double time)
 
 	SetState(SEEKING);
 
+	if (SeekInBuffer(time))
+	{
+		SetState(PLAYING);
+		return;
+	}
+
 	StopEverything();
 
 	// Retrieve the current quality markers
@@ -2570,6 +2593,17 @@ void HLSPlayer::Seek(double time)
 		return;
 	}
 
+	// If the segment was demuxed before, skip straight to the last IDR
+	// frame (or, for alternate audio, indexed audio frame) before the
+	// target instead of decoding from its start. The demuxers don't start
+	// reading ahead until the sources are started below.
+	if (time > 0 && mExtractor.get())
+		mExtractor->seekToKeyFrame((int64_t)(time * 1000000.0));
+	if (time > 0 && mAlternateAudioExtractor.get())
+		mAlternateAudioExtractor->seekToKeyFrame((int64_t)(time * 1000000.0));
+
+	if (time > 0) DropUntilTime(time);
+
 	status_t err;
 	if(mVideoSource.get())
 		err = mVideoSource->start();
@@ -2629,6 +2663,83 @@ void HLSPlayer::Seek(double time)
 
 }
 
+//
+//  SeekInBuffer()
+//
+//		Seeks without tearing anything down, when the data sources still
+//		hold the segment time falls in and the demuxers have indexed its IDR
+//		frames. The extractors move to the last such frame before time and
+//		drop up to it; the decoders flush on their next read. Returns false,
+//		for Seek to start over from a fresh segment, if time isn't buffered.
+//
+bool HLSPlayer::SeekInBuffer(double time)
+{
+	LOGTRACE("%s", __func__);
+	if (time <= 0 || !mExtractor.get()) return false;
+
+	if (mAudioPlayer) mAudioPlayer->Pause();
+
+	// Seek tears everything down anyway if the alternate audio can't follow.
+	if (!mExtractor->seekInBuffer(time)) return false;
+	if (mAlternateAudioExtractor.get() && !mAlternateAudioExtractor->seekInBuffer(time)) return false;
+
+	LOGI("Seeking To: %f within the buffer", time);
+
+	// What the decoders hold is from before the move.
+	if (mVideoBuffer)
+	{
+		mVideoBuffer->release();
+		mVideoBuffer = NULL;
+	}
+	mOptions.setSeekTo((int64_t)(time * 1000000.0));
+	mOptions23.setSeekTo((int64_t)(time * 1000000.0));
+
+	if (mAudioPlayer)
+	{
+		mAudioPlayer->Flush();
+		mAudioPlayer->FlushDecoder(time);
+		mAudioPlayer->forceTimeStampUpdate();
+	}
+
+	mLastVideoTimeUs = -1;
+	mVideoStartDelta = 0;
+	mSegmentTimeOffset = 0;
+	mVideoFrameDelta = 0;
+
+	bool doFormatChange = !ReadUntilTime(time);
+	if (!doFormatChange && mAudioPlayer)
+		doFormatChange = !mAudioPlayer->ReadUntilTime(time);
+
+	if (doFormatChange)
+	{
+		LOGI("Applying Format Change");
+		ApplyFormatChange();
+	}
+	else if (mAudioPlayer)
+	{
+		// Start rather than Play, so the audio clock counts from the target.
+		mAudioPlayer->Start();
+	}
+
+	return true;
+}
+
+//
+//  DropUntilTime()
+//
+//		Has the extractors discard the access units before timeSecs, so
+//		the ReadUntilTime calls that follow only decode from the last
+//		keyframe before it (video) or not at all (audio).
+//
+void HLSPlayer::DropUntilTime(double timeSecs)
+{
+	LOGTRACE("%s", __func__);
+	int64_t targetTimeUs = (int64_t)(timeSecs * 1000000.0);
+
+	if (mExtractor.get()) mExtractor->dropUntil(targetTimeUs);
+	if (mAlternateAudioExtractor.get()) mAlternateAudioExtractor->dropUntil(targetTimeUs);
+}
+
 bool HLSPlayer::ReadUntilTime(double timeSecs)
 {
 	LOGTRACE("%s", __func__);
@@ -2642,11 +2753,13 @@ bool HLSPlayer::ReadUntilTime(double timeSecs)
 	while (timeUs < targetTimeUs)
 	{
 		if(mVideoSource.get())
-			res = mVideoSource->read(&mediaBuffer, NULL);
+			res = mVideoSource->read(&mediaBuffer, &mOptions);
 
 		if(mVideoSource23.get())
-			res = mVideoSource23->read(&mediaBuffer, NULL);
+			res = mVideoSource23->read(&mediaBuffer, &mOptions23);
 
+		mOptions.clearSeekTo();
+		mOptions23.clearSeekTo();
 
 		if (res == OK)
 		{
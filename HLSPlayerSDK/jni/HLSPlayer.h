@@ -52,6 +52,7 @@ public:
 	int DroppedFramesPerSecond();
 
 	void Seek(double time);
+	bool SeekInBuffer(double time);
 
 	void SetJavaVM(JavaVM* jvm);
 
@@ -66,6 +67,7 @@ public:
 	void SetState(int status);
 
 	bool ReadUntilTime(double timeSecs);
+	void DropUntilTime(double timeSecs);
 
 	void PostError(int error, bool fatal, const char* msg);
 
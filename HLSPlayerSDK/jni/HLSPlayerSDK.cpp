@@ -17,94 +17,98 @@
 #include "constants.h"
 #include "androidVideoShim.h"
 #include "HLSSegmentCache.h"
-
-#include <unordered_map>
+#include "HLSSegmentDiskCache.h"
+#include "HLSCryptoTable.h"
 
 HLSPlayerSDK* gHLSPlayerSDK = NULL;
 
+// Segment bytes in a Java array, at the same offsets as in the segment.
+// GetByteArrayRegion copies without pinning the array, so it's safe to use
+// while the segment buffer's lock is held.
+class JavaArrayBytes : public HLSSegmentBytes
+{
+public:
+	JavaArrayBytes(JNIEnv *env, jbyteArray array) : mEnv(env), mArray(array) { }
+
+	virtual void copy(int64_t offset, int64_t size, void *dest) const
+	{
+		mEnv->GetByteArrayRegion(mArray, (jsize)offset, (jsize)size, (jbyte*)dest);
+	}
+
+private:
+	JNIEnv *mEnv;
+	jbyteArray mArray;
+};
 
-// AES crypto engine state.
-bool gCryptoStateMapInitialized = false;
-pthread_mutex_t gCryptoStateMapLock;
-int gCryptoStateMapCounter = 1000;
-std::tr1::unordered_map<int, AesCtx *> gCryptoStateMap;
 
 extern "C"
 {
 
 	jint Java_com_kaltura_hlsplayersdk_cache_SegmentCacheItem_allocAESCryptoState(JNIEnv *env, jobject caller, jbyteArray key, jbyteArray iv)
 	{
-		if(gCryptoStateMapInitialized == false)
-		{
-			initRecursivePthreadMutex(&gCryptoStateMapLock);
-			gCryptoStateMapInitialized = true;
-		}
-
-		AutoLock locker(&gCryptoStateMapLock);
-
 		jbyte *keyPtr = env->GetByteArrayElements(key, NULL);
 		jbyte *ivPtr = env->GetByteArrayElements(iv, NULL);
 
-		// Initialize the AES context.
-		AesCtx *ctx = new AesCtx();
-		AesCtxIni(ctx, (unsigned char*)ivPtr, (unsigned char*)keyPtr, KEY128, CBC);
+		// Initialize an AES context from the pool and assign a handle.
+		int idx = HLSCryptoTable::alloc((unsigned char*)keyPtr, (unsigned char*)ivPtr);
 
 		LOGI("AES KEY = %8x%8x%8x%8x", *(int*)&keyPtr[0], *(int*)&keyPtr[4], *(int*)&keyPtr[8], *(int*)&keyPtr[12]);
 		LOGI("AES IV  = %8x%8x%8x%8x", *(int*)&ivPtr[0], *(int*)&ivPtr[4], *(int*)&ivPtr[8], *(int*)&ivPtr[12]);
 
-		env->ReleaseByteArrayElements(key, keyPtr, 0);
-		env->ReleaseByteArrayElements(iv, ivPtr, 0);
+		env->ReleaseByteArrayElements(key, keyPtr, JNI_ABORT);
+		env->ReleaseByteArrayElements(iv, ivPtr, JNI_ABORT);
 
-		// Insert and assign a handle/id.
-		int idx = gCryptoStateMapCounter++;
-		gCryptoStateMap.insert(std::make_pair<int, AesCtx*>(idx, ctx));
 		return idx;
 	}
 
-	void Java_com_kaltura_hlsplayersdk_cache_SegmentCacheItem_freeCryptoState(JNIEnv, jobject caller, jint handle)
+	jint Java_com_kaltura_hlsplayersdk_cache_SegmentCacheItem_allocSampleAESCryptoState(JNIEnv *env, jobject caller, jbyteArray key, jbyteArray iv)
 	{
-		if(gCryptoStateMapInitialized == false)
-		{
-			initRecursivePthreadMutex(&gCryptoStateMapLock);
-			gCryptoStateMapInitialized = true;
-		}
+		jbyte *keyPtr = env->GetByteArrayElements(key, NULL);
+		jbyte *ivPtr = env->GetByteArrayElements(iv, NULL);
 
-		AutoLock locker(&gCryptoStateMapLock);
+		// Segments under this key are stored as downloaded; the demuxer
+		// decrypts the protected parts of each sample.
+		int idx = HLSCryptoTable::alloc((unsigned char*)keyPtr, (unsigned char*)ivPtr, true);
 
-		std::tr1::unordered_map<int, AesCtx*>::const_iterator got = gCryptoStateMap.find(handle);
-		if(got == gCryptoStateMap.end())
-		{
-			LOGE("Failed to locate cryptostate %d! Ignoring free request...", handle);
-			return;
-		}
+		env->ReleaseByteArrayElements(key, keyPtr, JNI_ABORT);
+		env->ReleaseByteArrayElements(iv, ivPtr, JNI_ABORT);
 
-		// Free and remove from the map.
-		gCryptoStateMap.erase(handle);
-		delete got->second;
+		return idx;
 	}
 
-	jlong Java_com_kaltura_hlsplayersdk_cache_SegmentCacheItem_decrypt(JNIEnv *env, jobject caller, jint handle, jbyteArray bytes, jlong offset, jlong length)
+	jboolean Java_com_kaltura_hlsplayersdk_cache_SegmentCacheItem_retainCryptoState(JNIEnv, jobject caller, jint handle)
 	{
-		// Can we modify bytes in place?
-		jboolean isCopy = false;
-		jbyte *bytesPtr = env->GetByteArrayElements(bytes, &isCopy);
-		if(isCopy)
-		{
-			LOGE("Got a copy; this could cause a lot of overhead!");
-		}
+		return HLSCryptoTable::retain(handle);
+	}
 
-		// Dummy debug to compare with AES; just writes zeroes over the "decrypted" region.
-		// memset((unsigned char*)bytesPtr + offset, 0, length);
+	void Java_com_kaltura_hlsplayersdk_cache_SegmentCacheItem_freeCryptoState(JNIEnv, jobject caller, jint handle)
+	{
+		HLSCryptoTable::free(handle);
+	}
 
-		// Get AES crypto state.
-		std::tr1::unordered_map<int, AesCtx*>::const_iterator got = gCryptoStateMap.find(handle);
-		if(got == gCryptoStateMap.end())
+	jlong Java_com_kaltura_hlsplayersdk_cache_SegmentCacheItem_decrypt(JNIEnv *env, jobject caller, jint handle, jbyteArray chain, jbyteArray bytes, jlong offset, jlong length)
+	{
+		// Get AES crypto state. Pinned until we return, so a concurrent free
+		// can't recycle it under us.
+		const unsigned char *iv;
+		const AesCtx *shared = HLSCryptoTable::acquire(handle, &iv);
+		if(shared == NULL)
 		{
 			LOGE("Failed to locate cryptostate %d! Ignoring decrypt request...", handle);
-			env->ReleaseByteArrayElements(bytes, bytesPtr, 0);
 			return -1;
 		}
 
+		// The context may be shared by every segment under this key and IV,
+		// so the CBC chain lives with the caller: the IV at the start of a
+		// segment, else the last cipher block of the previous call.
+		AesCtx ctx = *shared;
+		unsigned char chainBytes[16];
+		if(offset == 0)
+			memcpy(chainBytes, iv, 16);
+		else
+			env->GetByteArrayRegion(chain, 0, 16, (jbyte*)chainBytes);
+		AesSetIV(&ctx, chainBytes);
+
 		// Deal with buffering. 
 		//
 		// Key points:
@@ -115,6 +119,9 @@ extern "C"
 		//      always round up to a multiple of 16.
 		//    - We have to pad with nulls at the end of the file to hit 
 		//      a 16 byte boundary, and strip the decrypted nulls after.
+		//    - chain carries the CBC chaining state (the last cipher block)
+		//      from one call to the next, so each call just continues where
+		//      the previous one stopped.
 		//
 		// Secondary points:
 		//	  - Don't worry about start, assume it's aligned (since we control
@@ -147,13 +154,20 @@ extern "C"
 			}
 		}
 
-		// Decrypt into a temporary buffer for now. We can rewrite the AES routine
-		// to do this internally with much smaller buffers.
-		void *outputBits = malloc(length);
-		AesDecrypt(got->second, (unsigned char*)bytesPtr + offset, (unsigned char*)outputBits, length);
+		// Decrypt in place, straight in the Java array. AesDecrypt reads each
+		// block before it writes it, so no temporary buffer is needed, and a
+		// critical region avoids the whole-array copy GetByteArrayElements
+		// is allowed to make.
+		unsigned char *bytesPtr = (unsigned char*)env->GetPrimitiveArrayCritical(bytes, NULL);
+		if(bytesPtr == NULL)
+		{
+			LOGE("Could not pin segment for decryption!");
+			HLSCryptoTable::release(handle);
+			return -1;
+		}
 
-		// Copy back into place.
-		memcpy(bytesPtr + offset, outputBits, length);
+		if(length > 0)
+			AesDecrypt(&ctx, bytesPtr + offset, bytesPtr + offset, length);
 
 		// Do the final bit if needed.
 		if(convertFinalWithPadding)
@@ -161,22 +175,21 @@ extern "C"
 			assert(totalBufferLength - (offset + length) < 16);
 
 			LOGE("FINAL CASE %d %d", (int)(offset+length), (int)totalBufferLength);
-			char tmpIn[16], tmpOut[16];
+			unsigned char tmp[16];
 			int bufOffset = 0;
-			
+
 			// Null pad and copy last few bytes.
-			memset(tmpIn, 0, 16);
-			bufOffset=0;
+			memset(tmp, 0, 16);
 			for(int i=offset+length; i<totalBufferLength; i++)
-				tmpIn[bufOffset++] = bytesPtr[i];
+				tmp[bufOffset++] = bytesPtr[i];
 
 			// Decrypt.
-			AesDecrypt(got->second, (unsigned char*)tmpIn, (unsigned char*)tmpOut, 16);
+			AesDecrypt(&ctx, tmp, tmp, 16);
 
 			// Copy back out...
 			bufOffset=0;
 			for(int i=offset+length; i<totalBufferLength; i++)
-				bytesPtr[i] = tmpIn[bufOffset++];
+				bytesPtr[i] = tmp[bufOffset++];
 
 			// ... and update length.
 			length += bufOffset;
@@ -184,13 +197,99 @@ extern "C"
 		}
 
 		// Clean up.
-		free(outputBits);
-		env->ReleaseByteArrayElements(bytes, bytesPtr, 0);
+		env->ReleasePrimitiveArrayCritical(bytes, bytesPtr, 0);
+		HLSCryptoTable::release(handle);
+
+		AesGetIV(&ctx, chainBytes);
+		env->SetByteArrayRegion(chain, 0, 16, (jbyte*)chainBytes);
 
 		// Is it meaningful to adjust the requested end point?
 		return offset + length;
 	}
 
+	void Java_com_kaltura_hlsplayersdk_cache_HLSSegmentCache_storeNative(JNIEnv *env, jclass caller, jstring juri, jbyteArray bytes, jint size, jboolean keepOnDisk)
+	{
+		const char* uri = env->GetStringUTFChars(juri, 0);
+
+		if (size > env->GetArrayLength(bytes))
+			size = env->GetArrayLength(bytes);
+
+		// Copy once into native memory; all further reads are served from there.
+		HLSSegmentCache::store(uri, JavaArrayBytes(env, bytes), size, keepOnDisk);
+
+		env->ReleaseStringUTFChars(juri, uri);
+	}
+
+	void Java_com_kaltura_hlsplayersdk_cache_HLSSegmentCache_appendNative(JNIEnv *env, jclass caller, jstring juri, jbyteArray bytes, jint offset, jint length, jint capacity)
+	{
+		if (offset < 0 || length <= 0 || offset + length > env->GetArrayLength(bytes))
+			return;
+
+		const char* uri = env->GetStringUTFChars(juri, 0);
+
+		// Publish bytes of a segment that is still downloading.
+		HLSSegmentCache::append(uri, JavaArrayBytes(env, bytes), offset, length, capacity);
+
+		env->ReleaseStringUTFChars(juri, uri);
+	}
+
+	void Java_com_kaltura_hlsplayersdk_cache_HLSSegmentCache_initDiskCacheNative(JNIEnv *env, jclass caller, jstring jdir, jlong maxSize)
+	{
+		const char* dir = env->GetStringUTFChars(jdir, 0);
+		HLSSegmentDiskCache::initialize(dir, maxSize);
+		env->ReleaseStringUTFChars(jdir, dir);
+	}
+
+	jlong Java_com_kaltura_hlsplayersdk_cache_HLSSegmentCache_restoreNative(JNIEnv *env, jclass caller, jstring juri)
+	{
+		const char* uri = env->GetStringUTFChars(juri, 0);
+		HLSSegmentBuffer *buffer = HLSSegmentCache::restore(uri);
+		env->ReleaseStringUTFChars(juri, uri);
+
+		if (buffer == NULL)
+			return -1;
+
+		// The segment is back in the native store; Java readers go through
+		// readNative, so no copy is handed over.
+		jlong size = buffer->getSize();
+		buffer->release();
+		return size;
+	}
+
+	void Java_com_kaltura_hlsplayersdk_cache_HLSSegmentCache_removeNative(JNIEnv *env, jclass caller, jstring juri)
+	{
+		const char* uri = env->GetStringUTFChars(juri, 0);
+		HLSSegmentCache::remove(uri);
+		env->ReleaseStringUTFChars(juri, uri);
+	}
+
+	void Java_com_kaltura_hlsplayersdk_cache_HLSSegmentCache_failNative(JNIEnv *env, jclass caller, jstring juri)
+	{
+		const char* uri = env->GetStringUTFChars(juri, 0);
+		HLSSegmentCache::fail(uri);
+		env->ReleaseStringUTFChars(juri, uri);
+	}
+
+	jint Java_com_kaltura_hlsplayersdk_cache_HLSSegmentCache_readNative(JNIEnv *env, jclass caller, jstring juri, jlong offset, jbyteArray output, jint outputOffset, jint size)
+	{
+		if (outputOffset < 0 || size <= 0 || outputOffset + size > env->GetArrayLength(output))
+			return 0;
+
+		// Java keeps no copy of completed segments; serve it from ours.
+		const char* uri = env->GetStringUTFChars(juri, 0);
+		HLSSegmentBuffer *buffer = HLSSegmentCache::restore(uri);
+		env->ReleaseStringUTFChars(juri, uri);
+
+		if (buffer == NULL)
+			return 0;
+
+		jbyte *outputPtr = (jbyte*)env->GetPrimitiveArrayCritical(output, NULL);
+		int64_t got = buffer->read(offset, size, outputPtr + outputOffset);
+		env->ReleasePrimitiveArrayCritical(output, outputPtr, 0);
+		buffer->release();
+		return (jint)got;
+	}
+
 	void Java_com_kaltura_hlsplayersdk_HLSPlayerViewController_InitNativeDecoder(JNIEnv * env, jobject jcaller)
 	{
 		android_video_shim::initLibraries();
@@ -1,13 +1,215 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
 #include "HLSSegmentCache.h"
+#include "HLSSegmentDiskCache.h"
+#include "androidVideoShim.h"
+
+HLSSegmentBuffer::HLSSegmentBuffer(const char *uri, const HLSSegmentBytes &bytes, int64_t size)
+: mUri(uri), mData(NULL), mCapacity(size), mMapping(NULL), mMappingSize(0), mKeepOnDisk(false), mSize(size), mComplete(true), mAbandoned(false)
+{
+	pthread_mutex_init(&mLock, NULL);
+	pthread_cond_init(&mCond, NULL);
+
+	mData = (unsigned char*)malloc(size);
+	if (mData == NULL)
+	{
+		LOGE("Failed to allocate %lld bytes for %s", size, uri);
+		mCapacity = mSize = 0;
+		return;
+	}
+	bytes.copy(0, size, mData);
+}
+
+HLSSegmentBuffer::HLSSegmentBuffer(const char *uri, int64_t capacity)
+: mUri(uri), mData(NULL), mCapacity(capacity), mMapping(NULL), mMappingSize(0), mKeepOnDisk(false), mSize(0), mComplete(false), mAbandoned(false)
+{
+	pthread_mutex_init(&mLock, NULL);
+	pthread_cond_init(&mCond, NULL);
+
+	mData = (unsigned char*)malloc(capacity);
+	if (mData == NULL)
+	{
+		LOGE("Failed to allocate %lld bytes for %s", capacity, uri);
+		mCapacity = 0;
+	}
+}
+
+HLSSegmentBuffer::HLSSegmentBuffer(const char *uri, void *mapping, int64_t mappingSize, int64_t dataOffset)
+: mUri(uri), mData((unsigned char*)mapping + dataOffset), mCapacity(mappingSize - dataOffset), mMapping(mapping), mMappingSize(mappingSize), mKeepOnDisk(false),
+  mSize(mappingSize - dataOffset), mComplete(true), mAbandoned(false)
+{
+	pthread_mutex_init(&mLock, NULL);
+	pthread_cond_init(&mCond, NULL);
+}
+
+HLSSegmentBuffer::~HLSSegmentBuffer()
+{
+	if (mMapping)
+		munmap(mMapping, mMappingSize);
+	else
+		free(mData);
+	mData = NULL;
+	mMapping = NULL;
+	pthread_cond_destroy(&mCond);
+	pthread_mutex_destroy(&mLock);
+}
+
+void HLSSegmentBuffer::unload()
+{
+	LOGV("Unloading %s", mUri.c_str());
+	delete this;
+}
+
+int64_t HLSSegmentBuffer::read(int64_t offset, int64_t size, void *bytes)
+{
+	// How many bytes can we serve? Bytes below the high-water mark are
+	// immutable, so only the mark itself needs the lock.
+	int64_t available = getSize();
+	if (offset >= available || offset < 0)
+		return 0;
+
+	if (offset + size > available)
+		size = available - offset;
+
+	memcpy(bytes, mData + offset, size);
+	return size;
+}
+
+void HLSSegmentBuffer::append(int64_t offset, const HLSSegmentBytes &bytes, int64_t size)
+{
+	AutoLock locker(&mLock, __func__);
+
+	if (mComplete || offset > mSize || offset + size > mCapacity)
+	{
+		LOGE("Ignoring append of %lld bytes at %lld to %s (have %lld of %lld)", size, offset, mUri.c_str(), mSize, mCapacity);
+		return;
+	}
+
+	// Only copy what's new; readers may be looking at the rest.
+	if (mSize >= offset + size)
+		return;
+
+	bytes.copy(mSize, offset + size - mSize, mData + mSize);
+	mSize = offset + size;
+	pthread_cond_broadcast(&mCond);
+}
+
+bool HLSSegmentBuffer::finish(const HLSSegmentBytes &bytes, int64_t size)
+{
+	AutoLock locker(&mLock, __func__);
+
+	if (mComplete || size > mCapacity || size < mSize)
+		return false;
+
+	bytes.copy(mSize, size - mSize, mData + mSize);
+	mSize = size;
+	mComplete = true;
+	pthread_cond_broadcast(&mCond);
+	return true;
+}
+
+void HLSSegmentBuffer::abandon()
+{
+	AutoLock locker(&mLock, __func__);
+
+	if (mComplete)
+		return;
+
+	LOGI("Abandoning %s at %lld of %lld bytes", mUri.c_str(), mSize, mCapacity);
+	mComplete = true;
+	mAbandoned = true;
+	pthread_cond_broadcast(&mCond);
+}
+
+bool HLSSegmentBuffer::waitForData(int64_t offset, const volatile bool *cancel)
+{
+	AutoLock locker(&mLock, __func__);
+
+	while (mSize <= offset && !mComplete && !(cancel && *cancel))
+	{
+		// Wake up now and then so a stuck wait shows up in the log.
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 5;
+		if (pthread_cond_timedwait(&mCond, &mLock, &ts) == ETIMEDOUT)
+			LOGI("Still waiting on %s for byte %lld (have %lld)", mUri.c_str(), offset, mSize);
+	}
+
+	return mSize > offset;
+}
+
+void HLSSegmentBuffer::waitForComplete()
+{
+	waitForData(mCapacity);
+}
+
+void HLSSegmentBuffer::wake()
+{
+	AutoLock locker(&mLock, __func__);
+	pthread_cond_broadcast(&mCond);
+}
+
+int64_t HLSSegmentBuffer::getSize()
+{
+	AutoLock locker(&mLock, __func__);
+	return mSize;
+}
+
+bool HLSSegmentBuffer::isComplete()
+{
+	AutoLock locker(&mLock, __func__);
+	return mComplete;
+}
+
+bool HLSSegmentBuffer::isAbandoned()
+{
+	AutoLock locker(&mLock, __func__);
+	return mAbandoned;
+}
+
+void HLSSegmentBuffer::addKeyFrame(int64_t offset, int64_t timeUs)
+{
+	AutoLock locker(&mLock, __func__);
+
+	// Demuxing the segment again only adds what lies past the last entry.
+	if (!mKeyFrames.empty() && offset <= mKeyFrames.back().offset)
+		return;
+
+	KeyFrame keyFrame;
+	keyFrame.offset = offset;
+	keyFrame.timeUs = timeUs;
+	mKeyFrames.push_back(keyFrame);
+}
+
+bool HLSSegmentBuffer::findKeyFrame(int64_t timeUs, int64_t *offset, int64_t *keyTimeUs)
+{
+	AutoLock locker(&mLock, __func__);
+
+	bool found = false;
+	for (size_t i = 0; i < mKeyFrames.size() && mKeyFrames[i].timeUs <= timeUs; i++)
+	{
+		*offset = mKeyFrames[i].offset;
+		*keyTimeUs = mKeyFrames[i].timeUs;
+		found = true;
+	}
+	return found;
+}
 
 // Interface to the HLSSegmentCache Java subsystem.
 JavaVM *HLSSegmentCache::mJVM = NULL;
 jmethodID HLSSegmentCache::mPrecache = 0;
-jmethodID HLSSegmentCache::mRead = 0;
-jmethodID HLSSegmentCache::mGetSize = 0;
+jmethodID HLSSegmentCache::mRequest = 0;
 jmethodID HLSSegmentCache::mTouch = 0;
 jclass HLSSegmentCache::mClass = 0;
+HLSSegmentCache::SEGMENT_STORE HLSSegmentCache::mStore;
+pthread_mutex_t HLSSegmentCache::mStoreLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t HLSSegmentCache::mStoreCond = PTHREAD_COND_INITIALIZER;
+HLSSegmentCache::FAILURE_MAP HLSSegmentCache::mFailures;
+uint32_t HLSSegmentCache::mStoreEvent = 0;
 
 void HLSSegmentCache::initialize(JavaVM *jvm)
 {
@@ -37,17 +239,10 @@ void HLSSegmentCache::initialize(JavaVM *jvm)
 		return;
 	}
 
-	mRead = env->GetStaticMethodID(mClass, "read", "(Ljava/lang/String;JJLjava/nio/ByteBuffer;)J" );
-	if (env->ExceptionCheck())
-	{
-		LOGE("Could not find method com/kaltura/hlsplayersdk/cache/HLSSegmentCache.read" );
-		return;
-	}
-
-	mGetSize = env->GetStaticMethodID(mClass, "getSize", "(Ljava/lang/String;)J" );
+	mRequest = env->GetStaticMethodID(mClass, "request", "(Ljava/lang/String;)V" );
 	if (env->ExceptionCheck())
 	{
-		LOGE("Could not find method com/kaltura/hlsplayersdk/cache/HLSSegmentCache.getSize" );
+		LOGE("Could not find method com/kaltura/hlsplayersdk/cache/HLSSegmentCache.request" );
 		return;
 	}
 
@@ -89,28 +284,185 @@ void HLSSegmentCache::precache(const char *uri, int cryptoId)
 
 int64_t HLSSegmentCache::read(const char *uri, int64_t offset, int64_t size, void *bytes)
 {
-	assert(mJVM); // Didn't initialize.
-	assert(mClass);
-	assert(mRead);
+	LOGV2("%s offset=%lld size=%lld bytes=%p", uri, offset, size, bytes);
 
-	// Set up environment for this thread.
-	JNIEnv *env = NULL;
-	mJVM->AttachCurrentThread(&env, NULL);
+	HLSSegmentBuffer *buffer = acquire(uri);
+	if (buffer == NULL)
+		return 0;
 
-	jobject jbytes = env->NewDirectByteBuffer(bytes, size);
-	jstring juri = env->NewStringUTF(uri);
+	buffer->waitForData(offset + size - 1);
+	int64_t res = buffer->read(offset, size, bytes);
+	buffer->release();
+	return res;
+}
 
-	LOGV2("%s offset=%lld size=%lld bytes=%p", uri, offset, size, bytes);
+int64_t HLSSegmentCache::getSize(const char *uri)
+{
+	HLSSegmentBuffer *buffer = acquire(uri);
+	if (buffer == NULL)
+		return 0;
 
-	int64_t res = env->CallStaticLongMethod(mClass, mRead, juri, offset, size, jbytes);
+	buffer->waitForComplete();
+	int64_t res = buffer->getSize();
+	buffer->release();
+	return res;
+}
 
-	env->DeleteLocalRef(jbytes);
-	env->DeleteLocalRef(juri);
+void HLSSegmentCache::append(const char *uri, const HLSSegmentBytes &bytes, int64_t offset, int64_t size, int64_t capacity)
+{
+	HLSSegmentBuffer *buffer = NULL;
+	{
+		AutoLock locker(&mStoreLock, __func__);
 
-	return res;
+		SEGMENT_STORE::iterator existing = mStore.find(uri);
+		if (existing != mStore.end())
+		{
+			buffer = existing->second;
+		}
+		else
+		{
+			// First bytes of a new download; readers can start on it now.
+			buffer = new HLSSegmentBuffer(uri, capacity);
+			mStore.insert(std::make_pair(std::string(uri), buffer));
+			mFailures.erase(uri);
+			mStoreEvent++;
+			pthread_cond_broadcast(&mStoreCond);
+		}
+		buffer->addRef();
+	}
+
+	// Copy outside the store lock so other segments aren't held up.
+	buffer->append(offset, bytes, size);
+	buffer->release();
 }
 
-int64_t HLSSegmentCache::getSize(const char *uri)
+void HLSSegmentCache::store(const char *uri, const HLSSegmentBytes &bytes, int64_t size, bool keepOnDisk)
+{
+	// Complete a partial download in place, so readers already on it see
+	// the rest. Either way the copy is made outside the store lock, which
+	// every reader of every segment goes through.
+	HLSSegmentBuffer *partial = lookup(uri);
+	if (partial)
+	{
+		bool finished = partial->finish(bytes, size);
+		if (finished)
+			partial->setKeepOnDisk(keepOnDisk);
+		partial->release();
+		if (finished)
+		{
+			LOGV("Completed %lld bytes for %s", size, uri);
+			return;
+		}
+	}
+
+	HLSSegmentBuffer *buffer = new HLSSegmentBuffer(uri, bytes, size);
+	buffer->setKeepOnDisk(keepOnDisk);
+
+	AutoLock locker(&mStoreLock, __func__);
+
+	// Replace any previous copy; readers holding a reference keep theirs
+	// alive.
+	SEGMENT_STORE::iterator existing = mStore.find(uri);
+	if (existing != mStore.end())
+	{
+		existing->second->abandon();
+		existing->second->release();
+		mStore.erase(existing);
+	}
+
+	mStore.insert(std::make_pair(std::string(uri), buffer));
+	mFailures.erase(uri);
+	LOGV("Stored %lld bytes for %s", size, uri);
+
+	// Wake anyone waiting on this download.
+	mStoreEvent++;
+	pthread_cond_broadcast(&mStoreCond);
+}
+
+void HLSSegmentCache::fail(const char *uri)
+{
+	AutoLock locker(&mStoreLock, __func__);
+
+	LOGI("Download of %s stopped without data", uri);
+	mFailures[uri] = ++mStoreEvent;
+
+	// Let readers of a partial copy run off its end, and make the next
+	// request start over.
+	SEGMENT_STORE::iterator existing = mStore.find(uri);
+	if (existing != mStore.end() && !existing->second->isComplete())
+	{
+		existing->second->abandon();
+		existing->second->release();
+		mStore.erase(existing);
+	}
+
+	pthread_cond_broadcast(&mStoreCond);
+}
+
+void HLSSegmentCache::remove(const char *uri)
+{
+	HLSSegmentBuffer *buffer = NULL;
+	{
+		AutoLock locker(&mStoreLock, __func__);
+
+		SEGMENT_STORE::iterator existing = mStore.find(uri);
+		if (existing == mStore.end())
+			return;
+
+		buffer = existing->second;
+		mStore.erase(existing);
+	}
+
+	// Evicted from memory; keep a copy on disk if we got all of it and it
+	// may be kept there.
+	buffer->abandon();
+	if (!buffer->isAbandoned() && !buffer->isMapped() && buffer->keepOnDisk())
+		HLSSegmentDiskCache::write(buffer);
+	buffer->release();
+}
+
+HLSSegmentBuffer *HLSSegmentCache::restore(const char *uri)
+{
+	HLSSegmentBuffer *buffer = lookup(uri);
+	if (buffer)
+		return buffer;
+
+	buffer = HLSSegmentDiskCache::map(uri);
+	if (buffer == NULL)
+		return NULL;
+
+	AutoLock locker(&mStoreLock, __func__);
+
+	SEGMENT_STORE::iterator existing = mStore.find(uri);
+	if (existing != mStore.end())
+	{
+		// Somebody beat us to it.
+		buffer->release();
+		existing->second->addRef();
+		return existing->second;
+	}
+
+	buffer->addRef(); // One for the store, one for the caller.
+	mStore.insert(std::make_pair(std::string(uri), buffer));
+	mFailures.erase(uri);
+	mStoreEvent++;
+	pthread_cond_broadcast(&mStoreCond);
+	return buffer;
+}
+
+HLSSegmentBuffer *HLSSegmentCache::lookup(const char *uri)
+{
+	AutoLock locker(&mStoreLock, __func__);
+
+	SEGMENT_STORE::iterator got = mStore.find(uri);
+	if (got == mStore.end())
+		return NULL;
+
+	got->second->addRef();
+	return got->second;
+}
+
+void HLSSegmentCache::request(const char *uri)
 {
 	assert(mJVM); // Didn't initialize.
 
@@ -119,7 +471,74 @@ int64_t HLSSegmentCache::getSize(const char *uri)
 	mJVM->AttachCurrentThread(&env, NULL);
 
 	jstring juri = env->NewStringUTF(uri);
-	int64_t res = env->CallStaticLongMethod(mClass, mGetSize, juri);
-	env->DeleteLocalRef(juri);
-	return res;
+	env->CallStaticVoidMethod(mClass, mRequest, juri);
+	env->DeleteLocalRef(juri); // Cleaning up, just in case we're called from a native thread
+}
+
+HLSSegmentBuffer *HLSSegmentCache::tryAcquire(const char *uri)
+{
+	HLSSegmentBuffer *buffer = lookup(uri);
+	if (buffer)
+		return buffer;
+
+	// Idempotent if the download is already running. A segment in the disk
+	// cache is restored into the store before this returns.
+	request(uri);
+	return lookup(uri);
+}
+
+HLSSegmentBuffer *HLSSegmentCache::acquire(const char *uri, const volatile bool *cancel)
+{
+	HLSSegmentBuffer *buffer = lookup(uri);
+	if (buffer)
+		return buffer;
+
+	// Note where we are so we only react to failures from here on.
+	uint32_t since = 0;
+	{
+		AutoLock locker(&mStoreLock, __func__);
+		since = mStoreEvent;
+	}
+
+	// Not downloaded yet. Kick off the download, then sleep until the Java
+	// cache either stores the segment or tells us it gave up on it.
+	request(uri);
+
+	LOGI("Waiting on %s", uri);
+	AutoLock locker(&mStoreLock, __func__);
+	for (;;)
+	{
+		SEGMENT_STORE::iterator got = mStore.find(uri);
+		if (got != mStore.end())
+		{
+			got->second->addRef();
+			return got->second;
+		}
+
+		FAILURE_MAP::iterator failed = mFailures.find(uri);
+		if (failed != mFailures.end() && failed->second > since)
+		{
+			LOGE("Segment %s did not reach the native store", uri);
+			return NULL;
+		}
+
+		if (cancel && *cancel)
+		{
+			LOGI("Gave up waiting on %s", uri);
+			return NULL;
+		}
+
+		// Wake up now and then so a stuck wait shows up in the log.
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 5;
+		if (pthread_cond_timedwait(&mStoreCond, &mStoreLock, &ts) == ETIMEDOUT)
+			LOGI("Still waiting on %s", uri);
+	}
+}
+
+void HLSSegmentCache::wakeWaiters()
+{
+	AutoLock locker(&mStoreLock, __func__);
+	pthread_cond_broadcast(&mStoreCond);
 }
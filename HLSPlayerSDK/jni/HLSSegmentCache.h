@@ -3,8 +3,97 @@
 
 #include <jni.h>
 #include <sys/types.h>
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
 
 #include "debug.h"
+#include "RefCounted.h"
+
+// Where a segment's bytes come from as they are stored. Offsets are into
+// the segment. Lets the JNI layer copy straight from a Java array into the
+// buffer, without keeping the array pinned while buffer locks are taken.
+class HLSSegmentBytes
+{
+public:
+	virtual ~HLSSegmentBytes() {}
+	virtual void copy(int64_t offset, int64_t size, void *dest) const = 0;
+};
+
+// A downloaded (and decrypted) segment, owned by native code. Java hands us
+// the bytes as they arrive; after that the data source reads straight out of
+// this buffer without touching the JVM.
+//
+// While the download is in flight the buffer is partial: getSize() is the
+// high-water mark of bytes readers may use, and it only ever grows. Bytes
+// below it never change.
+class HLSSegmentBuffer : public RefCounted
+{
+public:
+	HLSSegmentBuffer(const char *uri, const HLSSegmentBytes &bytes, int64_t size);
+	HLSSegmentBuffer(const char *uri, int64_t capacity); // Partial.
+	HLSSegmentBuffer(const char *uri, void *mapping, int64_t mappingSize, int64_t dataOffset); // Takes over an mmap'd file.
+	virtual ~HLSSegmentBuffer();
+
+	virtual void unload(); // from RefCounted - deletes the buffer.
+
+	// Serves what is available now; never waits.
+	int64_t read(int64_t offset, int64_t size, void *bytes);
+
+	// Producer side, driven by HLSSegmentCache.
+	void append(int64_t offset, const HLSSegmentBytes &bytes, int64_t size);
+	bool finish(const HLSSegmentBytes &bytes, int64_t size);
+	void abandon();
+
+	// Waits until the byte at offset is available or the buffer is complete,
+	// or until *cancel is set and wake() is called. Returns true if the byte
+	// is available.
+	bool waitForData(int64_t offset, const volatile bool *cancel = NULL);
+	void waitForComplete();
+	void wake();
+
+	const char *getUri() { return mUri.c_str(); }
+	const unsigned char *getData() { return mData; }
+	int64_t getSize();
+	bool isComplete();
+	bool isAbandoned();
+	bool isMapped() { return mMapping != NULL; }
+
+	// Whether the segment may go to the disk cache once evicted. Off for
+	// segments that were encrypted as a whole, since this copy is clear.
+	void setKeepOnDisk(bool keep) { mKeepOnDisk = keep; }
+	bool keepOnDisk() { return mKeepOnDisk; }
+
+	// Index of the IDR frames the demuxer has come across, so a later seek
+	// into this segment can start demuxing at the last one before its
+	// target rather than at the top. Offsets are into the segment.
+	void addKeyFrame(int64_t offset, int64_t timeUs);
+	bool findKeyFrame(int64_t timeUs, int64_t *offset, int64_t *keyTimeUs);
+
+private:
+	struct KeyFrame
+	{
+		int64_t offset;
+		int64_t timeUs;
+	};
+
+	std::string mUri;
+	unsigned char *mData;
+	int64_t mCapacity;
+	void *mMapping;
+	int64_t mMappingSize;
+	bool mKeepOnDisk;
+
+	// Guarded by mLock.
+	int64_t mSize;
+	bool mComplete;
+	bool mAbandoned;
+	std::vector<KeyFrame> mKeyFrames; // In offset order.
+	pthread_mutex_t mLock;
+	pthread_cond_t mCond;
+};
 
 // Interface to the HLSSegmentCache Java subsystem.
 class HLSSegmentCache
@@ -12,17 +101,59 @@ class HLSSegmentCache
 private:
 	static JavaVM *mJVM;
 	static jmethodID mPrecache;
-	static jmethodID mRead;
-	static jmethodID mGetSize;
+	static jmethodID mRequest;
 	static jmethodID mTouch;
 	static jclass mClass;
 
+	// Native segment store, keyed by URI. Holds one reference per buffer.
+	typedef std::map<std::string, HLSSegmentBuffer *> SEGMENT_STORE;
+	static SEGMENT_STORE mStore;
+	static pthread_mutex_t mStoreLock;
+
+	// Signalled whenever a segment is stored or a download gives up.
+	// mStoreEvent counts those events; mFailures maps a URI to the event at
+	// which its download last failed.
+	typedef std::map<std::string, uint32_t> FAILURE_MAP;
+	static pthread_cond_t mStoreCond;
+	static FAILURE_MAP mFailures;
+	static uint32_t mStoreEvent;
+
+	static void request(const char *uri);
+
 public:
     static void initialize(JavaVM *jvm);
     static void precache(const char *uri, int cryptoId = -1);
     static int64_t read(const char *uri, int64_t offset, int64_t size, void *bytes);
     static int64_t getSize(const char *uri);
     static void touch(const char* uri);
+
+    // Native segment store. append(), store() and remove() are driven by the
+    // Java cache as downloads progress, complete and expire.
+    static void append(const char *uri, const HLSSegmentBytes &bytes, int64_t offset, int64_t size, int64_t capacity);
+    static void store(const char *uri, const HLSSegmentBytes &bytes, int64_t size, bool keepOnDisk);
+    static void remove(const char *uri);
+    static void fail(const char *uri);
+
+    // Returns a referenced buffer for a segment in the store, or NULL. Never
+    // touches the disk cache, calls into Java or waits.
+    static HLSSegmentBuffer *lookup(const char *uri);
+
+    // Returns a referenced buffer for a segment in the store, bringing it
+    // back from the disk cache first if it was evicted there. NULL if it is
+    // in neither. Never starts a download or waits.
+    static HLSSegmentBuffer *restore(const char *uri);
+
+    // Returns a referenced buffer for the segment, starting the download and
+    // waiting for its first bytes if needed. The buffer may still be partial.
+    // Caller must release() it.
+    // Returns NULL if the segment could not be loaded, or if *cancel was set
+    // and wakeWaiters() called while waiting.
+    static HLSSegmentBuffer *acquire(const char *uri, const volatile bool *cancel = NULL);
+    static void wakeWaiters();
+
+    // Like acquire, but never waits. Returns NULL (after starting the
+    // download) if the segment isn't in the store yet.
+    static HLSSegmentBuffer *tryAcquire(const char *uri);
 };
 
 
@@ -0,0 +1,326 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "HLSSegmentDiskCache.h"
+#include "HLSSegmentCache.h"
+#include "androidVideoShim.h"
+
+// File layout: magic, URI length, URI, segment data. Files written before
+// AES-128 segments were kept off disk used "HLSC"; they may hold decrypted
+// content and are deleted on sight.
+static const uint32_t kDiskMagic = 0x32534C48; // "HLS2"
+static const char *kDiskSuffix = ".seg";
+
+// Past this much queued for the writer, further evictions aren't kept.
+static const int64_t kMaxPendingSize = 16 * 1024 * 1024;
+
+HLSSegmentDiskCache::DISK_INDEX HLSSegmentDiskCache::mIndex;
+std::string HLSSegmentDiskCache::mDir;
+int64_t HLSSegmentDiskCache::mTotalSize = 0;
+int64_t HLSSegmentDiskCache::mMaxSize = 0;
+pthread_mutex_t HLSSegmentDiskCache::mLock = PTHREAD_MUTEX_INITIALIZER;
+std::deque<HLSSegmentBuffer *> HLSSegmentDiskCache::mPending;
+int64_t HLSSegmentDiskCache::mPendingSize = 0;
+pthread_cond_t HLSSegmentDiskCache::mPendingCond = PTHREAD_COND_INITIALIZER;
+bool HLSSegmentDiskCache::mWriterStarted = false;
+
+void HLSSegmentDiskCache::initialize(const char *dir, int64_t maxSize)
+{
+	AutoLock locker(&mLock, __func__);
+
+	mDir = dir;
+	mMaxSize = maxSize;
+	mTotalSize = 0;
+	mIndex.clear();
+
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+	{
+		LOGE("Could not create disk cache directory %s (%d); disk cache disabled", dir, errno);
+		mDir.clear();
+		return;
+	}
+
+	// Pick up whatever earlier sessions left behind.
+	DIR *d = opendir(dir);
+	if (d == NULL)
+	{
+		LOGE("Could not open disk cache directory %s (%d); disk cache disabled", dir, errno);
+		mDir.clear();
+		return;
+	}
+
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL)
+	{
+		std::string name(ent->d_name);
+		std::string path = mDir + "/" + name;
+		size_t suffixLen = strlen(kDiskSuffix);
+		if (name.size() <= suffixLen || name.compare(name.size() - suffixLen, suffixLen, kDiskSuffix) != 0)
+		{
+			// Leftover temporary from an interrupted write.
+			if (name.find(".tmp") != std::string::npos)
+				unlink(path.c_str());
+			continue;
+		}
+
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (!hasCurrentHeader(path))
+		{
+			unlink(path.c_str());
+			continue;
+		}
+
+		Entry e;
+		e.size = st.st_size;
+		e.lastUsed = st.st_mtime;
+		mIndex[name] = e;
+		mTotalSize += e.size;
+	}
+	closedir(d);
+
+	LOGI("Disk cache at %s has %d segments, %lld of %lld bytes", dir, (int)mIndex.size(), mTotalSize, mMaxSize);
+	trim();
+
+	if (!mWriterStarted)
+	{
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		mWriterStarted = pthread_create(&thread, &attr, writerThread, NULL) == 0;
+		pthread_attr_destroy(&attr);
+		if (!mWriterStarted)
+			LOGE("Could not start the disk cache writer; disk cache is read only");
+	}
+}
+
+bool HLSSegmentDiskCache::hasCurrentHeader(const std::string &path)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == NULL)
+		return false;
+
+	uint32_t magic = 0;
+	bool ok = fread(&magic, sizeof(magic), 1, f) == 1 && magic == kDiskMagic;
+	fclose(f);
+	return ok;
+}
+
+std::string HLSSegmentDiskCache::fileName(const char *uri)
+{
+	// 64-bit FNV-1a.
+	uint64_t hash = 14695981039346656037ULL;
+	for (const unsigned char *c = (const unsigned char*)uri; *c; ++c)
+	{
+		hash ^= *c;
+		hash *= 1099511628211ULL;
+	}
+
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx%s", (unsigned long long)hash, kDiskSuffix);
+	return std::string(name);
+}
+
+void HLSSegmentDiskCache::discard(const std::string &name)
+{
+	DISK_INDEX::iterator got = mIndex.find(name);
+	if (got == mIndex.end())
+		return;
+
+	mTotalSize -= got->second.size;
+	mIndex.erase(got);
+	unlink((mDir + "/" + name).c_str());
+}
+
+void HLSSegmentDiskCache::trim()
+{
+	// The index is at most a few hundred entries, so a scan for the oldest
+	// beats keeping a separate LRU list in step.
+	while (mTotalSize > mMaxSize && !mIndex.empty())
+	{
+		DISK_INDEX::iterator oldest = mIndex.begin();
+		for (DISK_INDEX::iterator i = mIndex.begin(); i != mIndex.end(); ++i)
+		{
+			if (i->second.lastUsed < oldest->second.lastUsed)
+				oldest = i;
+		}
+
+		LOGV("Disk cache evicting %s", oldest->first.c_str());
+		discard(oldest->first);
+	}
+}
+
+void HLSSegmentDiskCache::write(HLSSegmentBuffer *buffer)
+{
+	AutoLock locker(&mLock, __func__);
+
+	int64_t size = buffer->getSize();
+	if (mDir.empty() || !mWriterStarted || size <= 0 || size > mMaxSize)
+		return;
+
+	if (mPendingSize + size > kMaxPendingSize)
+	{
+		LOGW("Disk cache writer is behind; not keeping %s", buffer->getUri());
+		return;
+	}
+
+	buffer->addRef();
+	mPending.push_back(buffer);
+	mPendingSize += size;
+	pthread_cond_signal(&mPendingCond);
+}
+
+void *HLSSegmentDiskCache::writerThread(void *)
+{
+	for (;;)
+	{
+		HLSSegmentBuffer *buffer = NULL;
+		{
+			AutoLock locker(&mLock, __func__);
+			while (mPending.empty())
+				pthread_cond_wait(&mPendingCond, &mLock);
+			buffer = mPending.front();
+		}
+
+		// Left at the front of the queue while it's written, so map() can
+		// still find it.
+		writeFile(buffer->getUri(), buffer->getData(), buffer->getSize());
+
+		{
+			AutoLock locker(&mLock, __func__);
+			mPending.pop_front();
+			mPendingSize -= buffer->getSize();
+		}
+		buffer->release();
+	}
+	return NULL;
+}
+
+void HLSSegmentDiskCache::writeFile(const char *uri, const void *bytes, int64_t size)
+{
+	std::string name = fileName(uri);
+	std::string path, tmpPath;
+	{
+		AutoLock locker(&mLock, __func__);
+
+		if (mDir.empty() || size <= 0 || size > mMaxSize)
+			return;
+
+		DISK_INDEX::iterator got = mIndex.find(name);
+		if (got != mIndex.end())
+		{
+			got->second.lastUsed = time(NULL);
+			return;
+		}
+
+		path = mDir + "/" + name;
+		tmpPath = path + ".tmp";
+	}
+
+	// Write outside the lock, then rename into place so readers never see
+	// a half-written file.
+	FILE *f = fopen(tmpPath.c_str(), "wb");
+	if (f == NULL)
+	{
+		LOGE("Could not create %s (%d)", tmpPath.c_str(), errno);
+		return;
+	}
+
+	uint32_t header[2] = { kDiskMagic, (uint32_t)strlen(uri) };
+	bool ok = fwrite(header, sizeof(header), 1, f) == 1
+			&& fwrite(uri, header[1], 1, f) == 1
+			&& fwrite(bytes, size, 1, f) == 1;
+	ok = (fclose(f) == 0) && ok;
+
+	if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+	{
+		LOGE("Could not write %s to disk cache (%d)", uri, errno);
+		unlink(tmpPath.c_str());
+		return;
+	}
+
+	AutoLock locker(&mLock, __func__);
+
+	Entry e;
+	e.size = sizeof(header) + header[1] + size;
+	e.lastUsed = time(NULL);
+
+	DISK_INDEX::iterator got = mIndex.find(name);
+	if (got != mIndex.end())
+		mTotalSize -= got->second.size;
+	mIndex[name] = e;
+	mTotalSize += e.size;
+
+	LOGV("Disk cache stored %s as %s", uri, name.c_str());
+	trim();
+}
+
+HLSSegmentBuffer *HLSSegmentDiskCache::map(const char *uri)
+{
+	AutoLock locker(&mLock, __func__);
+
+	if (mDir.empty())
+		return NULL;
+
+	for (std::deque<HLSSegmentBuffer *>::iterator i = mPending.begin(); i != mPending.end(); ++i)
+	{
+		if (strcmp((*i)->getUri(), uri) == 0)
+		{
+			(*i)->addRef();
+			return *i;
+		}
+	}
+
+	std::string name = fileName(uri);
+	DISK_INDEX::iterator got = mIndex.find(name);
+	if (got == mIndex.end())
+		return NULL;
+
+	std::string path = mDir + "/" + name;
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		LOGE("Could not open %s (%d)", path.c_str(), errno);
+		discard(name);
+		return NULL;
+	}
+
+	struct stat st;
+	void *mapping = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > (off_t)(2 * sizeof(uint32_t)))
+		mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // The mapping keeps the file alive.
+
+	if (mapping == MAP_FAILED)
+	{
+		LOGE("Could not map %s (%d)", path.c_str(), errno);
+		discard(name);
+		return NULL;
+	}
+
+	// Make sure this is the segment we think it is.
+	const uint32_t *header = (const uint32_t*)mapping;
+	int64_t dataOffset = 2 * sizeof(uint32_t) + header[1];
+	if (header[0] != kDiskMagic || dataOffset > st.st_size
+			|| strlen(uri) != header[1] || memcmp((const char*)mapping + 2 * sizeof(uint32_t), uri, header[1]) != 0)
+	{
+		LOGE("%s doesn't hold %s; discarding", path.c_str(), uri);
+		munmap(mapping, st.st_size);
+		discard(name);
+		return NULL;
+	}
+
+	got->second.lastUsed = time(NULL);
+
+	LOGI("Disk cache hit for %s", uri);
+	return new HLSSegmentBuffer(uri, mapping, st.st_size, dataOffset);
+}
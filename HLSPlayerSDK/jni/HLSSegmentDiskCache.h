@@ -0,0 +1,72 @@
+#ifndef _HLSSEGMENTDISKCACHE_H_
+#define _HLSSEGMENTDISKCACHE_H_
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include "debug.h"
+
+class HLSSegmentBuffer;
+
+// On-disk tier behind the native segment store. Segments the Java cache
+// evicts are written to files in the app cache directory and mapped back in
+// when they're wanted again, so rewinding inside a DVR window or replaying a
+// VOD title doesn't go back to the CDN. Bounded by size; the least recently
+// used files go first.
+//
+// Files hold unpadded segment data behind a small header naming the URI, so
+// a hash collision is detected rather than served. Segments under whole-
+// segment AES are only ever clear in memory, so they are never written.
+//
+// Writes happen on a thread of their own; evicting a segment only queues it.
+class HLSSegmentDiskCache
+{
+private:
+	struct Entry
+	{
+		int64_t size; // Of the whole file.
+		time_t lastUsed;
+	};
+
+	// Keyed by file name.
+	typedef std::map<std::string, Entry> DISK_INDEX;
+	static DISK_INDEX mIndex;
+	static std::string mDir;
+	static int64_t mTotalSize;
+	static int64_t mMaxSize;
+	static pthread_mutex_t mLock;
+
+	// Segments waiting for the writer thread, each holding a reference.
+	// Guarded by mLock, like everything else.
+	static std::deque<HLSSegmentBuffer *> mPending;
+	static int64_t mPendingSize;
+	static pthread_cond_t mPendingCond;
+	static bool mWriterStarted;
+
+	static std::string fileName(const char *uri);
+	static void discard(const std::string &name);
+	static void trim();
+	static bool hasCurrentHeader(const std::string &path);
+	static void writeFile(const char *uri, const void *bytes, int64_t size);
+	static void *writerThread(void *);
+
+public:
+	// Scans dir for segments left by earlier sessions. Until this is called
+	// the tier is disabled and every other method is a no-op.
+	static void initialize(const char *dir, int64_t maxSize);
+
+	// Queue a complete segment to be written to disk, unless it's already
+	// there. Takes its own reference on buffer; never blocks on the write.
+	static void write(HLSSegmentBuffer *buffer);
+
+	// Map a segment back in, or hand back the buffer itself if it is still
+	// waiting to be written. Returns a referenced buffer the caller must
+	// release(), or NULL if the segment isn't on disk.
+	static HLSSegmentBuffer *map(const char *uri);
+};
+
+#endif
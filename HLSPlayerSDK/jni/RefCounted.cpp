@@ -29,9 +29,14 @@ int RefCounted::addRef()
 
 int RefCounted::release()
 {
-	AutoLock locker(&lock);
-	int refCount = (--mRefCount);
-	if (mRefCount == 0)
+	int refCount = 0;
+	{
+		AutoLock locker(&lock);
+		refCount = (--mRefCount);
+	}
+
+	// unload() may delete us, so it must run after the lock is released.
+	if (refCount == 0)
 	{
 		unload();
 	}
@@ -1,5 +1,11 @@
 #include "stdio.h"
-#include "aes.h"
+#include "aes_hw.h"
+#if defined(HLS_AES_NI)
+#include <cpuid.h>
+#endif
+#if defined(HLS_AES_ARMV8) && defined(__aarch64__)
+#include <sys/auxv.h>
+#endif
 static const unsigned int Te0[256] = {
     0xc66363a5UL, 0xf87c7c84UL, 0xee777799UL, 0xf67b7b8dUL,
     0xfff2f20dUL, 0xd66b6bbdUL, 0xde6f6fb1UL, 0x91c5c554UL,
@@ -1065,6 +1071,95 @@ void AesDecBlk(AesCtx *pCtx, const unsigned char ct[], unsigned char pt[])
     PUTU32(pt + 12, s3);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Hardware dispatch                                                        //
+//////////////////////////////////////////////////////////////////////////////
+
+#if defined(HLS_AES_NI)
+static int CpuHasAesNi(void)
+{
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d))
+        return 0;
+    return (c & bit_AES) != 0;
+}
+#endif
+
+#if (defined(HLS_AES_ARMV8) || defined(HLS_AES_NEON)) && !defined(__aarch64__)
+/*
+* getauxval() only arrived in API 18, so read the auxiliary vector
+* ourselves. Returns the value of the entry of the given type, or 0.
+*/
+static unsigned long AuxvEntry(unsigned long type)
+{
+    unsigned long entry[2];
+    unsigned long value = 0;
+    FILE *f = fopen("/proc/self/auxv", "rb");
+    if (f == 0)
+        return 0;
+    while (fread(entry, sizeof(entry), 1, f) == 1 && entry[0] != 0) {
+        if (entry[0] == type) {
+            value = entry[1];
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+#endif
+
+#if defined(HLS_AES_ARMV8)
+static int CpuHasArmv8Aes(void)
+{
+#if defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & (1 << 3)) != 0;   // HWCAP_AES
+#else
+    return (AuxvEntry(26) & 1) != 0;                // AT_HWCAP2, HWCAP2_AES
+#endif
+}
+#endif
+
+#if defined(HLS_AES_NEON)
+static int CpuHasNeon(void)
+{
+#if defined(__aarch64__)
+    return 1;
+#else
+    return (AuxvEntry(16) & (1 << 12)) != 0;        // AT_HWCAP, HWCAP_NEON
+#endif
+}
+#endif
+
+/*
+* Pick the CBC decrypt backend for this CPU, once. Racing first callers
+* all compute the same answer, so no lock is needed.
+*/
+static int gCbcBackendChosen = 0;
+static AesCbcDecryptFn gCbcBackend = 0;
+
+static AesCbcDecryptFn AesCbcBackend(void)
+{
+    if (gCbcBackendChosen)
+        return gCbcBackend;
+
+#if defined(HLS_AES_NI)
+    if (gCbcBackend == 0 && CpuHasAesNi())
+        gCbcBackend = AesNiCbcDecrypt;
+#endif
+#if defined(HLS_AES_ARMV8)
+    if (gCbcBackend == 0 && CpuHasArmv8Aes())
+        gCbcBackend = AesArmv8CbcDecrypt;
+#endif
+#if defined(HLS_AES_NEON)
+    // No AES instructions; bit-slicing keeps the key out of cache timings.
+    if (gCbcBackend == 0 && CpuHasNeon())
+        gCbcBackend = AesNeonCbcDecrypt;
+#endif
+
+    gCbcBackendChosen = 1;
+    return gCbcBackend;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // API functions                                                            //
 //////////////////////////////////////////////////////////////////////////////
@@ -1080,6 +1175,14 @@ int AesCtxIni(AesCtx *pCtx, unsigned char *pIV, unsigned char *pKey, unsigned in
     // generate key schedule
     pCtx->Nr = AesGenKeySched(pCtx->Ek,  pCtx->Dk, pKey, KeyLen);
 
+    // the hardware backends take the decrypt schedule as bytes
+    pCtx->Backend = (Mode == CBC) ? AesCbcBackend() : 0;
+    if (pCtx->Backend != 0) {
+        int i;
+        for (i = 0; i < 4 * (pCtx->Nr + 1); i++)
+            PUTU32(pCtx->Rk + 4 * i, pCtx->Dk[i]);
+    }
+
     // initialize IV
     if (pIV != 0) {
         pCtx->Iv[0] = GETU32(pIV     );
@@ -1094,12 +1197,42 @@ int AesCtxIni(AesCtx *pCtx, unsigned char *pIV, unsigned char *pKey, unsigned in
     return 0;
 }
 
+/*
+* reset the IV
+*/
+int AesSetIV(AesCtx *pCtx, const unsigned char *pIV)
+{
+    if (pCtx == 0 || pIV == 0)
+        return -1;
+
+    pCtx->Iv[0] = GETU32(pIV     );
+    pCtx->Iv[1] = GETU32(pIV + 4 );
+    pCtx->Iv[2] = GETU32(pIV + 8 );
+    pCtx->Iv[3] = GETU32(pIV + 12);
+    return 0;
+}
+
+/*
+* read back the IV
+*/
+int AesGetIV(const AesCtx *pCtx, unsigned char *pIV)
+{
+    if (pCtx == 0 || pIV == 0)
+        return -1;
+
+    PUTU32(pIV     , pCtx->Iv[0]);
+    PUTU32(pIV + 4 , pCtx->Iv[1]);
+    PUTU32(pIV + 8 , pCtx->Iv[2]);
+    PUTU32(pIV + 12, pCtx->Iv[3]);
+    return 0;
+}
+
 /*
 * Encrypt plain text
 */
 int AesEncrypt(AesCtx *pCtx, unsigned char *pData, unsigned char *pCipher, unsigned int DataLen)
 {
-    int i;
+    unsigned int i;
 
     if (pData == 0 || pCipher == 0 || pCtx == 0 || (DataLen & 0xf) != 0)
         return -1;
@@ -1118,11 +1251,25 @@ int AesEncrypt(AesCtx *pCtx, unsigned char *pData, unsigned char *pCipher, unsig
 */
 int AesDecrypt(AesCtx *pCtx, unsigned char *pCipher, unsigned char *pData, unsigned int CipherLen)
 {
-    int i;
+    unsigned int i;
 
     if (pData == 0 || pCipher == 0 || pCtx == 0 || (CipherLen & 0xf) != 0)
         return -1;
 
+    if (pCtx->Backend != 0 && pCtx->Mode == CBC) {
+        unsigned char iv[BLOCKSZ];
+        PUTU32(iv     , pCtx->Iv[0]);
+        PUTU32(iv +  4, pCtx->Iv[1]);
+        PUTU32(iv +  8, pCtx->Iv[2]);
+        PUTU32(iv + 12, pCtx->Iv[3]);
+        pCtx->Backend(pCtx->Rk, pCtx->Nr, iv, pCipher, pData, CipherLen);
+        pCtx->Iv[0] = GETU32(iv     );
+        pCtx->Iv[1] = GETU32(iv +  4);
+        pCtx->Iv[2] = GETU32(iv +  8);
+        pCtx->Iv[3] = GETU32(iv + 12);
+        return CipherLen;
+    }
+
     for (i = 0; i < CipherLen; i += BLOCKSZ) {
         // decrypt block by block
         AesDecBlk(pCtx, pCipher, pData);
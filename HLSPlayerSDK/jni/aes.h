@@ -4,10 +4,17 @@
 * public domain)
 */
 
+#ifndef _AES_H_
+#define _AES_H_
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// hardware CBC decryptor; see aes_hw.h
+typedef void (*AesCbcDecryptFn)(const unsigned char *rk, int nr, unsigned char iv[16],
+                                const unsigned char *in, unsigned char *out, unsigned int len);
+
 // AES context structure
 typedef struct {
  unsigned int Ek[60];
@@ -15,6 +22,9 @@ typedef struct {
  unsigned int Iv[4];
  unsigned char Nr;
  unsigned char Mode;
+ // set when a hardware backend handles CBC decryption on this CPU
+ AesCbcDecryptFn Backend;
+ unsigned char Rk[240];
 } AesCtx;
 
 // key length in bytes
@@ -31,8 +41,17 @@ typedef struct {
 
 int AesCtxIni(AesCtx *pCtx, unsigned char *pIV, unsigned char *pKey, unsigned int KeyLen, unsigned char Mode);
 int AesEncrypt(AesCtx *pCtx, unsigned char *pData, unsigned char *pCipher, unsigned int DataLen);
+// pCipher and pData may be the same buffer; each block is read before it is
+// written. In CBC mode the context keeps the last cipher block, so a stream
+// can be decrypted across several calls.
 int AesDecrypt(AesCtx *pCtx, unsigned char *pCipher, unsigned char *pData, unsigned int CipherLen);
+// Restart the CBC chain from pIV, keeping the key schedule.
+int AesSetIV(AesCtx *pCtx, const unsigned char *pIV);
+// Read back the CBC chain, e.g. to carry on with it in another context.
+int AesGetIV(const AesCtx *pCtx, unsigned char *pIV);
 
 #ifdef __cplusplus
 };
 #endif
+
+#endif
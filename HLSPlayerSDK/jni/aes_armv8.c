@@ -0,0 +1,63 @@
+/*
+* AES-CBC decryption with the ARMv8 Cryptography Extensions, in AArch32 or
+* AArch64 state. Built with the crypto FPU flags; only called once aes.c has
+* seen the AES hwcap.
+*/
+
+#include <arm_neon.h>
+#include "aes_hw.h"
+
+/*
+* AESD adds the round key before the inverse S-box rather than after the
+* inverse mix, so the equivalent inverse schedule lines up as
+* AESIMC(AESD(s, rk[i])) for the full rounds and a plain XOR at the end.
+*/
+#define DEC_ROUND(s, k) s = vaesimcq_u8(vaesdq_u8(s, k))
+
+void AesArmv8CbcDecrypt(const unsigned char *rk, int nr, unsigned char iv[16],
+                        const unsigned char *in, unsigned char *out, unsigned int len)
+{
+    uint8x16_t k[15], prev, c0, c1, c2, c3, s0, s1, s2, s3;
+    unsigned int i;
+    int r;
+
+    for (r = 0; r <= nr; r++)
+        k[r] = vld1q_u8(rk + 16 * r);
+    prev = vld1q_u8(iv);
+
+    // Four blocks in flight, all loaded before any is stored; see aes_x86.c.
+    for (i = 0; i + 4 * 16 <= len; i += 4 * 16) {
+        c0 = vld1q_u8(in + i);
+        c1 = vld1q_u8(in + i + 16);
+        c2 = vld1q_u8(in + i + 32);
+        c3 = vld1q_u8(in + i + 48);
+        s0 = c0; s1 = c1; s2 = c2; s3 = c3;
+        for (r = 0; r < nr - 1; r++) {
+            DEC_ROUND(s0, k[r]);
+            DEC_ROUND(s1, k[r]);
+            DEC_ROUND(s2, k[r]);
+            DEC_ROUND(s3, k[r]);
+        }
+        s0 = veorq_u8(veorq_u8(vaesdq_u8(s0, k[nr - 1]), k[nr]), prev);
+        s1 = veorq_u8(veorq_u8(vaesdq_u8(s1, k[nr - 1]), k[nr]), c0);
+        s2 = veorq_u8(veorq_u8(vaesdq_u8(s2, k[nr - 1]), k[nr]), c1);
+        s3 = veorq_u8(veorq_u8(vaesdq_u8(s3, k[nr - 1]), k[nr]), c2);
+        vst1q_u8(out + i, s0);
+        vst1q_u8(out + i + 16, s1);
+        vst1q_u8(out + i + 32, s2);
+        vst1q_u8(out + i + 48, s3);
+        prev = c3;
+    }
+
+    for (; i < len; i += 16) {
+        c0 = vld1q_u8(in + i);
+        s0 = c0;
+        for (r = 0; r < nr - 1; r++)
+            DEC_ROUND(s0, k[r]);
+        s0 = veorq_u8(veorq_u8(vaesdq_u8(s0, k[nr - 1]), k[nr]), prev);
+        vst1q_u8(out + i, s0);
+        prev = c0;
+    }
+
+    vst1q_u8(iv, prev);
+}
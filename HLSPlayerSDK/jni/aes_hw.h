@@ -0,0 +1,40 @@
+/*
+* Hardware AES backends, used by aes.c when the CPU has AES instructions,
+* or, failing those, NEON to run a bit-sliced AES on. Each lives in its own file so it can be built with the instruction set
+* flags it needs while the rest of the library stays baseline.
+*
+* Round keys are the equivalent inverse cipher schedule (aes.c's Dk) laid
+* out as bytes, Nr + 1 blocks of 16. The IV is updated to the last cipher
+* block. In and out may be the same buffer; len is a multiple of 16.
+*/
+
+#ifndef _AES_HW_H_
+#define _AES_HW_H_
+
+#include "aes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(HLS_AES_NI)
+void AesNiCbcDecrypt(const unsigned char *rk, int nr, unsigned char iv[16],
+                     const unsigned char *in, unsigned char *out, unsigned int len);
+#endif
+
+#if defined(HLS_AES_ARMV8)
+void AesArmv8CbcDecrypt(const unsigned char *rk, int nr, unsigned char iv[16],
+                        const unsigned char *in, unsigned char *out, unsigned int len);
+#endif
+
+#if defined(HLS_AES_NEON)
+// Bit-sliced, for NEON CPUs without AES instructions; see aes_neon.c.
+void AesNeonCbcDecrypt(const unsigned char *rk, int nr, unsigned char iv[16],
+                       const unsigned char *in, unsigned char *out, unsigned int len);
+#endif
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,295 @@
+/*
+* Bit-sliced AES-CBC decryption with NEON, for ARM CPUs that have NEON but
+* not the Cryptography Extensions. Built with the NEON FPU flags; only
+* called once aes.c has seen the NEON hwcap and not the AES one.
+*
+* Eight blocks are decrypted at a time. They are transposed so that vector
+* k holds bit k of every byte of all eight blocks: in each vector, byte j is
+* state byte j and bit b of it belongs to block b. The inverse S-box is then
+* a fixed circuit of ANDs and XORs rather than the table lookups of aes.c,
+* so it takes the same time whatever the key and data, and reads no memory
+* by secret index.
+*/
+
+#include <arm_neon.h>
+#include "aes_hw.h"
+
+typedef struct {
+    uint8x16_t b[8];
+} Planes;
+
+/*
+* Swap the bits of lo selected by m << n with the bits of hi selected by m.
+* Done for every pair below, it transposes the 8x8 bit matrix formed by a
+* byte of each of eight vectors; doing it again transposes back.
+*/
+#define SWAPMOVE(lo, hi, n, m) do {                                         \
+    uint8x16_t t_ = vandq_u8(veorq_u8(vshrq_n_u8(lo, n), hi), m);          \
+    hi = veorq_u8(hi, t_);                                                  \
+    lo = veorq_u8(lo, vshlq_n_u8(t_, n));                                   \
+} while (0)
+
+static void Transpose(Planes *p)
+{
+    const uint8x16_t m1 = vdupq_n_u8(0x55);
+    const uint8x16_t m2 = vdupq_n_u8(0x33);
+    const uint8x16_t m4 = vdupq_n_u8(0x0f);
+
+    SWAPMOVE(p->b[0], p->b[1], 1, m1);
+    SWAPMOVE(p->b[2], p->b[3], 1, m1);
+    SWAPMOVE(p->b[4], p->b[5], 1, m1);
+    SWAPMOVE(p->b[6], p->b[7], 1, m1);
+
+    SWAPMOVE(p->b[0], p->b[2], 2, m2);
+    SWAPMOVE(p->b[1], p->b[3], 2, m2);
+    SWAPMOVE(p->b[4], p->b[6], 2, m2);
+    SWAPMOVE(p->b[5], p->b[7], 2, m2);
+
+    SWAPMOVE(p->b[0], p->b[4], 4, m4);
+    SWAPMOVE(p->b[1], p->b[5], 4, m4);
+    SWAPMOVE(p->b[2], p->b[6], 4, m4);
+    SWAPMOVE(p->b[3], p->b[7], 4, m4);
+}
+
+/*
+* GF(2^4) arithmetic modulo z^4 + z + 1, one vector per coefficient. The
+* S-box inverts in GF((2^4)^2) instead of GF(2^8), which takes five of these
+* multiplications.
+*/
+static void Mul4(const uint8x16_t *a, const uint8x16_t *b, uint8x16_t *c)
+{
+    uint8x16_t p0, p1, p2, p3, p4, p5, p6;
+
+    p0 = vandq_u8(a[0], b[0]);
+    p1 = veorq_u8(vandq_u8(a[0], b[1]), vandq_u8(a[1], b[0]));
+    p2 = veorq_u8(veorq_u8(vandq_u8(a[0], b[2]), vandq_u8(a[1], b[1])),
+                  vandq_u8(a[2], b[0]));
+    p3 = veorq_u8(veorq_u8(vandq_u8(a[0], b[3]), vandq_u8(a[1], b[2])),
+                  veorq_u8(vandq_u8(a[2], b[1]), vandq_u8(a[3], b[0])));
+    p4 = veorq_u8(veorq_u8(vandq_u8(a[1], b[3]), vandq_u8(a[2], b[2])),
+                  vandq_u8(a[3], b[1]));
+    p5 = veorq_u8(vandq_u8(a[2], b[3]), vandq_u8(a[3], b[2]));
+    p6 = vandq_u8(a[3], b[3]);
+
+    // z^4 = z + 1, z^5 = z^2 + z, z^6 = z^3 + z^2
+    c[0] = veorq_u8(p0, p4);
+    c[1] = veorq_u8(veorq_u8(p1, p4), p5);
+    c[2] = veorq_u8(veorq_u8(p2, p5), p6);
+    c[3] = veorq_u8(p3, p6);
+}
+
+static void Square4(const uint8x16_t *a, uint8x16_t *c)
+{
+    c[0] = veorq_u8(a[0], a[2]);
+    c[1] = a[2];
+    c[2] = veorq_u8(a[1], a[3]);
+    c[3] = a[3];
+}
+
+// a^14, which is a^-1 for a != 0 and 0 for 0.
+static void Inverse4(const uint8x16_t *a, uint8x16_t *c)
+{
+    uint8x16_t a2[4], a4[4], a8[4], t[4];
+
+    Square4(a, a2);
+    Square4(a2, a4);
+    Square4(a4, a8);
+    Mul4(a2, a4, t);
+    Mul4(t, a8, c);
+}
+
+/*
+* The inverse S-box: undo the affine map, invert, all in the tower field
+* GF((2^4)^2) with Y^2 + Y + 13 over the GF(2^4) above. The linear maps in
+* and out fold the affine inverse together with the change of basis between
+* the AES field and the tower, which maps x to the element 0x4b.
+*/
+static void InvSubBytes(Planes *p)
+{
+    const uint8x16_t ones = vdupq_n_u8(0xff);
+    uint8x16_t *x = p->b;
+    uint8x16_t lo[4], hi[4], d[4], di[4], t[4], u[8];
+    uint8x16_t x12, x16, x27;
+
+    // Into the tower, with the affine constant; hi is a, lo is b in aY + b.
+    x12 = veorq_u8(x[1], x[2]);
+    x16 = veorq_u8(x[1], x[6]);
+    x27 = veorq_u8(x[2], x[7]);
+    lo[0] = x[3];
+    lo[1] = veorq_u8(veorq_u8(x[1], x[3]), x[5]);
+    lo[2] = veorq_u8(veorq_u8(x[3], x[6]), veorq_u8(x27, ones));
+    lo[3] = veorq_u8(veorq_u8(x[5], x[7]), ones);
+    hi[0] = veorq_u8(veorq_u8(x12, x[7]), ones);
+    hi[1] = veorq_u8(veorq_u8(x[0], x[4]), veorq_u8(veorq_u8(x[5], x[6]), ones));
+    hi[2] = veorq_u8(veorq_u8(x12, x[3]), veorq_u8(veorq_u8(x[4], x[5]), x[7]));
+    hi[3] = veorq_u8(x16, x27);
+
+    // (aY + b)^-1 = (aY + a + b) / (13a^2 + ab + b^2)
+    Mul4(hi, lo, d);
+    d[0] = veorq_u8(d[0], veorq_u8(veorq_u8(hi[0], hi[1]), hi[3]));
+    d[1] = veorq_u8(d[1], hi[3]);
+    d[2] = veorq_u8(d[2], veorq_u8(hi[0], hi[2]));
+    d[3] = veorq_u8(d[3], hi[0]);
+    d[0] = veorq_u8(d[0], veorq_u8(lo[0], lo[2]));
+    d[1] = veorq_u8(d[1], lo[2]);
+    d[2] = veorq_u8(d[2], veorq_u8(lo[1], lo[3]));
+    d[3] = veorq_u8(d[3], lo[3]);
+    Inverse4(d, di);
+
+    t[0] = veorq_u8(hi[0], lo[0]);
+    t[1] = veorq_u8(hi[1], lo[1]);
+    t[2] = veorq_u8(hi[2], lo[2]);
+    t[3] = veorq_u8(hi[3], lo[3]);
+    Mul4(t, di, u);
+    Mul4(hi, di, u + 4);
+
+    // And back out of the tower.
+    x16 = veorq_u8(u[1], u[6]);
+    x[0] = veorq_u8(veorq_u8(u[0], u[1]), u[4]);
+    x[1] = veorq_u8(veorq_u8(u[4], u[5]), u[6]);
+    x[2] = veorq_u8(veorq_u8(veorq_u8(u[2], u[3]), u[4]), veorq_u8(u[6], u[7]));
+    x[3] = veorq_u8(veorq_u8(veorq_u8(u[2], u[3]), u[4]), veorq_u8(u[5], u[6]));
+    x[4] = veorq_u8(u[2], u[4]);
+    x[5] = x16;
+    x[6] = veorq_u8(veorq_u8(x16, u[2]), u[5]);
+    x[7] = veorq_u8(x16, u[7]);
+}
+
+static uint8x16_t Shuffle(uint8x16_t v, uint8x16_t index)
+{
+#if defined(__aarch64__)
+    return vqtbl1q_u8(v, index);
+#else
+    uint8x8x2_t t;
+    t.val[0] = vget_low_u8(v);
+    t.val[1] = vget_high_u8(v);
+    return vcombine_u8(vtbl2_u8(t, vget_low_u8(index)), vtbl2_u8(t, vget_high_u8(index)));
+#endif
+}
+
+static const unsigned char kInvShiftRows[16] = {
+    0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3
+};
+
+static void InvShiftRows(Planes *p)
+{
+    const uint8x16_t index = vld1q_u8(kInvShiftRows);
+    int k;
+
+    for (k = 0; k < 8; k++)
+        p->b[k] = Shuffle(p->b[k], index);
+}
+
+// Each column is a 32-bit lane; byte r of the result is row r + 1 or r + 2.
+static uint8x16_t RotateRows1(uint8x16_t v)
+{
+    uint32x4_t w = vreinterpretq_u32_u8(v);
+    return vreinterpretq_u8_u32(vsriq_n_u32(vshlq_n_u32(w, 24), w, 8));
+}
+
+static uint8x16_t RotateRows2(uint8x16_t v)
+{
+    return vreinterpretq_u8_u16(vrev32q_u16(vreinterpretq_u16_u8(v)));
+}
+
+// Multiply every byte by x, modulo x^8 + x^4 + x^3 + x + 1.
+static void Xtime(const uint8x16_t *x, uint8x16_t *y)
+{
+    uint8x16_t x7 = x[7];
+
+    y[7] = x[6];
+    y[6] = x[5];
+    y[5] = x[4];
+    y[4] = veorq_u8(x[3], x7);
+    y[3] = veorq_u8(x[2], x7);
+    y[2] = x[1];
+    y[1] = veorq_u8(x[0], x7);
+    y[0] = x7;
+}
+
+/*
+* InvMixColumns as a pre-step into MixColumns: a[r] ^= 4 * (a[r] ^ a[r+2]),
+* then out[r] = 2 * (a[r] ^ a[r+1]) ^ a[r+1] ^ a[r+2] ^ a[r+3].
+*/
+static void InvMixColumns(Planes *p)
+{
+    uint8x16_t *x = p->b;
+    uint8x16_t t[8], u[8];
+    int k;
+
+    for (k = 0; k < 8; k++)
+        t[k] = veorq_u8(x[k], RotateRows2(x[k]));
+    Xtime(t, u);
+    Xtime(u, t);
+    for (k = 0; k < 8; k++)
+        x[k] = veorq_u8(x[k], t[k]);
+
+    for (k = 0; k < 8; k++)
+        t[k] = veorq_u8(x[k], RotateRows1(x[k]));
+    Xtime(t, u);
+    for (k = 0; k < 8; k++)
+        x[k] = veorq_u8(veorq_u8(u[k], RotateRows1(x[k])), RotateRows2(t[k]));
+}
+
+static void AddRoundKey(Planes *p, const Planes *k)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        p->b[i] = veorq_u8(p->b[i], k->b[i]);
+}
+
+static void DecryptPlanes(Planes *p, const Planes *k, int nr)
+{
+    int r;
+
+    AddRoundKey(p, &k[0]);
+    for (r = 1; r < nr; r++) {
+        InvSubBytes(p);
+        InvShiftRows(p);
+        InvMixColumns(p);
+        AddRoundKey(p, &k[r]);
+    }
+    InvSubBytes(p);
+    InvShiftRows(p);
+    AddRoundKey(p, &k[nr]);
+}
+
+void AesNeonCbcDecrypt(const unsigned char *rk, int nr, unsigned char iv[16],
+                       const unsigned char *in, unsigned char *out, unsigned int len)
+{
+    Planes k[15], s;
+    uint8x16_t c[8], prev;
+    unsigned int i, n, b;
+    int r, bit;
+
+    // A round key is the same for all eight blocks: each bit fills a byte.
+    for (r = 0; r <= nr; r++) {
+        uint8x16_t key = vld1q_u8(rk + 16 * r);
+        for (bit = 0; bit < 8; bit++)
+            k[r].b[bit] = vtstq_u8(key, vdupq_n_u8((uint8_t)(1 << bit)));
+    }
+    prev = vld1q_u8(iv);
+
+    // All blocks of a batch are loaded before any is stored, for in place.
+    for (i = 0; i < len; i += n * 16) {
+        n = (len - i) / 16;
+        if (n > 8)
+            n = 8;
+        for (b = 0; b < 8; b++) {
+            c[b] = (b < n) ? vld1q_u8(in + i + 16 * b) : vdupq_n_u8(0);
+            s.b[b] = c[b];
+        }
+
+        Transpose(&s);
+        DecryptPlanes(&s, k, nr);
+        Transpose(&s);
+
+        for (b = 0; b < n; b++) {
+            vst1q_u8(out + i + 16 * b, veorq_u8(s.b[b], prev));
+            prev = c[b];
+        }
+    }
+
+    vst1q_u8(iv, prev);
+}
@@ -0,0 +1,63 @@
+/*
+* AES-CBC decryption with the x86 AES-NI instructions. Built with -maes;
+* only called once aes.c has seen the AES bit in CPUID.
+*/
+
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#include "aes_hw.h"
+
+void AesNiCbcDecrypt(const unsigned char *rk, int nr, unsigned char iv[16],
+                     const unsigned char *in, unsigned char *out, unsigned int len)
+{
+    __m128i k[15], prev, c0, c1, c2, c3, s0, s1, s2, s3;
+    unsigned int i;
+    int r;
+
+    for (r = 0; r <= nr; r++)
+        k[r] = _mm_loadu_si128((const __m128i *)(rk + 16 * r));
+    prev = _mm_loadu_si128((const __m128i *)iv);
+
+    /*
+     * CBC decryption has no chain between blocks, so keep four in flight to
+     * cover the latency of aesdec. All four are loaded before any is stored,
+     * which keeps in-place decryption safe.
+     */
+    for (i = 0; i + 4 * 16 <= len; i += 4 * 16) {
+        c0 = _mm_loadu_si128((const __m128i *)(in + i));
+        c1 = _mm_loadu_si128((const __m128i *)(in + i + 16));
+        c2 = _mm_loadu_si128((const __m128i *)(in + i + 32));
+        c3 = _mm_loadu_si128((const __m128i *)(in + i + 48));
+        s0 = _mm_xor_si128(c0, k[0]);
+        s1 = _mm_xor_si128(c1, k[0]);
+        s2 = _mm_xor_si128(c2, k[0]);
+        s3 = _mm_xor_si128(c3, k[0]);
+        for (r = 1; r < nr; r++) {
+            s0 = _mm_aesdec_si128(s0, k[r]);
+            s1 = _mm_aesdec_si128(s1, k[r]);
+            s2 = _mm_aesdec_si128(s2, k[r]);
+            s3 = _mm_aesdec_si128(s3, k[r]);
+        }
+        s0 = _mm_xor_si128(_mm_aesdeclast_si128(s0, k[nr]), prev);
+        s1 = _mm_xor_si128(_mm_aesdeclast_si128(s1, k[nr]), c0);
+        s2 = _mm_xor_si128(_mm_aesdeclast_si128(s2, k[nr]), c1);
+        s3 = _mm_xor_si128(_mm_aesdeclast_si128(s3, k[nr]), c2);
+        _mm_storeu_si128((__m128i *)(out + i), s0);
+        _mm_storeu_si128((__m128i *)(out + i + 16), s1);
+        _mm_storeu_si128((__m128i *)(out + i + 32), s2);
+        _mm_storeu_si128((__m128i *)(out + i + 48), s3);
+        prev = c3;
+    }
+
+    for (; i < len; i += 16) {
+        c0 = _mm_loadu_si128((const __m128i *)(in + i));
+        s0 = _mm_xor_si128(c0, k[0]);
+        for (r = 1; r < nr; r++)
+            s0 = _mm_aesdec_si128(s0, k[r]);
+        s0 = _mm_xor_si128(_mm_aesdeclast_si128(s0, k[nr]), prev);
+        _mm_storeu_si128((__m128i *)(out + i), s0);
+        prev = c0;
+    }
+
+    _mm_storeu_si128((__m128i *)iv, prev);
+}
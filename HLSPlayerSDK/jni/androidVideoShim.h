@@ -16,12 +16,16 @@
 #include <android/log.h>
 
 #include <vector>
+#include <deque>
+#include <string>
+#include <algorithm>
 
 #include <pthread.h>
 
 #include "debug.h"
 
 #include "HLSSegmentCache.h"
+#include "HLSCryptoTable.h"
 
 // Handy pthreads autolocker.
 class AutoLock
@@ -434,7 +438,7 @@ namespace android_video_shim
 
         virtual void            onFirstRef() {};
         virtual void            onLastStrongRef(const void* id) {};
-        virtual bool            onIncStrongAttempted(uint32_t flags, const void* id) {};
+        virtual bool            onIncStrongAttempted(uint32_t flags, const void* id) { return (flags & 1) != 0; }; // As RefBase's: only for FIRST_INC_STRONG.
         virtual void            onLastWeakRef(const void* id) {};
 
         void *mRefs;
@@ -1027,7 +1031,7 @@ namespace android_video_shim
             LOGV2("   o Got %p", surfaceID);
 
             LOGV2("Getting Surface off of the Java Surface");
-            sp<Surface> surface = (Surface *)env->GetIntField(javaSurface, surfaceID);
+            sp<Surface> surface = (Surface *)(intptr_t)env->GetIntField(javaSurface, surfaceID);
             LOGV2("   o Got %p", surface.get());
 
             LOGV2("Getting ISurface off of the Surface");
@@ -1220,6 +1224,8 @@ namespace android_video_shim
         virtual ~DataSource() {}
     };
 
+    class MediaBufferObserver;
+
     class MediaBuffer
     {
     public:
@@ -1238,6 +1244,16 @@ namespace android_video_shim
             lfc(this, size);
         }
 
+        // Wraps memory owned by the caller; it is not freed with the buffer.
+        MediaBuffer(void *data, size_t size)
+        {
+            typedef void (*localFuncCast)(void *thiz, void *data, unsigned int size);
+            localFuncCast lfc = (localFuncCast)searchSymbol("_ZN7android11MediaBufferC1EPvj");
+            assert(lfc);
+            LOGV2("MediaBuffer::ctor with data = %p", lfc);
+            lfc(this, data, size);
+        }
+
         // Decrements the reference count and returns the buffer to its
         // associated MediaBufferGroup if the reference count drops to 0.
         void release()
@@ -1253,7 +1269,22 @@ namespace android_video_shim
         // Increments the reference count.
         void add_ref()
         {
-            assert(0);
+            typedef void (*localFuncCast)(void *thiz);
+            localFuncCast lfc = (localFuncCast)searchSymbol("_ZN7android11MediaBuffer7add_refEv");
+            assert(lfc);
+            LOGV2("MediaBuffer::add_ref = %p this=%p", lfc, this);
+            lfc(this);
+        }
+
+        // With an observer set, release() hands the buffer back to it
+        // instead of deleting it once the reference count drops to 0.
+        void setObserver(MediaBufferObserver *group)
+        {
+            typedef void (*localFuncCast)(void *thiz, MediaBufferObserver *group);
+            localFuncCast lfc = (localFuncCast)searchSymbol("_ZN7android11MediaBuffer11setObserverEPNS_19MediaBufferObserverE");
+            assert(lfc);
+            LOGV2("MediaBuffer::setObserver = %p this=%p", lfc, this);
+            lfc(this, group);
         }
 
         void *data()
@@ -1294,7 +1325,11 @@ namespace android_video_shim
 
         void set_range(size_t offset, size_t length)
         {
-            assert(0);
+            typedef void (*localFuncCast)(void *thiz, unsigned int offset, unsigned int length);
+            localFuncCast lfc = (localFuncCast)searchSymbol("_ZN7android11MediaBuffer9set_rangeEjj");
+            assert(lfc);
+            LOGV2("MediaBuffer::set_range = %p this=%p", lfc, this);
+            lfc(this, offset, length);
         }
 
         sp<RefBase> graphicBuffer() const
@@ -1316,7 +1351,11 @@ namespace android_video_shim
         // Clears meta data and resets the range to the full extent.
         void reset()
         {
-            assert(0);
+            typedef void (*localFuncCast)(void *thiz);
+            localFuncCast lfc = (localFuncCast)searchSymbol("_ZN7android11MediaBuffer5resetEv");
+            assert(lfc);
+            LOGV2("MediaBuffer::reset = %p this=%p", lfc, this);
+            lfc(this);
         }
 
         // Returns a clone of this MediaBuffer increasing its reference count.
@@ -1441,11 +1480,27 @@ namespace android_video_shim
             // Reset everything back to defaults.
             void reset();
 
-            void setSeekTo(int64_t time_us, SeekMode mode = SEEK_CLOSEST_SYNC);
-            void clearSeekTo();
+            // These match the platform's, so a seek set here reaches the
+            // platform decoders we hand the options to, and theirs reach us.
+            void setSeekTo(int64_t time_us, SeekMode mode = SEEK_CLOSEST_SYNC)
+            {
+                mOptions |= kSeekTo_Option;
+                mSeekTimeUs = time_us;
+                mSeekMode = mode;
+            }
+
+            void clearSeekTo()
+            {
+                mOptions &= ~kSeekTo_Option;
+                mSeekTimeUs = 0;
+                mSeekMode = SEEK_CLOSEST_SYNC;
+            }
+
             bool getSeekTo(int64_t *time_us, SeekMode *mode) const
             {
-                return false;
+                *time_us = mSeekTimeUs;
+                *mode = mSeekMode;
+                return (mOptions & kSeekTo_Option) != 0;
             }
 
             void setLateBy(int64_t lateness_us);
@@ -1602,9 +1657,28 @@ namespace android_video_shim
             // Reset everything back to defaults.
             void reset();
 
-            void setSeekTo(int64_t time_us, SeekMode mode = SEEK_CLOSEST_SYNC);
-            void clearSeekTo();
-            bool getSeekTo(int64_t *time_us, SeekMode *mode) const;
+            // These match the platform's, so a seek set here reaches the
+            // platform decoders we hand the options to, and theirs reach us.
+            void setSeekTo(int64_t time_us, SeekMode mode = SEEK_CLOSEST_SYNC)
+            {
+                mOptions |= kSeekTo_Option;
+                mSeekTimeUs = time_us;
+                mSeekMode = mode;
+            }
+
+            void clearSeekTo()
+            {
+                mOptions &= ~kSeekTo_Option;
+                mSeekTimeUs = 0;
+                mSeekMode = SEEK_CLOSEST_SYNC;
+            }
+
+            bool getSeekTo(int64_t *time_us, SeekMode *mode) const
+            {
+                *time_us = mSeekTimeUs;
+                *mode = mSeekMode;
+                return (mOptions & kSeekTo_Option) != 0;
+            }
 
             void setLateBy(int64_t lateness_us);
             int64_t getLateBy() const;
@@ -2157,9 +2231,25 @@ namespace android_video_shim
     class HLSDataSource : public DataSource
     {
     public:
-        HLSDataSource(): mSourceIdx(0), mSegmentStartOffset(0), mOffsetAdjustment(0),
-        				 mContinuityEra(0), mQuality(0), mStartTime(0)
+        // Returned by readBlockAt and waitForData for an offset past the end
+        // of every source appended so far. More may still be appended.
+        static const status_t END_OF_SOURCES = MEDIA_ERROR_BASE - 100;
+
+        // Told whenever sources are appended, so a reader that caught up
+        // with them knows to carry on. Called with the data source locked.
+        struct AppendListener
         {
+            virtual ~AppendListener() {}
+            virtual void onSourcesAppended() = 0;
+        };
+
+        HLSDataSource(): mSourceIdx(0), mSegmentStartOffset(0),
+        				 mQuality(0), mContinuityEra(0), mStartTime(0), mSourceBuffer(NULL),
+        				 mSourcesGeneration(0), mAppendListener(NULL), mReadsInterrupted(false),
+        				 mWaitBuffer(NULL)
+        {
+            mSourceOffsets.push_back(0);
+
             // Initialize our mutex.
             int err = initRecursivePthreadMutex(&lock);
             LOGI(" HLSDataSource mutex err = %d", err);
@@ -2172,10 +2262,25 @@ namespace android_video_shim
 
         void patchTable()
         {
+            // Now we can patch the vtable...
+            void ***fakeObj = (void***)this;
+            fakeObj[0] = sharedVtable();
+        }
+
+        // Every data source shares one fake vtable; what goes in it only
+        // depends on which DataSource ABI the device has.
+        static void **sharedVtable()
+        {
+            static pthread_mutex_t vtableLock = PTHREAD_MUTEX_INITIALIZER;
+            static void **vtable = NULL;
+
+            AutoLock locker(&vtableLock, __func__);
+            if (vtable)
+                return vtable;
+
             // Fake up the right vtable.
 
-            // First look up and make a copy of the official vtable.
-            // This leaks a bit of RAM per source but we can deal with that later.
+            // We used to look up and make a copy of the official vtable.
             // Update - we can't resolve this symbol on some x86 devices, and it turns
             // out we don't need it - we can just set stuff to 0s and it works OK.
             // This is obviously a bit finicky but adequate for now.
@@ -2186,11 +2291,8 @@ namespace android_video_shim
             //memcpy(newVtable, officialVtable, 1024);
             memset(newVtable, 0, 1024);
 
-            // Now we can patch the vtable...
-            void ***fakeObj = (void***)this;
-
             // Take into account mandatory vtable offsets.
-            fakeObj[0] = (void**)(((int*)newVtable) + 2);
+            void **entries = (void**)(((int*)newVtable) + 2);
 
             // Dump some useful known symbols.
             #if 0
@@ -2203,12 +2305,6 @@ namespace android_video_shim
             #undef DLSYM_MACRO
             #endif
 
-            // Dump the vtable.
-            for(int i=0; i<16; i++)
-            {
-              LOGV2("vtable[%d] = %p", i, fakeObj[0][i]);
-            }
-
             // The compiler may complain about these as we are getting into
             // pointer-to-member-function (pmf) territory. However, we aren't
             // actually treating them as such here because there's no instance.
@@ -2221,49 +2317,59 @@ namespace android_video_shim
             LOGSYMBOLERROR(" _readAt_23=%p", (void*)&HLSDataSource::_readAt_23);
             LOGSYMBOLERROR(" _getSize_23=%p", (void*)&HLSDataSource::_getSize_23);
 
+            // Stub in a dummy function for the other entries so that if
+            // e.g. someone tries to call a destructor it won't segfault.
+            for(int i=0; i<18; i++)
+                entries[i] = (void*)&HLSDataSource::dummyDtor;
+
             // And override the pointers as appropriate.
             if(AVSHIM_USE_NEWDATASOURCEVTABLE)
             {
-                // Stub in a dummy function for the other entries so that if
-                // e.g. someone tries to call a destructor it won't segfault.
-                for(int i=0; i<18; i++)
-                    fakeObj[0][i] = (void*)&HLSDataSource::dummyDtor;
-
                 // 4.x entry points
-                fakeObj[0][6] = (void*)&HLSDataSource::_initCheck;
-                fakeObj[0][7] = (void*)&HLSDataSource::_readAt;
-                fakeObj[0][8] = (void*)&HLSDataSource::_getSize;
+                entries[6] = (void*)&HLSDataSource::_initCheck;
+                entries[7] = (void*)&HLSDataSource::_readAt;
+                entries[8] = (void*)&HLSDataSource::_getSize;
             }
             else
             {
                 // Confirm what we can that we're doing this right...
                 void *oldGetSize = searchSymbol("_ZN7android10DataSource7getSizeEPl");
                 void *oldGetSize2 = searchSymbol("_ZN7android10DataSource7getSizeEPx");
-                LOGI("  oldGetSize_l=%p oldGetSize_x=%p fakeObj[0][8]=%p", oldGetSize, oldGetSize2, fakeObj[0][8]);
-
-                // Stub in a dummy function for the other entries so that if
-                // e.g. someone tries to call a destructor it won't segfault.
-                for(int i=0; i<18; i++)
-                    fakeObj[0][i] = (void*)&HLSDataSource::dummyDtor;
+                LOGI("  oldGetSize_l=%p oldGetSize_x=%p", oldGetSize, oldGetSize2);
 
                 // 2.3 entry points
-                fakeObj[0][6] = (void*)&HLSDataSource::_initCheck;
-                fakeObj[0][7] = (void*)&HLSDataSource::_readAt_23;
-                fakeObj[0][8] = (void*)&HLSDataSource::_getSize_23;
+                entries[6] = (void*)&HLSDataSource::_initCheck;
+                entries[7] = (void*)&HLSDataSource::_readAt_23;
+                entries[8] = (void*)&HLSDataSource::_getSize_23;
+            }
+
+            // Dump the vtable.
+            for(int i=0; i<16; i++)
+            {
+              LOGV2("vtable[%d] = %p", i, entries[i]);
             }
+
+            vtable = entries;
+            return vtable;
         }
 
         virtual ~HLSDataSource()
         {
-
+            releaseSourceBuffer();
+            freeSourceCryptoIds();
         }
 
         void clearSources()
         {
             AutoLock locker(&lock, __func__);
+            releaseSourceBuffer();
+            mSourcesGeneration++;
         	mSources.clear();
+        	mSourceStartTimes.clear();
+        	freeSourceCryptoIds();
         	mSourceIdx = 0;
-        	mOffsetAdjustment = 0;
+        	mSourceOffsets.clear();
+        	mSourceOffsets.push_back(0);
         }
 
         bool isSameEra(int quality, int continuityEra)
@@ -2284,18 +2390,72 @@ namespace android_video_shim
             mQuality = quality;
             mContinuityEra = continuityEra;
 
-            // Small memory leak, look out.
-            uri = strdup(uri);
-
-            // Stick it in our sources.
+            // Stick it in our sources. The copy is freed when the source is
+            // retired or cleared.
             mSources.push_back(uri);
+            mSourceStartTimes.push_back(startTime);
+
+            // Whole-segment AES is undone by the segment cache; only SAMPLE-AES
+            // keys are needed by the demuxer. We hold a reference for as long
+            // as we keep the source.
+            if (!HLSCryptoTable::isSampleAes(cryptoId) || !HLSCryptoTable::retain(cryptoId))
+                cryptoId = -1;
+            mSourceCryptoIds.push_back(cryptoId);
+
+            if (mAppendListener)
+                mAppendListener->onSourcesAppended();
 
             return OK;
         }
 
+        void setAppendListener(AppendListener *listener)
+        {
+            AutoLock locker(&lock, __func__);
+            mAppendListener = listener;
+        }
+
+        // Unset listener, unless another has been set in its place since.
+        void clearAppendListener(AppendListener *listener)
+        {
+            AutoLock locker(&lock, __func__);
+            if (mAppendListener == listener)
+                mAppendListener = NULL;
+        }
+
+        // While set, reads stop waiting on downloads and return what they
+        // have, so that a reader thread can be shut down promptly.
+        void setReadsInterrupted(bool interrupted)
+        {
+            AutoLock locker(&lock, __func__);
+            mReadsInterrupted = interrupted;
+            if (!interrupted)
+                return;
+
+            if (mWaitBuffer)
+                mWaitBuffer->wake();
+            HLSSegmentCache::wakeWaiters();
+        }
+
+        // The SAMPLE-AES crypto handle for the segment holding offset, or -1
+        // if its samples are in the clear. *end is set to the offset at which
+        // the answer may change.
+        int getSampleAesHandle(off64_t offset, off64_t *end)
+        {
+            AutoLock locker(&lock, __func__);
+
+            *end = offset + 1;
+            int idx = (std::upper_bound(mSourceOffsets.begin(), mSourceOffsets.end(), offset) - mSourceOffsets.begin()) - 1;
+            if (idx < 0 || idx >= (int)mSources.size())
+                return -1;
+
+            if (idx + 1 < (int)mSourceOffsets.size())
+                *end = mSourceOffsets[idx + 1];
+            return mSourceCryptoIds[idx];
+        }
+
         void logContinuityInfo()
         {
-        	LOGI("Quality = %d | Continuity Era = %d | Time = %f | First URI = %s ", mQuality, mContinuityEra, mStartTime, *mSources.begin()  );
+        	LOGI("Quality = %d | Continuity Era = %d | Time = %f | First URI = %s ", mQuality, mContinuityEra, mStartTime, mSources.begin()->c_str()  );
         }
 
         int getQualityLevel()
@@ -2325,7 +2485,7 @@ namespace android_video_shim
             AutoLock locker(&lock, __func__);
             for (int i = mSourceIdx; i < mSources.size(); ++i)
             {
-            	HLSSegmentCache::touch(mSources[i]);
+            	HLSSegmentCache::touch(mSources[i].c_str());
             }
         }
 
@@ -2340,6 +2500,94 @@ namespace android_video_shim
         }
 
         ssize_t _readAt(off64_t offset, void* data, size_t size)
+        {
+            return readInternal(offset, data, size, true, true);
+        }
+
+        // Like readAt, but once some bytes have been read it stops at the end
+        // of the current segment instead of moving on. This lets callers read
+        // large blocks without blocking on a download they don't need yet.
+        //
+        // If blocking is false and the data isn't downloaded yet, the download
+        // is started and WOULD_BLOCK is returned; use waitForData to sleep
+        // until it arrives. Past the last source, END_OF_SOURCES is returned
+        // rather than 0.
+        ssize_t readBlockAt(off64_t offset, void* data, size_t size, bool blocking = true)
+        {
+            return readInternal(offset, data, size, false, blocking);
+        }
+
+        // Blocks until the byte at offset has been downloaded. Returns
+        // END_OF_SOURCES if it lies past the sources appended so far, and
+        // ERROR_END_OF_STREAM if it never will be downloaded.
+        status_t waitForData(off64_t offset)
+        {
+            unsigned char scratch;
+            ssize_t n = readInternal(offset, &scratch, 1, false, true);
+            if (n == 1)
+                return OK;
+            return n == END_OF_SOURCES ? END_OF_SOURCES : ERROR_END_OF_STREAM;
+        }
+
+        // Files an IDR frame found by the demuxer at logical offset under the
+        // segment being read, in that segment's keyframe index.
+        void noteKeyFrame(off64_t offset, int64_t timeUs)
+        {
+            AutoLock locker(&lock, __func__);
+
+            if (mSourceIdx >= mSources.size() || offset < mSourceOffsets[mSourceIdx])
+                return;
+            if (mSourceIdx + 1 < mSourceOffsets.size() && offset >= mSourceOffsets[mSourceIdx + 1])
+                return;
+
+            HLSSegmentBuffer *buffer = getSourceBuffer();
+            if (buffer)
+                buffer->addKeyFrame(offset - mSourceOffsets[mSourceIdx], timeUs);
+        }
+
+        // Logical offset of the last indexed IDR frame at or before timeUs in
+        // the segment being read, or -1 if it has none indexed yet.
+        off64_t findKeyFrame(int64_t timeUs, int64_t *keyTimeUs)
+        {
+            AutoLock locker(&lock, __func__);
+
+            if (mSourceIdx >= mSources.size())
+                return -1;
+
+            HLSSegmentBuffer *buffer = getSourceBuffer();
+            int64_t offset;
+            if (buffer == NULL || !buffer->findKeyFrame(timeUs, &offset, keyTimeUs))
+                return -1;
+
+            return mSourceOffsets[mSourceIdx] + offset;
+        }
+
+        // Like findKeyFrame, but in whichever source we still hold covers
+        // timeSecs of stream time, so a reader can move back or ahead to it.
+        // Only sources whose start offset and end time are both known count.
+        off64_t findBufferedKeyFrame(double timeSecs, int64_t *keyTimeUs)
+        {
+            AutoLock locker(&lock, __func__);
+
+            for (size_t i = 0; i + 1 < mSources.size() && i < mSourceOffsets.size(); i++)
+            {
+                if (timeSecs < mSourceStartTimes[i] || timeSecs >= mSourceStartTimes[i + 1])
+                    continue;
+
+                HLSSegmentBuffer *buffer = HLSSegmentCache::lookup(mSources[i].c_str());
+                if (buffer == NULL)
+                    return -1;
+
+                int64_t offset;
+                bool found = buffer->findKeyFrame((int64_t)(timeSecs * 1000000.0), &offset, keyTimeUs);
+                buffer->release();
+                return found ? mSourceOffsets[i] + offset : -1;
+            }
+
+            return -1;
+        }
+
+        ssize_t readInternal(off64_t offset, void* data, size_t size, bool spanSegments, bool blocking)
         {
             AutoLock locker(&lock, __func__);
 
@@ -2350,82 +2598,94 @@ namespace android_video_shim
                 return 0;
             }
 
-            LOGDATAMINING("Attempting _readAt mSources[mSourceIdx]=%s %lld %p %d mOffsetAdjustment=%lld", mSources[mSourceIdx], offset, data, size, mOffsetAdjustment);
+            LOGDATAMINING("Attempting _readAt mSources[mSourceIdx]=%s %lld %p %d", mSources[mSourceIdx].c_str(), offset, data, size);
 
-            // Calculate adjusted offset based on reads so far. The TSExtractor
-            // always reads in order.
-            ssize_t adjOffset = offset - mOffsetAdjustment;
+            if(offset < mSourceOffsets.front())
+            {
+                LOGE("Offset %lld is in a retired source! Aborting read...", offset);
+                return 0;
+            }
 
-            // Read chunks from the segment cache until we've fulfilled the request.
-            ssize_t sizeLeft = size;
+            // Read chunks from the segment store until we've fulfilled the request.
             ssize_t readSize = 0;
-            int safety = 10;
-            while(sizeLeft > 0 && safety--)
+            bool wouldBlock = false;
+            bool endOfSources = false;
+            while(readSize < (ssize_t)size && !mReadsInterrupted)
             {
-                // If we have a negative adjOffset it means we moved into a new segment - but readSize should compensate.
-                while(adjOffset + readSize < 0)
+                int idx = findSourceIndex(offset + readSize, blocking);
+                if(idx == kSourceWouldBlock)
                 {
-                	LOGDATAMINING("Got negative offset, adjOffset=%ld readSize=%ld", adjOffset, readSize);
-
-                    assert(mSourceIdx > 0);
-
-                    // Walk back to preceding source!
-                    int64_t sourceSize = HLSSegmentCache::getSize(mSources[mSourceIdx-1]);
-                    LOGDATAMINING("Retreating by %lld bytes!", sourceSize);
+                    wouldBlock = true;
+                    break;
+                }
 
-                    mOffsetAdjustment -= sourceSize;
-                    adjOffset += sourceSize;
+                if(idx == kSourcesChanged)
+                    break;
 
-                    mSourceIdx--;
+                if(idx < 0)
+                {
+                    LOGI("Reached end of segment list.");
+                    endOfSources = true;
+                    break;
                 }
 
-                // Attempt a read. Blocking and tries VERY hard not to fail.
-                ssize_t lastReadSize = HLSSegmentCache::read(mSources[mSourceIdx], adjOffset + readSize, sizeLeft, ((unsigned char*)data) + readSize);
+                setSourceIdx(idx);
 
-                if (sizeLeft - lastReadSize < 0)
+                // Attempt a read straight out of the native segment store.
+                // Blocks until the segment starts downloading, unless asked not to.
+                HLSSegmentBuffer *buffer = NULL;
+                if(!acquireSourceBuffer(blocking, &buffer))
+                    break;
+
+                if(buffer == NULL && !blocking)
                 {
-                	LOGW("NEGATIVE SIZE LEFT: sizeLeft=%d lastReadSize=%d source=%s", sizeLeft, lastReadSize, mSources[mSourceIdx]); // Something happened to the segment - maybe it's 404
-                	assert (sizeLeft - lastReadSize >= 0);
+                    wouldBlock = true;
+                    break;
                 }
 
+                if(buffer == NULL)
+                {
+                    LOGW("No data for source=%s", mSources[mSourceIdx].c_str()); // Something happened to the segment - maybe it's 404
+                    break;
+                }
 
-                // Account for read.
-                sizeLeft -= lastReadSize;
-                readSize += lastReadSize;
+                off64_t segmentOffset = offset + readSize - mSourceOffsets[idx];
+                int64_t got = buffer->read(segmentOffset, size - readSize, ((unsigned char*)data) + readSize);
+                readSize += got;
 
                 // If done reading, then we can break out.
-                if(sizeLeft == 0)
+                if(readSize == (ssize_t)size)
                     break;
 
-                // Otherwise, we need to move to the next source if we have one.
-                if(mSourceIdx + 1 < mSources.size())
+                if(buffer->isComplete())
                 {
-                    // Advance by the current source size.
-                    int64_t sourceSize = HLSSegmentCache::getSize(mSources[mSourceIdx]);
-                    LOGDATAMINING("Advancing by %lld bytes, size of current source", sourceSize);
-
-                    mOffsetAdjustment += sourceSize;
-                    adjOffset -= sourceSize;
-
-                    mSourceIdx++;
+                    // End of this segment. Block reads stop at the boundary;
+                    // otherwise findSourceIndex moves us to the next source.
+                    if(!spanSegments && readSize > 0)
+                        break;
+                    continue;
                 }
-                else
+
+                // The segment is still downloading. Block reads take what's
+                // there; everyone else waits for the next bytes to land.
+                if(!blocking || (!spanSegments && readSize > 0))
                 {
-                    // No more sources?
-                    LOGI("Reached end of segment list.");
+                    wouldBlock = true;
                     break;
                 }
-            }
 
-            // Make sure we didn't do anything weird.
-            if(safety == 0)
-            {
-                LOGE("****** HIT SAFETY ON READ LOOP");
-                LOGE("****** HIT SAFETY ON READ LOOP");
-                LOGE("****** HIT SAFETY ON READ LOOP");
+                if(!waitForSourceData(buffer, segmentOffset + got))
+                    break;
             }
 
-            // Return what we read.
+            retireConsumedSources();
+
+            // Return what we read. readAt keeps DataSource's convention of
+            // returning 0 at the end.
+            if(readSize == 0 && wouldBlock)
+                return WOULD_BLOCK;
+            if(readSize == 0 && endOfSources && !spanSegments)
+                return END_OF_SOURCES;
             return readSize;
         }
 
@@ -2452,14 +2712,182 @@ namespace android_video_shim
 
     private:
 
+        // Native buffer for mSources[mSourceIdx], kept once found so that
+        // steady-state reads never have to look up the segment store. NULL if
+        // the segment isn't in the store yet. Never waits or calls into Java,
+        // so it is safe under our lock.
+        HLSSegmentBuffer *getSourceBuffer()
+        {
+            if (mSourceBuffer == NULL)
+                mSourceBuffer = HLSSegmentCache::lookup(mSources[mSourceIdx].c_str());
+            return mSourceBuffer;
+        }
+
+        // Like getSourceBuffer, but if the segment isn't in the store, starts
+        // its download and, if blocking, waits for its first bytes. That is
+        // done with our lock released so the player can keep appending,
+        // counting and touching sources meanwhile. Returns false if the
+        // sources were cleared or moved while it was released; otherwise
+        // *buffer is the buffer, or NULL if the segment can't be had.
+        bool acquireSourceBuffer(bool blocking, HLSSegmentBuffer **buffer)
+        {
+            *buffer = getSourceBuffer();
+            if (*buffer)
+                return true;
+
+            std::string uri = mSources[mSourceIdx];
+            uint32_t generation = mSourcesGeneration;
+
+            // Our lock is recursive, but readers never hold it more than once.
+            pthread_mutex_unlock(&lock);
+            HLSSegmentBuffer *acquired = blocking ? HLSSegmentCache::acquire(uri.c_str(), &mReadsInterrupted) : HLSSegmentCache::tryAcquire(uri.c_str());
+            pthread_mutex_lock(&lock);
+
+            // An interrupted wait isn't a failed download; don't let the
+            // caller skip the segment over it.
+            if (generation != mSourcesGeneration || mReadsInterrupted
+                    || mSourceIdx >= mSources.size() || mSources[mSourceIdx] != uri)
+            {
+                if (acquired)
+                    acquired->release();
+                return false;
+            }
+
+            // Someone may have found it in the store while we waited.
+            if (mSourceBuffer == NULL)
+                mSourceBuffer = acquired;
+            else if (acquired)
+                acquired->release();
+
+            *buffer = mSourceBuffer;
+            return true;
+        }
+
+        // Waits for buffer to hold more than offset bytes, with our lock
+        // released. Returns false if the sources were cleared or reads
+        // interrupted meanwhile.
+        bool waitForSourceData(HLSSegmentBuffer *buffer, int64_t offset)
+        {
+            uint32_t generation = mSourcesGeneration;
+
+            buffer->addRef();
+            mWaitBuffer = buffer;
+            pthread_mutex_unlock(&lock);
+            buffer->waitForData(offset, &mReadsInterrupted);
+            pthread_mutex_lock(&lock);
+            mWaitBuffer = NULL;
+            buffer->release();
+
+            return generation == mSourcesGeneration && !mReadsInterrupted;
+        }
+
+        void releaseSourceBuffer()
+        {
+            if (mSourceBuffer)
+                mSourceBuffer->release();
+            mSourceBuffer = NULL;
+        }
+
+        void setSourceIdx(uint32_t idx)
+        {
+            if (idx == mSourceIdx)
+                return;
+            releaseSourceBuffer();
+            mSourceIdx = idx;
+        }
+
+        // Returns the index of the source holding logical offset, -1 if the
+        // offset is past the end of our sources, kSourceWouldBlock if a
+        // non-blocking lookup needs a segment that hasn't started downloading,
+        // or kSourcesChanged if the sources were cleared while we waited.
+        // Sizes are taken from the native store as segments finish
+        // downloading, so the table only grows as far as reads actually go
+        // and never has to call into Java for a segment that is already loaded.
+        //
+        // A segment that is still downloading has no end yet; every offset
+        // past its start maps to it until it completes.
+        int findSourceIndex(off64_t offset, bool blocking)
+        {
+            while (mSourceOffsets.back() <= offset && mSourceOffsets.size() <= mSources.size())
+            {
+                setSourceIdx(mSourceOffsets.size() - 1);
+                HLSSegmentBuffer *buffer = NULL;
+                if (!acquireSourceBuffer(blocking, &buffer))
+                    return kSourcesChanged;
+
+                if (buffer == NULL && !blocking)
+                    return kSourceWouldBlock;
+
+                if (buffer && !buffer->isComplete())
+                    return mSourceIdx;
+
+                int64_t sourceSize = buffer ? buffer->getSize() : 0;
+                mSourceOffsets.push_back(mSourceOffsets.back() + sourceSize);
+            }
+
+            int idx = (std::upper_bound(mSourceOffsets.begin(), mSourceOffsets.end(), offset) - mSourceOffsets.begin()) - 1;
+            if (idx < 0 || idx >= (int)mSources.size())
+                return -1;
+            return idx;
+        }
+
+        // Forget sources the reader has moved well past, so that a live
+        // stream that runs for days doesn't keep every URI and offset it has
+        // ever played. Logical offsets are unaffected.
+        void retireConsumedSources()
+        {
+            while (mSourceIdx > kRetainedSources)
+            {
+                LOGV("Retiring source %s", mSources.front().c_str());
+                mSources.pop_front();
+                mSourceStartTimes.pop_front();
+                if (mSourceCryptoIds.front() != -1)
+                    HLSCryptoTable::free(mSourceCryptoIds.front());
+                mSourceCryptoIds.pop_front();
+                mSourceOffsets.pop_front();
+                mSourceIdx--;
+            }
+        }
+
+        void freeSourceCryptoIds()
+        {
+            for (size_t i = 0; i < mSourceCryptoIds.size(); i++)
+            {
+                if (mSourceCryptoIds[i] != -1)
+                    HLSCryptoTable::free(mSourceCryptoIds[i]);
+            }
+            mSourceCryptoIds.clear();
+        }
+
+        // How many fully read sources to keep behind the current one, for
+        // readers that back up a little (e.g. to resync on a packet).
+        static const uint32_t kRetainedSources = 2;
+
+        static const int kSourceWouldBlock = -2;
+        static const int kSourcesChanged = -3;
+
         pthread_mutex_t lock;
-        std::vector< const char * > mSources;
+        std::deque< std::string > mSources;
+        std::deque< int > mSourceCryptoIds; // SAMPLE-AES handle per source, or -1.
+        std::deque< double > mSourceStartTimes; // Stream time each source starts at, in seconds.
         uint32_t mSourceIdx;
         off64_t mSegmentStartOffset;
-        off64_t mOffsetAdjustment;
+
+        // mSourceOffsets[i] is the logical offset at which mSources[i] starts;
+        // the entry after the last known source is the end of the data so far.
+        std::deque< off64_t > mSourceOffsets;
         int mQuality;
         int mContinuityEra;
         double mStartTime;
+        HLSSegmentBuffer *mSourceBuffer;
+
+        // Bumped by clearSources, so readers that released the lock to wait
+        // can tell their position no longer means anything.
+        uint32_t mSourcesGeneration;
+
+        AppendListener *mAppendListener;
+        volatile bool mReadsInterrupted;
+        HLSSegmentBuffer *mWaitBuffer; // Being waited on by a reader, if any.
 
     };
 
@@ -30,7 +30,11 @@ ABuffer::ABuffer(size_t capacity)
       mRangeOffset(0),
       mRangeLength(capacity),
       mInt32Data(0),
-      mOwnsData(true) {
+      mOwnsData(true),
+      mRecycler(NULL) {
+    mHeader.mTimeUs = 0;
+    mHeader.mFlags = 0;
+    mHeader.mDiscontinuityType = 0;
 }
 
 ABuffer::ABuffer(void *data, size_t capacity)
@@ -39,7 +43,24 @@ ABuffer::ABuffer(void *data, size_t capacity)
       mRangeOffset(0),
       mRangeLength(capacity),
       mInt32Data(0),
-      mOwnsData(false) {
+      mOwnsData(false),
+      mRecycler(NULL) {
+    mHeader.mTimeUs = 0;
+    mHeader.mFlags = 0;
+    mHeader.mDiscontinuityType = 0;
+}
+
+ABuffer::ABuffer(void *data, size_t capacity, Recycler *recycler)
+    : mData(data),
+      mCapacity(capacity),
+      mRangeOffset(0),
+      mRangeLength(capacity),
+      mInt32Data(0),
+      mOwnsData(false),
+      mRecycler(recycler) {
+    mHeader.mTimeUs = 0;
+    mHeader.mFlags = 0;
+    mHeader.mDiscontinuityType = 0;
 }
 
 ABuffer::~ABuffer() {
@@ -48,6 +69,9 @@ ABuffer::~ABuffer() {
             free(mData);
             mData = NULL;
         }
+    } else if (mRecycler != NULL) {
+        mRecycler->recycle(mData);
+        mData = NULL;
     }
 
     if (mFarewell != NULL) {
@@ -29,8 +29,18 @@ namespace android {
 struct AMessage;
 
 struct ABuffer : public RefBase {
+    // Takes back storage that a pool lent to a buffer, in place of free(),
+    // once the buffer is destroyed.
+    struct Recycler {
+        virtual void recycle(void *data) = 0;
+
+    protected:
+        virtual ~Recycler() {}
+    };
+
     ABuffer(size_t capacity);
     ABuffer(void *data, size_t capacity);
+    ABuffer(void *data, size_t capacity, Recycler *recycler);
 
     void setFarewellMessage(const sp<AMessage> msg);
 
@@ -45,12 +55,78 @@ struct ABuffer : public RefBase {
     void setInt32Data(int32_t data) { mInt32Data = data; }
     int32_t int32Data() const { return mInt32Data; }
 
+    // Access unit header. Every access unit carries a timestamp and the
+    // queues test the rest on each one, so these live in the buffer rather
+    // than in meta(), which is left for rarely used extras.
+    void setTimeUs(int64_t timeUs) {
+        mHeader.mTimeUs = timeUs;
+        mHeader.mFlags |= kFlagHasTime;
+    }
+    bool findTimeUs(int64_t *timeUs) const {
+        if (!(mHeader.mFlags & kFlagHasTime)) {
+            return false;
+        }
+        *timeUs = mHeader.mTimeUs;
+        return true;
+    }
+
+    void setDiscontinuity(int32_t type) {
+        mHeader.mDiscontinuityType = type;
+        mHeader.mFlags |= kFlagDiscontinuity;
+    }
+    bool findDiscontinuity(int32_t *type) const {
+        if (!(mHeader.mFlags & kFlagDiscontinuity)) {
+            return false;
+        }
+        *type = mHeader.mDiscontinuityType;
+        return true;
+    }
+    bool isDiscontinuity() const {
+        return (mHeader.mFlags & kFlagDiscontinuity) != 0;
+    }
+
+    void setDamaged(bool damaged) {
+        if (damaged) {
+            mHeader.mFlags |= kFlagDamaged;
+        } else {
+            mHeader.mFlags &= ~kFlagDamaged;
+        }
+    }
+    bool isDamaged() const { return (mHeader.mFlags & kFlagDamaged) != 0; }
+
+    // Decodable without any earlier access unit (an IDR frame for H.264).
+    void setSyncFrame() { mHeader.mFlags |= kFlagSyncFrame; }
+    bool isSyncFrame() const { return (mHeader.mFlags & kFlagSyncFrame) != 0; }
+
+    // A new format for the stream, set on the first access unit after it
+    // changes. NULL on all the others.
+    void setFormat(const sp<RefBase> &format) { mHeader.mFormat = format; }
+    RefBase *format() const { return mHeader.mFormat.get(); }
+
     sp<AMessage> meta();
 
+    Recycler *recycler() const { return mRecycler; }
+
 protected:
     virtual ~ABuffer();
 
 private:
+    enum {
+        kFlagHasTime        = 1,
+        kFlagDiscontinuity  = 2,
+        kFlagDamaged        = 4,
+        kFlagSyncFrame      = 8,
+    };
+
+    struct AccessUnitHeader {
+        int64_t mTimeUs;
+        uint32_t mFlags;
+        int32_t mDiscontinuityType;
+        sp<RefBase> mFormat;
+    };
+
+    AccessUnitHeader mHeader;
+
     sp<AMessage> mFarewell;
     sp<AMessage> mMeta;
 
@@ -62,6 +138,7 @@ private:
     int32_t mInt32Data;
 
     bool mOwnsData;
+    Recycler *mRecycler;
 
     DISALLOW_EVIL_CONSTRUCTORS(ABuffer);
 };
@@ -19,6 +19,8 @@
 //#include "Log.h"
 #include "../debug.h"
 #include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
 #include "ADebug.h"
 
 #include "ATSParser.h"
@@ -26,6 +28,7 @@
 #include "AnotherPacketSource.h"
 #include "ESQueue.h"
 //#include "include/avc_utils.h"
+#include "avc_utils.h"
 
 #include "ABitReader.h"
 #include "ABuffer.h"
@@ -51,6 +54,11 @@ namespace android {
 
 
 static const size_t kTSPacketSize = 188;
+static const size_t kPacketsPerBlock = 64;
+
+// Without video, report an audio PES packet to the keyframe listener about
+// this often.
+static const int64_t kAudioKeyFrameIntervalUs = 1000000ll;
 
 struct ATSParser::Program : public RefBase {
     Program(ATSParser *parser, unsigned programNumber, unsigned programMapPID);
@@ -58,18 +66,22 @@ struct ATSParser::Program : public RefBase {
     bool parsePSISection(
             unsigned pid, ABitReader *br, status_t *err);
 
-    bool parsePID(
-            unsigned pid, unsigned continuity_counter,
-            unsigned payload_unit_start_indicator,
-            ABitReader *br, status_t *err);
+    // Point the entries for the PIDs of our wanted streams at them, unless
+    // the PID already has a handler.
+    void addStreamHandlers(PIDHandler *handlers);
 
     void signalDiscontinuity(
             DiscontinuityType type, const sp<AMessage> &extra);
 
     void signalEOS(status_t finalResult);
 
+    void dropPendingData();
+
     sp<AnotherPacketSource> getSource(SourceType type);
 
+    // Whether any of our video streams is being demuxed.
+    bool demuxesVideo() const;
+
     int64_t convertPTSToTimestamp(uint64_t PTS);
 
     bool PTSTimeDeltaEstablished() const {
@@ -90,6 +102,22 @@ struct ATSParser::Program : public RefBase {
         return mParser->mFlags;
     }
 
+    int sampleAesHandle() const {
+        return mParser->mSampleAesHandle;
+    }
+
+    bool isSourceDiscarded(SourceType type) const {
+        return mParser->mSourceDiscarded[type];
+    }
+
+    KeyFrameListener *keyFrameListener() const {
+        return mParser->mKeyFrameListener;
+    }
+
+    void invalidatePIDTable() {
+        mParser->mPIDTableStale = true;
+    }
+
 private:
     ATSParser *mParser;
     unsigned mProgramNumber;
@@ -113,16 +141,21 @@ struct ATSParser::Stream : public RefBase {
     unsigned pid() const { return mElementaryPID; }
     void setPID(unsigned pid) { mElementaryPID = pid; }
 
-    status_t parse(
-            unsigned continuity_counter,
-            unsigned payload_unit_start_indicator,
-            ABitReader *br);
+    status_t parse(const PacketInfo &packet);
+
+    // Whether the packets on our PID should be parsed at all.
+    bool isWanted() const;
+
+    bool isAudio() const;
+    bool isVideo() const;
 
     void signalDiscontinuity(
             DiscontinuityType type, const sp<AMessage> &extra);
 
     void signalEOS(status_t finalResult);
 
+    void dropPendingData();
+
     sp<AnotherPacketSource> getSource(SourceType type);
 
 protected:
@@ -135,25 +168,47 @@ private:
     unsigned mPCR_PID;
     int32_t mExpectedContinuityCounter;
 
-    sp<ABuffer> mBuffer;
+    // The PES packet being assembled, as slices of the payloads of its TS
+    // packets where they were fed in. mBlocks keeps the blocks holding them
+    // alive until the PES is flushed; the bytes are only copied once, into
+    // the queue.
+    struct PESSlice {
+        const uint8_t *mData;
+        size_t mSize;
+    };
+    PESSlice *mSlices;
+    size_t mNumSlices;
+    size_t mSlicesCapacity;
+    size_t mPESSize;
+    Vector<sp<ABuffer> > mBlocks;
+
     sp<AnotherPacketSource> mSource;
     bool mPayloadStarted;
+    int mPayloadCryptoHandle;
+    int64_t mPayloadOffset;
 
     uint64_t mPrevPTS;
+    int64_t mLastKeyFrameTimeUs;
 
     ElementaryStreamQueue *mQueue;
 
+    void appendSlice(const PacketInfo &packet);
+    void clearPES();
+    void copyPESBytes(size_t offset, size_t size, uint8_t *dst) const;
+
     status_t flush();
-    status_t parsePES(ABitReader *br);
+    status_t parsePES();
 
+    // The payload is the size bytes at offset into the PES packet.
     void onPayloadData(
             unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS,
-            const uint8_t *data, size_t size);
+            size_t offset, size_t size);
 
     void extractAACFrames(const sp<ABuffer> &buffer);
 
-    bool isAudio() const;
-    bool isVideo() const;
+    // Whether a seek could start demuxing at this PES packet.
+    bool isRandomAccessPoint(
+            const uint8_t *payload, size_t size, int64_t timeUs) const;
 
     DISALLOW_EVIL_CONSTRUCTORS(Stream);
 };
@@ -204,21 +259,19 @@ bool ATSParser::Program::parsePSISection(
     return true;
 }
 
-bool ATSParser::Program::parsePID(
-        unsigned pid, unsigned continuity_counter,
-        unsigned payload_unit_start_indicator,
-        ABitReader *br, status_t *err) {
-    *err = OK;
-
-    ssize_t index = mStreams.indexOfKey(pid);
-    if (index < 0) {
-        return false;
-    }
+void ATSParser::Program::addStreamHandlers(PIDHandler *handlers) {
+    for (size_t i = 0; i < mStreams.size(); ++i) {
+        Stream *stream = mStreams.editValueAt(i).get();
 
-    *err = mStreams.editValueAt(index)->parse(
-            continuity_counter, payload_unit_start_indicator, br);
+        if (!stream->isWanted()) {
+            continue;
+        }
 
-    return true;
+        PIDHandler *handler = &handlers[stream->pid()];
+        if (handler->mSection == NULL && handler->mStream == NULL) {
+            handler->mStream = stream;
+        }
+    }
 }
 
 void ATSParser::Program::signalDiscontinuity(
@@ -242,6 +295,12 @@ void ATSParser::Program::signalEOS(status_t finalResult) {
     }
 }
 
+void ATSParser::Program::dropPendingData() {
+    for (size_t i = 0; i < mStreams.size(); ++i) {
+        mStreams.editValueAt(i)->dropPendingData();
+    }
+}
+
 struct StreamInfo {
     unsigned mType;
     unsigned mPID;
@@ -398,6 +457,7 @@ status_t ATSParser::Program::parseProgramMap(ABitReader *br) {
                 mStreams.clear();
                 mStreams.add(s1->pid(), s1);
                 mStreams.add(s2->pid(), s2);
+                invalidatePIDTable();
 
                 success = true;
             }
@@ -419,6 +479,7 @@ status_t ATSParser::Program::parseProgramMap(ABitReader *br) {
                     this, info.mPID, info.mType, PCR_PID);
 
             mStreams.add(info.mPID, stream);
+            invalidatePIDTable();
         }
     }
 
@@ -441,6 +502,17 @@ sp<AnotherPacketSource> ATSParser::Program::getSource(SourceType type) {
     return NULL;
 }
 
+bool ATSParser::Program::demuxesVideo() const {
+    for (size_t i = 0; i < mStreams.size(); ++i) {
+        const sp<Stream> &stream = mStreams.valueAt(i);
+        if (stream->isVideo() && stream->isWanted()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 int64_t ATSParser::Program::convertPTSToTimestamp(uint64_t PTS) {
     if (!(mParser->mFlags & TS_TIMESTAMPS_ARE_ABSOLUTE)) {
         if (!mFirstPTSValid) {
@@ -483,8 +555,15 @@ ATSParser::Stream::Stream(
       mStreamType(streamType),
       mPCR_PID(PCR_PID),
       mExpectedContinuityCounter(-1),
+      mSlices(NULL),
+      mNumSlices(0),
+      mSlicesCapacity(0),
+      mPESSize(0),
       mPayloadStarted(false),
+      mPayloadCryptoHandle(-1),
+      mPayloadOffset(-1),
       mPrevPTS(0),
+      mLastKeyFrameTimeUs(-1),
       mQueue(NULL) {
     switch (mStreamType) {
         case STREAMTYPE_H264:
@@ -493,9 +572,21 @@ ATSParser::Stream::Stream(
                     (mProgram->parserFlags() & ALIGNED_VIDEO_DATA)
                         ? ElementaryStreamQueue::kFlag_AlignedData : 0);
             break;
+        case STREAMTYPE_H264_ENCRYPTED:
+            mQueue = new ElementaryStreamQueue(
+                    ElementaryStreamQueue::H264,
+                    ElementaryStreamQueue::kFlag_SampleAES
+                        | ((mProgram->parserFlags() & ALIGNED_VIDEO_DATA)
+                            ? ElementaryStreamQueue::kFlag_AlignedData : 0));
+            break;
         case STREAMTYPE_MPEG2_AUDIO_ADTS:
             mQueue = new ElementaryStreamQueue(ElementaryStreamQueue::AAC);
             break;
+        case STREAMTYPE_AAC_ENCRYPTED:
+            mQueue = new ElementaryStreamQueue(
+                    ElementaryStreamQueue::AAC,
+                    ElementaryStreamQueue::kFlag_SampleAES);
+            break;
         case STREAMTYPE_MPEG1_AUDIO:
         case STREAMTYPE_MPEG2_AUDIO:
             mQueue = new ElementaryStreamQueue(
@@ -523,31 +614,29 @@ ATSParser::Stream::Stream(
     }
 
     LOGATS("new stream PID 0x%02x, type 0x%02x", elementaryPID, streamType);
-
-    if (mQueue != NULL) {
-        mBuffer = new ABuffer(192 * 1024);
-        mBuffer->setRange(0, 0);
-    }
 }
 
 ATSParser::Stream::~Stream() {
     delete mQueue;
     mQueue = NULL;
+
+    free(mSlices);
+    mSlices = NULL;
 }
 
-status_t ATSParser::Stream::parse(
-        unsigned continuity_counter,
-        unsigned payload_unit_start_indicator, ABitReader *br) {
+status_t ATSParser::Stream::parse(const PacketInfo &packet) {
     if (mQueue == NULL) {
         return OK;
     }
 
+    unsigned continuity_counter = packet.continuity_counter;
+
     if (mExpectedContinuityCounter >= 0
             && (unsigned)mExpectedContinuityCounter != continuity_counter) {
         ALOGI("discontinuity on stream pid 0x%04x", mElementaryPID);
 
         mPayloadStarted = false;
-        mBuffer->setRange(0, 0);
+        clearPES();
         mExpectedContinuityCounter = -1;
 
 #if 0
@@ -565,7 +654,7 @@ status_t ATSParser::Stream::parse(
 
     mExpectedContinuityCounter = (continuity_counter + 1) & 0x0f;
 
-    if (payload_unit_start_indicator) {
+    if (packet.payload_unit_start_indicator) {
         if (mPayloadStarted) {
             // Otherwise we run the danger of receiving the trailing bytes
             // of a PES packet that we never saw the start of and assuming
@@ -579,37 +668,93 @@ status_t ATSParser::Stream::parse(
         }
 
         mPayloadStarted = true;
+        mPayloadCryptoHandle = mProgram->sampleAesHandle();
+        mPayloadOffset = packet.offset;
     }
 
     if (!mPayloadStarted) {
         return OK;
     }
 
-    size_t payloadSizeBits = br->numBitsLeft();
-    CHECK_EQ(payloadSizeBits % 8, 0u);
+    appendSlice(packet);
 
-    size_t neededSize = mBuffer->size() + payloadSizeBits / 8;
-    if (mBuffer->capacity() < neededSize) {
-        // Increment in multiples of 64K.
-        neededSize = (neededSize + 65535) & ~65535;
+    return OK;
+}
 
-        ALOGI("resizing buffer to %d bytes", neededSize);
+void ATSParser::Stream::appendSlice(const PacketInfo &packet) {
+    if (packet.payloadSize == 0) {
+        return;
+    }
 
-        sp<ABuffer> newBuffer = new ABuffer(neededSize);
-        memcpy(newBuffer->data(), mBuffer->data(), mBuffer->size());
-        newBuffer->setRange(0, mBuffer->size());
-        mBuffer = newBuffer;
+    // Consecutive packets nearly always come from the same block, so this
+    // takes one reference per block rather than one per packet.
+    if (mBlocks.isEmpty() || mBlocks.top().get() != packet.block) {
+        mBlocks.push(packet.block);
     }
 
-    memcpy(mBuffer->data() + mBuffer->size(), br->data(), payloadSizeBits / 8);
-    mBuffer->setRange(0, mBuffer->size() + payloadSizeBits / 8);
+    if (mNumSlices == mSlicesCapacity) {
+        size_t capacity = mSlicesCapacity ? mSlicesCapacity * 2 : 64;
+        PESSlice *slices =
+            (PESSlice *)realloc(mSlices, capacity * sizeof(PESSlice));
+        CHECK(slices != NULL);
 
-    return OK;
+        mSlices = slices;
+        mSlicesCapacity = capacity;
+    }
+
+    PESSlice *slice = &mSlices[mNumSlices++];
+    slice->mData = packet.payload;
+    slice->mSize = packet.payloadSize;
+
+    mPESSize += packet.payloadSize;
+}
+
+void ATSParser::Stream::clearPES() {
+    mNumSlices = 0;
+    mPESSize = 0;
+    mBlocks.clear();
+}
+
+void ATSParser::Stream::copyPESBytes(
+        size_t offset, size_t size, uint8_t *dst) const {
+    CHECK_LE(offset + size, mPESSize);
+
+    if (size == 0) {
+        return;
+    }
+
+    size_t i = 0;
+    while (offset >= mSlices[i].mSize) {
+        offset -= mSlices[i].mSize;
+        ++i;
+    }
+
+    while (size > 0) {
+        size_t n = mSlices[i].mSize - offset;
+        if (n > size) {
+            n = size;
+        }
+
+        memcpy(dst, mSlices[i].mData + offset, n);
+        dst += n;
+        size -= n;
+        offset = 0;
+        ++i;
+    }
+}
+
+bool ATSParser::Stream::isWanted() const {
+    if (mQueue == NULL) {
+        return false;
+    }
+
+    return !mProgram->isSourceDiscarded(isAudio() ? AUDIO : VIDEO);
 }
 
 bool ATSParser::Stream::isVideo() const {
     switch (mStreamType) {
         case STREAMTYPE_H264:
+        case STREAMTYPE_H264_ENCRYPTED:
         case STREAMTYPE_MPEG1_VIDEO:
         case STREAMTYPE_MPEG2_VIDEO:
         case STREAMTYPE_MPEG4_VIDEO:
@@ -620,11 +765,37 @@ bool ATSParser::Stream::isVideo() const {
     }
 }
 
+bool ATSParser::Stream::isRandomAccessPoint(
+        const uint8_t *payload, size_t size, int64_t timeUs) const {
+    // HLS segments put each frame in a PES packet of its own, so one that
+    // opens with an IDR frame is somewhere a seek can start demuxing.
+    if (mStreamType == STREAMTYPE_H264
+            || mStreamType == STREAMTYPE_H264_ENCRYPTED) {
+        return StartsWithIDR(payload, size);
+    }
+
+    // Audio PES packets open on a frame header, so in a stream without
+    // video (alternate audio) any of them will do.
+    if (!isAudio() || mStreamType == STREAMTYPE_PCM_AUDIO
+            || mProgram->demuxesVideo()) {
+        return false;
+    }
+
+    if (mLastKeyFrameTimeUs >= 0 && timeUs >= mLastKeyFrameTimeUs
+            && timeUs < mLastKeyFrameTimeUs + kAudioKeyFrameIntervalUs) {
+        return false;
+    }
+
+    // ADTS and MPEG audio sync words.
+    return size >= 2 && payload[0] == 0xff && (payload[1] & 0xe0) == 0xe0;
+}
+
 bool ATSParser::Stream::isAudio() const {
     switch (mStreamType) {
         case STREAMTYPE_MPEG1_AUDIO:
         case STREAMTYPE_MPEG2_AUDIO:
         case STREAMTYPE_MPEG2_AUDIO_ADTS:
+        case STREAMTYPE_AAC_ENCRYPTED:
         case STREAMTYPE_PCM_AUDIO:
             return true;
 
@@ -642,7 +813,7 @@ void ATSParser::Stream::signalDiscontinuity(
     }
 
     mPayloadStarted = false;
-    mBuffer->setRange(0, 0);
+    clearPES();
 
     bool clearFormat = false;
     if (isAudio()) {
@@ -681,7 +852,30 @@ void ATSParser::Stream::signalEOS(status_t finalResult) {
     }
 }
 
-status_t ATSParser::Stream::parsePES(ABitReader *br) {
+void ATSParser::Stream::dropPendingData() {
+    mExpectedContinuityCounter = -1;
+    mPayloadStarted = false;
+    clearPES();
+
+    if (mQueue != NULL) {
+        mQueue->clear(false /* clearFormat */);
+    }
+
+    if (mSource != NULL) {
+        mSource->flush();
+    }
+}
+
+status_t ATSParser::Stream::parsePES() {
+    // The header comes first and is never longer than this; it's nearly
+    // always within the first TS packet, but gather it to be sure.
+    uint8_t header[9 + 255];
+    size_t headerSize = mPESSize < sizeof(header) ? mPESSize : sizeof(header);
+    copyPESBytes(0, headerSize, header);
+
+    ABitReader bits(header, headerSize);
+    ABitReader *br = &bits;
+
     unsigned packet_startcode_prefix = br->getBits(24);
 
     LOGATS("packet_startcode_prefix = 0x%08x", packet_startcode_prefix);
@@ -810,66 +1004,57 @@ status_t ATSParser::Stream::parsePES(ABitReader *br) {
 
         // ES data follows.
 
+        CHECK_EQ(br->numBitsLeft() % 8, 0u);
+        size_t payloadOffset = headerSize - br->numBitsLeft() / 8;
+        size_t payloadSize = mPESSize - payloadOffset;
+
         if (PES_packet_length != 0) {
             CHECK_GE(PES_packet_length, PES_header_data_length + 3);
 
             unsigned dataLength =
                 PES_packet_length - 3 - PES_header_data_length;
 
-            if (br->numBitsLeft() < dataLength * 8) {
+            if (payloadSize < dataLength) {
                 ALOGE("PES packet does not carry enough data to contain "
                      "payload. (numBitsLeft = %d, required = %d)",
-                     br->numBitsLeft(), dataLength * 8);
+                     payloadSize * 8, dataLength * 8);
 
                 return ERROR_MALFORMED;
             }
 
-            CHECK_GE(br->numBitsLeft(), dataLength * 8);
-
             onPayloadData(
-                    PTS_DTS_flags, PTS, DTS, br->data(), dataLength);
-
-            br->skipBits(dataLength * 8);
+                    PTS_DTS_flags, PTS, DTS, payloadOffset, dataLength);
         } else {
             onPayloadData(
-                    PTS_DTS_flags, PTS, DTS,
-                    br->data(), br->numBitsLeft() / 8);
-
-            size_t payloadSizeBits = br->numBitsLeft();
-            CHECK_EQ(payloadSizeBits % 8, 0u);
+                    PTS_DTS_flags, PTS, DTS, payloadOffset, payloadSize);
 
-            LOGATS("There's %d bytes of payload.", payloadSizeBits / 8);
+            LOGATS("There's %d bytes of payload.", payloadSize);
         }
-    } else if (stream_id == 0xbe) {  // padding_stream
-        CHECK_NE(PES_packet_length, 0u);
-        br->skipBits(PES_packet_length * 8);
     } else {
+        // padding_stream and the like; nothing in them for us.
         CHECK_NE(PES_packet_length, 0u);
-        br->skipBits(PES_packet_length * 8);
     }
 
     return OK;
 }
 
 status_t ATSParser::Stream::flush() {
-    if (mBuffer->size() == 0) {
+    if (mPESSize == 0) {
         return OK;
     }
 
-    LOGATS("flushing stream 0x%04x size = %d", mElementaryPID, mBuffer->size());
+    LOGATS("flushing stream 0x%04x size = %d", mElementaryPID, mPESSize);
 
-    ABitReader br(mBuffer->data(), mBuffer->size());
+    status_t err = parsePES();
 
-    status_t err = parsePES(&br);
-
-    mBuffer->setRange(0, 0);
+    clearPES();
 
     return err;
 }
 
 void ATSParser::Stream::onPayloadData(
         unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS,
-        const uint8_t *data, size_t size) {
+        size_t offset, size_t size) {
 #if 0
     ALOGI("payload streamType 0x%02x, PTS = 0x%016llx, dPTS = %lld",
           mStreamType,
@@ -885,7 +1070,20 @@ void ATSParser::Stream::onPayloadData(
         timeUs = mProgram->convertPTSToTimestamp(PTS);
     }
 
-    status_t err = mQueue->appendData(data, size, timeUs);
+    // Gather the payload straight into the queue; this is the only copy
+    // it sees on the way from the read block to the access unit.
+    uint8_t *payload = mQueue->reserveData(size);
+    copyPESBytes(offset, size, payload);
+
+    KeyFrameListener *listener = mProgram->keyFrameListener();
+    if (listener != NULL
+            && mPayloadOffset >= 0
+            && (PTS_DTS_flags == 2 || PTS_DTS_flags == 3)
+            && isRandomAccessPoint(payload, size, timeUs)) {
+        mLastKeyFrameTimeUs = timeUs;
+        listener->onKeyFrame(mPayloadOffset, timeUs);
+    }
+    status_t err = mQueue->commitData(size, timeUs, mPayloadCryptoHandle);
 
     if (err != OK) {
         return;
@@ -949,8 +1147,16 @@ ATSParser::ATSParser(uint32_t flags)
       mTimeOffsetValid(false),
       mTimeOffsetUs(0ll),
       mNumTSPacketsParsed(0),
+      mSampleAesHandle(-1),
+      mKeyFrameListener(NULL),
+      mPIDTableStale(true),
       mNumPCRs(0) {
+    for (size_t i = 0; i < NUM_SOURCE_TYPES; ++i) {
+        mSourceDiscarded[i] = false;
+    }
+
     mPSISections.add(0 /* PID */, new PSISection);
+    rebuildPIDTable();
 }
 
 ATSParser::~ATSParser() {
@@ -959,8 +1165,27 @@ ATSParser::~ATSParser() {
 status_t ATSParser::feedTSPacket(const void *data, size_t size) {
     CHECK_EQ(size, kTSPacketSize);
 
-    ABitReader br((const uint8_t *)data, kTSPacketSize);
-    return parseTS(&br);
+    // Streams point at the packets they're assembling, so they have to live
+    // in a block of our own.
+    if (mPacketBlock == NULL
+            || mPacketBlock->size() + size > mPacketBlock->capacity()) {
+        mPacketBlock = new ABuffer(kTSPacketSize * kPacketsPerBlock);
+        mPacketBlock->setRange(0, 0);
+    }
+
+    uint8_t *packet = mPacketBlock->data() + mPacketBlock->size();
+    memcpy(packet, data, size);
+    mPacketBlock->setRange(0, mPacketBlock->size() + size);
+
+    return parseTS(packet, mPacketBlock.get(), -1);
+}
+
+status_t ATSParser::feedTSPacket(
+        const sp<ABuffer> &block, const void *data, size_t size,
+        int64_t offset) {
+    CHECK_EQ(size, kTSPacketSize);
+
+    return parseTS((const uint8_t *)data, block.get(), offset);
 }
 
 void ATSParser::signalDiscontinuity(
@@ -1000,6 +1225,55 @@ void ATSParser::signalEOS(status_t finalResult) {
     }
 }
 
+void ATSParser::dropPendingData() {
+    for (size_t i = 0; i < mPSISections.size(); ++i) {
+        mPSISections.editValueAt(i)->clear();
+    }
+
+    for (size_t i = 0; i < mPrograms.size(); ++i) {
+        mPrograms.editItemAt(i)->dropPendingData();
+    }
+}
+
+void ATSParser::rebuildPIDTable() {
+    mPIDTableStale = false;
+    memset(mPIDHandlers, 0, sizeof(mPIDHandlers));
+
+    // PSI sections take precedence over streams, and earlier programs over
+    // later ones, as they did when we searched for the handler per packet.
+    for (size_t i = 0; i < mPSISections.size(); ++i) {
+        unsigned PID = mPSISections.keyAt(i);
+        if (PID != kNullPID) {
+            mPIDHandlers[PID].mSection = mPSISections.valueAt(i).get();
+        }
+    }
+
+    for (size_t i = 0; i < mPrograms.size(); ++i) {
+        mPrograms.editItemAt(i)->addStreamHandlers(mPIDHandlers);
+    }
+
+    mPIDHandlers[kNullPID].mSection = NULL;
+    mPIDHandlers[kNullPID].mStream = NULL;
+}
+
+void ATSParser::setSourceDiscarded(SourceType type, bool discard) {
+    CHECK_LT((size_t)type, (size_t)NUM_SOURCE_TYPES);
+
+    if (mSourceDiscarded[type] == discard) {
+        return;
+    }
+
+    mSourceDiscarded[type] = discard;
+    rebuildPIDTable();
+
+    if (discard) {
+        sp<AnotherPacketSource> source = getSource(type);
+        if (source != NULL) {
+            source->clear();
+        }
+    }
+}
+
 void ATSParser::parseProgramAssociationTable(ABitReader *br) {
     unsigned table_id = br->getBits(8);
     LOGATS("  table_id = %u", table_id);
@@ -1057,6 +1331,7 @@ void ATSParser::parseProgramAssociationTable(ABitReader *br) {
 
             if (mPSISections.indexOfKey(programMapPID) < 0) {
                 mPSISections.add(programMapPID, new PSISection);
+                mPIDTableStale = true;
             }
         }
     }
@@ -1065,178 +1340,272 @@ void ATSParser::parseProgramAssociationTable(ABitReader *br) {
 }
 
 status_t ATSParser::parsePID(
-        ABitReader *br, unsigned PID,
-        unsigned continuity_counter,
-        unsigned payload_unit_start_indicator) {
-    ssize_t sectionIndex = mPSISections.indexOfKey(PID);
-
-    if (sectionIndex >= 0) {
-        sp<PSISection> section = mPSISections.valueAt(sectionIndex);
-
-        if (payload_unit_start_indicator) {
-            CHECK(section->isEmpty());
+        const PIDHandler &handler, const PacketInfo &packet) {
+    if (handler.mStream != NULL) {
+        return handler.mStream->parse(packet);
+    }
 
-            unsigned skip = br->getBits(8);
-            br->skipBits(skip * 8);
-        }
+    unsigned PID = packet.PID;
 
-        CHECK(((br->numBitsLeft() % 8) == 0));
-        status_t err = section->append(br->data(), br->numBitsLeft() / 8);
+    // Hold a reference; the section may be dropped below.
+    sp<PSISection> section = handler.mSection;
+    CHECK(section != NULL);
 
-        if (err != OK) {
-            return err;
-        }
+    const uint8_t *payload = packet.payload;
+    size_t payloadSize = packet.payloadSize;
+    if (packet.payload_unit_start_indicator) {
+        CHECK(section->isEmpty());
 
-        if (!section->isComplete()) {
-            return OK;
-        }
+        // pointer_field
+        size_t skip = 1 + (payloadSize > 0 ? payload[0] : 0);
+        CHECK_LE(skip, payloadSize);
+        payload += skip;
+        payloadSize -= skip;
+    }
 
-        ABitReader sectionBits(section->data(), section->size());
+    status_t err = section->append(payload, payloadSize);
 
-        if (PID == 0) {
-            parseProgramAssociationTable(&sectionBits);
-        } else {
-            bool handled = false;
-            for (size_t i = 0; i < mPrograms.size(); ++i) {
-                status_t err;
-                if (!mPrograms.editItemAt(i)->parsePSISection(
-                            PID, &sectionBits, &err)) {
-                    continue;
-                }
+    if (err != OK) {
+        return err;
+    }
 
-                if (err != OK) {
-                    return err;
-                }
+    if (!section->isComplete()) {
+        return OK;
+    }
 
-                handled = true;
-                break;
-            }
+    ABitReader sectionBits(section->data(), section->size());
 
-            if (!handled) {
-                mPSISections.removeItem(PID);
-                section.clear();
+    if (PID == 0) {
+        parseProgramAssociationTable(&sectionBits);
+    } else {
+        bool handled = false;
+        for (size_t i = 0; i < mPrograms.size(); ++i) {
+            status_t err;
+            if (!mPrograms.editItemAt(i)->parsePSISection(
+                        PID, &sectionBits, &err)) {
+                continue;
             }
-        }
-
-        if (section != NULL) {
-            section->clear();
-        }
-
-        return OK;
-    }
 
-    bool handled = false;
-    for (size_t i = 0; i < mPrograms.size(); ++i) {
-        status_t err;
-        if (mPrograms.editItemAt(i)->parsePID(
-                    PID, continuity_counter, payload_unit_start_indicator,
-                    br, &err)) {
             if (err != OK) {
+                if (mPIDTableStale) {
+                    rebuildPIDTable();
+                }
                 return err;
             }
 
             handled = true;
             break;
         }
+
+        if (!handled) {
+            mPSISections.removeItem(PID);
+            section.clear();
+            mPIDTableStale = true;
+        }
+    }
+
+    if (section != NULL) {
+        section->clear();
     }
 
-    if (!handled) {
-        LOGATS("PID 0x%04x not handled.", PID);
+    // Most sections just repeat the tables we already have; only rebuild
+    // when the PAT or PMT added, moved or dropped a PID.
+    if (mPIDTableStale) {
+        rebuildPIDTable();
     }
 
     return OK;
 }
 
-void ATSParser::parseAdaptationField(ABitReader *br, unsigned PID) {
-    unsigned adaptation_field_length = br->getBits(8);
+// field points at adaptation_field_length. Only called when the PCR or
+// discontinuity flag is set; nothing else in the field is of interest.
+void ATSParser::parseAdaptationField(const uint8_t *field, unsigned PID) {
+    unsigned adaptation_field_length = field[0];
+    unsigned flags = field[1];
+
+    if (flags & 0x80) {  // discontinuity_indicator
+        LOGATS("PID 0x%04x: discontinuity_indicator = 1 (!!!)", PID);
+    }
+
+    if ((flags & 0x10) && adaptation_field_length >= 7) {  // PCR_flag
+        uint64_t PCR_base =
+            ((uint64_t)field[2] << 25)
+            | ((uint64_t)field[3] << 17)
+            | ((uint64_t)field[4] << 9)
+            | ((uint64_t)field[5] << 1)
+            | (field[6] >> 7);
+
+        unsigned PCR_ext = ((field[6] & 1) << 8) | field[7];
 
-    if (adaptation_field_length > 0) {
-        unsigned discontinuity_indicator = br->getBits(1);
+        uint64_t PCR = PCR_base * 300 + PCR_ext;
 
-        if (discontinuity_indicator) {
-            LOGATS("PID 0x%04x: discontinuity_indicator = 1 (!!!)", PID);
+        LOGATS("PID 0x%04x: PCR = 0x%016llx (%.2f)",
+              PID, PCR, PCR / 27E6);
+
+        // The number of bytes from the start of the current
+        // MPEG2 transport stream packet up and including
+        // the final byte of this PCR_ext field.
+        size_t byteOffsetFromStartOfTSPacket = 4 + 1 + 7;
+
+        // The number of bytes received by this parser up to and
+        // including the final byte of this PCR_ext field.
+        size_t byteOffsetFromStart =
+            mNumTSPacketsParsed * 188 + byteOffsetFromStartOfTSPacket;
+
+        for (size_t i = 0; i < mPrograms.size(); ++i) {
+            updatePCR(PID, PCR, byteOffsetFromStart);
         }
+    }
+}
+
+#ifdef HLS_ATS_BITREADER_BASELINE
+
+// The header decode parseTS used to do, a field at a time through
+// ABitReader, kept so that Tools/HostTests can time the two against each
+// other. Never defined in the player's build.
+status_t ATSParser::parseTS(
+        const uint8_t *packet, ABuffer *block, int64_t offset) {
+    ABitReader br(packet, kTSPacketSize);
+
+    unsigned sync_byte = br.getBits(8);
+    CHECK_EQ(sync_byte, 0x47u);
+
+    if (br.getBits(1)) {  // transport_error_indicator
+        // silently ignore.
+        return OK;
+    }
 
-        br->skipBits(2);
-        unsigned PCR_flag = br->getBits(1);
+    PacketInfo info;
+    info.block = block;
+    info.offset = offset;
+    info.payload_unit_start_indicator = br.getBits(1);
+    MY_LOGV("transport_priority = %u", br.getBits(1));
+    info.PID = br.getBits(13);
+    MY_LOGV("transport_scrambling_control = %u", br.getBits(2));
+    unsigned adaptation_field_control = br.getBits(2);
+    info.continuity_counter = br.getBits(4);
 
-        size_t numBitsRead = 4;
+    if (adaptation_field_control == 2 || adaptation_field_control == 3) {
+        unsigned adaptation_field_length = br.getBits(8);
+
+        if (adaptation_field_length > 0) {
+            unsigned discontinuity_indicator = br.getBits(1);
+
+            if (discontinuity_indicator) {
+                LOGATS("PID 0x%04x: discontinuity_indicator = 1 (!!!)",
+                       info.PID);
+            }
 
-        if (PCR_flag) {
-            br->skipBits(4);
-            uint64_t PCR_base = br->getBits(32);
-            PCR_base = (PCR_base << 1) | br->getBits(1);
+            br.skipBits(2);
+            unsigned PCR_flag = br.getBits(1);
 
-            br->skipBits(6);
-            unsigned PCR_ext = br->getBits(9);
+            size_t numBitsRead = 4;
 
-            // The number of bytes from the start of the current
-            // MPEG2 transport stream packet up and including
-            // the final byte of this PCR_ext field.
-            size_t byteOffsetFromStartOfTSPacket =
-                (188 - br->numBitsLeft() / 8);
+            if (PCR_flag) {
+                br.skipBits(4);
+                uint64_t PCR_base = br.getBits(32);
+                PCR_base = (PCR_base << 1) | br.getBits(1);
 
-            uint64_t PCR = PCR_base * 300 + PCR_ext;
+                br.skipBits(6);
+                unsigned PCR_ext = br.getBits(9);
 
-            LOGATS("PID 0x%04x: PCR = 0x%016llx (%.2f)",
-                  PID, PCR, PCR / 27E6);
+                size_t byteOffsetFromStartOfTSPacket =
+                    (188 - br.numBitsLeft() / 8);
 
-            // The number of bytes received by this parser up to and
-            // including the final byte of this PCR_ext field.
-            size_t byteOffsetFromStart =
-                mNumTSPacketsParsed * 188 + byteOffsetFromStartOfTSPacket;
+                uint64_t PCR = PCR_base * 300 + PCR_ext;
+
+                size_t byteOffsetFromStart =
+                    mNumTSPacketsParsed * 188 + byteOffsetFromStartOfTSPacket;
+
+                for (size_t i = 0; i < mPrograms.size(); ++i) {
+                    updatePCR(info.PID, PCR, byteOffsetFromStart);
+                }
 
-            for (size_t i = 0; i < mPrograms.size(); ++i) {
-                updatePCR(PID, PCR, byteOffsetFromStart);
+                numBitsRead += 52;
             }
 
-            numBitsRead += 52;
+            CHECK_GE(adaptation_field_length * 8, numBitsRead);
+
+            br.skipBits(adaptation_field_length * 8 - numBitsRead);
         }
+    }
 
-        CHECK_GE(adaptation_field_length * 8, numBitsRead);
+    const PIDHandler &handler = mPIDHandlers[info.PID];
+    if (handler.mSection == NULL && handler.mStream == NULL) {
+        ++mNumTSPacketsParsed;
+        return OK;
+    }
 
-        br->skipBits(adaptation_field_length * 8 - numBitsRead);
+    status_t err = OK;
+
+    if (adaptation_field_control == 1 || adaptation_field_control == 3) {
+        CHECK_EQ(br.numBitsLeft() % 8, 0u);
+        info.payload = br.data();
+        info.payloadSize = br.numBitsLeft() / 8;
+        err = parsePID(handler, info);
     }
+
+    ++mNumTSPacketsParsed;
+
+    return err;
 }
 
-status_t ATSParser::parseTS(ABitReader *br) {
+#else
+
+// The header is at fixed positions, so decode it with byte and mask
+// operations instead of a bit reader: this runs for every 188 bytes.
+status_t ATSParser::parseTS(
+        const uint8_t *packet, ABuffer *block, int64_t offset) {
     LOGATS("---");
 
-    unsigned sync_byte = br->getBits(8);
-    CHECK_EQ(sync_byte, 0x47u);
+    CHECK_EQ((unsigned)packet[0], 0x47u);  // sync_byte
 
-    if (br->getBits(1)) {  // transport_error_indicator
+    if (packet[1] & 0x80) {  // transport_error_indicator
         // silently ignore.
         return OK;
     }
 
-    unsigned payload_unit_start_indicator = br->getBits(1);
-    LOGATS("payload_unit_start_indicator = %u", payload_unit_start_indicator);
+    PacketInfo info;
+    info.block = block;
+    info.offset = offset;
+    info.payload_unit_start_indicator = (packet[1] >> 6) & 1;
+    info.PID = ((packet[1] & 0x1f) << 8) | packet[2];
+    info.continuity_counter = packet[3] & 0x0f;
 
-    MY_LOGV("transport_priority = %u", br->getBits(1));
+    unsigned adaptation_field_control = (packet[3] >> 4) & 3;
 
-    unsigned PID = br->getBits(13);
-    LOGATS("PID = 0x%04x", PID);
+    LOGATS("PID = 0x%04x, payload_unit_start_indicator = %u, "
+           "adaptation_field_control = %u, continuity_counter = %u",
+           info.PID, info.payload_unit_start_indicator,
+           adaptation_field_control, info.continuity_counter);
 
-    MY_LOGV("transport_scrambling_control = %u", br->getBits(2));
+    size_t payloadOffset = 4;
 
-    unsigned adaptation_field_control = br->getBits(2);
-    LOGATS("adaptation_field_control = %u", adaptation_field_control);
+    if (adaptation_field_control & 2) {
+        unsigned adaptation_field_length = packet[4];
 
-    unsigned continuity_counter = br->getBits(4);
-    LOGATS("PID = 0x%04x, continuity_counter = %u", PID, continuity_counter);
+        if (adaptation_field_length > 0 && (packet[5] & 0x90)) {
+            parseAdaptationField(&packet[4], info.PID);
+        }
 
-    // ALOGI("PID = 0x%04x, continuity_counter = %u", PID, continuity_counter);
+        payloadOffset += 1 + adaptation_field_length;
+    }
 
-    if (adaptation_field_control == 2 || adaptation_field_control == 3) {
-        parseAdaptationField(br, PID);
+    // Null packets, PIDs no program maps and streams we don't want all
+    // end here, after any PCR they carry has been seen.
+    const PIDHandler &handler = mPIDHandlers[info.PID];
+    if (handler.mSection == NULL && handler.mStream == NULL) {
+        LOGATS("PID 0x%04x not handled.", info.PID);
+        ++mNumTSPacketsParsed;
+        return OK;
     }
 
     status_t err = OK;
 
-    if (adaptation_field_control == 1 || adaptation_field_control == 3) {
-        err = parsePID(
-                br, PID, continuity_counter, payload_unit_start_indicator);
+    if ((adaptation_field_control & 1) && payloadOffset <= kTSPacketSize) {
+        info.payload = packet + payloadOffset;
+        info.payloadSize = kTSPacketSize - payloadOffset;
+        err = parsePID(handler, info);
     }
 
     ++mNumTSPacketsParsed;
@@ -1244,6 +1613,8 @@ status_t ATSParser::parseTS(ABitReader *br) {
     return err;
 }
 
+#endif  // HLS_ATS_BITREADER_BASELINE
+
 sp<AnotherPacketSource> ATSParser::getSource(SourceType type) {
     int which = -1;  // any
 
@@ -63,10 +63,37 @@ struct ATSParser : public RefBase {
         ALIGNED_VIDEO_DATA         = 2,
     };
 
+    // Told where each H.264 PES packet that opens with an IDR frame starts,
+    // as the offset its first TS packet was fed with. In a program whose
+    // video isn't demuxed, audio PES packets about a second apart are
+    // reported instead.
+    struct KeyFrameListener {
+        virtual void onKeyFrame(int64_t offset, int64_t timeUs) = 0;
+
+    protected:
+        virtual ~KeyFrameListener() {}
+    };
+
     ATSParser(uint32_t flags = 0);
 
     status_t feedTSPacket(const void *data, size_t size);
 
+    // Zero-copy variant: data lies within block, which must not be written
+    // to again after this. The parser keeps a reference to it for as long
+    // as a PES packet it is assembling has bytes there. offset is where the
+    // packet sits in the stream, for the keyframe listener.
+    status_t feedTSPacket(
+            const sp<ABuffer> &block, const void *data, size_t size,
+            int64_t offset);
+
+    void setKeyFrameListener(KeyFrameListener *listener) {
+        mKeyFrameListener = listener;
+    }
+
+    // Throw away partly parsed data and queued access units, keeping the
+    // stream formats, before feeding packets from elsewhere in the stream.
+    void dropPendingData();
+
     void signalDiscontinuity(
             DiscontinuityType type, const sp<AMessage> &extra);
 
@@ -79,8 +106,18 @@ struct ATSParser : public RefBase {
     };
     sp<AnotherPacketSource> getSource(SourceType type);
 
+    // Drop the packets of every stream of this type unparsed, e.g. the video
+    // of a rendition we only play the audio from. Any access units already
+    // queued on its source are thrown away.
+    void setSourceDiscarded(SourceType type, bool discard);
+
     bool PTSTimeDeltaEstablished();
 
+    // SAMPLE-AES crypto handle (see HLSCryptoTable) for the packets fed from
+    // now on, or -1 if they're not encrypted. PES packets are decrypted with
+    // the handle that was current when they started.
+    void setSampleAesHandle(int handle) { mSampleAesHandle = handle; }
+
     enum {
         // From ISO/IEC 13818-1: 2000 (E), Table 2-29
         STREAMTYPE_RESERVED             = 0x00,
@@ -92,6 +129,11 @@ struct ATSParser : public RefBase {
         STREAMTYPE_MPEG4_VIDEO          = 0x10,
         STREAMTYPE_H264                 = 0x1b,
         STREAMTYPE_PCM_AUDIO            = 0x83,
+
+        // SAMPLE-AES variants (Apple, MPEG-2 Stream Encryption Format
+        // for HTTP Live Streaming).
+        STREAMTYPE_AAC_ENCRYPTED        = 0xcf,
+        STREAMTYPE_H264_ENCRYPTED       = 0xdb,
     };
 
     uint32_t getFlags() { return mFlags; }
@@ -104,6 +146,30 @@ private:
     struct Stream;
     struct PSISection;
 
+    // The header of one transport packet, decoded with fixed byte and mask
+    // operations, and where its payload lies. Handed to the PID handlers.
+    struct PacketInfo {
+        unsigned PID;
+        unsigned continuity_counter;
+        unsigned payload_unit_start_indicator;
+        ABuffer *block;
+        int64_t offset;
+        const uint8_t *payload;
+        size_t payloadSize;
+    };
+
+    // What to do with the packets on one PID; both NULL means drop them.
+    // The pointers are owned by mPSISections and the programs' streams.
+    struct PIDHandler {
+        PSISection *mSection;
+        Stream *mStream;
+    };
+
+    enum {
+        kNumPIDs = 8192,
+        kNullPID = 0x1fff,
+    };
+
     uint32_t mFlags;
     Vector<sp<Program> > mPrograms;
 
@@ -117,17 +183,31 @@ private:
 
     size_t mNumTSPacketsParsed;
 
+    int mSampleAesHandle;
+
+    KeyFrameListener *mKeyFrameListener;
+
+    // Holds the packets fed to us by copy.
+    sp<ABuffer> mPacketBlock;
+
+    bool mSourceDiscarded[NUM_SOURCE_TYPES];
+
+    // Indexed by PID, so each packet finds its handler with one load.
+    // Rebuilt after a PAT or PMT section only if it marked the table
+    // stale by adding, moving or dropping a PID.
+    PIDHandler mPIDHandlers[kNumPIDs];
+    bool mPIDTableStale;
+
+    void rebuildPIDTable();
+
     void parseProgramAssociationTable(ABitReader *br);
     void parseProgramMap(ABitReader *br);
     void parsePES(ABitReader *br);
 
-    status_t parsePID(
-        ABitReader *br, unsigned PID,
-        unsigned continuity_counter,
-        unsigned payload_unit_start_indicator);
+    status_t parsePID(const PIDHandler &handler, const PacketInfo &packet);
 
-    void parseAdaptationField(ABitReader *br, unsigned PID);
-    status_t parseTS(ABitReader *br);
+    void parseAdaptationField(const uint8_t *field, unsigned PID);
+    status_t parseTS(const uint8_t *packet, ABuffer *block, int64_t offset);
 
     void updatePCR(unsigned PID, uint64_t PCR, size_t byteOffsetFromStart);
 
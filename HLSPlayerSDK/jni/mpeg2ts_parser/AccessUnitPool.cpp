@@ -0,0 +1,138 @@
+#define LOG_TAG "AccessUnitPool"
+
+#include "AccessUnitPool.h"
+
+#include "ADebug.h"
+
+#include <new>
+#include <pthread.h>
+
+namespace android {
+
+// Block headers are padded so the bytes after them stay 16-byte aligned.
+static const size_t kBlockHeaderSize = 64;
+
+static AccessUnitPool *gPool = NULL;
+static pthread_once_t gPoolOnce = PTHREAD_ONCE_INIT;
+
+void AccessUnitPool::Create() {
+    gPool = new AccessUnitPool;
+}
+
+AccessUnitPool *AccessUnitPool::Get() {
+    pthread_once(&gPoolOnce, Create);
+    return gPool;
+}
+
+AccessUnitPool::AccessUnitPool()
+    : mProbed(false),
+      mCanWrap(false) {
+    CHECK_LE(sizeof(Block), kBlockHeaderSize);
+
+    for (size_t i = 0; i < kNumClasses; ++i) {
+        mFree[i] = NULL;
+    }
+}
+
+AccessUnitPool::~AccessUnitPool() {
+}
+
+AccessUnitPool::Block *AccessUnitPool::BlockOf(void *data) {
+    return (Block *)((uint8_t *)data - kBlockHeaderSize);
+}
+
+uint8_t *AccessUnitPool::DataOf(Block *block) {
+    return (uint8_t *)block + kBlockHeaderSize;
+}
+
+sp<ABuffer> AccessUnitPool::acquire(size_t size) {
+    size_t cls = 0;
+    while (cls < kNumClasses && ((size_t)1 << (kMinClassShift + cls)) < size) {
+        ++cls;
+    }
+
+    if (cls == kNumClasses) {
+        return new ABuffer(size);
+    }
+
+    Block *block;
+    {
+        Mutex::Autolock autoLock(mLock);
+        block = mFree[cls];
+        if (block != NULL) {
+            mFree[cls] = block->mNext;
+        }
+    }
+
+    if (block == NULL) {
+        size_t capacity = (size_t)1 << (kMinClassShift + cls);
+        void *mem = malloc(kBlockHeaderSize + capacity);
+        CHECK(mem != NULL);
+
+        block = new (mem) Block;
+        block->mCapacity = capacity;
+        block->mClass = cls;
+        block->mMediaBuffer = NULL;
+    }
+    block->mNext = NULL;
+
+    sp<ABuffer> buffer = new ABuffer(DataOf(block), block->mCapacity, this);
+    buffer->setRange(0, size);
+    return buffer;
+}
+
+void AccessUnitPool::recycle(void *data) {
+    Block *block = BlockOf(data);
+
+    // The pool keeps the peak working set of each class; that is bounded
+    // by how much the packet sources let queue up.
+    Mutex::Autolock autoLock(mLock);
+    block->mNext = mFree[block->mClass];
+    mFree[block->mClass] = block;
+}
+
+bool AccessUnitPool::canWrap() {
+    Mutex::Autolock autoLock(mLock);
+    if (!mProbed) {
+        // Everything wrap() and release() need from the platform
+        // MediaBuffer. Without them the copy path is used.
+        mCanWrap = searchSymbol("_ZN7android11MediaBufferC1EPvj") != NULL
+            && searchSymbol("_ZN7android11MediaBuffer11setObserverEPNS_19MediaBufferObserverE") != NULL
+            && searchSymbol("_ZN7android11MediaBuffer7add_refEv") != NULL
+            && searchSymbol("_ZN7android11MediaBuffer9set_rangeEjj") != NULL
+            && searchSymbol("_ZN7android11MediaBuffer5resetEv") != NULL;
+        mProbed = true;
+        LOGI("Zero-copy access units %s", mCanWrap ? "enabled" : "unavailable");
+    }
+    return mCanWrap;
+}
+
+MediaBuffer *AccessUnitPool::wrap(const sp<ABuffer> &buffer) {
+    if (buffer->recycler() != this || !canWrap()) {
+        return NULL;
+    }
+
+    // Nobody else touches the block while its buffer is alive, so no lock.
+    Block *block = BlockOf(buffer->base());
+    if (block->mMediaBuffer == NULL) {
+        block->mMediaBuffer = new MediaBuffer(DataOf(block), block->mCapacity);
+        block->mMediaBuffer->setObserver(this);
+    } else {
+        block->mMediaBuffer->reset();
+    }
+
+    block->mLent = buffer;
+    block->mMediaBuffer->set_range(buffer->offset(), buffer->size());
+    block->mMediaBuffer->add_ref();
+    return block->mMediaBuffer;
+}
+
+void AccessUnitPool::signalBufferReturned(MediaBuffer *buffer) {
+    // Dropping the access unit recycles the block, wrapper and all. Take
+    // it out of the block first: once recycled, the block may be lent again.
+    Block *block = BlockOf(buffer->data());
+    sp<ABuffer> lent = block->mLent;
+    block->mLent.clear();
+}
+
+}  // namespace android
@@ -0,0 +1,69 @@
+/*
+ * Size-classed storage for access units. A pooled access unit can be handed
+ * to a decoder as a MediaBuffer over the same bytes, and the decoder's
+ * release() brings the storage back here instead of freeing it.
+ */
+
+#ifndef ACCESS_UNIT_POOL_H_
+
+#define ACCESS_UNIT_POOL_H_
+
+#include "ABase.h"
+#include "threads.h"
+
+#include "ABuffer.h"
+
+namespace android {
+
+struct AccessUnitPool : public ABuffer::Recycler, public MediaBufferObserver {
+    // The process-wide pool. It is never destroyed, since decoders may
+    // return buffers to it at any time.
+    static AccessUnitPool *Get();
+
+    // A buffer of at least size bytes, with its range set to [0, size).
+    sp<ABuffer> acquire(size_t size);
+
+    // A MediaBuffer over buffer's range, holding buffer until the decoder
+    // releases it. NULL if buffer isn't from this pool or the platform
+    // MediaBuffer can't wrap our memory; the caller should copy instead.
+    MediaBuffer *wrap(const sp<ABuffer> &buffer);
+
+    virtual void recycle(void *data);
+    virtual void signalBufferReturned(MediaBuffer *buffer);
+
+private:
+    enum {
+        kMinClassShift  = 12,   // 4KB
+        kMaxClassShift  = 20,   // 1MB; larger units aren't pooled
+        kNumClasses     = kMaxClassShift - kMinClassShift + 1,
+    };
+
+    // Sits in front of the bytes it describes, in the same allocation.
+    struct Block {
+        size_t mCapacity;
+        size_t mClass;
+        MediaBuffer *mMediaBuffer;  // Made on first wrap(), then reused.
+        sp<ABuffer> mLent;          // Set while the decoder has the block.
+        Block *mNext;
+    };
+
+    Mutex mLock;
+    Block *mFree[kNumClasses];
+    bool mProbed;
+    bool mCanWrap;
+
+    AccessUnitPool();
+    virtual ~AccessUnitPool();
+
+    bool canWrap();
+
+    static void Create();
+    static Block *BlockOf(void *data);
+    static uint8_t *DataOf(Block *block);
+
+    DISALLOW_EVIL_CONSTRUCTORS(AccessUnitPool);
+};
+
+}  // namespace android
+
+#endif  // ACCESS_UNIT_POOL_H_
@@ -19,6 +19,7 @@
 #include "AnotherPacketSource.h"
 
 #include "ABuffer.h"
+#include "AccessUnitPool.h"
 #include "ADebug.h"
 #include "AMessage.h"
 #include "AString.h"
@@ -34,12 +35,21 @@ namespace android {
 
 const int64_t kNearEOSMarkUs = 2000000ll; // 2 secs
 
+// Default queue caps. Well past any sane interleaving, so they only come
+// into play when a track stops being consumed.
+const int64_t kDefaultMaxBufferedDurationUs = 30000000ll;
+const size_t kDefaultMaxBufferedBytes = 16 * 1024 * 1024;
+
 AnotherPacketSource::AnotherPacketSource(const sp<MetaData> &meta)
     : mIsAudio(false),
       mFormat(NULL),
       mLastQueuedTimeUs(0),
+      mBufferedBytes(0),
+      mMaxBufferedDurationUs(kDefaultMaxBufferedDurationUs),
+      mMaxBufferedBytes(kDefaultMaxBufferedBytes),
       mEOSResult(OK),
-      mLatestEnqueuedMeta(NULL) {
+      mLatestEnqueuedTimeUs(-1),
+      mDropUntilUs(-1) {
     setFormat(meta);
 }
 
@@ -84,16 +94,15 @@ sp<MetaData> AnotherPacketSource::getFormat() {
 
     List<sp<ABuffer> >::iterator it = mBuffers.begin();
     while (it != mBuffers.end()) {
-        sp<ABuffer> buffer = *it;
-        int32_t discontinuity;
-        if (buffer->meta()->findInt32("discontinuity", &discontinuity)) {
+        const sp<ABuffer> &buffer = *it;
+        if (buffer->isDiscontinuity()) {
             break;
         }
 
-        sp<RefBase> object;
-        if (buffer->meta()->findObject("format", &object)) {
-            LOGV2("Returning found format %p", (void*)buffer->meta()->findObject("format", &object));
-            return static_cast<MetaData*>(object.get());
+        RefBase *format = buffer->format();
+        if (format != NULL) {
+            LOGV2("Returning found format %p", format);
+            return static_cast<MetaData*>(format);
         }
 
         ++it;
@@ -105,16 +114,17 @@ status_t AnotherPacketSource::dequeueAccessUnit(sp<ABuffer> *buffer) {
     buffer->clear();
 
     Mutex::Autolock autoLock(mLock);
-    while (mEOSResult == OK && mBuffers.empty()) {
+    while (mEOSResult == OK && !hasReadableBufferLocked()) {
         mCondition.wait(mLock);
     }
 
     if (!mBuffers.empty()) {
         *buffer = *mBuffers.begin();
         mBuffers.erase(mBuffers.begin());
+        mBufferedBytes -= (*buffer)->size();
 
         int32_t discontinuity;
-        if ((*buffer)->meta()->findInt32("discontinuity", &discontinuity)) {
+        if ((*buffer)->findDiscontinuity(&discontinuity)) {
             if (wasFormatChange(discontinuity)) {
                 mFormat.clear();
             }
@@ -122,9 +132,9 @@ status_t AnotherPacketSource::dequeueAccessUnit(sp<ABuffer> *buffer) {
             return INFO_DISCONTINUITY;
         }
 
-        sp<RefBase> object;
-        if ((*buffer)->meta()->findObject("format", &object)) {
-            mFormat = static_cast<MetaData*>(object.get());
+        RefBase *format = (*buffer)->format();
+        if (format != NULL) {
+            mFormat = static_cast<MetaData*>(format);
         }
 
         return OK;
@@ -138,16 +148,17 @@ status_t AnotherPacketSource::read(
     *out = NULL;
 
     Mutex::Autolock autoLock(mLock);
-    while (mEOSResult == OK && mBuffers.empty()) {
+    while (mEOSResult == OK && !hasReadableBufferLocked()) {
         mCondition.wait(mLock);
     }
 
     if (!mBuffers.empty()) {
         const sp<ABuffer> buffer = *mBuffers.begin();
         mBuffers.erase(mBuffers.begin());
+        mBufferedBytes -= buffer->size();
 
         int32_t discontinuity;
-        if (buffer->meta()->findInt32("discontinuity", &discontinuity)) {
+        if (buffer->findDiscontinuity(&discontinuity)) {
             if (wasFormatChange(discontinuity)) {
                 mFormat.clear();
             }
@@ -155,19 +166,23 @@ status_t AnotherPacketSource::read(
             return INFO_DISCONTINUITY;
         }
 
-        sp<RefBase> object;
-        if (buffer->meta()->findObject("format", &object)) {
-            mFormat = static_cast<MetaData*>(object.get());
+        RefBase *format = buffer->format();
+        if (format != NULL) {
+            mFormat = static_cast<MetaData*>(format);
         }
 
         int64_t timeUs;
-        CHECK(buffer->meta()->findInt64("timeUs", &timeUs));
+        CHECK(buffer->findTimeUs(&timeUs));
 
         LOGTIMING("read %lld, isAudio=%d, bufferSize=%d", timeUs, mIsAudio, buffer->size() );
 
-        // Copy data into a MediaBuffer.
-        MediaBuffer *mediaBuffer = new MediaBuffer(buffer->size());
-        memcpy(mediaBuffer->data(), buffer->data(), buffer->size());
+        // Hand the access unit's own storage to the decoder when it came
+        // from the pool; otherwise copy it into a MediaBuffer.
+        MediaBuffer *mediaBuffer = AccessUnitPool::Get()->wrap(buffer);
+        if (mediaBuffer == NULL) {
+            mediaBuffer = new MediaBuffer(buffer->size());
+            memcpy(mediaBuffer->data(), buffer->data(), buffer->size());
+        }
         mediaBuffer->meta_data()->setInt64(kKeyTime, timeUs);
 
         *out = mediaBuffer;
@@ -187,32 +202,31 @@ bool AnotherPacketSource::wasFormatChange(
 }
 
 void AnotherPacketSource::queueAccessUnit(const sp<ABuffer> &buffer) {
-    int32_t damaged;
-    if (buffer->meta()->findInt32("damaged", &damaged) && damaged) {
+    if (buffer->isDamaged()) {
         // LOG(VERBOSE) << "discarding damaged AU";
         return;
     }
 
     int64_t lastQueuedTimeUs;
-    CHECK(buffer->meta()->findInt64("timeUs", &lastQueuedTimeUs));
-    mLastQueuedTimeUs = lastQueuedTimeUs;
-    LOGV2("queueAccessUnit timeUs=%lld us (%.2f secs)", mLastQueuedTimeUs, mLastQueuedTimeUs / 1E6);
+    CHECK(buffer->findTimeUs(&lastQueuedTimeUs));
+    LOGV2("queueAccessUnit timeUs=%lld us (%.2f secs)", lastQueuedTimeUs, lastQueuedTimeUs / 1E6);
 
     Mutex::Autolock autoLock(mLock);
+    mLastQueuedTimeUs = lastQueuedTimeUs;
+
+    if (dropBeforeTargetLocked(buffer)) {
+        return;
+    }
+
     mBuffers.push_back(buffer);
+    mBufferedBytes += buffer->size();
     mCondition.signal();
 
     if(!AVSHIM_HAS_OMXRENDERERPATH)
     {
-        if (!mLatestEnqueuedMeta.get()) {
-            mLatestEnqueuedMeta = buffer->meta();
-        } else {
-            int64_t latestTimeUs = 0;
-            CHECK(mLatestEnqueuedMeta->findInt64("timeUs", &latestTimeUs));
-            if (lastQueuedTimeUs > latestTimeUs) {
-                LOGV2("Setting buffer with bad time %d > %d, LEM=%p", lastQueuedTimeUs, latestTimeUs, mLatestEnqueuedMeta.get());
-                mLatestEnqueuedMeta = buffer->meta();
-            }
+        if (lastQueuedTimeUs > mLatestEnqueuedTimeUs) {
+            LOGV2("Setting latest enqueued time %lld > %lld", lastQueuedTimeUs, mLatestEnqueuedTimeUs);
+            mLatestEnqueuedTimeUs = lastQueuedTimeUs;
         }
     }
 }
@@ -221,10 +235,21 @@ void AnotherPacketSource::clear() {
     Mutex::Autolock autoLock(mLock);
 
     mBuffers.clear();
+    mBufferedBytes = 0;
     mEOSResult = OK;
 
     mFormat = NULL;
-    mLatestEnqueuedMeta = NULL;
+    mLatestEnqueuedTimeUs = -1;
+    mDropUntilUs = -1;
+}
+
+void AnotherPacketSource::flush() {
+    Mutex::Autolock autoLock(mLock);
+
+    mBuffers.clear();
+    mBufferedBytes = 0;
+    mLastQueuedTimeUs = 0;
+    mLatestEnqueuedTimeUs = -1;
 }
 
 void AnotherPacketSource::queueDiscontinuity(
@@ -235,25 +260,25 @@ void AnotherPacketSource::queueDiscontinuity(
     // Leave only discontinuities in the queue.
     List<sp<ABuffer> >::iterator it = mBuffers.begin();
     while (it != mBuffers.end()) {
-        sp<ABuffer> oldBuffer = *it;
-
-        int32_t oldDiscontinuityType;
-        if (!oldBuffer->meta()->findInt32(
-                    "discontinuity", &oldDiscontinuityType)) {
+        if (!(*it)->isDiscontinuity()) {
             it = mBuffers.erase(it);
             continue;
         }
 
         ++it;
     }
+    mBufferedBytes = 0;
 
     mEOSResult = OK;
     mLastQueuedTimeUs = 0;
-    mLatestEnqueuedMeta = NULL;
+    mLatestEnqueuedTimeUs = -1;
+    mDropUntilUs = -1;
 
     sp<ABuffer> buffer = new ABuffer(0);
-    buffer->meta()->setInt32("discontinuity", static_cast<int32_t>(type));
-    buffer->meta()->setMessage("extra", extra);
+    buffer->setDiscontinuity(static_cast<int32_t>(type));
+    if (extra != NULL) {
+        buffer->meta()->setMessage("extra", extra);
+    }
 
     mBuffers.push_back(buffer);
     mCondition.signal();
@@ -264,12 +289,15 @@ void AnotherPacketSource::signalEOS(status_t result) {
 
     Mutex::Autolock autoLock(mLock);
     mEOSResult = result;
+
+    // The target won't be reached; let out whatever was held for it.
+    mDropUntilUs = -1;
     mCondition.signal();
 }
 
 bool AnotherPacketSource::hasBufferAvailable(status_t *finalResult) {
     Mutex::Autolock autoLock(mLock);
-    if (!mBuffers.empty()) {
+    if (hasReadableBufferLocked()) {
         return true;
     }
 
@@ -294,7 +322,7 @@ int64_t AnotherPacketSource::getBufferedDurationUs(status_t *finalResult) {
         const sp<ABuffer> &buffer = *it;
 
         int64_t timeUs;
-        if (buffer->meta()->findInt64("timeUs", &timeUs)) {
+        if (buffer->findTimeUs(&timeUs)) {
             if (time1 < 0) {
                 time1 = timeUs;
             }
@@ -311,17 +339,128 @@ int64_t AnotherPacketSource::getBufferedDurationUs(status_t *finalResult) {
     return time2 - time1;
 }
 
+void AnotherPacketSource::getBufferLevel(
+        int64_t *durationUs, size_t *bytes, status_t *finalResult) {
+    Mutex::Autolock autoLock(mLock);
+
+    // Held access units can't be read yet, so don't let them count.
+    if (mDropUntilUs >= 0) {
+        *durationUs = 0;
+        *bytes = 0;
+    } else {
+        *durationUs = bufferedDurationLocked();
+        *bytes = mBufferedBytes;
+    }
+    *finalResult = mEOSResult;
+}
+
+void AnotherPacketSource::setBufferLimits(
+        int64_t maxDurationUs, size_t maxBytes) {
+    Mutex::Autolock autoLock(mLock);
+    mMaxBufferedDurationUs = maxDurationUs;
+    mMaxBufferedBytes = maxBytes;
+}
+
+bool AnotherPacketSource::isFull() {
+    Mutex::Autolock autoLock(mLock);
+
+    // Held back until the target comes in, so we must be fed to get there.
+    if (mDropUntilUs >= 0) {
+        return false;
+    }
+
+    if (mMaxBufferedBytes > 0 && mBufferedBytes >= mMaxBufferedBytes) {
+        return true;
+    }
+
+    return mMaxBufferedDurationUs > 0
+        && bufferedDurationLocked() >= mMaxBufferedDurationUs;
+}
+
+int64_t AnotherPacketSource::bufferedDurationLocked() {
+    // Only discontinuities can sit in front of the first access unit, and
+    // everything queued after it is newer, so at most a step or two here.
+    List<sp<ABuffer> >::iterator it = mBuffers.begin();
+    while (it != mBuffers.end()) {
+        int64_t firstTimeUs;
+        if ((*it)->findTimeUs(&firstTimeUs)) {
+            return mLastQueuedTimeUs > firstTimeUs
+                ? mLastQueuedTimeUs - firstTimeUs : 0;
+        }
+        ++it;
+    }
+
+    return 0;
+}
+
+void AnotherPacketSource::dropUntil(int64_t timeUs) {
+    Mutex::Autolock autoLock(mLock);
+
+    mDropUntilUs = timeUs;
+
+    // Whatever was queued before we knew the target gets the same
+    // treatment as what comes in from now on.
+    List<sp<ABuffer> > queued = mBuffers;
+    mBuffers.clear();
+    mBufferedBytes = 0;
+
+    List<sp<ABuffer> >::iterator it = queued.begin();
+    while (it != queued.end()) {
+        const sp<ABuffer> &buffer = *it;
+        if (buffer->isDiscontinuity()) {
+            mDropUntilUs = -1;
+        }
+
+        if (!dropBeforeTargetLocked(buffer)) {
+            mBuffers.push_back(buffer);
+            mBufferedBytes += buffer->size();
+        }
+        ++it;
+    }
+
+    mCondition.signal();
+}
+
+bool AnotherPacketSource::hasReadableBufferLocked() const {
+    return !mBuffers.empty() && mDropUntilUs < 0;
+}
+
+bool AnotherPacketSource::dropBeforeTargetLocked(const sp<ABuffer> &buffer) {
+    int64_t timeUs;
+    if (mDropUntilUs < 0 || !buffer->findTimeUs(&timeUs)) {
+        return false;
+    }
+
+    if (timeUs >= mDropUntilUs) {
+        // Made it; what is held becomes readable from here on.
+        LOGI("Reached drop target %lld us (isAudio=%d)", mDropUntilUs, mIsAudio);
+        mDropUntilUs = -1;
+        return false;
+    }
+
+    if (mIsAudio) {
+        return true;
+    }
+
+    // Nothing before a sync frame is needed to decode it or what follows.
+    if (buffer->isSyncFrame()) {
+        mBuffers.clear();
+        mBufferedBytes = 0;
+    }
+
+    return false;
+}
+
 status_t AnotherPacketSource::nextBufferTime(int64_t *timeUs) {
     *timeUs = 0;
 
     Mutex::Autolock autoLock(mLock);
 
-    if (mBuffers.empty()) {
+    if (!hasReadableBufferLocked()) {
         return mEOSResult != OK ? mEOSResult : -EWOULDBLOCK;
     }
 
-    sp<ABuffer> buffer = *mBuffers.begin();
-    CHECK(buffer->meta()->findInt64("timeUs", timeUs));
+    CHECK((*mBuffers.begin())->findTimeUs(timeUs));
 
     return OK;
 }
@@ -339,7 +478,13 @@ bool AnotherPacketSource::isFinished(int64_t duration) const {
 
 sp<AMessage> AnotherPacketSource::getLatestMeta() {
     Mutex::Autolock autoLock(mLock);
-    return mLatestEnqueuedMeta;
+    if (mLatestEnqueuedTimeUs < 0) {
+        return NULL;
+    }
+
+    sp<AMessage> meta = new AMessage;
+    meta->setInt64("timeUs", mLatestEnqueuedTimeUs);
+    return meta;
 }
 
 }  // namespace android
@@ -44,12 +44,32 @@ struct AnotherPacketSource : public RefBase {
 
     void clear();
 
+    // Drops the queued access units but, unlike clear(), keeps the format.
+    void flush();
+
     bool hasBufferAvailable(status_t *finalResult);
 
     // Returns the difference between the last and the first queued
     // presentation timestamps since the last discontinuity (if any).
     int64_t getBufferedDurationUs(status_t *finalResult);
 
+    // What is queued right now: the time from the next access unit to the
+    // newest one, and their total size. Cheap enough to call per frame.
+    void getBufferLevel(
+            int64_t *durationUs, size_t *bytes, status_t *finalResult);
+
+    // Most that should be queued; 0 lifts a cap. Nothing is refused here:
+    // whoever feeds the source checks isFull() and stops until it drains.
+    void setBufferLimits(int64_t maxDurationUs, size_t maxBytes);
+    bool isFull();
+
+    // Discard what comes before timeUs instead of handing it out. Audio
+    // access units are simply dropped; video is held back from the latest
+    // sync frame on, since that is where decoding has to start. Nothing is
+    // readable until an access unit at or past timeUs arrives, or EOS.
+    // Ends early at a discontinuity, as times past it can't be compared.
+    void dropUntil(int64_t timeUs);
+
     status_t nextBufferTime(int64_t *timeUs);
 
     void queueAccessUnit(const sp<ABuffer> &buffer);
@@ -76,10 +96,17 @@ private:
     sp<MetaData> mFormat;
     int64_t mLastQueuedTimeUs;
     List<sp<ABuffer> > mBuffers;
+    size_t mBufferedBytes;
+    int64_t mMaxBufferedDurationUs;
+    size_t mMaxBufferedBytes;
     status_t mEOSResult;
-    sp<AMessage> mLatestEnqueuedMeta;
+    int64_t mLatestEnqueuedTimeUs;
+    int64_t mDropUntilUs;
 
     bool wasFormatChange(int32_t discontinuityType) const;
+    int64_t bufferedDurationLocked();
+    bool hasReadableBufferLocked() const;
+    bool dropBeforeTargetLocked(const sp<ABuffer> &buffer);
 
     DISALLOW_EVIL_CONSTRUCTORS(AnotherPacketSource);
 };
@@ -19,13 +19,15 @@
 #include "ADebug.h"
  //#define ALOGI LOGI
 #define ALOGI(...)
-#define ALOGV(...) LOGV2(...)
+#undef ALOGV
+#define ALOGV(...) LOGV2(__VA_ARGS__)
 
 #include "ESQueue.h"
 
 #include "hexdump.h"
 #include "ABitReader.h"
 #include "ABuffer.h"
+#include "AccessUnitPool.h"
 #include "AMessage.h"
 #include "Vector.h"
 //#include <media/stagefright/MediaErrors.h>
@@ -34,14 +36,31 @@
 //#include <media/stagefright/Utils.h>
 
 #include "avc_utils.h"
+#include "StartCode.h"
+#include "../HLSCryptoTable.h"
 
 #include <netinet/in.h>
+#include <stdlib.h>
 
 namespace android {
 
 ElementaryStreamQueue::ElementaryStreamQueue(Mode mode, uint32_t flags)
     : mMode(mode),
-      mFlags(flags) {
+      mFlags(flags),
+      mConsumedBytes(0),
+      mRangeInfos(NULL),
+      mRangeInfoCapacity(0),
+      mRangeInfoHead(0),
+      mNumRangeInfos(0),
+      mNALScanOffset(0),
+      mNALTotalSize(0),
+      mNALFoundSlice(false),
+      mMissingKeyLogged(false) {
+}
+
+ElementaryStreamQueue::~ElementaryStreamQueue() {
+    free(mRangeInfos);
+    mRangeInfos = NULL;
 }
 
 sp<android_video_shim::MetaData> ElementaryStreamQueue::getFormat() {
@@ -53,13 +72,64 @@ void ElementaryStreamQueue::clear(bool clearFormat) {
         mBuffer->setRange(0, 0);
     }
 
-    mRangeInfos.clear();
+    mRangeInfoHead = 0;
+    mNumRangeInfos = 0;
+
+    resetNALIndex();
 
     if (clearFormat) {
         mFormat.clear();
     }
 }
 
+void ElementaryStreamQueue::consume(size_t size) {
+    CHECK_LE(size, mBuffer->size());
+
+    mBuffer->setRange(mBuffer->offset() + size, mBuffer->size() - size);
+    mConsumedBytes += size;
+}
+
+void ElementaryStreamQueue::pushRangeInfo(const RangeInfo &info) {
+    if (mNumRangeInfos == mRangeInfoCapacity) {
+        size_t capacity = mRangeInfoCapacity ? mRangeInfoCapacity * 2 : 16;
+        RangeInfo *infos = (RangeInfo *)malloc(capacity * sizeof(RangeInfo));
+        CHECK(infos != NULL);
+
+        // Unwrap the ring into the start of the new one.
+        for (size_t i = 0; i < mNumRangeInfos; ++i) {
+            infos[i] = mRangeInfos[(mRangeInfoHead + i) & (mRangeInfoCapacity - 1)];
+        }
+
+        free(mRangeInfos);
+        mRangeInfos = infos;
+        mRangeInfoCapacity = capacity;
+        mRangeInfoHead = 0;
+    }
+
+    mRangeInfos[(mRangeInfoHead + mNumRangeInfos) & (mRangeInfoCapacity - 1)] = info;
+    ++mNumRangeInfos;
+}
+
+ElementaryStreamQueue::RangeInfo *ElementaryStreamQueue::firstRangeInfo() {
+    CHECK_GT(mNumRangeInfos, 0u);
+
+    return &mRangeInfos[mRangeInfoHead];
+}
+
+void ElementaryStreamQueue::popRangeInfo() {
+    CHECK_GT(mNumRangeInfos, 0u);
+
+    mRangeInfoHead = (mRangeInfoHead + 1) & (mRangeInfoCapacity - 1);
+    --mNumRangeInfos;
+}
+
+void ElementaryStreamQueue::resetNALIndex() {
+    mNALs.clear();
+    mNALScanOffset = mConsumedBytes;
+    mNALTotalSize = 0;
+    mNALFoundSlice = false;
+}
+
 static bool IsSeeminglyValidADTSHeader(const uint8_t *ptr, size_t size) {
     if (size < 3) {
         // Not enough data to verify header.
@@ -124,9 +194,192 @@ static bool IsSeeminglyValidMPEGAudioHeader(const uint8_t *ptr, size_t size) {
     return true;
 }
 
+// Index of the next 00 00 01 at or after from, or size if there is none.
+static size_t NextStartCode(const uint8_t *data, size_t size, size_t from) {
+    return from + FindStartCode(data + from, size - from);
+}
+
+// SAMPLE-AES H.264 (Apple, "MPEG-2 Stream Encryption Format for HTTP Live
+// Streaming"): slices (NAL types 1 and 5) longer than 48 bytes keep their
+// first 32 bytes clear, then alternate one encrypted 16-byte block with up
+// to 144 clear bytes; a tail of 16 bytes or less stays clear. The CBC chain
+// restarts from the IV for every NAL unit.
+static void DecryptSampleAESNALUnit(
+        AesCtx *ctx, const unsigned char *iv, uint8_t *nal, size_t size) {
+    if (size <= 48) {
+        return;
+    }
+
+    AesSetIV(ctx, iv);
+
+    uint8_t *ptr = nal + 32;
+    size_t remaining = size - 32;
+    while (remaining > 16) {
+        AesDecrypt(ctx, ptr, ptr, 16);
+        ptr += 16;
+        remaining -= 16;
+
+        size_t skip = remaining < 144 ? remaining : 144;
+        ptr += skip;
+        remaining -= skip;
+    }
+}
+
+// Decrypts the NAL units in an Annex B buffer in place. Emulation
+// prevention was applied after encryption, so it is taken out of encrypted
+// NAL units first (decryption restores the original escaping), which can
+// shrink the buffer. Returns the new size.
+static size_t DecryptSampleAESH264(
+        AesCtx *ctx, const unsigned char *iv, uint8_t *data, size_t size) {
+    size_t next = NextStartCode(data, size, 0);
+    size_t in = (next < size) ? next + 3 : size;
+    size_t out = in;
+
+    while (in < size) {
+        next = NextStartCode(data, size, in);
+
+        // Zero bytes ahead of the next start code aren't part of the NAL.
+        size_t nalEnd = next;
+        while (next < size && nalEnd > in && data[nalEnd - 1] == 0) {
+            --nalEnd;
+        }
+
+        unsigned nalType = data[in] & 0x1f;
+        if ((nalType == 1 || nalType == 5) && nalEnd - in > 48) {
+            size_t nalStart = out;
+            unsigned zeros = 0;
+            for (size_t i = in; i < nalEnd; ++i) {
+                uint8_t b = data[i];
+                if (zeros >= 2 && b == 3) {
+                    zeros = 0;
+                    continue;
+                }
+                data[out++] = b;
+                zeros = (b == 0) ? zeros + 1 : 0;
+            }
+            DecryptSampleAESNALUnit(ctx, iv, data + nalStart, out - nalStart);
+        } else {
+            memmove(data + out, data + in, nalEnd - in);
+            out += nalEnd - in;
+        }
+
+        // Carry the start code over.
+        size_t gapEnd = (next < size) ? next + 3 : size;
+        memmove(data + out, data + nalEnd, gapEnd - nalEnd);
+        out += gapEnd - nalEnd;
+        in = gapEnd;
+    }
+
+    return out;
+}
+
+// SAMPLE-AES AAC: after the ADTS header each frame has 16 clear bytes, then
+// as many whole encrypted blocks as fit; the tail stays clear. The CBC
+// chain restarts from the IV for every frame.
+static void DecryptSampleAESADTS(
+        AesCtx *ctx, const unsigned char *iv, uint8_t *data, size_t size) {
+    size_t offset = 0;
+    while (offset + 7 <= size) {
+        const uint8_t *header = data + offset;
+        if (header[0] != 0xff || (header[1] >> 4) != 0x0f) {
+            break;
+        }
+
+        size_t headerSize = (header[1] & 1) ? 7 : 9;
+        size_t frameSize = ((header[3] & 3) << 11)
+                | (header[4] << 3)
+                | (header[5] >> 5);
+        if (frameSize < headerSize || offset + frameSize > size) {
+            break;
+        }
+
+        size_t clear = headerSize + 16;
+        if (frameSize >= clear + 16) {
+            AesSetIV(ctx, iv);
+            AesDecrypt(ctx, data + offset + clear, data + offset + clear,
+                    (frameSize - clear) & ~15);
+        }
+
+        offset += frameSize;
+    }
+}
+
+size_t ElementaryStreamQueue::decryptSamples(
+        uint8_t *data, size_t size, int cryptoHandle) {
+    const unsigned char *iv;
+    const AesCtx *shared = HLSCryptoTable::acquire(cryptoHandle, &iv);
+    if (shared == NULL) {
+        if (!mMissingKeyLogged) {
+            LOGE("No SAMPLE-AES key (handle %d) for encrypted stream; passing samples through", cryptoHandle);
+            mMissingKeyLogged = true;
+        }
+        return size;
+    }
+
+    // Other streams may be decrypting with the same key; the CBC chain is
+    // ours alone.
+    AesCtx ctx = *shared;
+
+    if (mMode == H264) {
+        size = DecryptSampleAESH264(&ctx, iv, data, size);
+    } else if (mMode == AAC) {
+        DecryptSampleAESADTS(&ctx, iv, data, size);
+    }
+
+    HLSCryptoTable::release(cryptoHandle);
+    return size;
+}
+
 status_t ElementaryStreamQueue::appendData(
-        const void *data, size_t size, int64_t timeUs) {
-    if (mBuffer == NULL || mBuffer->size() == 0) {
+        const void *data, size_t size, int64_t timeUs, int cryptoHandle) {
+    memcpy(reserveData(size), data, size);
+
+    return commitData(size, timeUs, cryptoHandle);
+}
+
+uint8_t *ElementaryStreamQueue::reserveData(size_t size) {
+    // Access units are consumed by moving the start of mBuffer's range, so
+    // the free space is what's left after its end. When that runs out, the
+    // unread bytes move back to the front if they fit in half the buffer,
+    // and to a buffer twice their size otherwise; either way each byte is
+    // moved a bounded number of times, however much is queued.
+    size_t liveSize = (mBuffer == NULL ? 0 : mBuffer->size());
+    size_t neededSize = liveSize + size;
+
+    if (mBuffer != NULL
+            && mBuffer->offset() + neededSize <= mBuffer->capacity()) {
+        return mBuffer->data() + liveSize;
+    }
+
+    if (mBuffer != NULL && neededSize <= mBuffer->capacity() / 2) {
+        memmove(mBuffer->base(), mBuffer->data(), liveSize);
+        mBuffer->setRange(0, liveSize);
+
+        return mBuffer->data() + liveSize;
+    }
+
+    neededSize = (2 * neededSize + 65535) & ~65535;
+
+    LOGV("resizing buffer to size %d", neededSize);
+
+    sp<ABuffer> buffer = new ABuffer(neededSize);
+    if (mBuffer != NULL) {
+        memcpy(buffer->data(), mBuffer->data(), liveSize);
+    }
+    buffer->setRange(0, liveSize);
+
+    mBuffer = buffer;
+
+    return mBuffer->data() + liveSize;
+}
+
+status_t ElementaryStreamQueue::commitData(
+        size_t size, int64_t timeUs, int cryptoHandle) {
+    uint8_t *dst = mBuffer->data() + mBuffer->size();
+
+    if (mBuffer->size() == 0) {
+        const void *data = dst;
+
         switch (mMode) {
             case H264:
             case MPEG_VIDEO:
@@ -138,10 +391,12 @@ status_t ElementaryStreamQueue::appendData(
 #else
                 uint8_t *ptr = (uint8_t *)data;
 
+                // The first 00 00 01 with a zero ahead of it.
                 ssize_t startOffset = -1;
-                for (size_t i = 0; i + 3 < size; ++i) {
-                    if (!memcmp("\x00\x00\x00\x01", &ptr[i], 4)) {
-                        startOffset = i;
+                for (size_t i = 1; i + 2 < size; ++i) {
+                    i += FindStartCode(&ptr[i], size - i);
+                    if (i + 2 < size && ptr[i - 1] == 0) {
+                        startOffset = i - 1;
                         break;
                     }
                 }
@@ -170,11 +425,9 @@ status_t ElementaryStreamQueue::appendData(
                 uint8_t *ptr = (uint8_t *)data;
 
                 ssize_t startOffset = -1;
-                for (size_t i = 0; i + 2 < size; ++i) {
-                    if (!memcmp("\x00\x00\x01", &ptr[i], 3)) {
-                        startOffset = i;
-                        break;
-                    }
+                size_t i = FindStartCode(ptr, size);
+                if (i < size) {
+                    startOffset = i;
                 }
 
                 if (startOffset < 0) {
@@ -262,37 +515,33 @@ status_t ElementaryStreamQueue::appendData(
                 TRESPASS();
                 break;
         }
-    }
-
-    size_t neededSize = (mBuffer == NULL ? 0 : mBuffer->size()) + size;
-    if (mBuffer == NULL || neededSize > mBuffer->capacity()) {
-        neededSize = (neededSize + 65535) & ~65535;
 
-        LOGV("resizing buffer to size %d", neededSize);
-
-        sp<ABuffer> buffer = new ABuffer(neededSize);
-        if (mBuffer != NULL) {
-            memcpy(buffer->data(), mBuffer->data(), mBuffer->size());
-            buffer->setRange(0, mBuffer->size());
-        } else {
-            buffer->setRange(0, 0);
+        // Drop whatever came before the sync word.
+        if (data != dst) {
+            memmove(dst, data, size);
         }
 
-        mBuffer = buffer;
+        // Nothing is pending, so the NAL scan starts over with this data.
+        resetNALIndex();
+    }
+
+    // Only the protected parts of each sample are encrypted, so this touches
+    // a fraction of the bytes a whole-segment decrypt would.
+    if (mFlags & kFlag_SampleAES) {
+        size = decryptSamples(dst, size, cryptoHandle);
     }
 
-    memcpy(mBuffer->data() + mBuffer->size(), data, size);
-    mBuffer->setRange(0, mBuffer->size() + size);
+    mBuffer->setRange(mBuffer->offset(), mBuffer->size() + size);
 
     RangeInfo info;
     info.mLength = size;
     info.mTimestampUs = timeUs;
-    mRangeInfos.push_back(info);
+    pushRangeInfo(info);
 
 #if 0
     if (mMode == AAC) {
         ALOGI("size = %d, timeUs = %.2f secs", size, timeUs / 1E6);
-        hexdump(data, size);
+        hexdump(dst, size);
     }
 #endif
 
@@ -301,22 +550,18 @@ status_t ElementaryStreamQueue::appendData(
 
 sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnit() {
     if ((mFlags & kFlag_AlignedData) && mMode == H264 && !AVSHIM_HAS_OMXRENDERERPATH) {
-        if (mRangeInfos.empty()) {
+        if (mNumRangeInfos == 0) {
             return NULL;
         }
 
-        RangeInfo info = *mRangeInfos.begin();
-        mRangeInfos.erase(mRangeInfos.begin());
+        RangeInfo info = *firstRangeInfo();
+        popRangeInfo();
 
-        sp<ABuffer> accessUnit = new ABuffer(info.mLength);
+        sp<ABuffer> accessUnit = AccessUnitPool::Get()->acquire(info.mLength);
         memcpy(accessUnit->data(), mBuffer->data(), info.mLength);
-        accessUnit->meta()->setInt64("timeUs", info.mTimestampUs);
-
-        memmove(mBuffer->data(),
-                mBuffer->data() + info.mLength,
-                mBuffer->size() - info.mLength);
+        accessUnit->setTimeUs(info.mTimestampUs);
 
-        mBuffer->setRange(0, mBuffer->size() - info.mLength);
+        consume(info.mLength);
 
         if (mFormat == NULL) {
             mFormat = MakeAVCCodecSpecificData(accessUnit);
@@ -374,24 +619,19 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitPCMAudio() {
         return NULL;
     }
 
-    sp<ABuffer> accessUnit = new ABuffer(payloadSize);
+    sp<ABuffer> accessUnit = AccessUnitPool::Get()->acquire(payloadSize);
     memcpy(accessUnit->data(), mBuffer->data() + 4, payloadSize);
 
     int64_t timeUs = fetchTimestamp(payloadSize + 4);
     CHECK_GE(timeUs, 0ll);
-    accessUnit->meta()->setInt64("timeUs", timeUs);
+    accessUnit->setTimeUs(timeUs);
 
     int16_t *ptr = (int16_t *)accessUnit->data();
     for (size_t i = 0; i < payloadSize / sizeof(int16_t); ++i) {
         ptr[i] = ntohs(ptr[i]);
     }
 
-    memmove(
-            mBuffer->data(),
-            mBuffer->data() + 4 + payloadSize,
-            mBuffer->size() - 4 - payloadSize);
-
-    mBuffer->setRange(0, mBuffer->size() - 4 - payloadSize);
+    consume(4 + payloadSize);
 
     return accessUnit;
 }
@@ -445,7 +685,7 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitAAC_23() {
     if (offset == 0) {
         return NULL;
     }
-    sp<ABuffer> accessUnit = new ABuffer(auSize);
+    sp<ABuffer> accessUnit = AccessUnitPool::Get()->acquire(auSize);
     size_t dstOffset = 0;
     for (size_t i = 0; i < frameOffsets.size(); ++i) {
         memcpy(accessUnit->data() + dstOffset,
@@ -453,14 +693,11 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitAAC_23() {
                frameSizes.itemAt(i));
         dstOffset += frameSizes.itemAt(i);
     }
-    memmove(mBuffer->data(), mBuffer->data() + offset,
-            mBuffer->size() - offset);
-    mBuffer->setRange(0, mBuffer->size() - offset);
+    consume(offset);
 
     int64_t timeUs = fetchTimestamp(offset);
 
-    accessUnit->meta()->setInt64("time", timeUs);
-    accessUnit->meta()->setInt64("timeUs", timeUs);
+    accessUnit->setTimeUs(timeUs);
 
     return accessUnit;
 }
@@ -471,9 +708,7 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitAAC() {
         return NULL;
     }
 
-    CHECK(!mRangeInfos.empty());
-
-    const RangeInfo &info = *mRangeInfos.begin();
+    const RangeInfo &info = *firstRangeInfo();
     if (mBuffer->size() < info.mLength) {
         return NULL;
     }
@@ -553,14 +788,12 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitAAC() {
 
     int64_t timeUs = fetchTimestamp(offset);
 
-    sp<ABuffer> accessUnit = new ABuffer(offset);
+    sp<ABuffer> accessUnit = AccessUnitPool::Get()->acquire(offset);
     memcpy(accessUnit->data(), mBuffer->data(), offset);
 
-    memmove(mBuffer->data(), mBuffer->data() + offset,
-            mBuffer->size() - offset);
-    mBuffer->setRange(0, mBuffer->size() - offset);
+    consume(offset);
 
-    accessUnit->meta()->setInt64("timeUs", timeUs);
+    accessUnit->setTimeUs(timeUs);
 
     return accessUnit;
 }
@@ -570,9 +803,7 @@ int64_t ElementaryStreamQueue::fetchTimestamp(size_t size) {
     bool first = true;
 
     while (size > 0) {
-        CHECK(!mRangeInfos.empty());
-
-        RangeInfo *info = &*mRangeInfos.begin();
+        RangeInfo *info = firstRangeInfo();
 
         if (first) {
             timeUs = info->mTimestampUs;
@@ -585,7 +816,7 @@ int64_t ElementaryStreamQueue::fetchTimestamp(size_t size) {
         } else {
             size -= info->mLength;
 
-            mRangeInfos.erase(mRangeInfos.begin());
+            popRangeInfo();
             info = NULL;
         }
 
@@ -598,31 +829,32 @@ int64_t ElementaryStreamQueue::fetchTimestamp(size_t size) {
     return timeUs;
 }
 
-struct NALPosition {
-    size_t nalOffset;
-    size_t nalSize;
-};
-
 sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitH264() {
-    const uint8_t *data = mBuffer->data();
-
-    size_t size = mBuffer->size();
-    Vector<NALPosition> nals;
+    // Carry on from where the last call's scan stopped; the NAL units before
+    // that are already in mNALs.
+    const uint8_t *base = mBuffer->data();
+    size_t scanned = mNALScanOffset - mConsumedBytes;
+    CHECK_LE(scanned, mBuffer->size());
 
-    size_t totalSize = 0;
+    const uint8_t *data = base + scanned;
+    size_t size = mBuffer->size() - scanned;
 
     status_t err;
     const uint8_t *nalStart;
     size_t nalSize;
-    bool foundSlice = false;
     while ((err = getNextNALUnit(&data, &size, &nalStart, &nalSize)) == OK) {
+        // Resume at the next start code, or after this NAL unit if the start
+        // code is right at the end (the zeros before it are skipped again).
+        mNALScanOffset = mConsumedBytes
+            + ((data != NULL ? data : nalStart + nalSize) - base);
+
         if (nalSize == 0) continue;
 
         unsigned nalType = nalStart[0] & 0x1f;
         bool flush = false;
 
         if (nalType == 1 || nalType == 5) {
-            if (foundSlice) {
+            if (mNALFoundSlice) {
                 ABitReader br(nalStart + 1, nalSize);
                 unsigned first_mb_in_slice = parseUE(&br);
 
@@ -633,8 +865,8 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitH264() {
                 }
             }
 
-            foundSlice = true;
-        } else if ((nalType == 9 || nalType == 7) && foundSlice) {
+            mNALFoundSlice = true;
+        } else if ((nalType == 9 || nalType == 7) && mNALFoundSlice) {
             // Access unit delimiter and SPS will be associated with the
             // next frame.
 
@@ -645,18 +877,22 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitH264() {
             // The access unit will contain all nal units up to, but excluding
             // the current one, separated by 0x00 0x00 0x00 0x01 startcodes.
 
-            size_t auSize = 4 * nals.size() + totalSize;
-            sp<ABuffer> accessUnit = new ABuffer(auSize);
+            size_t auSize = 4 * mNALs.size() + mNALTotalSize;
+            sp<ABuffer> accessUnit = AccessUnitPool::Get()->acquire(auSize);
 
 #if !LOG_NDEBUG
             AString out;
 #endif
 
             size_t dstOffset = 0;
-            for (size_t i = 0; i < nals.size(); ++i) {
-                const NALPosition &pos = nals.itemAt(i);
+            for (size_t i = 0; i < mNALs.size(); ++i) {
+                const NALPosition &pos = mNALs.itemAt(i);
+                const uint8_t *nal = base + (pos.nalOffset - mConsumedBytes);
+                unsigned nalType = nal[0] & 0x1f;
 
-                unsigned nalType = mBuffer->data()[pos.nalOffset] & 0x1f;
+                if (nalType == 5) {
+                    accessUnit->setSyncFrame();
+                }
 
 #if !LOG_NDEBUG
                 char tmp[128];
@@ -669,43 +905,41 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitH264() {
 
                 memcpy(accessUnit->data() + dstOffset, "\x00\x00\x00\x01", 4);
 
-                memcpy(accessUnit->data() + dstOffset + 4,
-                       mBuffer->data() + pos.nalOffset,
-                       pos.nalSize);
+                memcpy(accessUnit->data() + dstOffset + 4, nal, pos.nalSize);
 
                 dstOffset += pos.nalSize + 4;
             }
 
             LOGV("accessUnit contains nal types %s", out.c_str());
 
-            const NALPosition &pos = nals.itemAt(nals.size() - 1);
-            size_t nextScan = pos.nalOffset + pos.nalSize;
-
-            memmove(mBuffer->data(),
-                    mBuffer->data() + nextScan,
-                    mBuffer->size() - nextScan);
+            const NALPosition &pos = mNALs.itemAt(mNALs.size() - 1);
+            size_t nextScan = pos.nalOffset + pos.nalSize - mConsumedBytes;
 
-            mBuffer->setRange(0, mBuffer->size() - nextScan);
+            consume(nextScan);
 
             int64_t timeUs = fetchTimestamp(nextScan);
             CHECK_GE(timeUs, 0ll);
 
-            accessUnit->meta()->setInt64("timeUs", timeUs);
+            accessUnit->setTimeUs(timeUs);
 
             if (mFormat == NULL) {
                 mFormat = MakeAVCCodecSpecificData(accessUnit);
             }
 
+            // The NAL unit that ended this access unit starts the next one,
+            // so it's found again from here.
+            resetNALIndex();
+
             return accessUnit;
         }
 
         NALPosition pos;
-        pos.nalOffset = nalStart - mBuffer->data();
+        pos.nalOffset = mConsumedBytes + (nalStart - base);
         pos.nalSize = nalSize;
 
-        nals.push(pos);
+        mNALs.push(pos);
 
-        totalSize += nalSize;
+        mNALTotalSize += nalSize;
     }
     CHECK_EQ(err, (status_t)-EAGAIN);
 
@@ -734,19 +968,15 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGAudio() {
 
     unsigned layer = 4 - ((header >> 17) & 3);
 
-    sp<ABuffer> accessUnit = new ABuffer(frameSize);
+    sp<ABuffer> accessUnit = AccessUnitPool::Get()->acquire(frameSize);
     memcpy(accessUnit->data(), data, frameSize);
 
-    memmove(mBuffer->data(),
-            mBuffer->data() + frameSize,
-            mBuffer->size() - frameSize);
-
-    mBuffer->setRange(0, mBuffer->size() - frameSize);
+    consume(frameSize);
 
     int64_t timeUs = fetchTimestamp(frameSize);
     CHECK_GE(timeUs, 0ll);
 
-    accessUnit->meta()->setInt64("timeUs", timeUs);
+    accessUnit->setTimeUs(timeUs);
 
     if (mFormat == NULL) {
         mFormat = new android_video_shim::MetaData();
@@ -828,7 +1058,7 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo() {
     size_t offset = 0;
     while (offset + 3 < size) {
         if (memcmp(&data[offset], "\x00\x00\x01", 3)) {
-            ++offset;
+            offset += FindStartCode(&data[offset], size - offset);
             continue;
         }
 
@@ -837,11 +1067,11 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo() {
         currentStartCode = data[offset + 3];
 
         if (currentStartCode == 0xb3 && mFormat == NULL) {
-            memmove(mBuffer->data(), mBuffer->data() + offset, size - offset);
+            consume(offset);
+            data = mBuffer->data();
             size -= offset;
             (void)fetchTimestamp(offset);
             offset = 0;
-            mBuffer->setRange(0, size);
         }
 
         if ((prevStartCode == 0xb3 && currentStartCode != 0xb5)
@@ -867,11 +1097,8 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo() {
                 sp<ABuffer> csd = new ABuffer(offset);
                 memcpy(csd->data(), data, offset);
 
-                memmove(mBuffer->data(),
-                        mBuffer->data() + offset,
-                        mBuffer->size() - offset);
-
-                mBuffer->setRange(0, mBuffer->size() - offset);
+                consume(offset);
+                data = mBuffer->data();
                 size -= offset;
                 (void)fetchTimestamp(offset);
                 offset = 0;
@@ -892,21 +1119,17 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo() {
             if (!sawPictureStart) {
                 sawPictureStart = true;
             } else {
-                sp<ABuffer> accessUnit = new ABuffer(offset);
+                sp<ABuffer> accessUnit = AccessUnitPool::Get()->acquire(offset);
                 memcpy(accessUnit->data(), data, offset);
 
-                memmove(mBuffer->data(),
-                        mBuffer->data() + offset,
-                        mBuffer->size() - offset);
-
-                mBuffer->setRange(0, mBuffer->size() - offset);
+                consume(offset);
 
                 int64_t timeUs = fetchTimestamp(offset);
                 CHECK_GE(timeUs, 0ll);
 
                 offset = 0;
 
-                accessUnit->meta()->setInt64("timeUs", timeUs);
+                accessUnit->setTimeUs(timeUs);
 
                 LOGV("returning MPEG video access unit at time %lld us",
                       timeUs);
@@ -935,13 +1158,9 @@ static ssize_t getNextChunkSize(
         TRESPASS();
     }
 
-    size_t offset = 3;
-    while (offset + 2 < size) {
-        if (!memcmp(&data[offset], kStartCode, 3)) {
-            return offset;
-        }
-
-        ++offset;
+    size_t offset = 3 + FindStartCode(&data[3], size - 3);
+    if (offset < size) {
+        return offset;
     }
 
     return -EAGAIN;
@@ -1053,19 +1272,17 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEG4Video() {
                 if (chunkType == 0xb6) {
                     offset += chunkSize;
 
-                    sp<ABuffer> accessUnit = new ABuffer(offset);
+                    sp<ABuffer> accessUnit = AccessUnitPool::Get()->acquire(offset);
                     memcpy(accessUnit->data(), data, offset);
 
-                    memmove(data, &data[offset], size - offset);
-                    size -= offset;
-                    mBuffer->setRange(0, size);
+                    consume(offset);
 
                     int64_t timeUs = fetchTimestamp(offset);
                     CHECK_GE(timeUs, 0ll);
 
                     offset = 0;
 
-                    accessUnit->meta()->setInt64("timeUs", timeUs);
+                    accessUnit->setTimeUs(timeUs);
 
                     LOGV("returning MPEG4 video access unit at time %lld us",
                          timeUs);
@@ -1087,10 +1304,10 @@ sp<ABuffer> ElementaryStreamQueue::dequeueAccessUnitMPEG4Video() {
 
         if (discard) {
             (void)fetchTimestamp(offset);
-            memmove(data, &data[offset], size - offset);
+            consume(offset);
+            data = mBuffer->data();
             size -= offset;
             offset = 0;
-            mBuffer->setRange(0, size);
         } else {
             offset += chunkSize;
         }
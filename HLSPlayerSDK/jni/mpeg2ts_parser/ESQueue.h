@@ -20,7 +20,7 @@
 
 #include "ABase.h"
 //#include <utils/Errors.h>
-#include "List.h"
+#include "Vector.h"
 //#include <utils/RefBase.h>
 
 namespace android {
@@ -41,10 +41,21 @@ struct ElementaryStreamQueue {
     enum Flags {
         // Data appended to the queue is always at access unit boundaries.
         kFlag_AlignedData = 1,
+        // Samples are SAMPLE-AES encrypted and decrypted as they're appended.
+        kFlag_SampleAES = 2,
     };
     ElementaryStreamQueue(Mode mode, uint32_t flags = 0);
+    ~ElementaryStreamQueue();
 
-    status_t appendData(const void *data, size_t size, int64_t timeUs);
+    // cryptoHandle is the SAMPLE-AES key (see HLSCryptoTable) for the data,
+    // used only with kFlag_SampleAES. data must hold whole samples.
+    status_t appendData(const void *data, size_t size, int64_t timeUs, int cryptoHandle = -1);
+
+    // appendData in two steps, for callers that gather the data from
+    // several places: write size bytes at the pointer reserveData returns,
+    // then commit them. Nothing is appended if commitData fails.
+    uint8_t *reserveData(size_t size);
+    status_t commitData(size_t size, int64_t timeUs, int cryptoHandle = -1);
     void clear(bool clearFormat);
 
     sp<ABuffer> dequeueAccessUnit();
@@ -57,14 +68,42 @@ private:
         size_t mLength;
     };
 
+    // Where a NAL unit lies, as a stream position (see mConsumedBytes).
+    struct NALPosition {
+        size_t nalOffset;
+        size_t nalSize;
+    };
+
     Mode mMode;
     uint32_t mFlags;
 
+    // The range of mBuffer is the data not consumed yet; access units are
+    // taken off its front by moving the start of the range.
     sp<ABuffer> mBuffer;
-    List<RangeInfo> mRangeInfos;
+
+    // Bytes consumed since the queue was created. Stream positions are
+    // this plus an offset into mBuffer's range; they wrap harmlessly, as
+    // only differences are used.
+    size_t mConsumedBytes;
+
+    // Ring of the lengths and timestamps of the data appended, oldest first.
+    // The capacity is a power of two.
+    RangeInfo *mRangeInfos;
+    size_t mRangeInfoCapacity;
+    size_t mRangeInfoHead;
+    size_t mNumRangeInfos;
+
+    // H.264 NAL units of the access unit being gathered, and how far the
+    // data has been scanned for them, so each byte is only scanned once.
+    Vector<NALPosition> mNALs;
+    size_t mNALScanOffset;
+    size_t mNALTotalSize;
+    bool mNALFoundSlice;
 
     sp<android_video_shim::MetaData> mFormat;
 
+    bool mMissingKeyLogged;
+
     sp<ABuffer> dequeueAccessUnitH264();
     sp<ABuffer> dequeueAccessUnitAAC();
     sp<ABuffer> dequeueAccessUnitAAC_23();
@@ -73,10 +112,22 @@ private:
     sp<ABuffer> dequeueAccessUnitMPEG4Video();
     sp<ABuffer> dequeueAccessUnitPCMAudio();
 
+    // Decrypts the samples in data in place; returns the new size.
+    size_t decryptSamples(uint8_t *data, size_t size, int cryptoHandle);
+
     // consume a logical (compressed) access unit of size "size",
     // returns its timestamp in us (or -1 if no time information).
     int64_t fetchTimestamp(size_t size);
 
+    // Drops size bytes off the front of mBuffer.
+    void consume(size_t size);
+
+    void pushRangeInfo(const RangeInfo &info);
+    RangeInfo *firstRangeInfo();
+    void popRangeInfo();
+
+    void resetNALIndex();
+
     DISALLOW_EVIL_CONSTRUCTORS(ElementaryStreamQueue);
 };
 
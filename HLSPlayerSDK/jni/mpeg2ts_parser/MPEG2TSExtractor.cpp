@@ -25,6 +25,8 @@
 
 #include "ADebug.h"
 
+#include "ABuffer.h"
+#include "AccessUnitPool.h"
 #include "AnotherPacketSource.h"
 #include "ATSParser.h"
 
@@ -32,6 +34,19 @@ namespace android {
 
 static const size_t kTSPacketSize = 188;
 
+// Read ahead this many whole packets (~64k) from the data source at a time.
+static const size_t kReadBlockSize = kTSPacketSize * 348;
+
+// The demux thread parses this many packets between queue level checks.
+static const size_t kPacketsPerBatch = 348;
+
+// Per-track read-ahead. A track is low when it is under both low marks and
+// full when it reaches either high mark.
+static const int64_t kLowWatermarkUs = 2000000ll;
+static const size_t kLowWatermarkBytes = 1024 * 1024;
+static const int64_t kHighWatermarkUs = 5000000ll;
+static const size_t kHighWatermarkBytes = 4 * 1024 * 1024;
+
 struct MPEG2TSSource : public RefBase {
 
     pthread_mutex_t lock;
@@ -73,6 +88,7 @@ MPEG2TSSource::MPEG2TSSource(
 
 status_t MPEG2TSSource::start(MetaData *params) {
     AutoLock locker(&lock);
+    mExtractor->startDemuxThread();
     return mImpl->start(params);
 }
 
@@ -92,25 +108,30 @@ status_t MPEG2TSSource::read(
     AutoLock locker(&lock);
     *out = NULL;
 
-    int64_t seekTimeUs;
-    android_video_shim::MediaSource::ReadOptions::SeekMode seekMode;
-    if (mSeekable && options && options->getSeekTo(&seekTimeUs, &seekMode)) {
-        return ERROR_UNSUPPORTED;
-    }
+    // A seek only reaches us from a decoder passing on the flush the player
+    // asked it for; by then the player has moved the extractor itself (see
+    // seekInBuffer), so just carry on reading.
+
+    // The demux thread fills mImpl; make sure it is running, and that it
+    // knows we're waiting if there is nothing there yet.
+    mExtractor->startDemuxThread();
 
     status_t finalResult;
-    while (!mImpl->hasBufferAvailable(&finalResult)) {
+    if (!mImpl->hasBufferAvailable(&finalResult)) {
         if (finalResult != OK) {
             return ERROR_END_OF_STREAM;
         }
 
-        status_t err = mExtractor->feedMore();
-        if (err != OK) {
-            mImpl->signalEOS(err);
-        }
+        mExtractor->setReaderWaiting(mImpl.get(), true);
     }
 
-    return mImpl->read(out, options);
+    status_t err = mImpl->read(out, options);
+    mExtractor->setReaderWaiting(mImpl.get(), false);
+
+    if (err != OK && err != INFO_DISCONTINUITY) {
+        return ERROR_END_OF_STREAM;
+    }
+    return err;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -427,15 +448,76 @@ android_video_shim::MediaSource23 *MPEG2TSExtractor::getTrackProxy23(size_t inde
 MPEG2TSExtractor::MPEG2TSExtractor(const sp<HLSDataSource> &source)
     : mDataSource(source),
       mParser(new ATSParser(ATSParser::TS_TIMESTAMPS_ARE_ABSOLUTE)),
-      mOffset(0) {
+      mOffset(0),
+      mReadBuffer(AccessUnitPool::Get()->acquire(kReadBlockSize)),
+      mReadBufferFed(false),
+      mCryptoHandle(-1),
+      mCryptoStart(0),
+      mCryptoEnd(0),
+      mDemuxStartAttempted(false),
+      mDemuxThreadStarted(false),
+      mDemuxStopping(false),
+      mDemuxIdle(false),
+      mReadPositionChanged(false),
+      mDiscardedTracks(0),
+      mStarvingTracks(0) {
+    mReadBuffer->setRange(0, 0);
 	LOGV("mParser->flags=%d", mParser->getFlags());
+
+    mKeyFrameIndexer.mDataSource = mDataSource.get();
+    mParser->setKeyFrameListener(&mKeyFrameIndexer);
+
+    mAppendNotifier.mExtractor = this;
+    mDataSource->setAppendListener(&mAppendNotifier);
+
     init();
 }
 
+MPEG2TSExtractor::~MPEG2TSExtractor() {
+    if (mDemuxThreadStarted) {
+        {
+            Mutex::Autolock autoLock(mDemuxLock);
+            mDemuxStopping = true;
+            mDemuxCondition.signal();
+        }
+
+        // The thread may be waiting on a download; make the data source
+        // give up on it rather than wait for the segment to arrive.
+        mDataSource->setReadsInterrupted(true);
+        pthread_join(mDemuxThread, NULL);
+        mDataSource->setReadsInterrupted(false);
+    }
+
+    // A newer extractor may be reading the same data source by now.
+    mDataSource->clearAppendListener(&mAppendNotifier);
+}
+
 size_t MPEG2TSExtractor::countTracks() {
     return mSourceImpls.size();
 }
 
+void MPEG2TSExtractor::discardTrack(size_t index) {
+    if (index >= mSourceImpls.size()) {
+        return;
+    }
+
+    sp<MetaData> meta = mSourceImpls.editItemAt(index)->getFormat();
+    const char *mime;
+    if (meta == NULL || !meta->findCString(kKeyMIMEType, &mime)) {
+        return;
+    }
+
+    {
+        Mutex::Autolock autoLock(mLock);
+        mParser->setSourceDiscarded(
+                !strncasecmp("audio/", mime, 6) ? ATSParser::AUDIO : ATSParser::VIDEO,
+                true);
+    }
+
+    Mutex::Autolock autoLock(mDemuxLock);
+    mDiscardedTracks |= 1u << index;
+}
+
 /*sp<android_video_shim::MediaSource> MPEG2TSExtractor::getTrack(size_t index) {
     if (index >= mSourceImpls.size()) {
         return NULL;
@@ -512,18 +594,355 @@ void MPEG2TSExtractor::init() {
     ALOGI("haveAudio=%d, haveVideo=%d", haveAudio, haveVideo);
 }
 
-status_t MPEG2TSExtractor::feedMore() {
-    Mutex::Autolock autoLock(mLock);
+void MPEG2TSExtractor::setBufferLimits(
+        int64_t maxDurationUs, size_t maxBytes) {
+    for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+        mSourceImpls.editItemAt(i)->setBufferLimits(maxDurationUs, maxBytes);
+    }
+
+    // Raised caps may let the thread go on.
+    Mutex::Autolock autoLock(mDemuxLock);
+    if (mDemuxIdle && needsMoreDataLocked()) {
+        mDemuxCondition.signal();
+    }
+}
+
+bool MPEG2TSExtractor::seekToKeyFrame(int64_t timeUs) {
+    int64_t keyTimeUs;
+    off64_t offset = mDataSource->findKeyFrame(timeUs, &keyTimeUs);
+    if (offset < 0) {
+        return false;
+    }
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        LOGI("Resuming at keyframe %lld us (offset %lld) for %lld us",
+             keyTimeUs, offset, timeUs);
+
+        moveReadPositionLocked(offset);
+    }
+
+    Mutex::Autolock autoLock(mDemuxLock);
+    mReadPositionChanged = true;
+    if (mDemuxIdle) {
+        mDemuxCondition.signal();
+    }
+
+    return true;
+}
+
+bool MPEG2TSExtractor::seekInBuffer(double timeSecs) {
+    int64_t timeUs = (int64_t)(timeSecs * 1000000.0);
+    int64_t keyTimeUs;
+    off64_t offset = mDataSource->findBufferedKeyFrame(timeSecs, &keyTimeUs);
+    if (offset < 0) {
+        return false;
+    }
+
+    {
+        Mutex::Autolock autoLock(mLock);
+
+        // Once the tracks have ended the demux thread is gone, and nothing
+        // would refill them.
+        for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+            int64_t durationUs;
+            size_t bytes;
+            status_t finalResult;
+            mSourceImpls.editItemAt(i)->getBufferLevel(
+                    &durationUs, &bytes, &finalResult);
+            if (finalResult != OK) {
+                return false;
+            }
+        }
+
+        LOGI("Moving to keyframe %lld us (offset %lld) for %lld us",
+             keyTimeUs, offset, timeUs);
+
+        moveReadPositionLocked(offset);
+
+        // Nothing is fed while we hold mLock, so the tracks hear of the
+        // target before any access unit from the new position.
+        for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+            mSourceImpls.editItemAt(i)->flush();
+            mSourceImpls.editItemAt(i)->dropUntil(timeUs);
+        }
+    }
+
+    Mutex::Autolock autoLock(mDemuxLock);
+    mReadPositionChanged = true;
+    if (mDemuxIdle) {
+        mDemuxCondition.signal();
+    }
+
+    return true;
+}
+
+void MPEG2TSExtractor::moveReadPositionLocked(off64_t offset) {
+    mParser->dropPendingData();
+
+    // Start reading at the keyframe's first packet in a fresh block, and
+    // look up its crypto handle again.
+    mOffset = offset;
+    mReadBuffer->setRange(0, 0);
+    mReadBufferFed = true;
+    mCryptoStart = mCryptoEnd = 0;
+}
+
+void MPEG2TSExtractor::dropUntil(int64_t timeUs) {
+    LOGI("Dropping access units before %lld us", timeUs);
+
+    for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+        mSourceImpls.editItemAt(i)->dropUntil(timeUs);
+    }
+
+    // The tracks no longer count what they hold back.
+    Mutex::Autolock autoLock(mDemuxLock);
+    if (mDemuxIdle && needsMoreDataLocked()) {
+        mDemuxCondition.signal();
+    }
+}
+
+void MPEG2TSExtractor::KeyFrameIndexer::onKeyFrame(
+        int64_t offset, int64_t timeUs) {
+    mDataSource->noteKeyFrame(offset, timeUs);
+}
+
+void MPEG2TSExtractor::AppendNotifier::onSourcesAppended() {
+    Mutex::Autolock autoLock(mExtractor->mDemuxLock);
+    mExtractor->mReadPositionChanged = true;
+    mExtractor->mDemuxCondition.signal();
+}
+
+void MPEG2TSExtractor::startDemuxThread() {
+    Mutex::Autolock autoLock(mDemuxLock);
+    if (mDemuxStartAttempted) {
+        return;
+    }
+
+    // Only try once; the tracks end if it fails.
+    mDemuxStartAttempted = true;
+
+    if (pthread_create(&mDemuxThread, NULL, DemuxThreadWrapper, this) != 0) {
+        LOGE("Couldn't start the demux thread");
+        for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+            mSourceImpls.editItemAt(i)->signalEOS(UNKNOWN_ERROR);
+        }
+        return;
+    }
 
-    uint8_t packet[kTSPacketSize];
-    ssize_t n = mDataSource->readAt(mOffset, packet, kTSPacketSize);
+    mDemuxThreadStarted = true;
+}
+
+// static
+void *MPEG2TSExtractor::DemuxThreadWrapper(void *me) {
+    static_cast<MPEG2TSExtractor *>(me)->demuxThread();
+    return NULL;
+}
+
+void MPEG2TSExtractor::demuxThread() {
+    for (;;) {
+        {
+            Mutex::Autolock autoLock(mDemuxLock);
+            while (!mDemuxStopping && !needsMoreDataLocked()) {
+                mDemuxIdle = true;
+                mDemuxCondition.wait(mDemuxLock);
+            }
+            mDemuxIdle = false;
+
+            if (mDemuxStopping) {
+                break;
+            }
+
+            // Appends and seeks from here on cut short the wait below.
+            mReadPositionChanged = false;
+        }
+
+        status_t err = OK;
+        for (size_t i = 0; i < kPacketsPerBatch && err == OK; ++i) {
+            err = feedMore();
+        }
+
+        if (err == HLSDataSource::END_OF_SOURCES) {
+            // Caught up with the player, which keeps only a couple of
+            // segments ahead. Wait for it to append more, unless a reader
+            // runs out of data first.
+            Mutex::Autolock autoLock(mDemuxLock);
+            while (!mDemuxStopping && !mReadPositionChanged
+                    && mStarvingTracks == 0) {
+                mDemuxIdle = true;
+                mDemuxCondition.wait(mDemuxLock);
+            }
+            mDemuxIdle = false;
+
+            if (mDemuxStopping) {
+                break;
+            }
+
+            err = mReadPositionChanged ? OK : ERROR_END_OF_STREAM;
+        }
+
+        if (err != OK) {
+            for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+                mSourceImpls.editItemAt(i)->signalEOS(err);
+            }
+            break;
+        }
+    }
+}
+
+bool MPEG2TSExtractor::needsMoreDataLocked() {
+    bool belowLow = false;
+    bool belowHigh = false;
+    for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+        if (mDiscardedTracks & (1u << i)) {
+            continue;
+        }
+
+        const sp<AnotherPacketSource> &impl = mSourceImpls.editItemAt(i);
+
+        int64_t durationUs;
+        size_t bytes;
+        status_t finalResult;
+        impl->getBufferLevel(&durationUs, &bytes, &finalResult);
+
+        if (finalResult != OK) {
+            continue;
+        }
+
+        // A track nobody is draining would otherwise grow without bound
+        // while we feed the others.
+        if (impl->isFull()) {
+            return false;
+        }
+
+        if (durationUs < kLowWatermarkUs && bytes < kLowWatermarkBytes) {
+            belowLow = true;
+        }
+
+        if (durationUs < kHighWatermarkUs && bytes < kHighWatermarkBytes) {
+            belowHigh = true;
+        }
+    }
+
+    if (mStarvingTracks != 0 || belowLow) {
+        return true;
+    }
+
+    // Once woken, keep going until every track is full; while asleep only
+    // a low track is worth waking for.
+    return !mDemuxIdle && belowHigh;
+}
+
+uint32_t MPEG2TSExtractor::trackBit(const AnotherPacketSource *impl) {
+    for (size_t i = 0; i < mSourceImpls.size(); ++i) {
+        if (mSourceImpls.editItemAt(i).get() == impl) {
+            return 1u << i;
+        }
+    }
+    return 0;
+}
+
+void MPEG2TSExtractor::setReaderWaiting(
+        const AnotherPacketSource *impl, bool waiting) {
+    Mutex::Autolock autoLock(mDemuxLock);
+
+    if (waiting) {
+        mStarvingTracks |= trackBit(impl);
+    } else {
+        mStarvingTracks &= ~trackBit(impl);
+    }
+
+    // A thread waiting for sources to be appended wants to hear about a
+    // reader running dry even if another track is full.
+    if (mDemuxIdle && (waiting || needsMoreDataLocked())) {
+        mDemuxCondition.signal();
+    }
+}
+
+status_t MPEG2TSExtractor::fillReadBuffer() {
+    // The parser may still point into the packets we fed it from the old
+    // block, so read into a fresh one. Blocks come from the pool, and go
+    // back to it once the last PES slice into them is gone.
+    if (mReadBufferFed) {
+        mReadBuffer = AccessUnitPool::Get()->acquire(kReadBlockSize);
+        mReadBufferFed = false;
+    }
+
+    uint8_t *base = mReadBuffer->base();
+    ssize_t n = mDataSource->readBlockAt(mOffset, base, kReadBlockSize, false);
+
+    if (n == WOULD_BLOCK || n == HLSDataSource::END_OF_SOURCES) {
+        mReadBuffer->setRange(0, 0);
+        return n;
+    }
+
+    if (n >= 0 && n < (ssize_t)kTSPacketSize) {
+        // A packet straddles the segment boundary; fall back to a plain
+        // read that is allowed to span segments.
+        n = mDataSource->readAt(mOffset, base, kTSPacketSize);
+    }
 
     if (n < (ssize_t)kTSPacketSize) {
-        return (n < 0) ? (status_t)n : ERROR_END_OF_STREAM;
+        // Either error, or the rest of the packet is in a source that
+        // hasn't been appended yet.
+        mReadBuffer->setRange(0, 0);
+        return (n < 0) ? (status_t)n : HLSDataSource::END_OF_SOURCES;
+    }
+
+    // Only keep whole packets; a partial tail gets read again next time.
+    mReadBuffer->setRange(0, n - (n % kTSPacketSize));
+    return OK;
+}
+
+status_t MPEG2TSExtractor::feedMore() {
+    for (;;) {
+        off64_t offset;
+        {
+            Mutex::Autolock autoLock(mLock);
+            status_t err = feedPacket();
+            if (err != WOULD_BLOCK) {
+                return err;
+            }
+            offset = mOffset;
+        }
+
+        // The segment we need is still downloading; sleep until the segment
+        // cache signals it has arrived, without holding mLock.
+        status_t err = mDataSource->waitForData(offset);
+        if (err != OK) {
+            return err;
+        }
+    }
+}
+
+status_t MPEG2TSExtractor::feedPacket() {
+    if (mReadBuffer->size() < kTSPacketSize) {
+        status_t err = fillReadBuffer();
+        if (err != OK) {
+            return err;
+        }
+    }
+
+    const uint8_t *packet = mReadBuffer->data();
+    mReadBuffer->setRange(mReadBuffer->offset() + kTSPacketSize,
+                          mReadBuffer->size() - kTSPacketSize);
+
+    // Tell the parser which key the samples starting here are under.
+    if (mOffset < mCryptoStart || mOffset >= mCryptoEnd) {
+        mCryptoStart = mOffset;
+        int handle = mDataSource->getSampleAesHandle(mOffset, &mCryptoEnd);
+        if (handle != mCryptoHandle) {
+            mCryptoHandle = handle;
+            mParser->setSampleAesHandle(handle);
+        }
     }
 
-    mOffset += n;
-    return mParser->feedTSPacket(packet, kTSPacketSize);
+    off64_t packetOffset = mOffset;
+    mOffset += kTSPacketSize;
+    mReadBufferFed = true;
+    return mParser->feedTSPacket(
+            mReadBuffer, packet, kTSPacketSize, packetOffset);
 }
 
 uint32_t MPEG2TSExtractor::flags() const {
@@ -20,7 +20,10 @@
 #include "threads.h"
 #include "Vector.h"
 
+#include "ATSParser.h"
+
 namespace android {
+struct ABuffer;
 struct AMessage;
 struct AnotherPacketSource;
 struct ATSParser;
@@ -37,20 +40,117 @@ struct MPEG2TSExtractor : public android_video_shim::MediaExtractor
     virtual sp<MetaData> getTrackMetaData(size_t index, uint32_t flags = 0);
     virtual size_t countTracks();
 
+    // Stop demuxing a track nobody is going to read; its packets are dropped
+    // as soon as their PID is known.
+    void discardTrack(size_t index);
+
+    // Caps how much each track may queue ahead of its reader. Demuxing
+    // stops while any track is at its cap, even if another track's reader
+    // is waiting; 0 lifts a cap.
+    void setBufferLimits(int64_t maxDurationUs, size_t maxBytes);
+
+    // If the segment being read has an IDR frame at or before timeUs in
+    // its keyframe index, drop what has been demuxed so far and carry on
+    // from the last such frame. Returns whether it did. Call before any
+    // track is started: demuxing ahead only begins then, and could move
+    // past the segment holding the target.
+    bool seekToKeyFrame(int64_t timeUs);
+
+    // Like seekToKeyFrame, but for a target anywhere in the segments the
+    // data source still holds, and with the tracks already started: what
+    // they have queued is dropped, and they carry on from the last indexed
+    // IDR frame before timeSecs, dropping up to it. Returns false, having
+    // changed nothing, if that segment isn't indexed or demuxing has ended.
+    bool seekInBuffer(double timeSecs);
+
+    // Have every track discard what comes before timeUs here, rather than
+    // have it decoded only to be thrown away. Video still starts at the
+    // last sync frame before timeUs; see AnotherPacketSource::dropUntil.
+    void dropUntil(int64_t timeUs);
+
     virtual sp<MetaData> getMetaData();
     virtual uint32_t flags() const;
+
+protected:
+    virtual ~MPEG2TSExtractor();
+
 private:
 
     //virtual sp<MediaSource> getTrack(size_t index);
 
     friend struct MPEG2TSSource;
+
+    // Files the IDR frames the parser finds in the segment cache's index.
+    struct KeyFrameIndexer : public ATSParser::KeyFrameListener {
+        HLSDataSource *mDataSource;
+
+        virtual void onKeyFrame(int64_t offset, int64_t timeUs);
+    };
+
+    // Wakes the demux thread when it is waiting for sources to be appended.
+    struct AppendNotifier : public HLSDataSource::AppendListener {
+        MPEG2TSExtractor *mExtractor;
+
+        virtual void onSourcesAppended();
+    };
+
     mutable Mutex mLock;
     sp<HLSDataSource> mDataSource;
     sp<ATSParser> mParser;
     Vector< sp<AnotherPacketSource> > mSourceImpls;
     off64_t mOffset;
+
+    // Block of packets read ahead from mDataSource. The buffer range covers
+    // the bytes from mOffset that have not been fed to the parser yet. The
+    // parser assembles PES packets in place, so once any of a block has
+    // been fed the next read goes to a new block from AccessUnitPool.
+    sp<ABuffer> mReadBuffer;
+    bool mReadBufferFed;
+
+    // SAMPLE-AES handle of the segment being parsed, which holds the bytes
+    // in [mCryptoStart, mCryptoEnd).
+    int mCryptoHandle;
+    off64_t mCryptoStart;
+    off64_t mCryptoEnd;
+
+    KeyFrameIndexer mKeyFrameIndexer;
+    AppendNotifier mAppendNotifier;
+
+    // Demuxing runs ahead on its own thread, so a read only waits on its
+    // track's queue. The thread starts when a track is first started or
+    // read, so that a seek made before then still finds its segment. The
+    // thread tops each wanted track up to the high watermark, then sleeps
+    // until one drains below the low watermark or a reader finds its queue
+    // empty. The mask bits are indices into mSourceImpls.
+    //
+    // Once it has caught up with the sources appended so far, the thread
+    // waits for more. It only ends the tracks if a reader runs dry first,
+    // which is when reading without the thread used to hit the end.
+    Mutex mDemuxLock;
+    Condition mDemuxCondition;
+    pthread_t mDemuxThread;
+    bool mDemuxStartAttempted;
+    bool mDemuxThreadStarted;
+    bool mDemuxStopping;
+    bool mDemuxIdle;
+    bool mReadPositionChanged; // Sources appended, or a seek, since the batch began.
+    uint32_t mDiscardedTracks;
+    uint32_t mStarvingTracks;
+
     void init();
+    void moveReadPositionLocked(off64_t offset);
+    void startDemuxThread();
+    static void *DemuxThreadWrapper(void *me);
+    void demuxThread();
+    bool needsMoreDataLocked();
+    uint32_t trackBit(const AnotherPacketSource *impl);
+
+    // A reader is about to wait on impl's empty queue, or is done reading.
+    void setReaderWaiting(const AnotherPacketSource *impl, bool waiting);
+
+    status_t fillReadBuffer();
     status_t feedMore();
+    status_t feedPacket();
     DISALLOW_EVIL_CONSTRUCTORS(MPEG2TSExtractor);
 };
 bool SniffMPEG2TS(
@@ -0,0 +1,114 @@
+/*
+ * Start code search kernels. SSE2 is part of the NDK x86 ABI, so it's
+ * used whenever the compiler targets it; NEON is optional on armeabi-v7a,
+ * so that kernel lives in StartCode_neon.cpp and is picked at runtime.
+ */
+
+#include "StartCode.h"
+
+#include <stdio.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace android {
+
+// A byte above 1 can't be part of a start code anywhere but as its 01, so
+// when the third byte of the window is one, the window moves past it.
+static size_t FindStartCodeScalar(const uint8_t *data, size_t size) {
+    for (size_t i = 0; i + 2 < size; ++i) {
+        if (data[i + 2] > 1) {
+            i += 2;
+        } else if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+#if defined(__SSE2__)
+static size_t FindStartCodeSSE2(const uint8_t *data, size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    // Each pass tests the 16 positions from i, which reads up to i + 17.
+    size_t i = 0;
+    for (; i + 18 <= size; i += 16) {
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(data + i + 1));
+        __m128i b2 = _mm_loadu_si128((const __m128i *)(data + i + 2));
+
+        __m128i match = _mm_and_si128(
+                _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                _mm_cmpeq_epi8(b2, one));
+
+        int mask = _mm_movemask_epi8(match);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + FindStartCodeScalar(data + i, size - i);
+}
+#endif
+
+#if !defined(__SSE2__)
+#if defined(HLS_STARTCODE_NEON) && !defined(__aarch64__)
+static int CpuHasNeon() {
+    // getauxval() only arrived in API 18, so read the auxiliary vector
+    // ourselves. AT_HWCAP is 16 and HWCAP_NEON is bit 12.
+    unsigned long entry[2];
+    int found = 0;
+    FILE *f = fopen("/proc/self/auxv", "rb");
+    if (f == NULL) {
+        return 0;
+    }
+    while (fread(entry, sizeof(entry), 1, f) == 1 && entry[0] != 0) {
+        if (entry[0] == 16) {
+            found = (entry[1] & (1 << 12)) != 0;
+            break;
+        }
+    }
+    fclose(f);
+    return found;
+}
+#endif
+
+typedef size_t (*FindStartCodeFn)(const uint8_t *data, size_t size);
+
+// Chosen on first use. Racing first callers all pick the same kernel, so
+// no lock is needed.
+static FindStartCodeFn gFindStartCode = NULL;
+
+static FindStartCodeFn FindStartCodeKernel() {
+    if (gFindStartCode != NULL) {
+        return gFindStartCode;
+    }
+
+    FindStartCodeFn fn = FindStartCodeScalar;
+#if defined(HLS_STARTCODE_NEON)
+#if defined(__aarch64__)
+    fn = FindStartCodeNEON;
+#else
+    if (CpuHasNeon()) {
+        fn = FindStartCodeNEON;
+    }
+#endif
+#endif
+
+    gFindStartCode = fn;
+    return fn;
+}
+#endif
+
+size_t FindStartCode(const uint8_t *data, size_t size) {
+#if defined(__SSE2__)
+    return FindStartCodeSSE2(data, size);
+#else
+    return FindStartCodeKernel()(data, size);
+#endif
+}
+
+}  // namespace android
@@ -0,0 +1,27 @@
+/*
+ * Start code (00 00 01) search for the H.264 and MPEG video parsers. This
+ * is one of the hottest loops in the demuxer, so it compares 16 bytes at a
+ * time with SSE2 or NEON where the CPU has them.
+ */
+
+#ifndef START_CODE_H_
+
+#define START_CODE_H_
+
+#include <sys/types.h>
+#include <stdint.h>
+
+namespace android {
+
+// Offset of the first 00 00 01 in data, or size if there is none.
+size_t FindStartCode(const uint8_t *data, size_t size);
+
+#if defined(HLS_STARTCODE_NEON)
+// The NEON kernel, built on its own with the NEON FPU flags. Only called
+// once StartCode.cpp has seen the NEON hwcap.
+size_t FindStartCodeNEON(const uint8_t *data, size_t size);
+#endif
+
+}  // namespace android
+
+#endif  // START_CODE_H_
@@ -0,0 +1,47 @@
+/*
+ * NEON start code search. Built with the NEON FPU flags on armeabi-v7a;
+ * only called once StartCode.cpp has seen the NEON hwcap.
+ */
+
+#include <arm_neon.h>
+
+#include "StartCode.h"
+
+namespace android {
+
+size_t FindStartCodeNEON(const uint8_t *data, size_t size) {
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    // Each pass tests the 16 positions from i, which reads up to i + 17.
+    size_t i = 0;
+    for (; i + 18 <= size; i += 16) {
+        uint8x16_t b0 = vld1q_u8(data + i);
+        uint8x16_t b1 = vld1q_u8(data + i + 1);
+        uint8x16_t b2 = vld1q_u8(data + i + 2);
+
+        uint8x16_t match = vandq_u8(
+                vandq_u8(vceqq_u8(b0, zero), vceqq_u8(b1, zero)),
+                vceqq_u8(b2, one));
+
+        // Matching positions are 0xff bytes; the lowest one is the first.
+        uint64x2_t lanes = vreinterpretq_u64_u8(match);
+        uint64_t lo = vgetq_lane_u64(lanes, 0);
+        uint64_t hi = vgetq_lane_u64(lanes, 1);
+        if ((lo | hi) != 0) {
+            return lo != 0
+                ? i + (__builtin_ctzll(lo) >> 3)
+                : i + 8 + (__builtin_ctzll(hi) >> 3);
+        }
+    }
+
+    for (; i + 2 < size; ++i) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            return i;
+        }
+    }
+
+    return size;
+}
+
+}  // namespace android
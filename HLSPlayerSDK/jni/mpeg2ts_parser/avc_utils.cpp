@@ -21,6 +21,7 @@ using namespace android_video_shim;
 #include "ADebug.h"
  #define ALOGI LOGI
 #include "avc_utils.h"
+#include "StartCode.h"
 #include "ABitReader.h"
 #include "ADebug.h"
 #include "hexdump.h"
@@ -171,22 +172,15 @@ status_t getNextNALUnit(
     }
     ++offset;
     size_t startOffset = offset;
-    for (;;) {
-        while (offset < size && data[offset] != 0x01) {
-            ++offset;
-        }
-        if (offset == size) {
-            if (startCodeFollows) {
-                offset = size + 2;
-                break;
-            }
+    // offset ends up on the 01 of the next start code.
+    offset = startOffset + FindStartCode(&data[startOffset], size - startOffset);
+    if (offset == size) {
+        if (!startCodeFollows) {
             return -EAGAIN;
         }
-        if (data[offset - 1] == 0x00 && data[offset - 2] == 0x00) {
-            break;
-        }
-        ++offset;
+        offset = size;
     }
+    offset += 2;
     size_t endOffset = offset - 2;
     while (endOffset > startOffset + 1 && data[endOffset - 1] == 0x00) {
         --endOffset;
@@ -320,6 +314,20 @@ bool IsIDR(const sp<ABuffer> &buffer) {
     }
     return foundIDR;
 }
+bool StartsWithIDR(const uint8_t *data, size_t size) {
+    const uint8_t *nalStart;
+    size_t nalSize;
+    while (getNextNALUnit(&data, &size, &nalStart, &nalSize, false) == OK) {
+        if (nalSize == 0) {
+            continue;
+        }
+        unsigned nalType = nalStart[0] & 0x1f;
+        if (nalType >= 1 && nalType <= 5) {
+            return nalType == 5;
+        }
+    }
+    return false;
+}
 bool IsAVCReferenceFrame(const sp<ABuffer> &accessUnit) {
     const uint8_t *data = accessUnit->data();
     size_t size = accessUnit->size();
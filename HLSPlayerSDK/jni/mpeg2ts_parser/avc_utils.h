@@ -43,6 +43,9 @@ status_t getNextNALUnit(
 //struct MetaData;
 sp<android_video_shim::MetaData> MakeAVCCodecSpecificData(const sp<ABuffer> &accessUnit);
 bool IsIDR(const sp<ABuffer> &accessUnit);
+// Whether the first slice in this Annex B data belongs to an IDR picture.
+// Stops at that slice, so only the head of a frame is looked at.
+bool StartsWithIDR(const uint8_t *data, size_t size);
 bool IsAVCReferenceFrame(const sp<ABuffer> &accessUnit);
 const char *AVCProfileToString(uint8_t profile);
 sp<android_video_shim::MetaData> MakeAACCodecSpecificData(
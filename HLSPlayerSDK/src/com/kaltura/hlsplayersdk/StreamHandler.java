@@ -430,6 +430,35 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 		closed = true;
 		stopReloads();
 		stopListeningToBestEffortDownloads();
+		
+		// Segments hold native crypto contexts; give them back now rather
+		// than when the manifests are collected.
+		if (baseManifest != null)
+			baseManifest.releaseCrypto();
+		if (primaryStream != null && primaryStream.manifest != null)
+			primaryStream.manifest.releaseCrypto();
+	}
+	
+	/**
+	 * newManifest is a reload of old and replaces it. Segments still in the
+	 * window keep old's crypto contexts; those that left it release theirs.
+	 * A released segment that is asked for again allocates a new context.
+	 */
+	private void replacingManifest(ManifestParser old, ManifestParser newManifest)
+	{
+		if (old == null || old == newManifest)
+			return;
+		
+		for (int i = 0; i < old.segments.size(); ++i)
+		{
+			ManifestSegment seg = old.segments.get(i);
+			if (seg.cryptoId == -1)
+				continue;
+			
+			ManifestSegment kept = getSegmentBySequence(newManifest.segments, seg.id);
+			if (kept == null || !kept.takeCrypto(seg, getKeyForSequence(kept.id, newManifest.keys)))
+				seg.releaseCrypto();
+		}
 	}
 
 	@Override
@@ -568,6 +597,7 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 			Log.i("StreamHandler.onReloadComplete", "Setting alt audio to " + rid);
 			if (baseManifest.playLists.size() > 0)
 			{
+				replacingManifest(baseManifest.playLists.get(newManifest.quality).manifest, newManifest);
 				baseManifest.playLists.get(newManifest.quality).manifest = newManifest;
 				if (newManifest.quality == lid)
 					altAudioManifest = newManifest;
@@ -588,11 +618,13 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 			newManifest.logSegments("StreamHandler.onReloadComplete");
 			if (baseManifest.streams.size() > 0)
 			{
+				replacingManifest(baseManifest.streams.get(newManifest.quality).manifest, newManifest);
 				baseManifest.streams.get(newManifest.quality).manifest = newManifest;
 			}
 			else
 			{
 				// The reason this is okay is because if we don't have any submanifests, we don't have alt audio
+				replacingManifest(baseManifest, newManifest);
 				baseManifest = newManifest;
 			}
 			
@@ -1105,9 +1137,7 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 		
 		for (String url : uri)
 		{
-			ByteArray ba = new ByteArray(HLSSegmentCache.getByteArray(url));
-			
-			long pts = getPTS(ba, url);
+			long pts = getPTS(url);
 			if (pts != -1)
 			{
 				double startTime = (double)((double)pts / (double)90000);
@@ -1223,16 +1253,21 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 	
 
 	private final int _bufferCopySize = 0x4000;  
-	private long getPTS(ByteArray segmentBytes, String uri)
+	private long getPTS(String uri)
 	{
 		M2TSParser tsParser = new M2TSParser();
+		
+		// Only the start of the segment is needed, a chunk at a time.
+		ByteArray chunk = new ByteArray(_bufferCopySize);
 					
 		long pts = -1;
 		int offset = 0;
-		while (pts == -1 && offset < segmentBytes.length())
+		while (pts == -1)
 		{
-			int len = Math.min(_bufferCopySize, segmentBytes.length() - offset);
-			tsParser.appendBytes(segmentBytes, offset, len );
+			int len = HLSSegmentCache.read(uri, offset, chunk.array, 0, _bufferCopySize);
+			if (len <= 0)
+				break;
+			tsParser.appendBytes(chunk, 0, len );
 			pts = tsParser.pts;
 			offset += len;
 		}
@@ -1274,9 +1309,7 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 				{
 					if (!req.downloadComplete) continue;
 					
-					ByteArray ba = new ByteArray(HLSSegmentCache.getByteArray(req.segment.uri));
-					
-					long pts = getPTS(ba, req.segment.uri);
+					long pts = getPTS(req.segment.uri);
 					
 					if (req.type == BestEffortRequest.TYPE_VIDEO) // check the base - i should be 0
 					{
@@ -1298,8 +1331,7 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 						startTimeWitnesses.put(req.segment.uri, req.segment.startTime);
 						
 						// Have to get the PTS for the alt audio separately.
-						ByteArray baa = new ByteArray(HLSSegmentCache.getByteArray(req.segment.altAudioSegment.uri));
-						pts = getPTS(baa, req.segment.altAudioSegment.uri);
+						pts = getPTS(req.segment.altAudioSegment.uri);
 						
 						req.segment.altAudioSegment.startTime = (double)((double)pts / (double)90000);
 						startTimeWitnesses.put(req.segment.altAudioSegment.uri, req.segment.altAudioSegment.startTime);
@@ -1458,10 +1490,12 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 						if (currentManifest.instance() == baseManifest.instance())
 						{
 							// I'm not sure this should ever happen, as if you are in the base manifest, there aren't any other quality levels.
+							replacingManifest(baseManifest, newManifest);
 							baseManifest = newManifest; 
 						}
 						else
 						{
+							replacingManifest(baseManifest.streams.get(newManifest.quality).manifest, newManifest);
 							baseManifest.streams.get(newManifest.quality).manifest = newManifest;
 						}
 						
@@ -1565,6 +1599,7 @@ public class StreamHandler implements ManifestParser.ReloadEventListener, Manife
 					}
 					else
 					{
+						replacingManifest(baseManifest.playLists.get(newManifest.quality).manifest, newManifest);
 						baseManifest.playLists.get(newManifest.quality).manifest = newManifest;
 						altAudioIndex = newManifest.quality;
 						altAudioManifest = newManifest;
@@ -1,5 +1,6 @@
 package com.kaltura.hlsplayersdk.cache;
 
+import java.io.File;
 import java.util.Collection;
 import java.nio.ByteBuffer;
 import java.nio.charset.Charset;
@@ -19,6 +20,7 @@ import com.loopj.android.http.*;
 public class HLSSegmentCache 
 {	
 	protected static long targetSize = 16*1024*1024; // 16mb segment cache.
+	protected static long diskTargetSize = 128*1024*1024; // 128mb of evicted segments on disk.
 	protected static long minimumExpireAge = 5000; // Keep everything touched in last 5 seconds.
 	private static final int minimumTimeBetweenProgressNotifications = 100; // Keep us from spamming progress notifications
 
@@ -37,6 +39,54 @@ public class HLSSegmentCache
 	
 	public static Context context = null;
 	
+	// Native segment store. Completed segments are handed over once so the
+	// demuxer can read them without calling back into Java for every packet.
+	// keepOnDisk says whether the segment may go to the disk tier once evicted.
+	private static native void storeNative(String segmentUri, byte[] data, int size, boolean keepOnDisk);
+	static native void appendNative(String segmentUri, byte[] data, int offset, int length, int capacity);
+	static native void removeNative(String segmentUri);
+	static native void failNative(String segmentUri);
+	private static native int readNative(String segmentUri, long offset, byte[] output, int outputOffset, int size);
+	
+	// Disk tier behind the native store. Evicted segments are written there,
+	// and restoreNative puts one back in the native store instead of
+	// downloading it again, returning its size or -1 if it isn't on disk.
+	private static native void initDiskCacheNative(String dir, long maxSize);
+	static native long restoreNative(String segmentUri);
+	
+	static void publishToNative(SegmentCacheItem sci)
+	{
+		byte[] data;
+		synchronized (segmentCache)
+		{
+			data = sci.data;
+			if (data == null)
+			{
+				// Nothing to hand over, unless native already has it.
+				if (sci.storedSize == 0) failNative(sci.uri);
+				return;
+			}
+		}
+		
+		// Decrypt everything up front; the native side only sees clear bytes.
+		// This and the copy take a while, so other segments' readers mustn't
+		// wait on the cache lock for them.
+		int size = sci.prepareForStore(data);
+		// Segments encrypted as a whole are clear from here on; keep them off
+		// disk. SAMPLE-AES segments are stored as downloaded.
+		storeNative(sci.uri, data, size, !sci.hasCrypto());
+		
+		// Native has its own copy now, and serves Java readers too.
+		synchronized (segmentCache)
+		{
+			if (sci.data == data)
+			{
+				sci.storedSize = size;
+				sci.data = null;
+			}
+		}
+	}
+	
 	public static AsyncHttpClient httpClient()
 	{
 		synchronized (asyncHttpClient)
@@ -56,26 +106,6 @@ public class HLSSegmentCache
 		}
 	}
 	
-	static public int getCryptoId(final String segmentUri)
-	{
-		initialize();
-		synchronized (segmentCache)
-		{
-			SegmentCacheEntry sce = segmentCache.get(segmentUri);
-			if (sce != null)
-			{
-				SegmentCacheItem sci = sce.getItem(segmentUri);
-				Log.i("getCryptoId", "Found Id (" + sci.cryptoHandle + ") for URI: " + segmentUri );
-				return sci.cryptoHandle;
-			}
-			else
-			{
-				Log.i("getCryptoId", "Found no existing sce for URI: " + segmentUri );
-				return -1;
-			}
-		}
-	}
-	
 	static public SegmentCacheEntry populateCache(String [] segmentUris)
 	{
 		if (segmentUris == null || segmentUris.length == 0)
@@ -114,6 +144,36 @@ public class HLSSegmentCache
 		return sce;
 	}
 	
+	/**
+	 * Called from native code when a reader misses the native segment store.
+	 * Starts the download if needed; the native reader sleeps until
+	 * storeNative or failNative is called for the uri.
+	 */
+	static public void request(String segmentUri)
+	{
+		initialize();
+		
+		SegmentCacheEntry sce = populateCache( new String [] { segmentUri } );
+		SegmentCacheItem sci = (sce != null) ? sce.getItem(segmentUri) : null;
+		if (sci == null)
+		{
+			failNative(segmentUri);
+			return;
+		}
+		
+		synchronized (segmentCache)
+		{
+			if (sci.running)
+			{
+				sce.setWaiting(segmentUri, true);
+				return;
+			}
+		}
+		
+		// Already finished; make sure native has seen the outcome.
+		publishToNative(sci);
+	}
+	
 	static public void notifyStored(SegmentCacheEntry sce)
 	{
 		synchronized (segmentCache)
@@ -149,6 +209,7 @@ public class HLSSegmentCache
 			segmentCache = new ConcurrentHashMap<String, SegmentCacheEntry>();
 			context = HLSPlayerViewController.currentController.getContext();
 			if (context == null) Log.e("HLS Cache", "Context is null!!!");
+			else initDiskCacheNative(new File(context.getCacheDir(), "hls_segments").getAbsolutePath(), diskTargetSize);
 		}
 	}
 	
@@ -220,14 +281,58 @@ public class HLSSegmentCache
 	 */
 	static public void precache(ManifestSegment segment, boolean forceWait, SegmentCachedListener segmentCachedListener, Handler callbackHandler)
 	{
+		// Byte ranges must be known before the download is scheduled.
+		registerByteRange(segment);
+		if (segment.altAudioSegment != null) registerByteRange(segment.altAudioSegment);
+		
 		if (segment.altAudioSegment != null)
 		{
-			HLSSegmentCache.precache(new String[] {segment.uri, segment.altAudioSegment.uri}, new int [] { segment.cryptoId, segment.altAudioSegment.cryptoId }, forceWait, segmentCachedListener, callbackHandler);
+			HLSSegmentCache.precache(new String[] {segment.uri, segment.altAudioSegment.uri}, new int [] { segment.segmentCryptoId(), segment.altAudioSegment.segmentCryptoId() }, forceWait, segmentCachedListener, callbackHandler);
+			setDeadline(segment.altAudioSegment.uri, segment.altAudioSegment.startTime);
 		}
 		else
 		{
-			HLSSegmentCache.precache(segment.uri, segment.cryptoId, forceWait, segmentCachedListener, callbackHandler);
+			HLSSegmentCache.precache(segment.uri, segment.segmentCryptoId(), forceWait, segmentCachedListener, callbackHandler);
 		}
+		setDeadline(segment.uri, segment.startTime);
+	}
+	
+	/**
+	 * Byte ranges of segments cut from a larger resource, by segment uri.
+	 */
+	private static Map<String, ManifestSegment> byteRanges = new ConcurrentHashMap<String, ManifestSegment>();
+	
+	static void registerByteRange(ManifestSegment segment)
+	{
+		if (segment.byteRangeStart != -1 && segment.resourceUri != null)
+			byteRanges.put(segment.uri, segment);
+	}
+	
+	static void applyByteRange(SegmentCacheItem sci)
+	{
+		ManifestSegment segment = byteRanges.get(sci.uri);
+		if (segment == null) return;
+		sci.resourceUri = segment.resourceUri;
+		sci.rangeStart = segment.byteRangeStart;
+		sci.rangeEnd = segment.byteRangeEnd;
+	}
+	
+	static void forgetByteRange(String segmentUri)
+	{
+		byteRanges.remove(segmentUri);
+	}
+	
+	/**
+	 * Tell the download scheduler when a segment will be needed, in seconds
+	 * of stream time. Sooner deadlines are fetched first.
+	 */
+	static public void setDeadline(String segmentUri, double time)
+	{
+		initialize();
+		
+		SegmentCacheEntry sce = segmentCache.get(segmentUri);
+		SegmentCacheItem sci = (sce != null) ? sce.getItem(segmentUri) : null;
+		if (sci != null) SegmentDownloadScheduler.get().setDeadline(sci, time);
 	}
 	
 	/**
@@ -274,11 +379,7 @@ public class HLSSegmentCache
 			sce = populateCache( new String [] { segmentUri });
 		}
 		waitForLoad(sce);
-		SegmentCacheItem sci = sce.getItem(segmentUri);
-		if(sci.forceSize != -1)
-			return sci.forceSize;
-		if (sci.data == null) return 0;
-		return sci.data.length;
+		return sce.dataSize(segmentUri);
 	}
 	
 	private static long lastTime = System.currentTimeMillis();
@@ -350,12 +451,7 @@ public class HLSSegmentCache
 		while(sce.isRunning())
 		{
 			postProgressUpdate(false);
-			try {
-				Thread.sleep(30);
-				Thread.yield();
-			} catch (InterruptedException e) {
-				// Don't care.
-			}
+			sce.waitForChange(minimumTimeBetweenProgressNotifications);
 		}
 		sce.setWaiting(false);
 		long timerElapsed = System.currentTimeMillis() - timerStart;
@@ -389,116 +485,49 @@ public static String bytesToHex(ByteBuffer bytes) {
 	 * @param segmentUri URI identifying the segment.
 	 * @param offset Offset into the segment.
 	 * @param size Number of bytes to read.
-	 * @param output Array pre-sized to at least size, to which data is written.
+	 * @param output Buffer with at least size bytes remaining, to which data is written.
 	 * @return Bytes read.
 	 */
 	static public long read(String segmentUri, long offset, long size, ByteBuffer output)
 	{
-		boolean adjusted = false;
-
-		//Log.i("HLS Cache", "Reading " + segmentUri + " offset=" + offset + " size=" + size + " output.capacity()=" + output.capacity());
-		
-		initialize();
+		int count = (int)Math.min(size, output.remaining());
 		
-		// Do we have a cache entry for the segment? Populate if it doesn't exist.
-		SegmentCacheEntry sce = populateCache( new String[] { segmentUri });
-		
-		// Sanity check.
-		if(sce == null)
+		// Read straight into the buffer's array if it has one; otherwise go
+		// through this thread's scratch array.
+		if (output.hasArray())
 		{
-			Log.e("HLS Cache", "Failed to populate cache! Aborting...");
-			return 0;
+			int got = read(segmentUri, offset, output.array(), output.arrayOffset() + output.position(), count);
+			output.position(output.position() + got);
+			return got;
 		}
 		
-		waitForLoad(sce);
-		
-		if (sce.dataSize(segmentUri) == 0)
+		byte[] scratch = readScratch.get();
+		if (scratch == null || scratch.length < count)
 		{
-			Log.e("HLS Cache", "Segment Data is nonexistant or empty");
-			return 0;
+			scratch = new byte[count];
+			readScratch.set(scratch);
 		}
 		
-		synchronized(segmentCache)
-		{
-			SegmentCacheItem sci = sce.getItem(segmentUri);
-
-			// How many bytes can we serve?
-			if(offset + size > sci.data.length)
-			{
-				long newSize = sci.data.length - offset;
-				Log.i("HLS Cache", "Adjusting size to " + newSize + " from " + size + " offset=" + offset + " data.length=" + sci.data.length + " for file:" + sci.uri);
-				size = newSize;
-				adjusted = true;
-			}
-			
-			if(size < 0)
-			{
-				Log.i("HLS Cache", "Couldn't return any bytes.");
-				return 0;
-			}
-
-			// Ensure decrypted.
-			sci.ensureDecryptedTo(offset + size);
-
-			// If we have decrypted to the end, look for padding and adjust length.
-			if(sci.isFullyDecrypted() && sci.hasCrypto() && sci.forceSize == -1)
-			{
-				// Look for padding.
-				byte padByte = sci.data[sci.data.length - 1];
-
-				boolean isPadded = true;
-				for(int i=sci.data.length-padByte; i<sci.data.length; i++)
-				{
-					if(sci.data[i] == padByte)
-						continue;
-
-					isPadded = false;
-					break;
-				}
-
-				if(isPadded)
-				{
-					// Note new size.
-					sci.forceSize = sci.data.length - padByte;
-					Log.i("HLS Cache", "Forcing segment size to " + sci.forceSize);
-				}
-			} 
-			
-			// Truncate length based on forced size.
-			if(sci.forceSize != -1)
-			{
-				if(offset + size >= sci.forceSize)
-				{
-					size = sci.forceSize - offset;
-					Log.i("HLS Cache", "Truncating size due to padding to " + size);
-				}
-			}
-			
-			// Copy the available bytes.
-			output.put(sci.data, (int)offset, (int)size);
-			
-//			if(adjusted)
-//			{
-//				try
-//				{
-//					Log.i("HLS Cache", "Saw bytes: " + bytesToHex(output));
-//				}
-//				catch(Exception e)
-//				{
-//					Log.i("HLS Cache", "Failed to dump hex bytes");
-//				}
-//			}
-
-			// Return how much we read.
-			return size;			
-		}
+		int got = read(segmentUri, offset, scratch, 0, count);
+		output.put(scratch, 0, got);
+		return got;
 	}
 	
+	private static ThreadLocal<byte[]> readScratch = new ThreadLocal<byte[]>();
 	
-	static public byte[] getByteArray(String segmentUri)
+	/**
+	 * Read from segment into a caller-supplied array.
+	 * @param segmentUri URI identifying the segment.
+	 * @param offset Offset into the segment.
+	 * @param output Array to which data is written.
+	 * @param outputOffset Where in output to start writing.
+	 * @param size Number of bytes to read.
+	 * @return Bytes read; 0 at the end of the segment or if it can't be loaded.
+	 */
+	static public int read(String segmentUri, long offset, byte[] output, int outputOffset, int size)
 	{
-		boolean adjusted = false;
-
+		//Log.i("HLS Cache", "Reading " + segmentUri + " offset=" + offset + " size=" + size);
+		
 		initialize();
 		
 		// Do we have a cache entry for the segment? Populate if it doesn't exist.
@@ -508,50 +537,26 @@ public static String bytesToHex(ByteBuffer bytes) {
 		if(sce == null)
 		{
 			Log.e("HLS Cache", "Failed to populate cache! Aborting...");
-			return null;
+			return 0;
 		}
 		
 		waitForLoad(sce);
 		
-		if (sce.dataSize() == 0)
+		if (sce.dataSize(segmentUri) == 0)
 		{
 			Log.e("HLS Cache", "Segment Data is nonexistant or empty");
-			return null;
+			return 0;
 		}
 		
-		synchronized(segmentCache)
+		// Completed segments live in the native store.
+		int got = readNative(segmentUri, offset, output, outputOffset, size);
+		if (got <= 0)
 		{
-			SegmentCacheItem sci = sce.getItem(segmentUri);
-
-			// Ensure decrypted.
-			sci.ensureDecryptedTo(sci.data.length);
-
-			// If we have decrypted to the end, look for padding and adjust length.
-			if(sci.isFullyDecrypted() && sci.hasCrypto() && sci.forceSize == -1)
-			{
-				// Look for padding.
-				byte padByte = sci.data[sci.data.length - 1];
-
-				boolean isPadded = true;
-				for(int i=sci.data.length-padByte; i<sci.data.length; i++)
-				{
-					if(sci.data[i] == padByte)
-						continue;
-
-					isPadded = false;
-					break;
-				}
-
-				if(isPadded)
-				{
-					// Note new size.
-					sci.forceSize = sci.data.length - padByte;
-					Log.i("HLS Cache", "Forcing segment size to " + sci.forceSize);
-				}
-			} 
-
-			return sci.data;
+			Log.i("HLS Cache", "Couldn't return any bytes.");
+			return 0;
 		}
+		
+		return got;
 	}
 	
 	static public String cacheInfo()
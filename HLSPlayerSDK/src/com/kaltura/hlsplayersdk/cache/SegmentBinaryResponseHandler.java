@@ -1,6 +1,13 @@
 package com.kaltura.hlsplayersdk.cache;
 
+import java.io.IOException;
+import java.io.InputStream;
+import java.util.Arrays;
+
 import org.apache.http.Header;
+import org.apache.http.HttpEntity;
+import org.apache.http.HttpResponse;
+import org.apache.http.StatusLine;
 
 import android.util.Log;
 
@@ -10,11 +17,25 @@ public class SegmentBinaryResponseHandler extends AsyncHttpResponseHandler {
 
 	public SegmentCacheItem entry = null;
 	
+	// Everything this request fetches. More than one item means adjacent byte
+	// ranges of one resource, laid end to end in the response.
+	private SegmentCacheItem [] items = null;
+	private boolean [] delivered = null;
+	
 	private boolean succeeded = false;
 	
+	private static final int readChunkSize = 16 * 1024;
+	
 	public SegmentBinaryResponseHandler(SegmentCacheItem sci)
 	{
-		entry = sci;
+		this(new SegmentCacheItem [] { sci });
+	}
+	
+	public SegmentBinaryResponseHandler(SegmentCacheItem [] sci)
+	{
+		items = sci;
+		entry = sci[0];
+		delivered = new boolean[sci.length];
 	}
 	
 	@Override
@@ -32,15 +53,150 @@ public class SegmentBinaryResponseHandler extends AsyncHttpResponseHandler {
 			}
 			return; // This is a hack because sometimes, loopj likes to call onFailure after it's called onSuccess
 		}
-		Log.e("SegmentBinaryResponseHandler.onFailure", "Failed to download '" + entry.uri + "'! " + statusCode);
-		entry.postOnSegmentFailed(statusCode);
+		for (int i = 0; i < items.length; ++i)
+		{
+			if (delivered[i]) continue;
+			Log.e("SegmentBinaryResponseHandler.onFailure", "Failed to download '" + items[i].uri + "'! " + statusCode);
+			items[i].postOnSegmentFailed(statusCode);
+		}
 	}
 
 	@Override
 	public void onSuccess(int statusCode, Header[] headers, byte[] responseData) {
 		Log.i("SegmentBinaryResponseHandler.onSuccess", "Download Succeeded: " + entry.uri);
 		succeeded = true;
-		entry.postSegmentSucceeded(statusCode, responseData);
+		
+		if (!entry.hasByteRange())
+		{
+			entry.postSegmentSucceeded(statusCode, responseData);
+			return;
+		}
+		
+		// Ranges that weren't streamed; cut them out of the whole body.
+		long skip = (statusCode == 206) ? 0 : entry.rangeStart; // A 200 means the server ignored our Range header.
+		for (int i = 0; i < items.length; ++i)
+		{
+			if (delivered[i]) continue;
+			delivered[i] = true;
+			
+			long from = skip + items[i].rangeStart - entry.rangeStart;
+			long to = from + items[i].rangeLength();
+			if (statusCode >= 300 || responseData == null || to > responseData.length)
+				items[i].postOnSegmentFailed(statusCode);
+			else
+				items[i].postSegmentSucceeded(200, Arrays.copyOfRange(responseData, (int)from, (int)to));
+		}
+	}
+	
+	private void deliver(int i, final byte [] body)
+	{
+		delivered[i] = true;
+		final SegmentCacheItem sci = items[i];
+		postRunnable(new Runnable() {
+			public void run()
+			{
+				sci.postSegmentSucceeded(200, body);
+			}
+		});
+	}
+	
+	/**
+	 * Stream the body into the cache items as it arrives, so the demuxer can
+	 * start on a segment before it finishes downloading. Falls back to loopj's
+	 * buffering when the size isn't known up front.
+	 */
+	@Override
+	public void sendResponseMessage(HttpResponse response) throws IOException {
+		if (Thread.currentThread().isInterrupted()) return;
+		
+		StatusLine status = response.getStatusLine();
+		HttpEntity entity = response.getEntity();
+		long contentLength = (entity != null) ? entity.getContentLength() : -1;
+		boolean ranged = entry.hasByteRange();
+		
+		// Where our bytes sit in the body. A server that ignores the Range
+		// header sends the whole resource with a 200.
+		long skip = 0;
+		long wanted = contentLength;
+		int [] lengths = new int[items.length];
+		if (ranged)
+		{
+			if (status.getStatusCode() != 206) skip = entry.rangeStart;
+			wanted = 0;
+			for (int i = 0; i < items.length; ++i)
+			{
+				lengths[i] = items[i].rangeLength();
+				wanted += lengths[i];
+			}
+			if (contentLength < skip + wanted) contentLength = -1;
+		}
+		else
+		{
+			lengths[0] = (int)contentLength;
+		}
+		
+		byte[][] bodies = new byte[items.length][];
+		boolean streamable = status.getStatusCode() < 300 && contentLength > 0 && contentLength <= Integer.MAX_VALUE;
+		for (int i = 0; i < items.length && streamable; ++i)
+		{
+			bodies[i] = items[i].beginPartial(lengths[i]);
+			streamable = (bodies[i] != null);
+		}
+		
+		if (!streamable)
+		{
+			super.sendResponseMessage(response);
+			return;
+		}
+		
+		InputStream in = entity.getContent();
+		if (in == null) throw new IOException("No content for " + entry.uri);
+		
+		byte[] chunk = new byte[readChunkSize];
+		long position = 0;
+		long end = skip + wanted;
+		int current = 0;
+		int currentStart = 0;
+		try
+		{
+			while (position < end && !Thread.currentThread().isInterrupted())
+			{
+				int n = in.read(chunk, 0, (int)Math.min(chunk.length, end - position));
+				if (n == -1) break;
+				
+				int used = (position < skip) ? (int)Math.min(n, skip - position) : 0;
+				while (used < n)
+				{
+					int offset = (int)(position + used - skip) - currentStart;
+					int take = Math.min(n - used, lengths[current] - offset);
+					items[current].receivePartial(chunk, used, offset, take);
+					used += take;
+					
+					// Hand finished ranges over now rather than when the whole request is done.
+					if (ranged && offset + take == lengths[current])
+					{
+						deliver(current, bodies[current]);
+						currentStart += lengths[current];
+						if (++current < items.length)
+							items[current].downloadStartTime = System.currentTimeMillis();
+					}
+				}
+				
+				position += n;
+				sendProgressMessage((int)Math.max(0, position - skip), (int)wanted);
+			}
+		}
+		finally
+		{
+			AsyncHttpClient.silentCloseInputStream(in);
+		}
+		
+		if (Thread.currentThread().isInterrupted()) return;
+		
+		if (position < end)
+			throw new IOException("Connection closed after " + (position - skip) + " of " + wanted + " bytes: " + entry.uri);
+		
+		sendSuccessMessage(status.getStatusCode(), response.getAllHeaders(), ranged ? null : bodies[0]);
 	}
 	
     @Override
@@ -51,7 +207,20 @@ public class SegmentBinaryResponseHandler extends AsyncHttpResponseHandler {
     @Override
     public void onProgress(int bytesWritten, int totalSize) {
     	//Log.i("SegmentBinaryResponseHandler.onProgress", "Bytes Written:" + bytesWritten + " Total Size:" + totalSize + " : " + entry.uri);
-        entry.updateProgress(bytesWritten, totalSize);
+    	if (items.length == 1)
+    	{
+    		entry.updateProgress(bytesWritten, totalSize);
+    		return;
+    	}
+    	
+    	// Split the progress of a coalesced request between its ranges.
+    	long start = 0;
+    	for (SegmentCacheItem sci : items)
+    	{
+    		int length = sci.rangeLength();
+    		sci.updateProgress((int)Math.max(0, Math.min(length, bytesWritten - start)), length);
+    		start += length;
+    	}
     }
 
     @Override
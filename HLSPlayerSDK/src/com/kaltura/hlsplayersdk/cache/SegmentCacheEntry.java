@@ -8,6 +8,10 @@ import android.util.Log;
 import com.kaltura.hlsplayersdk.HLSPlayerViewController;
 import com.kaltura.hlsplayersdk.events.OnErrorListener;
 import com.loopj.android.http.AsyncHttpClient;
+import com.loopj.android.http.RequestHandle;
+
+import org.apache.http.Header;
+import org.apache.http.message.BasicHeader;
 
 
 /*
@@ -30,7 +34,8 @@ public class SegmentCacheEntry
 		for (int i = 0; i < uris.length; ++i)
 		{
 			mItems[i] = new SegmentCacheItem(this);
-			mItems[i].uri = uris[i];			
+			mItems[i].uri = uris[i];
+			HLSSegmentCache.applyByteRange(mItems[i]);
 		}
 		
 		registerSegmentCachedListener(null, null);
@@ -40,7 +45,7 @@ public class SegmentCacheEntry
 	{
 		if (cryptoIds.length != mItems.length) return;
 		for (int i = 0; i < cryptoIds.length; ++i)
-			mItems[i].cryptoHandle = cryptoIds[i];
+			mItems[i].setCryptoHandle(cryptoIds[i]);
 	}
 	
 	public long lastTouchedMillis = 0;
@@ -53,7 +58,11 @@ public class SegmentCacheEntry
 	public void clear()
 	{
 		for (int i = 0; i < mItems.length; ++i)
+		{
 			mItems[i].data = null;
+			mItems[i].storedSize = 0;
+			HLSSegmentCache.removeNative(mItems[i].uri);
+		}
 	}
 	
 	public void cancel()
@@ -65,7 +74,11 @@ public class SegmentCacheEntry
 	public void removeMe(Map<String, SegmentCacheEntry> segmentCache)
 	{
 		for (int i = 0; i < mItems.length; ++i)
+		{
 			segmentCache.remove(mItems[i].uri);
+			HLSSegmentCache.forgetByteRange(mItems[i].uri);
+			mItems[i].releaseCrypto();
+		}
 	}
 	
 	public boolean matchUri(String uri)
@@ -95,9 +108,25 @@ public class SegmentCacheEntry
 	
 	private void initiateDownload(final SegmentCacheItem sci)
 	{
-		if (dataSize() != 0) return; // We don't want to initiate a completed download
+		if (dataSize(sci.uri) != 0) return; // We don't want to initiate a completed download
+		if (sci.restoreFromDisk()) return; // Evicted earlier; no need to go back to the network.
 		sci.running = true;
 		sci.downloadStartTime = System.currentTimeMillis();
+		SegmentDownloadScheduler.get().enqueue(sci);
+	}
+	
+	/**
+	 * Put a request on the wire. Called by the SegmentDownloadScheduler when
+	 * the items' turn comes. More than one item means adjacent byte ranges of
+	 * the same resource, fetched with a single range request.
+	 */
+	static void startRequest(final SegmentCacheItem [] items)
+	{
+		final SegmentCacheItem sci = items[0];
+		final String url = sci.hasByteRange() ? sci.resourceUri : sci.uri;
+		final Header [] headers = sci.hasByteRange()
+				? new Header[] { new BasicHeader("Range", "bytes=" + sci.rangeStart + "-" + (items[items.length - 1].rangeEnd - 1)) }
+				: null;
 		
 		HLSPlayerViewController.postToHTTPResponseThread( new Runnable()
 		{
@@ -109,7 +138,9 @@ public class SegmentCacheEntry
 				else Log.i("HLS Cache", "Using Asynchronous HTTP Client");
 				
 				httpClient.setMaxRetriesAndTimeout(0, httpClient.getConnectTimeout());
-				sci.request = httpClient.get(HLSSegmentCache.context, sci.uri, new SegmentBinaryResponseHandler(sci));
+				RequestHandle request = httpClient.get(HLSSegmentCache.context, url, headers, null, new SegmentBinaryResponseHandler(items));
+				for (SegmentCacheItem item : items)
+					item.request = request;
 
 			}
 		});
@@ -139,6 +170,30 @@ public class SegmentCacheEntry
 		return false;		
 	}
 	
+	/**
+	 * Sleep until an item finishes, fails or is cancelled, or until ms elapse.
+	 */
+	public void waitForChange(long ms)
+	{
+		synchronized (selfRef)
+		{
+			if (!isRunning()) return;
+			try {
+				selfRef.wait(ms);
+			} catch (InterruptedException e) {
+				// Don't care.
+			}
+		}
+	}
+	
+	public void notifyLoadWaiters()
+	{
+		synchronized (selfRef)
+		{
+			selfRef.notifyAll();
+		}
+	}
+	
 	public boolean isWaiting()
 	{
 		if (mItems == null) return false;
@@ -154,7 +209,7 @@ public class SegmentCacheEntry
 	public void setWaiting(boolean waiting)
 	{
 		for (int i = 0; i < mItems.length; ++i)
-			mItems[i].waiting = waiting;
+			SegmentDownloadScheduler.get().setWaiting(mItems[i], waiting);
 	}
 	
 	public void setWaiting(String uri, boolean waiting)
@@ -162,7 +217,7 @@ public class SegmentCacheEntry
 		for (int i = 0; i < mItems.length; ++i)
 		{
 			if (mItems[i].uri.equals(uri))
-				mItems[i].waiting = waiting;
+				SegmentDownloadScheduler.get().setWaiting(mItems[i], waiting);
 		}
 	}
 	
@@ -187,11 +242,7 @@ public class SegmentCacheEntry
 		for (SegmentCacheItem item : mItems)
 		{
 			if (item.uri.equals(uri))
-			{
-				if (item.data != null)
-					return item.data.length;
-				return 0;
-			}
+				return item.dataSize();
 		}
 		return 0;
 	}
@@ -200,10 +251,7 @@ public class SegmentCacheEntry
 	{
 		int ds = 0;
 		for (int i = 0; i < mItems.length; ++i)
-		{
-			if (mItems[i].data != null)
-				ds += mItems[i].data.length;
-		}
+			ds += mItems[i].dataSize();
 		return ds;
 	}
 	
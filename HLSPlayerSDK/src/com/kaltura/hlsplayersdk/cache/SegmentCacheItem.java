@@ -10,29 +10,80 @@ import com.loopj.android.http.*;
 public class SegmentCacheItem {
 	public String uri;
 	public byte[] data;
+	
+	// Once the segment has been handed to the native store, data is dropped
+	// and this is its size there. Guarded by the segment cache lock.
+	protected int storedSize = 0;
 	public boolean running = false;
 	public boolean waiting = false;
+	
+	// Scheduling state, owned by the SegmentDownloadScheduler. deadline is the
+	// stream time the segment is needed at, if known.
+	protected double deadline = Double.MAX_VALUE;
+	protected long scheduleSequence = 0;
+	protected int scheduledConcurrency = 0;
+	protected SegmentCacheItem [] requestGroup = null;
+	
+	// If this segment is a byte range of a larger resource: the resource and
+	// the range, end exclusive.
+	protected String resourceUri = null;
+	protected long rangeStart = -1;
+	protected long rangeEnd = -1;
+	
+	public boolean hasByteRange()
+	{
+		return resourceUri != null && rangeStart >= 0 && rangeEnd > rangeStart;
+	}
+	
+	public int rangeLength()
+	{
+		return (int)(rangeEnd - rangeStart);
+	}
 	public long lastTouchedMillis;
 	public long downloadStartTime = 0;
 	public long downloadCompletedTime = 0;
 	public long forceSize = -1;
 
-	// If >= 0, ID of a crypto context on the native side.
-	protected int cryptoHandle = -1;
+	// If >= 0, ID of a crypto context on the native side. We hold a
+	// reference to it until the item leaves the cache. Cleared under
+	// decryptLock when released.
+	protected volatile int cryptoHandle = -1;
 
 	// All bytes < decryptHighWaterMark are descrypted; all >=  are still 
 	// encrypted. This allows us to avoid duplicating every segment.
-	protected long decryptHighWaterMark = 0;
+	protected volatile long decryptHighWaterMark = 0;
 	private boolean fullyDecrypted = false;
 	
+	// Decryption runs one call at a time under decryptLock. While a call is
+	// running, bytes below decryptClaim are being rewritten in place.
+	private final Object decryptLock = new Object();
+	private long decryptClaim = 0;
+	
+	// CBC chain (last cipher block) from the previous decrypt call. The
+	// native context may be shared with other segments, so it can't keep it.
+	private final byte[] decryptChain = new byte[16];
+	
+	// Bytes of a download still in flight. Kept across retries, so that the
+	// prefix we already decrypted (and published to native) stays valid.
+	// The marks below are guarded by this item's monitor.
+	protected byte[] partialData = null;
+	private int publishedHighWaterMark = 0;
+	private int receivedHighWaterMark = 0;
+	private boolean decryptQueued = false;
+	
+	// Hand partial data to native in steps of at least this many bytes.
+	private static final int minimumPartialPublish = 32 * 1024;
+	
 	// We will retry 3 times before giving up
 	private static final int maxRetries = 3;
 	private int curRetries = 0;
 	
 	
 	public static native int allocAESCryptoState(byte[] key, byte[] iv);
+	public static native int allocSampleAESCryptoState(byte[] key, byte[] iv);
+	public static native boolean retainCryptoState(int id);
 	public static native void freeCryptoState(int id);
-	public static native long decrypt(int cryptoHandle, byte[] data, long start, long length);
+	public static native long decrypt(int cryptoHandle, byte[] chain, byte[] data, long start, long length);
 	
 	public RequestHandle request = null;
 	
@@ -51,8 +102,15 @@ public class SegmentCacheItem {
 		if (running)
 		{
 			Log.i("HLS Cache", "Cancelling " + uri);
-			running = false;
-			waiting = false;
+			SegmentDownloadScheduler.get().finished(this, 0);
+			synchronized (this)
+			{
+				running = false;
+				waiting = false;
+				publishedHighWaterMark = 0;
+				HLSSegmentCache.failNative(uri);
+			}
+			cacheEntry.notifyLoadWaiters();
 		}
 		
 	}
@@ -64,29 +122,87 @@ public class SegmentCacheItem {
 
 	public void setCryptoHandle(int handle)
 	{
-		// If we already have a crypto handle, I don't think we want to reset it
-		if (cryptoHandle == -1)
-			cryptoHandle = handle;
-		else if (handle != cryptoHandle)
-			Log.i("setCryptoHandle", "Tried to change an existing cryptoHandle (" + cryptoHandle + ") to (" + handle + ")");
+		synchronized (decryptLock)
+		{
+			// If we already have a crypto handle, I don't think we want to reset it
+			if (cryptoHandle == -1)
+			{
+				if (handle != -1 && retainCryptoState(handle))
+					cryptoHandle = handle;
+			}
+			else if (handle != cryptoHandle)
+				Log.i("setCryptoHandle", "Tried to change an existing cryptoHandle (" + cryptoHandle + ") to (" + handle + ")");
+		}
+	}
+
+	/**
+	 * Drop our reference to the crypto context once the item has left the
+	 * cache. Anything still decrypting with it fails instead of using a
+	 * recycled key.
+	 */
+	void releaseCrypto()
+	{
+		synchronized (decryptLock)
+		{
+			if (cryptoHandle != -1)
+			{
+				freeCryptoState(cryptoHandle);
+				cryptoHandle = -1;
+			}
+		}
 	}
 
-	public void ensureDecryptedTo(long offset)
+	/**
+	 * Decrypt all of a downloaded segment and strip its padding. Returns how
+	 * many bytes of buffer are segment data.
+	 */
+	int prepareForStore(byte[] buffer)
+	{
+		decryptTo(buffer, buffer.length);
+		detectPadding(buffer);
+		return (int)(forceSize != -1 ? forceSize : buffer.length);
+	}
+	
+	/**
+	 * Bytes of the segment we have, in Java or in the native store.
+	 */
+	public int dataSize()
+	{
+		byte[] d = data;
+		return (d != null) ? d.length : storedSize;
+	}
+	
+	private void decryptTo(byte[] buffer, long offset)
 	{
 		if(cryptoHandle == -1)
 			return;
-//		if (offset == 188)
-//		{
-//			Log.i("HLS Cache", "Decrypting " + uri);
-//			Log.i("HLS Cache", "  to " + offset);
-//			Log.i("HLS Cache", "  first bytes = " + data[0] + data[1] + data[2] + data[3] + data[4]);
-//		}
-		long delta = offset - decryptHighWaterMark;
-//		if (offset == 188)
-//			Log.i("HLS Cache", "  delta = " + delta + " | HighWaterMark = " + decryptHighWaterMark);
 		
-		if (delta > 0)
-			decryptHighWaterMark = decrypt(cryptoHandle, data, decryptHighWaterMark, delta);
+		synchronized (decryptLock)
+		{
+			// Released while we waited for the lock.
+			if (cryptoHandle == -1)
+				return;
+			
+			long start;
+			synchronized (this)
+			{
+				start = decryptHighWaterMark;
+				if (offset <= start) return;
+				decryptClaim = offset;
+			}
+			
+			long reached = decrypt(cryptoHandle, decryptChain, buffer, start, offset - start);
+			if (reached < 0)
+			{
+				Log.e("HLS Cache", "Failed to decrypt " + uri + " from " + start);
+				return;
+			}
+			
+			synchronized (this)
+			{
+				decryptHighWaterMark = reached;
+			}
+		}
 //		if (offset == 188)
 //		{
 //			Log.i("HLS Cache", "Decrypted to " + decryptHighWaterMark);
@@ -94,9 +210,179 @@ public class SegmentCacheItem {
 //		}
 	}
 
-	public boolean isFullyDecrypted()
+	/**
+	 * Put the segment back in the native store from the disk cache, if it's
+	 * there. The bytes on disk are unpadded and never need decrypting; Java
+	 * keeps no copy of them.
+	 */
+	public boolean restoreFromDisk()
 	{
-		return (decryptHighWaterMark == data.length);
+		long restored = HLSSegmentCache.restoreNative(uri);
+		if (restored < 0) return false;
+		
+		synchronized (HLSSegmentCache.segmentCache)
+		{
+			data = null;
+			storedSize = (int)restored;
+		}
+		decryptHighWaterMark = restored;
+		forceSize = restored;
+		downloadStartTime = downloadCompletedTime = System.currentTimeMillis();
+		Log.i("HLS Cache", "Restored " + uri + " from disk");
+		return true;
+	}
+	
+	/**
+	 * Start receiving a download of the given size progressively. Returns the
+	 * buffer the body will land in, or null if it can't be received that way.
+	 */
+	public byte[] beginPartial(int size)
+	{
+		// On a retry, keep what we already have.
+		if (partialData != null && partialData.length == size)
+			return partialData;
+		
+		if (decryptHighWaterMark > 0)
+		{
+			Log.e("HLS Cache", "Size of " + uri + " changed to " + size + " after decryption started");
+			return null;
+		}
+		
+		synchronized (this)
+		{
+			partialData = new byte[size];
+			publishedHighWaterMark = 0;
+			receivedHighWaterMark = 0;
+			return partialData;
+		}
+	}
+	
+	/**
+	 * Bytes [offset, offset + length) of the segment have arrived in chunk,
+	 * starting at chunkOffset. Clear bytes go straight to the native store;
+	 * encrypted ones are queued for the SegmentDecryptor.
+	 */
+	public void receivePartial(byte[] chunk, int chunkOffset, int offset, int length)
+	{
+		byte[] buffer;
+		int skip;
+		synchronized (this)
+		{
+			// Bytes below the decrypt mark are already clear from an earlier
+			// attempt, or are being decrypted right now; leave them alone.
+			buffer = partialData;
+			skip = (int)Math.max(0, Math.min(length, Math.max(decryptHighWaterMark, decryptClaim) - offset));
+		}
+		System.arraycopy(chunk, chunkOffset + skip, buffer, offset + skip, length - skip);
+		
+		if (!hasCrypto())
+		{
+			publishPartial(buffer, offset + length);
+			return;
+		}
+		
+		synchronized (this)
+		{
+			receivedHighWaterMark = Math.max(receivedHighWaterMark, offset + length);
+			if (decryptQueued) return;
+			decryptQueued = true;
+		}
+		SegmentDecryptor.submit(this, buffer);
+	}
+	
+	/**
+	 * Run by the SegmentDecryptor: decrypt whole AES blocks up to what has
+	 * arrived, publishing as we go, until we catch up with the download.
+	 */
+	void decryptReceived(byte[] buffer)
+	{
+		while (true)
+		{
+			long target;
+			synchronized (this)
+			{
+				target = receivedHighWaterMark & ~15;
+				if (buffer != partialData || target <= decryptHighWaterMark)
+				{
+					decryptQueued = false;
+					return;
+				}
+			}
+			
+			decryptTo(buffer, target);
+			
+			// Hold back the final block until we're done; it may be padding.
+			publishPartial(buffer, Math.min(decryptHighWaterMark, buffer.length - 16));
+		}
+	}
+	
+	/**
+	 * Hand bytes of buffer below readable to the native store, once there
+	 * are enough new ones to be worth it.
+	 */
+	private synchronized void publishPartial(byte[] buffer, long readable)
+	{
+		// Completed, failed or cancelled since; the native side has moved on.
+		if (buffer != partialData || !running)
+			return;
+		
+		if (readable - publishedHighWaterMark < minimumPartialPublish)
+			return;
+		
+		HLSSegmentCache.appendNative(uri, buffer, publishedHighWaterMark, (int)(readable - publishedHighWaterMark), buffer.length);
+		publishedHighWaterMark = (int)readable;
+	}
+	
+	/**
+	 * If an earlier attempt already decrypted a prefix of this segment, the
+	 * crypto state has moved past it; carry the clear bytes over so that
+	 * decryption picks up where it left off.
+	 */
+	private byte[] adoptPartialData(byte[] responseData)
+	{
+		byte[] partial;
+		synchronized (this)
+		{
+			partial = partialData;
+			partialData = null;
+		}
+		
+		if (partial == null || responseData == partial || decryptHighWaterMark == 0)
+			return responseData;
+		
+		if (responseData == null || responseData.length != partial.length)
+		{
+			Log.e("HLS Cache", "Retried download of " + uri + " doesn't match the decrypted prefix");
+			return responseData;
+		}
+		
+		System.arraycopy(partial, 0, responseData, 0, (int)decryptHighWaterMark);
+		return responseData;
+	}
+	
+	/**
+	 * If we have decrypted to the end, look for PKCS7 padding and note the
+	 * real size of the segment in forceSize.
+	 */
+	private void detectPadding(byte[] buffer)
+	{
+		if(decryptHighWaterMark != buffer.length || !hasCrypto() || forceSize != -1 || buffer.length == 0)
+			return;
+
+		// Look for padding.
+		int padByte = buffer[buffer.length - 1];
+		if(padByte < 1 || padByte > 16 || padByte > buffer.length)
+			return;
+
+		for(int i=buffer.length-padByte; i<buffer.length; i++)
+		{
+			if(buffer[i] != padByte)
+				return;
+		}
+
+		// Note new size.
+		forceSize = buffer.length - padByte;
+		Log.i("HLS Cache", "Forcing segment size to " + forceSize);
 	}
 	
 	private boolean retry()
@@ -108,6 +394,7 @@ public class SegmentCacheItem {
 	
 	public void postOnSegmentFailed(int statusCode)
 	{
+		SegmentDownloadScheduler.get().finished(this, 0);
 		if (retry())
 		{
 			if (statusCode == 0) HLSSegmentCache.expire();
@@ -117,7 +404,13 @@ public class SegmentCacheItem {
 		else
 		{
 			Log.i("SegmentCacheItem.postOnSegmentFailed", "Segment download failed. No More Retries Left: " + uri + " : " + statusCode);
-			running = false;
+			synchronized (this)
+			{
+				running = false;
+				publishedHighWaterMark = 0;
+				HLSSegmentCache.failNative(uri);
+			}
+			cacheEntry.notifyLoadWaiters();
 			cacheEntry.postItemFailed(this, statusCode);
 		}
 	}
@@ -126,13 +419,16 @@ public class SegmentCacheItem {
 	{
 		if (statusCode == 200)
 		{
-			data = responseData;
+			data = adoptPartialData(responseData);
+			SegmentDownloadScheduler.get().finished(this, data != null ? data.length : 0);
 			
 			downloadCompletedTime = System.currentTimeMillis();
 			Log.i("SegmentCacheItem.postSegmentSucceeded", "Got " + (responseData != null ? responseData.length + " bytes for " : " null document for " )  + uri);
 			if (waiting) updateProgress(responseData != null ? responseData.length : 0, expectedSize);
 			if (waiting) cacheEntry.updateProgress(true);
+			HLSSegmentCache.publishToNative(this); // Must land before we stop running; native readers wait on that.
 			running = false; // We are still running until we've posted the success!!!
+			cacheEntry.notifyLoadWaiters();
 			cacheEntry.postItemSucceeded(this, statusCode);
 			
 
@@ -0,0 +1,52 @@
+package com.kaltura.hlsplayersdk.cache;
+
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.ThreadFactory;
+
+import android.os.Process;
+
+/*
+ *  Small pool of threads that decrypt segments as their bytes arrive, so
+ *  neither the network threads nor the demuxer spend time in AES. CBC chains
+ *  within a segment, so each segment is decrypted by one task at a time; with
+ *  several segments in flight, they decrypt in parallel.
+ */
+
+public class SegmentDecryptor
+{
+	// Leave a core for the demuxer and decoders.
+	private static final int threadCount = Math.max(1, Math.min(4, Runtime.getRuntime().availableProcessors() - 1));
+
+	private static ExecutorService pool = Executors.newFixedThreadPool(threadCount, new ThreadFactory() {
+		private int count = 0;
+
+		public synchronized Thread newThread(final Runnable r)
+		{
+			Thread t = new Thread(new Runnable() {
+				public void run()
+				{
+					Process.setThreadPriority(Process.THREAD_PRIORITY_BACKGROUND);
+					r.run();
+				}
+			}, "SegmentDecryptor-" + (++count));
+			t.setDaemon(true);
+			return t;
+		}
+	});
+
+	/**
+	 * Decrypt whatever sci has received into buffer, publishing clear bytes
+	 * to native as it goes. The caller makes sure only one of these is queued
+	 * per item at a time.
+	 */
+	public static void submit(final SegmentCacheItem sci, final byte[] buffer)
+	{
+		pool.execute(new Runnable() {
+			public void run()
+			{
+				sci.decryptReceived(buffer);
+			}
+		});
+	}
+}
@@ -0,0 +1,272 @@
+package com.kaltura.hlsplayersdk.cache;
+
+import java.util.ArrayList;
+import java.util.Comparator;
+import java.util.HashSet;
+import java.util.PriorityQueue;
+
+import android.util.Log;
+
+/*
+ *  Decides when queued segment downloads go out on the wire. Keeps a bounded
+ *  number of requests in flight, most urgent first: anything a reader is
+ *  blocked on, then segments in order of their start time (distance from the
+ *  playhead), then everything else in request order.
+ *
+ *  The bound follows the throughput each connection actually gets. On a
+ *  high-RTT link a single connection spends most of its time waiting, so
+ *  adding one raises total throughput and we keep going; once connections
+ *  just split a saturated pipe between them, we back off.
+ *
+ *  The player uses the shared instance from get(), which puts requests on the
+ *  wire through SegmentCacheEntry and times them by the system clock. Tests
+ *  can build their own with a fake starter and clock.
+ */
+
+public class SegmentDownloadScheduler
+{
+	private static final int minConcurrent = 1;
+	private static final int maxConcurrent = 6;
+
+	// Adding a connection must improve total throughput by this much to try another.
+	private static final double growthThreshold = 1.1;
+
+	// Weight of the newest sample in the per-level throughput averages.
+	private static final double rateSmoothing = 0.3;
+
+	// Most adjacent byte ranges to fetch with one request.
+	private static final int maxCoalesced = 4;
+
+	public interface RequestStarter
+	{
+		// Called without the scheduler's lock held.
+		void startRequest(SegmentCacheItem [] group);
+	}
+
+	public interface Clock
+	{
+		long currentTimeMillis();
+	}
+
+	private static final SegmentDownloadScheduler defaultScheduler = new SegmentDownloadScheduler(
+		new RequestStarter()
+		{
+			public void startRequest(SegmentCacheItem [] group)
+			{
+				SegmentCacheEntry.startRequest(group);
+			}
+		},
+		new Clock()
+		{
+			public long currentTimeMillis()
+			{
+				return System.currentTimeMillis();
+			}
+		});
+
+	/**
+	 * The scheduler the segment cache downloads through.
+	 */
+	public static SegmentDownloadScheduler get()
+	{
+		return defaultScheduler;
+	}
+
+	private final RequestStarter starter;
+	private final Clock clock;
+
+	private int concurrent = 2;
+	private int samplesSinceChange = 0;
+	private long sequence = 0;
+
+	// Smoothed per-connection throughput (bytes/ms) seen at each concurrency level; 0 if never measured.
+	private double [] rateAtLevel = new double[maxConcurrent + 1];
+
+	private PriorityQueue<SegmentCacheItem> pending = new PriorityQueue<SegmentCacheItem>(16, new Comparator<SegmentCacheItem>() {
+		public int compare(SegmentCacheItem a, SegmentCacheItem b)
+		{
+			if (a.waiting != b.waiting) return a.waiting ? -1 : 1;
+			if (a.deadline != b.deadline) return a.deadline < b.deadline ? -1 : 1;
+			return a.scheduleSequence < b.scheduleSequence ? -1 : (a.scheduleSequence > b.scheduleSequence ? 1 : 0);
+		}
+	});
+	private HashSet<SegmentCacheItem> inFlight = new HashSet<SegmentCacheItem>();
+	private int activeRequests = 0; // A coalesced request carries several items.
+
+	private Object lock = new Object();
+
+	public SegmentDownloadScheduler(RequestStarter starter, Clock clock)
+	{
+		this.starter = starter;
+		this.clock = clock;
+	}
+
+	/**
+	 * Queue a download. It goes out as soon as its priority and the
+	 * concurrency limit allow.
+	 */
+	public void enqueue(SegmentCacheItem sci)
+	{
+		synchronized (lock)
+		{
+			if (inFlight.contains(sci) || pending.contains(sci)) return;
+			sci.scheduleSequence = sequence++;
+			pending.add(sci);
+		}
+		dispatch();
+	}
+
+	/**
+	 * Note when the item will be needed, in seconds of stream time. Earlier
+	 * deadlines go first.
+	 */
+	public void setDeadline(SegmentCacheItem sci, double deadline)
+	{
+		synchronized (lock)
+		{
+			// Take it out while its ordering changes.
+			boolean queued = pending.remove(sci);
+			sci.deadline = deadline;
+			if (queued) pending.add(sci);
+		}
+		dispatch();
+	}
+
+	/**
+	 * Note whether someone is blocked on the item. Waited-on items jump the
+	 * queue and aren't held back by the concurrency limit.
+	 */
+	public void setWaiting(SegmentCacheItem sci, boolean waiting)
+	{
+		synchronized (lock)
+		{
+			boolean queued = pending.remove(sci);
+			sci.waiting = waiting;
+			if (queued) pending.add(sci);
+		}
+		if (waiting) dispatch();
+	}
+
+	/**
+	 * The item's request is over, successfully or not, or it was cancelled.
+	 * bytes is what it delivered; 0 if it failed.
+	 */
+	public void finished(SegmentCacheItem sci, int bytes)
+	{
+		synchronized (lock)
+		{
+			if (pending.remove(sci)) return;
+			if (!inFlight.remove(sci)) return;
+
+			boolean requestDone = true;
+			for (SegmentCacheItem other : sci.requestGroup)
+				requestDone = requestDone && !inFlight.contains(other);
+			if (requestDone) --activeRequests;
+
+			long elapsed = clock.currentTimeMillis() - sci.downloadStartTime;
+			if (bytes > 0 && elapsed > 0)
+				recordRate(sci.scheduledConcurrency, (double)bytes / elapsed);
+		}
+		dispatch();
+	}
+
+	public int getConcurrency()
+	{
+		synchronized (lock)
+		{
+			return concurrent;
+		}
+	}
+
+	private void recordRate(int level, double rate)
+	{
+		if (level < minConcurrent || level > maxConcurrent) return;
+
+		if (rateAtLevel[level] == 0)
+			rateAtLevel[level] = rate;
+		else
+			rateAtLevel[level] += (rate - rateAtLevel[level]) * rateSmoothing;
+
+		// Judge a level only after a full round of requests at it.
+		if (level != concurrent || ++samplesSinceChange < concurrent) return;
+		samplesSinceChange = 0;
+
+		double total = rateAtLevel[concurrent] * concurrent;
+		double previousTotal = (concurrent > minConcurrent) ? rateAtLevel[concurrent - 1] * (concurrent - 1) : 0;
+		double nextTotal = (concurrent < maxConcurrent) ? rateAtLevel[concurrent + 1] * (concurrent + 1) : 0;
+
+		// Grow while it pays, but don't walk straight back up to a level that was worse.
+		boolean growing = (previousTotal == 0 || total > previousTotal * growthThreshold);
+		if (concurrent < maxConcurrent && growing && (nextTotal == 0 || nextTotal > total))
+		{
+			++concurrent;
+			Log.i("SegmentDownloadScheduler", "Raising concurrency to " + concurrent + " (" + (int)(total * 1000 / 1024) + "kb/s total)");
+		}
+		else if (concurrent > minConcurrent && total < previousTotal)
+		{
+			--concurrent;
+			Log.i("SegmentDownloadScheduler", "Lowering concurrency to " + concurrent + " (" + (int)(total * 1000 / 1024) + "kb/s total)");
+		}
+	}
+
+	private void dispatch()
+	{
+		while (true)
+		{
+			SegmentCacheItem [] group = null;
+			synchronized (lock)
+			{
+				SegmentCacheItem next = pending.peek();
+				if (next == null) return;
+
+				// Never make a blocked reader queue behind prefetches.
+				if (activeRequests >= concurrent && !next.waiting) return;
+
+				pending.poll();
+				group = coalesce(next);
+				for (SegmentCacheItem sci : group)
+				{
+					inFlight.add(sci);
+					sci.requestGroup = group;
+					sci.scheduledConcurrency = concurrent;
+					sci.downloadStartTime = clock.currentTimeMillis();
+				}
+				++activeRequests;
+			}
+
+			starter.startRequest(group);
+		}
+	}
+
+	/**
+	 * Pull queued byte ranges that carry on where first's range ends, in the
+	 * same resource, so they go out as one request.
+	 */
+	private SegmentCacheItem [] coalesce(SegmentCacheItem first)
+	{
+		ArrayList<SegmentCacheItem> group = new ArrayList<SegmentCacheItem>();
+		group.add(first);
+
+		long end = first.rangeEnd;
+		while (first.hasByteRange() && group.size() < maxCoalesced)
+		{
+			SegmentCacheItem match = null;
+			for (SegmentCacheItem sci : pending)
+			{
+				if (sci.hasByteRange() && sci.rangeStart == end && sci.resourceUri.equals(first.resourceUri))
+				{
+					match = sci;
+					break;
+				}
+			}
+			if (match == null) break;
+
+			pending.remove(match);
+			group.add(match);
+			end = match.rangeEnd;
+		}
+
+		if (group.size() > 1) Log.i("SegmentDownloadScheduler", "Coalesced " + group.size() + " ranges of " + first.resourceUri);
+		return group.toArray(new SegmentCacheItem[group.size()]);
+	}
+}
@@ -8,6 +8,7 @@ public class ManifestEncryptionKey {
 	private static HashMap KEY_CACHE = new HashMap(); 
 
 	public boolean usePadding = false;
+	public String method = "AES-128";
 	public String iv;
 	public String url;
 	
@@ -37,7 +38,11 @@ public class ManifestEncryptionKey {
 			String name = tokens[i];
 			String value = tokens[i+1];
 			
-			if (name.equals("URI"))
+			if (name.equals("METHOD"))
+			{
+				result.method = value;
+			}
+			else if (name.equals("URI"))
 			{
 				result.url = value;
 			}
@@ -49,6 +54,20 @@ public class ManifestEncryptionKey {
 		return result;
 	}
 
+	public boolean isNone()
+	{
+		return method.equals("NONE");
+	}
+	
+	/**
+	 * SAMPLE-AES encrypts parts of each sample rather than the whole
+	 * segment; the demuxer decrypts those.
+	 */
+	public boolean isSampleAes()
+	{
+		return method.equals("SAMPLE-AES");
+	}
+	
 	public String getIV(int id)
 	{
 		if (iv != null) return iv;
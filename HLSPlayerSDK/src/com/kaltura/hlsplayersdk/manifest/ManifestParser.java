@@ -89,6 +89,28 @@ public class ManifestParser implements OnParseCompleteListener, URLLoader.Downlo
 		return this;		
 	}
 	
+	/**
+	 * Release the native crypto contexts of our segments, and of the
+	 * manifests of our streams and playlists. For when the stream is closed.
+	 */
+	public void releaseCrypto()
+	{
+		for (ManifestSegment seg : segments)
+			seg.releaseCrypto();
+		for (ManifestStream stream : streams)
+		{
+			if (stream.manifest != null)
+				stream.manifest.releaseCrypto();
+			if (stream.backupStream != null && stream.backupStream.manifest != null)
+				stream.backupStream.manifest.releaseCrypto();
+		}
+		for (ManifestPlaylist playList : playLists)
+		{
+			if (playList.manifest != null)
+				playList.manifest.releaseCrypto();
+		}
+	}
+	
 	@Override
 	public String toString()
 	{
@@ -208,7 +230,9 @@ public class ManifestParser implements OnParseCompleteListener, URLLoader.Downlo
 					ManifestSegment segment = as(ManifestSegment.class, lastHint);
 					if (segment != null && segment.byteRangeStart != -1)
 					{
-						// Append akamai ByteRange properties to URL
+						// The cache fetches the range from the resource with a Range
+						// header; the akamai ByteRange properties keep the key unique.
+						segment.resourceUri = targetUrl;
 						String urlPostFix = targetUrl.indexOf( "?" ) == -1 ? "?" : "&";
 						targetUrl += urlPostFix + "range=" + segment.byteRangeStart + "-" + segment.byteRangeEnd;
 					}
@@ -263,7 +287,7 @@ public class ManifestParser implements OnParseCompleteListener, URLLoader.Downlo
 				if (keys.size() > 0) keys.get(keys.size() - 1).endSegmentId = segments.size() - 1;
 				ManifestEncryptionKey key = ManifestEncryptionKey.fromParams(tagParams);
 				key.startSegmentId = segments.size();
-				if (!key.url.contains("://"))
+				if (key.url != null && !key.url.contains("://"))
 				{
 					key.url = getNormalizedUrl(baseUrl, key.url);
 				}
@@ -341,7 +365,7 @@ public class ManifestParser implements OnParseCompleteListener, URLLoader.Downlo
 				String [] byteRangeValues = tagParams.split("@");
 				hintAsSegment.byteRangeStart = byteRangeValues.length > 1 ? Integer.parseInt( byteRangeValues[ 1 ] ) : nextByteRangeStart;
 				hintAsSegment.byteRangeEnd = hintAsSegment.byteRangeStart + Integer.parseInt( byteRangeValues[ 0 ] );
-				nextByteRangeStart = hintAsSegment.byteRangeEnd + 1;
+				nextByteRangeStart = hintAsSegment.byteRangeEnd; // End is exclusive.
 			}
 			else if (tagType.equals("EXT-X-DISCONTINUITY"))
 			{
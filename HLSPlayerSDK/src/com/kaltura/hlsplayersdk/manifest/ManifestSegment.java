@@ -21,17 +21,32 @@ public class ManifestSegment extends BaseManifestItem
 	public int continuityEra;
 	public int quality = 0;
 	
-	// Byte Range support. -1 means no byte range.
+	// Byte Range support. -1 means no byte range. The end is exclusive.
+	// resourceUri is the file the range is taken from; uri stays unique per
+	// segment so the cache can tell ranges apart.
 	public int byteRangeStart = -1;
 	public int byteRangeEnd = -1;
+	public String resourceUri = null;
 	
 	public ManifestSegment altAudioSegment = null;
 	public int altAudioIndex = -1;
 	
 	public ManifestEncryptionKey key = null;
 
+	// Our reference to the native crypto context. Released when the segment
+	// leaves the playlist window or the stream is closed; the cache and the
+	// player take references of their own.
 	public int cryptoId = -1;
 	
+	/**
+	 * The crypto handle for the segment cache to decrypt the whole segment
+	 * with; -1 for SAMPLE-AES, which the demuxer handles.
+	 */
+	public int segmentCryptoId()
+	{
+		return (key != null && key.isSampleAes()) ? -1 : cryptoId;
+	}
+	
 	public double endTime()
 	{
 		return startTime + duration;
@@ -67,18 +82,13 @@ public class ManifestSegment extends BaseManifestItem
 	    return data;
 	}
 
-	public void initializeCrypto(ManifestEncryptionKey eKey)
+	public synchronized void initializeCrypto(ManifestEncryptionKey eKey)
 	{
-		if(cryptoId != -1 || eKey == null)
+		if(cryptoId != -1 || eKey == null || eKey.isNone())
 			return;
 		
 		key = eKey;
 		
-		// If we're already in the cache, use the same handle
-		cryptoId = HLSSegmentCache.getCryptoId(uri);
-		if (cryptoId != -1) 
-			return;
-
 		// Read the key optimistically.
 		ByteBuffer keyBytes = ByteBuffer.allocate(16);
 		HLSSegmentCache.read(key.url, 0, 16, keyBytes);
@@ -90,8 +100,42 @@ public class ManifestSegment extends BaseManifestItem
 
 		byte[] iv = hexStringToByteArray(ivStr);
 
-		cryptoId = SegmentCacheItem.allocAESCryptoState(keyBytes.array(), iv);
+		if (key.isSampleAes())
+			cryptoId = SegmentCacheItem.allocSampleAESCryptoState(keyBytes.array(), iv);
+		else
+			cryptoId = SegmentCacheItem.allocAESCryptoState(keyBytes.array(), iv);
 		Log.i("Crypto", "Got crypto ID " + cryptoId);
 	}
+	
+	/**
+	 * Take over the crypto context of the segment we replace in a reloaded
+	 * playlist, if it has the same key and IV; this saves reading the key
+	 * again. The old segment must not release it afterwards.
+	 */
+	public synchronized boolean takeCrypto(ManifestSegment old, ManifestEncryptionKey eKey)
+	{
+		if (cryptoId != -1 || old.cryptoId == -1 || old.key == null || eKey == null || old.id != id)
+			return false;
+		
+		if (!eKey.method.equals(old.key.method) || eKey.url == null || !eKey.url.equals(old.key.url)
+				|| !eKey.getIV(id).equals(old.key.getIV(id)))
+			return false;
+		
+		key = eKey;
+		cryptoId = old.cryptoId;
+		return true;
+	}
+	
+	/**
+	 * Drop our reference to the native crypto context.
+	 */
+	public synchronized void releaseCrypto()
+	{
+		if (cryptoId != -1)
+		{
+			SegmentCacheItem.freeCryptoState(cryptoId);
+			cryptoId = -1;
+		}
+	}
 
 }
@@ -106,6 +106,7 @@ public class SubTitleSegment implements SegmentCachedListener {
 		//HLSSegmentCache.precache(_url, -1, false, this, HLSPlayerViewController.getHTTPResponseThreadHandler()); //(_url, -1, );
 		Log.i("SubTitleSegment.precache", "Precaching " + this);
 		HLSSegmentCache.precache(_url, -1);
+		if (segmentTimeWindowDuration >= 0) HLSSegmentCache.setDeadline(_url, segmentTimeWindowStart);
 		_precacheRequested = true;
 	}
 	
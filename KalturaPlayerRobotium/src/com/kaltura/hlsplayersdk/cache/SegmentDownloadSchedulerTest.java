@@ -0,0 +1,171 @@
+package com.kaltura.hlsplayersdk.cache;
+
+import java.util.ArrayList;
+
+import junit.framework.TestCase;
+
+/**
+ * Drives a SegmentDownloadScheduler with a fake clock and a simulated link in
+ * place of HTTP, and checks which request goes out next and how many it keeps
+ * in flight as the link changes.
+ */
+public class SegmentDownloadSchedulerTest extends TestCase
+{
+	private static final int segmentBytes = 500 * 1024;
+	private static final int maxConcurrent = 6;
+
+	/**
+	 * Stands in for the network. A request takes the link's latency, plus its
+	 * bytes at the share of the bandwidth it gets among the requests in flight
+	 * when it starts. With contention above 0 each extra connection also costs
+	 * the link throughput, as on a congested pipe.
+	 */
+	private static class FakeLink implements SegmentDownloadScheduler.RequestStarter, SegmentDownloadScheduler.Clock
+	{
+		long now = 0;
+		long latency = 0;
+		double bytesPerMs = 1000;
+		double contention = 0;
+
+		ArrayList<SegmentCacheItem> started = new ArrayList<SegmentCacheItem>();
+		ArrayList<SegmentCacheItem> inFlight = new ArrayList<SegmentCacheItem>();
+		ArrayList<Long> endTimes = new ArrayList<Long>();
+		int mostInFlight = 0;
+
+		public long currentTimeMillis()
+		{
+			return now;
+		}
+
+		public void startRequest(SegmentCacheItem [] group)
+		{
+			for (SegmentCacheItem sci : group)
+			{
+				started.add(sci);
+				inFlight.add(sci);
+			}
+
+			int active = inFlight.size();
+			mostInFlight = Math.max(mostInFlight, active);
+			double share = bytesPerMs / active / (1 + contention * (active - 1));
+			long end = now + latency + (long)(segmentBytes / share);
+			for (int i = 0; i < group.length; ++i)
+				endTimes.add(end);
+		}
+
+		/**
+		 * Complete the request that ends first, moving the clock up to it.
+		 */
+		void completeNext(SegmentDownloadScheduler scheduler)
+		{
+			int first = 0;
+			for (int i = 1; i < endTimes.size(); ++i)
+				if (endTimes.get(i) < endTimes.get(first)) first = i;
+
+			SegmentCacheItem sci = inFlight.remove(first);
+			now = Math.max(now, endTimes.remove(first));
+			scheduler.finished(sci, segmentBytes);
+		}
+	}
+
+	private int itemCount = 0;
+
+	private SegmentCacheItem newItem(String name)
+	{
+		SegmentCacheItem sci = new SegmentCacheItem(null);
+		sci.uri = "http://test/" + name + "_" + (itemCount++) + ".ts";
+		return sci;
+	}
+
+	/**
+	 * Complete count requests, keeping the queue topped up so the scheduler
+	 * always has something to send.
+	 */
+	private void download(FakeLink link, SegmentDownloadScheduler scheduler, int count)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			for (int queued = 0; queued < 8; ++queued)
+				scheduler.enqueue(newItem("seg"));
+			link.completeNext(scheduler);
+		}
+	}
+
+	public void testDeadlineOrder()
+	{
+		FakeLink link = new FakeLink();
+		SegmentDownloadScheduler scheduler = new SegmentDownloadScheduler(link, link);
+
+		// Take every connection, so what follows has to queue.
+		int slots = scheduler.getConcurrency();
+		for (int i = 0; i < slots; ++i)
+			scheduler.enqueue(newItem("busy"));
+		assertEquals(slots, link.started.size());
+
+		double [] deadlines = { 40, 10, 30, 50, 20 };
+		SegmentCacheItem [] queued = new SegmentCacheItem[deadlines.length];
+		for (int i = 0; i < deadlines.length; ++i)
+		{
+			queued[i] = newItem("at" + (int)deadlines[i]);
+			scheduler.setDeadline(queued[i], deadlines[i]);
+			scheduler.enqueue(queued[i]);
+		}
+		assertEquals(slots, link.started.size());
+
+		// A new deadline reorders an item that's already queued.
+		scheduler.setDeadline(queued[3], 5);
+
+		// A blocked reader goes out at once, over the limit.
+		SegmentCacheItem blocked = newItem("blocked");
+		scheduler.enqueue(blocked);
+		assertEquals(slots, link.started.size());
+		scheduler.setWaiting(blocked, true);
+		assertEquals(slots + 1, link.started.size());
+		assertSame(blocked, link.started.get(slots));
+
+		// The rest go out earliest deadline first as connections free up.
+		while (!link.inFlight.isEmpty())
+			link.completeNext(scheduler);
+		SegmentCacheItem [] expected = { queued[3], queued[1], queued[4], queued[2], queued[0] };
+		assertEquals(slots + 1 + expected.length, link.started.size());
+		for (int i = 0; i < expected.length; ++i)
+			assertSame(expected[i], link.started.get(slots + 1 + i));
+	}
+
+	public void testConcurrencyRisesOnHighLatencyLink()
+	{
+		FakeLink link = new FakeLink();
+		link.latency = 400;
+		link.bytesPerMs = 100000;
+		SegmentDownloadScheduler scheduler = new SegmentDownloadScheduler(link, link);
+
+		// Each connection spends most of its time waiting, so each one added
+		// raises the total; it should climb to the limit and stop there.
+		download(link, scheduler, 100);
+		assertEquals(maxConcurrent, scheduler.getConcurrency());
+		assertEquals(maxConcurrent, link.mostInFlight);
+
+		download(link, scheduler, 100);
+		assertEquals(maxConcurrent, scheduler.getConcurrency());
+		assertEquals(maxConcurrent, link.mostInFlight);
+	}
+
+	public void testConcurrencyFallsWhenLinkCongests()
+	{
+		FakeLink link = new FakeLink();
+		link.latency = 400;
+		link.bytesPerMs = 100000;
+		SegmentDownloadScheduler scheduler = new SegmentDownloadScheduler(link, link);
+		download(link, scheduler, 100);
+		assertEquals(maxConcurrent, scheduler.getConcurrency());
+
+		// Now the connections split a narrow pipe and get in each other's
+		// way, so every one added lowers the total; it should back off.
+		link.latency = 0;
+		link.bytesPerMs = 1000;
+		link.contention = 0.5;
+		download(link, scheduler, 200);
+		int concurrency = scheduler.getConcurrency();
+		assertTrue("concurrency " + concurrency + " after congestion", concurrency >= 1 && concurrency <= 3);
+	}
+}
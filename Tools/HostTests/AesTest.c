@@ -0,0 +1,296 @@
+/*
+* Known-answer test and throughput benchmark for the AES-CBC decryptors in
+* HLSPlayerSDK/jni/aes.c, run on the build machine.
+*
+* Every backend compiled for this host is exercised: the portable C code,
+* whichever hardware backend (AES-NI, ARMv8) aes.c picks on this CPU, and
+* the bit-sliced NEON code on ARM. The aes_test_arm_emu build runs the ARM
+* backends on any host, through the intrinsics in host/neon/arm_neon.h.
+* Each must reproduce the FIPS-197 and SP 800-38A vectors, agree with the
+* portable code on random data, and keep the CBC chain across calls.
+*
+*   aes_test          run the checks; exit status is non-zero on failure
+*   aes_test bench    also report decrypt throughput per backend
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aes.h"
+#include "aes_hw.h"
+
+typedef struct {
+    const char *name;
+    AesCbcDecryptFn fn;     // 0 for the portable code
+} Backend;
+
+static Backend gBackends[3];
+static int gBackendCount = 0;
+static int gFailures = 0;
+
+static void Hex(const char *s, unsigned char *out)
+{
+    while (s[0] && s[1]) {
+        unsigned int b;
+        sscanf(s, "%2x", &b);
+        *out++ = (unsigned char)b;
+        s += 2;
+    }
+}
+
+/*
+* A context for key that decrypts with backend. The hardware backends take
+* the decrypt schedule as big-endian bytes, which AesCtxIni only fills in
+* when it picked one itself.
+*/
+static void BackendCtx(AesCtx *ctx, const Backend *backend, const unsigned char *key,
+                       unsigned int keyLen, const unsigned char *iv)
+{
+    int i;
+
+    AesCtxIni(ctx, (unsigned char *)iv, (unsigned char *)key, keyLen, CBC);
+    ctx->Backend = backend->fn;
+    for (i = 0; i < 4 * (ctx->Nr + 1); i++) {
+        ctx->Rk[4 * i    ] = (unsigned char)(ctx->Dk[i] >> 24);
+        ctx->Rk[4 * i + 1] = (unsigned char)(ctx->Dk[i] >> 16);
+        ctx->Rk[4 * i + 2] = (unsigned char)(ctx->Dk[i] >>  8);
+        ctx->Rk[4 * i + 3] = (unsigned char)(ctx->Dk[i]      );
+    }
+}
+
+static void Check(int ok, const Backend *backend, const char *what)
+{
+    if (!ok) {
+        printf("FAIL  %-9s %s\n", backend->name, what);
+        gFailures++;
+    }
+}
+
+/*
+* FIPS-197 appendix C. One block decrypted in CBC mode with a zero IV is the
+* bare inverse cipher, so the backends can run these too.
+*/
+static void TestFips197(const Backend *backend)
+{
+    static const struct {
+        const char *key, *ct;
+    } vectors[] = {
+        { "000102030405060708090a0b0c0d0e0f",
+          "69c4e0d86a7b0430d8cdb78070b4c55a" },
+        { "000102030405060708090a0b0c0d0e0f1011121314151617",
+          "dda97ca4864cdfe06eaf70a0ec0d7191" },
+        { "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f",
+          "8ea2b7ca516745bfeafc49904b496089" },
+    };
+    unsigned char key[32], iv[16], pt[16], buf[16];
+    unsigned int i;
+
+    memset(iv, 0, sizeof(iv));
+    Hex("00112233445566778899aabbccddeeff", pt);
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        AesCtx ctx;
+        char what[64];
+        unsigned int keyLen = strlen(vectors[i].key) / 2;
+
+        Hex(vectors[i].key, key);
+        Hex(vectors[i].ct, buf);
+        BackendCtx(&ctx, backend, key, keyLen, iv);
+        AesDecrypt(&ctx, buf, buf, 16);
+
+        sprintf(what, "FIPS-197 C.%u (AES-%u)", i + 1, keyLen * 8);
+        Check(memcmp(buf, pt, 16) == 0, backend, what);
+    }
+}
+
+/*
+* SP 800-38A F.2.2, F.2.4 and F.2.6: four blocks of CBC, decrypted in one
+* call, in place, and again split 16 + 48 to check the chain carries over.
+*/
+static void TestSp80038a(const Backend *backend)
+{
+    static const struct {
+        const char *name, *key, *ct;
+    } vectors[] = {
+        { "F.2.2 (CBC-AES128)",
+          "2b7e151628aed2a6abf7158809cf4f3c",
+          "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+          "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7" },
+        { "F.2.4 (CBC-AES192)",
+          "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+          "4f021db243bc633d7178183a9fa071e8b4d9ada9ad7dedf4e5e738763f69145a"
+          "571b242012fb7ae07fa9baac3df102e008b0e27988598881d920a9e64f5615cd" },
+        { "F.2.6 (CBC-AES256)",
+          "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+          "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+          "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b" },
+    };
+    unsigned char key[32], iv[16], pt[64], ct[64], buf[64];
+    unsigned int i;
+
+    Hex("000102030405060708090a0b0c0d0e0f", iv);
+    Hex("6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+        "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710", pt);
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        AesCtx ctx;
+        char what[64];
+        unsigned int keyLen = strlen(vectors[i].key) / 2;
+
+        Hex(vectors[i].key, key);
+        Hex(vectors[i].ct, ct);
+
+        memcpy(buf, ct, 64);
+        BackendCtx(&ctx, backend, key, keyLen, iv);
+        AesDecrypt(&ctx, buf, buf, 64);
+        sprintf(what, "SP 800-38A %s", vectors[i].name);
+        Check(memcmp(buf, pt, 64) == 0, backend, what);
+
+        memcpy(buf, ct, 64);
+        BackendCtx(&ctx, backend, key, keyLen, iv);
+        AesDecrypt(&ctx, buf, buf, 16);
+        AesDecrypt(&ctx, buf + 16, buf + 16, 48);
+        sprintf(what, "SP 800-38A %s, split", vectors[i].name);
+        Check(memcmp(buf, pt, 64) == 0, backend, what);
+    }
+}
+
+/*
+* Random keys, IVs and lengths, so every unrolled path and tail in the
+* backends runs, out of place and in place, against the portable code's
+* encryption.
+*/
+static void TestRandom(const Backend *backend)
+{
+    static unsigned char pt[1024], ct[1024], buf[1024];
+    int round;
+
+    srand(1);
+    for (round = 0; round < 2000; round++) {
+        unsigned char key[32], iv[16];
+        unsigned int keyLen = (round % 3 == 0) ? KEY128 : (round % 3 == 1) ? KEY192 : KEY256;
+        unsigned int len = 16 * (1 + rand() % 64);
+        unsigned int i;
+        AesCtx enc, dec;
+
+        for (i = 0; i < sizeof(key); i++) key[i] = rand();
+        for (i = 0; i < sizeof(iv); i++) iv[i] = rand();
+        for (i = 0; i < len; i++) pt[i] = rand();
+
+        AesCtxIni(&enc, iv, key, keyLen, CBC);
+        AesEncrypt(&enc, pt, ct, len);
+
+        BackendCtx(&dec, backend, key, keyLen, iv);
+        AesDecrypt(&dec, ct, buf, len);
+        if (memcmp(buf, pt, len) != 0) {
+            Check(0, backend, "random round trip");
+            return;
+        }
+
+        memcpy(buf, ct, len);
+        BackendCtx(&dec, backend, key, keyLen, iv);
+        AesDecrypt(&dec, buf, buf, len);
+        if (memcmp(buf, pt, len) != 0) {
+            Check(0, backend, "random round trip, in place");
+            return;
+        }
+    }
+}
+
+static double Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A segment's worth of data, decrypted in place over and over.
+static void Bench(const Backend *backend)
+{
+    const unsigned int size = 1 << 20;
+    unsigned char key[16], iv[16];
+    unsigned char *buf = (unsigned char *)malloc(size);
+    double start, elapsed;
+    unsigned int i;
+    int passes = 0;
+    AesCtx ctx;
+
+    memset(key, 0x2b, sizeof(key));
+    memset(iv, 0, sizeof(iv));
+    for (i = 0; i < size; i++) buf[i] = (unsigned char)i;
+
+    BackendCtx(&ctx, backend, key, KEY128, iv);
+    start = Now();
+    do {
+        AesDecrypt(&ctx, buf, buf, size);
+        passes++;
+        elapsed = Now() - start;
+    } while (elapsed < 1.0);
+
+    printf("%-9s %8.1f MB/s\n", backend->name, passes * (size / 1048576.0) / elapsed);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char key[16] = { 0 };
+    AesCtx probe;
+    int i;
+
+    // Whatever aes.c chooses for this CPU is what the player would use.
+    AesCtxIni(&probe, 0, key, KEY128, CBC);
+
+    gBackends[gBackendCount].name = "portable";
+    gBackends[gBackendCount].fn = 0;
+    gBackendCount++;
+#if defined(HLS_AES_ARM_EMULATED)
+    // Built against host/neon/arm_neon.h, so the ARM backends run anywhere.
+    gBackends[gBackendCount].name = "armv8";
+    gBackends[gBackendCount].fn = AesArmv8CbcDecrypt;
+    gBackendCount++;
+    gBackends[gBackendCount].name = "neon";
+    gBackends[gBackendCount].fn = AesNeonCbcDecrypt;
+    gBackendCount++;
+#else
+#if defined(HLS_AES_NI)
+    if (probe.Backend == AesNiCbcDecrypt) {
+        gBackends[gBackendCount].name = "aes-ni";
+        gBackends[gBackendCount].fn = AesNiCbcDecrypt;
+        gBackendCount++;
+    }
+#endif
+#if defined(HLS_AES_ARMV8)
+    if (probe.Backend == AesArmv8CbcDecrypt) {
+        gBackends[gBackendCount].name = "armv8";
+        gBackends[gBackendCount].fn = AesArmv8CbcDecrypt;
+        gBackendCount++;
+    }
+#endif
+#if defined(HLS_AES_NEON)
+    // NEON is always there on the AArch64 hosts this is built for.
+    gBackends[gBackendCount].name = "neon";
+    gBackends[gBackendCount].fn = AesNeonCbcDecrypt;
+    gBackendCount++;
+#endif
+#endif
+    if (gBackendCount == 1)
+        printf("No hardware AES backend for this host; testing the portable code only.\n");
+
+    for (i = 0; i < gBackendCount; i++) {
+        int failures = gFailures;
+        TestFips197(&gBackends[i]);
+        TestSp80038a(&gBackends[i]);
+        TestRandom(&gBackends[i]);
+        if (gFailures == failures)
+            printf("ok    %s\n", gBackends[i].name);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        printf("\nAES-128-CBC decrypt, 1MB in place:\n");
+        for (i = 0; i < gBackendCount; i++)
+            Bench(&gBackends[i]);
+    }
+
+    return gFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,248 @@
+/*
+ * Host stand-ins for the platform code androidVideoShim.h reaches through
+ * searchSymbol(). On a device those symbols come from libutils and
+ * libstagefright; here RefBase gets a plain reference count and MetaData a
+ * small key/value store, which is all the demuxer needs.
+ *
+ * The shim looks a symbol up on every call, so lookups are cached by the
+ * address of the name.
+ */
+
+#include <map>
+#include <string>
+
+#include "androidVideoShim.h"
+
+using android_video_shim::RefBase;
+
+namespace android_video_shim {
+
+int gAPILevel = 19;
+
+const char *MEDIA_MIMETYPE_VIDEO_AVC = "video/avc";
+const char *MEDIA_MIMETYPE_VIDEO_MPEG4 = "video/mp4v-es";
+const char *MEDIA_MIMETYPE_VIDEO_MPEG2 = "video/mpeg2";
+const char *MEDIA_MIMETYPE_AUDIO_MPEG = "audio/mpeg";
+const char *MEDIA_MIMETYPE_AUDIO_MPEG_LAYER_I = "audio/mpeg-L1";
+const char *MEDIA_MIMETYPE_AUDIO_MPEG_LAYER_II = "audio/mpeg-L2";
+const char *MEDIA_MIMETYPE_AUDIO_AAC = "audio/mp4a-latm";
+const char *MEDIA_MIMETYPE_AUDIO_RAW = "audio/raw";
+
+}  // namespace android_video_shim
+
+namespace {
+
+// RefBase: the count lives in mRefs, which the platform uses for a pointer
+// to its own bookkeeping.
+
+void RefBaseCtor(void *thiz) {
+    static_cast<RefBase *>(thiz)->mRefs = 0;
+}
+
+void RefBaseDtor(void *thiz) {
+}
+
+void RefBaseIncStrong(void *thiz, void *id) {
+    RefBase *base = static_cast<RefBase *>(thiz);
+    if (__sync_add_and_fetch((intptr_t *)&base->mRefs, 1) == 1) {
+        base->onFirstRef();
+    }
+}
+
+void RefBaseDecStrong(void *thiz, void *id) {
+    RefBase *base = static_cast<RefBase *>(thiz);
+    if (__sync_sub_and_fetch((intptr_t *)&base->mRefs, 1) == 0) {
+        base->onLastStrongRef(id);
+        delete base;
+    }
+}
+
+// MetaData: entries are kept beside the object rather than in it.
+
+struct Entry {
+    uint32_t type;
+    std::string data;
+};
+
+typedef std::map<uint32_t, Entry> Entries;
+
+pthread_mutex_t gMetaLock = PTHREAD_MUTEX_INITIALIZER;
+std::map<const void *, Entries> gMeta;
+
+Entries &EntriesFor(const void *meta) {
+    return gMeta[meta];
+}
+
+void MetaDataCtor(void *thiz) {
+    pthread_mutex_lock(&gMetaLock);
+    gMeta[thiz].clear();
+    pthread_mutex_unlock(&gMetaLock);
+}
+
+void MetaDataDtor(void *thiz) {
+    pthread_mutex_lock(&gMetaLock);
+    gMeta.erase(thiz);
+    pthread_mutex_unlock(&gMetaLock);
+}
+
+bool MetaDataSetData(void *thiz, uint32_t key, uint32_t type, const void *data, size_t size) {
+    pthread_mutex_lock(&gMetaLock);
+    Entries &entries = EntriesFor(thiz);
+    bool replaced = entries.find(key) != entries.end();
+    Entry &entry = entries[key];
+    entry.type = type;
+    entry.data.assign((const char *)data, size);
+    pthread_mutex_unlock(&gMetaLock);
+    return replaced;
+}
+
+bool MetaDataFindData(void *thiz, uint32_t key, uint32_t *type, const void **data, size_t *size) {
+    pthread_mutex_lock(&gMetaLock);
+    Entries &entries = EntriesFor(thiz);
+    Entries::iterator it = entries.find(key);
+    bool found = it != entries.end();
+    if (found) {
+        *type = it->second.type;
+        *data = it->second.data.data();
+        *size = it->second.data.size();
+    }
+    pthread_mutex_unlock(&gMetaLock);
+    return found;
+}
+
+enum {
+    TYPE_C_STRING = 'cstr',
+    TYPE_INT32    = 'in32',
+    TYPE_INT64    = 'in64',
+    TYPE_FLOAT    = 'floa',
+    TYPE_POINTER  = 'ptr ',
+};
+
+template <typename T>
+bool FindValue(void *thiz, uint32_t key, uint32_t wantType, T *value) {
+    uint32_t type;
+    const void *data;
+    size_t size;
+    if (!MetaDataFindData(thiz, key, &type, &data, &size)
+            || type != wantType || size != sizeof(T)) {
+        return false;
+    }
+    memcpy(value, data, sizeof(T));
+    return true;
+}
+
+bool MetaDataSetCString(void *thiz, uint32_t key, const char *value) {
+    return MetaDataSetData(thiz, key, TYPE_C_STRING, value, strlen(value) + 1);
+}
+
+bool MetaDataSetInt32(void *thiz, uint32_t key, int32_t value) {
+    return MetaDataSetData(thiz, key, TYPE_INT32, &value, sizeof(value));
+}
+
+bool MetaDataSetInt64(void *thiz, uint32_t key, int64_t value) {
+    return MetaDataSetData(thiz, key, TYPE_INT64, &value, sizeof(value));
+}
+
+bool MetaDataSetFloat(void *thiz, uint32_t key, float value) {
+    return MetaDataSetData(thiz, key, TYPE_FLOAT, &value, sizeof(value));
+}
+
+bool MetaDataSetPointer(void *thiz, uint32_t key, void *value) {
+    return MetaDataSetData(thiz, key, TYPE_POINTER, &value, sizeof(value));
+}
+
+bool MetaDataFindCString(void *thiz, uint32_t key, const char **value) {
+    uint32_t type;
+    const void *data;
+    size_t size;
+    if (!MetaDataFindData(thiz, key, &type, &data, &size) || type != TYPE_C_STRING) {
+        return false;
+    }
+    *value = (const char *)data;
+    return true;
+}
+
+bool MetaDataFindInt32(void *thiz, uint32_t key, int32_t *value) {
+    return FindValue(thiz, key, TYPE_INT32, value);
+}
+
+bool MetaDataFindInt64(void *thiz, uint32_t key, int64_t *value) {
+    return FindValue(thiz, key, TYPE_INT64, value);
+}
+
+bool MetaDataFindPointer(void *thiz, uint32_t key, void **value) {
+    return FindValue(thiz, key, TYPE_POINTER, value);
+}
+
+void MetaDataDumpToLog(void *thiz) {
+}
+
+struct Symbol {
+    const char *name;
+    void *fn;
+};
+
+const Symbol kSymbols[] = {
+    { "_ZN7android7RefBaseC2Ev", (void *)RefBaseCtor },
+    { "_ZN7android7RefBaseD2Ev", (void *)RefBaseDtor },
+    { "_ZNK7android7RefBase9incStrongEPKv", (void *)RefBaseIncStrong },
+    { "_ZNK7android7RefBase9decStrongEPKv", (void *)RefBaseDecStrong },
+    { "_ZN7android8MetaDataC1Ev", (void *)MetaDataCtor },
+    { "_ZN7android8MetaDataD1Ev", (void *)MetaDataDtor },
+    { "_ZNK7android8MetaData8findDataEjPjPPKvS1_", (void *)MetaDataFindData },
+    { "_ZN7android8MetaData7setDataEjjPKvj", (void *)MetaDataSetData },
+    { "_ZN7android8MetaData10setCStringEjPKc", (void *)MetaDataSetCString },
+    { "_ZN7android8MetaData8setInt32Eji", (void *)MetaDataSetInt32 },
+    { "_ZN7android8MetaData8setInt64Ejx", (void *)MetaDataSetInt64 },
+    { "_ZN7android8MetaData8setFloatEjf", (void *)MetaDataSetFloat },
+    { "_ZN7android8MetaData10setPointerEjPv", (void *)MetaDataSetPointer },
+    { "_ZN7android8MetaData11findCStringEjPPKc", (void *)MetaDataFindCString },
+    { "_ZN7android8MetaData9findInt32EjPi", (void *)MetaDataFindInt32 },
+    { "_ZN7android8MetaData9findInt64EjPx", (void *)MetaDataFindInt64 },
+    { "_ZN7android8MetaData11findPointerEjPPv", (void *)MetaDataFindPointer },
+    { "_ZNK7android8MetaData9dumpToLogEv", (void *)MetaDataDumpToLog },
+};
+
+const size_t kCacheSize = 64;
+Symbol gCache[kCacheSize];
+size_t gCacheCount = 0;
+pthread_mutex_t gCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+}  // namespace
+
+namespace android_video_shim {
+
+void *searchSymbol(const char *symName) {
+    size_t count = __sync_fetch_and_add(&gCacheCount, 0);
+    for (size_t i = 0; i < count; i++) {
+        if (gCache[i].name == symName) {
+            return gCache[i].fn;
+        }
+    }
+
+    void *fn = NULL;
+    for (size_t i = 0; i < sizeof(kSymbols) / sizeof(kSymbols[0]); i++) {
+        if (strcmp(kSymbols[i].name, symName) == 0) {
+            fn = kSymbols[i].fn;
+            break;
+        }
+    }
+
+    if (fn == NULL) {
+        fprintf(stderr, "HostShim: no host version of %s\n", symName);
+        abort();
+    }
+
+    pthread_mutex_lock(&gCacheLock);
+    if (gCacheCount < kCacheSize) {
+        gCache[gCacheCount].name = symName;
+        gCache[gCacheCount].fn = fn;
+        __sync_synchronize();
+        gCacheCount++;
+    }
+    pthread_mutex_unlock(&gCacheLock);
+
+    return fn;
+}
+
+}  // namespace android_video_shim
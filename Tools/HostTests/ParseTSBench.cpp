@@ -0,0 +1,406 @@
+/*
+ * Microbenchmark for ATSParser on the host: how many transport stream
+ * packets per second it gets through.
+ *
+ * The input is generated: a program with 2Mbit/s of H.264 (an IDR frame
+ * with SPS and PPS every second, P frames between) and 128kbit/s of ADTS
+ * AAC, PAT and PMT before every IDR frame and a PCR with each video PES
+ * packet, muxed the way HLS segmenters do. Access units are dequeued as
+ * the player would, so the sources don't grow without bound.
+ *
+ * Built twice: parse_ts_bench against ATSParser as it is, and
+ * parse_ts_bench_baseline with HLS_ATS_BITREADER_BASELINE, which puts back
+ * the ABitReader decode of the packet header, so the two numbers show what
+ * decoding it with byte operations is worth.
+ *
+ *   parse_ts_bench [seconds of stream]
+ */
+
+#include <sys/time.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "ATSParser.h"
+#include "AnotherPacketSource.h"
+#include "ABuffer.h"
+
+using namespace android;
+
+namespace {
+
+const size_t kPacketSize = 188;
+const unsigned kPMTPID = 0x1000;
+const unsigned kVideoPID = 0x100;
+const unsigned kAudioPID = 0x101;
+const int kFrameRate = 30;
+
+#ifdef HLS_ATS_BITREADER_BASELINE
+const char *kHeaderDecode = "ABitReader header decode (before)";
+#else
+const char *kHeaderDecode = "byte operation header decode (after)";
+#endif
+
+struct BitWriter {
+    std::vector<uint8_t> bytes;
+    unsigned bits;
+
+    BitWriter() : bits(0) {}
+
+    void put(uint32_t value, unsigned count) {
+        while (count-- > 0) {
+            if (bits % 8 == 0) {
+                bytes.push_back(0);
+            }
+            if ((value >> count) & 1) {
+                bytes.back() |= 0x80 >> (bits % 8);
+            }
+            bits++;
+        }
+    }
+
+    void ue(uint32_t value) {
+        unsigned length = 0;
+        for (uint32_t v = value + 1; v > 1; v >>= 1) {
+            length++;
+        }
+        put(0, length);
+        put(value + 1, length + 1);
+    }
+
+    void trailing() {
+        put(1, 1);
+        while (bits % 8 != 0) {
+            put(0, 1);
+        }
+    }
+};
+
+// Baseline profile, 640x368, one reference frame.
+std::vector<uint8_t> MakeSPS() {
+    BitWriter w;
+    w.put(0x67, 8);         // NAL header
+    w.put(66, 8);           // profile_idc
+    w.put(0, 8);            // constraint flags
+    w.put(30, 8);           // level_idc
+    w.ue(0);                // seq_parameter_set_id
+    w.ue(0);                // log2_max_frame_num_minus4
+    w.ue(2);                // pic_order_cnt_type
+    w.ue(1);                // max_num_ref_frames
+    w.put(0, 1);            // gaps_in_frame_num_value_allowed_flag
+    w.ue(640 / 16 - 1);     // pic_width_in_mbs_minus1
+    w.ue(368 / 16 - 1);     // pic_height_in_map_units_minus1
+    w.put(1, 1);            // frame_mbs_only_flag
+    w.put(1, 1);            // direct_8x8_inference_flag
+    w.put(0, 1);            // frame_cropping_flag
+    w.put(0, 1);            // vui_parameters_present_flag
+    w.trailing();
+    return w.bytes;
+}
+
+std::vector<uint8_t> MakePPS() {
+    BitWriter w;
+    w.put(0x68, 8);         // NAL header
+    w.ue(0);                // pic_parameter_set_id
+    w.ue(0);                // seq_parameter_set_id
+    w.put(0, 1);            // entropy_coding_mode_flag
+    w.put(0, 1);            // bottom_field_pic_order_in_frame_present_flag
+    w.ue(0);                // num_slice_groups_minus1
+    w.ue(0);                // num_ref_idx_l0_default_active_minus1
+    w.ue(0);                // num_ref_idx_l1_default_active_minus1
+    w.put(0, 1);            // weighted_pred_flag
+    w.put(0, 2);            // weighted_bipred_idc
+    w.ue(0);                // pic_init_qp_minus26 (se 0)
+    w.ue(0);                // pic_init_qs_minus26 (se 0)
+    w.ue(0);                // chroma_qp_index_offset (se 0)
+    w.put(1, 1);            // deblocking_filter_control_present_flag
+    w.put(0, 1);            // constrained_intra_pred_flag
+    w.put(0, 1);            // redundant_pic_cnt_present_flag
+    w.trailing();
+    return w.bytes;
+}
+
+// Slice data that can't contain a start code.
+void AppendFiller(std::vector<uint8_t> *out, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        out->push_back(1 + rand() % 255);
+    }
+}
+
+void AppendNAL(std::vector<uint8_t> *out, const std::vector<uint8_t> &nal) {
+    static const uint8_t kStartCode[] = { 0, 0, 0, 1 };
+    out->insert(out->end(), kStartCode, kStartCode + 4);
+    out->insert(out->end(), nal.begin(), nal.end());
+}
+
+std::vector<uint8_t> MakeVideoFrame(bool idr, size_t size) {
+    static const std::vector<uint8_t> sps = MakeSPS();
+    static const std::vector<uint8_t> pps = MakePPS();
+
+    std::vector<uint8_t> frame;
+    std::vector<uint8_t> aud(2);
+    aud[0] = 0x09;
+    aud[1] = 0xf0;
+    AppendNAL(&frame, aud);
+    if (idr) {
+        AppendNAL(&frame, sps);
+        AppendNAL(&frame, pps);
+    }
+
+    std::vector<uint8_t> slice;
+    slice.push_back(idr ? 0x65 : 0x41);
+    slice.push_back(0x88);  // first_mb_in_slice 0, then anything
+    AppendFiller(&slice, size);
+    AppendNAL(&frame, slice);
+    return frame;
+}
+
+// AAC LC, 44.1kHz stereo.
+std::vector<uint8_t> MakeAudioFrame(size_t size) {
+    size_t length = size + 7;
+    std::vector<uint8_t> frame(7);
+    frame[0] = 0xff;
+    frame[1] = 0xf1;
+    frame[2] = (1 << 6) | (4 << 2) | (2 >> 2);
+    frame[3] = ((2 & 3) << 6) | ((length >> 11) & 3);
+    frame[4] = (length >> 3) & 0xff;
+    frame[5] = ((length & 7) << 5) | 0x1f;
+    frame[6] = 0xfc;
+    AppendFiller(&frame, size);
+    return frame;
+}
+
+uint32_t CRC32(const uint8_t *data, size_t size) {
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= (uint32_t)data[i] << 24;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+struct Muxer {
+    std::vector<uint8_t> out;
+    uint8_t continuity[8192];
+
+    Muxer() {
+        memset(continuity, 0, sizeof(continuity));
+    }
+
+    // One packet carrying up to 184 - adaptation bytes of payload; returns
+    // how much it took.
+    size_t writePacket(unsigned PID, bool start, const uint8_t *payload, size_t size,
+                       const uint64_t *PCR) {
+        uint8_t packet[kPacketSize];
+        packet[0] = 0x47;
+        packet[1] = (start ? 0x40 : 0) | (PID >> 8);
+        packet[2] = PID & 0xff;
+
+        size_t adaptation = 0;
+        if (PCR != NULL) {
+            adaptation = 8;
+        }
+        if (size < 184 - adaptation) {
+            adaptation = 184 - size;
+        }
+        size_t take = 184 - adaptation;
+        if (take > size) {
+            take = size;
+        }
+
+        packet[3] = (adaptation > 0 ? 0x30 : 0x10) | (continuity[PID]++ & 0x0f);
+        uint8_t *p = packet + 4;
+        if (adaptation > 0) {
+            p[0] = adaptation - 1;
+            if (adaptation > 1) {
+                p[1] = (PCR != NULL) ? 0x10 : 0;
+                size_t used = 2;
+                if (PCR != NULL) {
+                    uint64_t base = *PCR;
+                    p[2] = base >> 25;
+                    p[3] = base >> 17;
+                    p[4] = base >> 9;
+                    p[5] = base >> 1;
+                    p[6] = ((base & 1) << 7) | 0x7e;
+                    p[7] = 0;
+                    used = 8;
+                }
+                memset(p + used, 0xff, adaptation - used);
+            }
+            p += adaptation;
+        }
+        memcpy(p, payload, take);
+        out.insert(out.end(), packet, packet + kPacketSize);
+        return take;
+    }
+
+    void writeSection(unsigned PID, const std::vector<uint8_t> &body) {
+        std::vector<uint8_t> section(1, 0);    // pointer_field
+        section.insert(section.end(), body.begin(), body.end());
+        uint32_t crc = CRC32(&body[0], body.size());
+        section.push_back(crc >> 24);
+        section.push_back(crc >> 16);
+        section.push_back(crc >> 8);
+        section.push_back(crc);
+        writePacket(PID, true, &section[0], section.size(), NULL);
+    }
+
+    void writeTables() {
+        static const uint8_t kPAT[] = {
+            0x00, 0xb0, 13, 0x00, 0x01, 0xc1, 0x00, 0x00,
+            0x00, 0x01, 0xe0 | (kPMTPID >> 8), kPMTPID & 0xff,
+        };
+        static const uint8_t kPMT[] = {
+            0x02, 0xb0, 23, 0x00, 0x01, 0xc1, 0x00, 0x00,
+            0xe0 | (kVideoPID >> 8), kVideoPID & 0xff, 0xf0, 0x00,
+            0x1b, 0xe0 | (kVideoPID >> 8), kVideoPID & 0xff, 0xf0, 0x00,
+            0x0f, 0xe0 | (kAudioPID >> 8), kAudioPID & 0xff, 0xf0, 0x00,
+        };
+        writeSection(0, std::vector<uint8_t>(kPAT, kPAT + sizeof(kPAT)));
+        writeSection(kPMTPID, std::vector<uint8_t>(kPMT, kPMT + sizeof(kPMT)));
+    }
+
+    void writePES(unsigned PID, uint8_t streamId, uint64_t PTS,
+                  const std::vector<uint8_t> &data, bool withPCR) {
+        std::vector<uint8_t> pes;
+        size_t length = data.size() + 8;
+        pes.push_back(0);
+        pes.push_back(0);
+        pes.push_back(1);
+        pes.push_back(streamId);
+        pes.push_back(length > 0xffff ? 0 : length >> 8);
+        pes.push_back(length > 0xffff ? 0 : length & 0xff);
+        pes.push_back(0x80);
+        pes.push_back(0x80);    // PTS only
+        pes.push_back(5);
+        pes.push_back(0x21 | ((PTS >> 29) & 0x0e));
+        pes.push_back(PTS >> 22);
+        pes.push_back(0x01 | ((PTS >> 14) & 0xfe));
+        pes.push_back(PTS >> 7);
+        pes.push_back(0x01 | ((PTS << 1) & 0xfe));
+        pes.insert(pes.end(), data.begin(), data.end());
+
+        uint64_t PCR = PTS - 9000;
+        size_t offset = 0;
+        bool first = true;
+        while (offset < pes.size()) {
+            offset += writePacket(PID, first, &pes[offset], pes.size() - offset,
+                                  (first && withPCR) ? &PCR : NULL);
+            first = false;
+        }
+    }
+};
+
+std::vector<uint8_t> MakeStream(int seconds) {
+    Muxer mux;
+    srand(1);
+
+    const uint64_t kStartPTS = 900000;
+    const int kAudioFramesPerPES = 3;
+    const double kAudioFrameTicks = 1024 * 90000.0 / 44100;
+    double nextAudioPTS = kStartPTS;
+
+    for (int frame = 0; frame < seconds * kFrameRate; frame++) {
+        bool idr = (frame % kFrameRate) == 0;
+        uint64_t PTS = kStartPTS + frame * (90000 / kFrameRate);
+
+        if (idr) {
+            mux.writeTables();
+        }
+
+        // 2Mbit/s: an IDR frame of about a third of a second's worth.
+        size_t size = idr ? 80000 : 5800;
+        mux.writePES(kVideoPID, 0xe0, PTS, MakeVideoFrame(idr, size), true);
+
+        while (nextAudioPTS < PTS + 90000 / kFrameRate) {
+            std::vector<uint8_t> audio;
+            for (int i = 0; i < kAudioFramesPerPES; i++) {
+                std::vector<uint8_t> aac = MakeAudioFrame(364);
+                audio.insert(audio.end(), aac.begin(), aac.end());
+            }
+            mux.writePES(kAudioPID, 0xc0, (uint64_t)nextAudioPTS, audio, false);
+            nextAudioPTS += kAudioFramesPerPES * kAudioFrameTicks;
+        }
+    }
+
+    return mux.out;
+}
+
+size_t Drain(const sp<ATSParser> &parser, ATSParser::SourceType type) {
+    sp<AnotherPacketSource> source = parser->getSource(type);
+    if (source == NULL) {
+        return 0;
+    }
+
+    size_t count = 0;
+    status_t result;
+    while (source->hasBufferAvailable(&result)) {
+        sp<ABuffer> accessUnit;
+        if (source->dequeueAccessUnit(&accessUnit) != OK) {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    int seconds = (argc > 1) ? atoi(argv[1]) : 60;
+    std::vector<uint8_t> stream = MakeStream(seconds);
+    size_t packets = stream.size() / kPacketSize;
+
+    printf("%d s of stream, %zu packets (%.1f MB)\n",
+           seconds, packets, stream.size() / 1048576.0);
+
+    double best = 0;
+    size_t videoUnits = 0, audioUnits = 0;
+    for (int pass = 0; pass < 5; pass++) {
+        sp<ATSParser> parser = new ATSParser(ATSParser::TS_TIMESTAMPS_ARE_ABSOLUTE);
+        videoUnits = audioUnits = 0;
+
+        double start = Now();
+        for (size_t i = 0; i < packets; i++) {
+            status_t err = parser->feedTSPacket(&stream[i * kPacketSize], kPacketSize);
+            if (err != OK) {
+                fprintf(stderr, "feedTSPacket failed at packet %zu: %d\n", i, err);
+                return 1;
+            }
+            if ((i & 1023) == 1023) {
+                videoUnits += Drain(parser, ATSParser::VIDEO);
+                audioUnits += Drain(parser, ATSParser::AUDIO);
+            }
+        }
+        videoUnits += Drain(parser, ATSParser::VIDEO);
+        audioUnits += Drain(parser, ATSParser::AUDIO);
+        double elapsed = Now() - start;
+
+        double rate = packets / elapsed;
+        if (rate > best) {
+            best = rate;
+        }
+    }
+
+    printf("%zu video and %zu audio access units\n", videoUnits, audioUnits);
+    printf("%s, best of 5: %.0f packets/s (%.1f MB/s)\n",
+           kHeaderDecode, best, best * kPacketSize / 1048576.0);
+
+    // Nearly every frame must come out, or we're timing the wrong thing.
+    if (videoUnits + 2 < (size_t)seconds * kFrameRate) {
+        fprintf(stderr, "expected %d video access units\n", seconds * kFrameRate);
+        return 1;
+    }
+    return 0;
+}
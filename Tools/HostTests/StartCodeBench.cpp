@@ -0,0 +1,275 @@
+/*
+ * Correctness check and throughput benchmark for FindStartCode() in
+ * mpeg2ts_parser/StartCode.cpp, run on the build machine.
+ *
+ * FindStartCode() must agree with a naive scan at every length and
+ * alignment. The benchmark walks every start code in a buffer, as NAL
+ * splitting does, with the kernel StartCode.cpp picks for this CPU and with
+ * the two loops it replaced: the byte-at-a-time search getNextNALUnit()
+ * used, and the skip-by-three scan ESQueue's resync used.
+ *
+ * The benchmark runs on generated slice data unless given a capture: a
+ * raw H.264 elementary stream, or a transport stream segment, of which the
+ * packet payloads are searched, as ESQueue sees them.
+ *
+ *   start_code_bench                  run the checks; exit status is non-zero on failure
+ *   start_code_bench bench [capture]  also report throughput
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "StartCode.h"
+
+using android::FindStartCode;
+
+namespace {
+
+typedef size_t (*SearchFn)(const uint8_t *data, size_t size);
+
+size_t Naive(const uint8_t *data, size_t size) {
+    for (size_t i = 0; i + 2 < size; ++i) {
+        if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            return i;
+        }
+    }
+    return size;
+}
+
+// getNextNALUnit() before FindStartCode(): find a 01, then look behind it.
+size_t ByteLoop(const uint8_t *data, size_t size) {
+    size_t offset = 2;
+    for (;;) {
+        while (offset < size && data[offset] != 0x01) {
+            ++offset;
+        }
+        if (offset >= size) {
+            return size;
+        }
+        if (data[offset - 1] == 0x00 && data[offset - 2] == 0x00) {
+            return offset - 2;
+        }
+        ++offset;
+    }
+}
+
+// ESQueue's NextStartCode() before FindStartCode().
+size_t SkipScalar(const uint8_t *data, size_t size) {
+    for (size_t i = 0; i + 2 < size; ++i) {
+        if (data[i + 2] > 1) {
+            i += 2;
+        } else if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1) {
+            return i;
+        }
+    }
+    return size;
+}
+
+int gFailures = 0;
+
+void Check(bool ok, const char *what, size_t size, size_t offset) {
+    if (!ok) {
+        printf("FAIL  %s (size %zu, offset %zu)\n", what, size, offset);
+        gFailures++;
+    }
+}
+
+// Bytes mostly 0 and 1, so partial and overlapping start codes are common.
+void TestRandom() {
+    static uint8_t buffer[300 + 16];
+
+    srand(1);
+    for (int round = 0; round < 500000 && gFailures == 0; round++) {
+        size_t offset = rand() % 16;
+        size_t size = rand() % 300;
+        uint8_t *data = buffer + offset;
+        for (size_t i = 0; i < size; i++) {
+            int r = rand() % 8;
+            data[i] = (r < 3) ? 0 : (r < 5) ? 1 : rand();
+        }
+        Check(FindStartCode(data, size) == Naive(data, size),
+              "random buffer", size, offset);
+    }
+}
+
+// One start code at each position of buffers around the vector width,
+// including straddling the end of a 16-byte step and the end of the buffer.
+void TestPositions() {
+    static uint8_t buffer[64 + 16];
+
+    for (size_t offset = 0; offset < 16; offset++) {
+        uint8_t *data = buffer + offset;
+        for (size_t size = 0; size <= 64; size++) {
+            memset(data, 0xff, size);
+            Check(FindStartCode(data, size) == size, "no start code", size, offset);
+
+            for (size_t at = 0; at + 3 <= size; at++) {
+                memset(data, 0xff, size);
+                data[at] = 0;
+                data[at + 1] = 0;
+                data[at + 2] = 1;
+                Check(FindStartCode(data, size) == at, "single start code", size, at);
+            }
+
+            // 00 00 at the very end must not match.
+            if (size >= 2) {
+                memset(data, 0xff, size);
+                data[size - 2] = 0;
+                data[size - 1] = 0;
+                Check(FindStartCode(data, size) == size, "truncated start code", size, offset);
+            }
+        }
+    }
+}
+
+double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Every start code in data, found one after another.
+size_t WalkStartCodes(SearchFn fn, const uint8_t *data, size_t size) {
+    size_t count = 0;
+    size_t offset = 0;
+    for (;;) {
+        offset += fn(data + offset, size - offset);
+        if (offset >= size) {
+            return count;
+        }
+        count++;
+        offset += 3;
+    }
+}
+
+void Bench(const char *name, SearchFn fn, const uint8_t *data, size_t size,
+           size_t expected) {
+    double start, elapsed;
+    int passes = 0;
+
+    start = Now();
+    do {
+        if (WalkStartCodes(fn, data, size) != expected) {
+            Check(false, name, size, 0);
+            return;
+        }
+        passes++;
+        elapsed = Now() - start;
+    } while (elapsed < 1.0);
+
+    printf("  %-14s %8.1f MB/s\n", name, passes * (size / 1048576.0) / elapsed);
+}
+
+void BenchInput(const char *what, const uint8_t *data, size_t size) {
+    size_t expected = WalkStartCodes(Naive, data, size);
+
+    printf("\n%s, %zu start codes in %.1f MB:\n", what, expected, size / 1048576.0);
+    Bench("byte loop", ByteLoop, data, size, expected);
+    Bench("skip scalar", SkipScalar, data, size, expected);
+    Bench("FindStartCode", FindStartCode, data, size, expected);
+}
+
+// A transport stream is cut down to its packet payloads; anything else is
+// taken as elementary stream.
+bool LoadCapture(const char *path, std::vector<uint8_t> *out) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    std::vector<uint8_t> bytes;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        bytes.insert(bytes.end(), chunk, chunk + n);
+    }
+    fclose(file);
+
+    const size_t kPacketSize = 188;
+    bool ts = bytes.size() >= kPacketSize && bytes.size() % kPacketSize == 0;
+    for (size_t i = 0; ts && i < bytes.size(); i += kPacketSize) {
+        ts = bytes[i] == 0x47;
+    }
+    if (!ts) {
+        out->swap(bytes);
+        return !out->empty();
+    }
+
+    out->clear();
+    for (size_t i = 0; i < bytes.size(); i += kPacketSize) {
+        const uint8_t *packet = &bytes[i];
+        unsigned afc = (packet[3] >> 4) & 3;
+        size_t payload = 4;
+        if (afc & 2) {
+            payload += 1 + packet[4];
+        }
+        if ((afc & 1) && payload < kPacketSize) {
+            out->insert(out->end(), packet + payload, packet + kPacketSize);
+        }
+    }
+    return !out->empty();
+}
+
+void BenchCapture(const char *path) {
+    std::vector<uint8_t> data;
+    if (!LoadCapture(path, &data)) {
+        printf("FAIL  can't read capture %s\n", path);
+        gFailures++;
+        return;
+    }
+    BenchInput(path, &data[0], data.size());
+}
+
+void BenchAll() {
+    const size_t size = 4 << 20;
+    uint8_t *data = (uint8_t *)malloc(size);
+
+    // Coded slices: no 00 00 0x inside a NAL unit (emulation prevention),
+    // with a start code every 6KB or so, like 2Mbit/s video.
+    srand(2);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = 1 + rand() % 255;
+    }
+    for (size_t i = 0; i + 4 < size; i += 4096 + rand() % 4096) {
+        data[i] = 0;
+        data[i + 1] = 0;
+        data[i + 2] = 0;
+        data[i + 3] = 1;
+    }
+    BenchInput("Slice data", data, size);
+
+    // Mostly zeros, as in padding or flat regions before entropy coding;
+    // the skip-by-three trick gets no purchase here.
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (rand() % 16 == 0) ? 2 + rand() % 254 : 0;
+    }
+    for (size_t i = 0; i + 4 < size; i += 4096 + rand() % 4096) {
+        data[i + 3] = 1;
+    }
+    BenchInput("Zero-heavy data", data, size);
+
+    free(data);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    TestPositions();
+    TestRandom();
+    if (gFailures == 0) {
+        printf("ok    FindStartCode\n");
+    }
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        if (argc > 2) {
+            BenchCapture(argv[2]);
+        } else {
+            BenchAll();
+        }
+    }
+
+    return gFailures == 0 ? 0 : 1;
+}
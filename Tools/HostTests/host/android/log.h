@@ -0,0 +1,40 @@
+/*
+* Host stand-in for the NDK log header. Logging is compiled out so that it
+* doesn't distort the benchmarks.
+*/
+
+#ifndef _HOST_ANDROID_LOG_H_
+#define _HOST_ANDROID_LOG_H_
+
+#include <stdarg.h>
+
+// The sources rely on these arriving through the log header, as they do
+// with the platform's bionic headers.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum {
+    ANDROID_LOG_UNKNOWN = 0,
+    ANDROID_LOG_DEFAULT,
+    ANDROID_LOG_VERBOSE,
+    ANDROID_LOG_DEBUG,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+    ANDROID_LOG_SILENT,
+};
+
+static inline int __android_log_print(int prio, const char *tag, const char *fmt, ...)
+{
+    return 0;
+}
+
+static inline int __android_log_vprint(int prio, const char *tag, const char *fmt, va_list ap)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,44 @@
+/*
+* Just enough of jni.h for the native headers to compile on the host. The
+* host tests never call into Java.
+*/
+
+#ifndef _HOST_JNI_H_
+#define _HOST_JNI_H_
+
+#include <stdint.h>
+
+typedef uint8_t  jboolean;
+typedef int8_t   jbyte;
+typedef uint16_t jchar;
+typedef int16_t  jshort;
+typedef int32_t  jint;
+typedef int64_t  jlong;
+typedef float    jfloat;
+typedef double   jdouble;
+typedef jint     jsize;
+
+typedef struct _jobject *jobject;
+typedef jobject jclass;
+typedef jobject jstring;
+typedef jobject jarray;
+typedef jobject jbyteArray;
+typedef jobject jshortArray;
+typedef jobject jthrowable;
+
+typedef struct _jmethodID *jmethodID;
+typedef struct _jfieldID *jfieldID;
+
+// Declared for inline code in the headers; never defined or called.
+struct _JNIEnv {
+    jclass FindClass(const char *name);
+    jfieldID GetFieldID(jclass clazz, const char *name, const char *sig);
+    jint GetIntField(jobject obj, jfieldID field);
+};
+typedef struct _JNIEnv JNIEnv;
+typedef struct _JavaVM JavaVM;
+
+#define JNIEXPORT
+#define JNICALL
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * Plain C versions of the NEON and ARMv8 AES intrinsics the ARM code in
+ * HLSPlayerSDK/jni uses, so that code can be run through its tests on a host
+ * without an ARM CPU or emulator. Only on the include path of the
+ * *_arm_emu targets; a real ARM build gets the compiler's arm_neon.h.
+ *
+ * These follow the ARM definitions lane by lane, not for speed. Timings of
+ * code built against them mean nothing.
+ */
+
+#ifndef HOST_ARM_NEON_H_
+#define HOST_ARM_NEON_H_
+
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t uint8x16_t __attribute__((vector_size(16)));
+typedef uint8_t uint8x8_t __attribute__((vector_size(8)));
+typedef uint16_t uint16x8_t __attribute__((vector_size(16)));
+typedef uint32_t uint32x4_t __attribute__((vector_size(16)));
+typedef uint64_t uint64x2_t __attribute__((vector_size(16)));
+
+typedef struct {
+    uint8x8_t val[2];
+} uint8x8x2_t;
+
+static inline uint8x16_t vld1q_u8(const uint8_t *p)
+{
+    uint8x16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void vst1q_u8(uint8_t *p, uint8x16_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline uint8x16_t vdupq_n_u8(uint8_t x)
+{
+    uint8x16_t v;
+    memset(&v, x, sizeof(v));
+    return v;
+}
+
+static inline uint8x16_t veorq_u8(uint8x16_t a, uint8x16_t b) { return a ^ b; }
+static inline uint8x16_t vandq_u8(uint8x16_t a, uint8x16_t b) { return a & b; }
+static inline uint8x16_t vorrq_u8(uint8x16_t a, uint8x16_t b) { return a | b; }
+
+static inline uint8x16_t vceqq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return (uint8x16_t)(a == b);
+}
+
+static inline uint8x16_t vtstq_u8(uint8x16_t a, uint8x16_t b)
+{
+    return (uint8x16_t)((a & b) != 0);
+}
+
+#define vshrq_n_u8(a, n) ((uint8x16_t)((a) >> (n)))
+#define vshlq_n_u8(a, n) ((uint8x16_t)((a) << (n)))
+#define vshlq_n_u32(a, n) ((uint32x4_t)((a) << (n)))
+
+// Shift b right by n and insert it under the top n bits of a.
+#define vsriq_n_u32(a, b, n) \
+    ((uint32x4_t)(((a) & ~(0xffffffffu >> (n))) | ((b) >> (n))))
+
+#define vgetq_lane_u64(v, lane) ((v)[lane])
+
+static inline uint8x16_t vreinterpretq_u8_u16(uint16x8_t v) { return (uint8x16_t)v; }
+static inline uint8x16_t vreinterpretq_u8_u32(uint32x4_t v) { return (uint8x16_t)v; }
+static inline uint16x8_t vreinterpretq_u16_u8(uint8x16_t v) { return (uint16x8_t)v; }
+static inline uint32x4_t vreinterpretq_u32_u8(uint8x16_t v) { return (uint32x4_t)v; }
+static inline uint64x2_t vreinterpretq_u64_u8(uint8x16_t v) { return (uint64x2_t)v; }
+
+static inline uint16x8_t vrev32q_u16(uint16x8_t v)
+{
+    uint16x8_t r;
+    int i;
+    for (i = 0; i < 8; i += 2) {
+        r[i] = v[i + 1];
+        r[i + 1] = v[i];
+    }
+    return r;
+}
+
+static inline uint8x8_t vget_low_u8(uint8x16_t v)
+{
+    uint8x8_t r;
+    memcpy(&r, &v, 8);
+    return r;
+}
+
+static inline uint8x8_t vget_high_u8(uint8x16_t v)
+{
+    uint8x8_t r;
+    memcpy(&r, (const uint8_t *)&v + 8, 8);
+    return r;
+}
+
+static inline uint8x16_t vcombine_u8(uint8x8_t lo, uint8x8_t hi)
+{
+    uint8x16_t r;
+    memcpy(&r, &lo, 8);
+    memcpy((uint8_t *)&r + 8, &hi, 8);
+    return r;
+}
+
+// Out of range indices give 0.
+static inline uint8x8_t vtbl2_u8(uint8x8x2_t t, uint8x8_t index)
+{
+    uint8x8_t r;
+    int i;
+    for (i = 0; i < 8; i++)
+        r[i] = index[i] < 8 ? t.val[0][index[i]] : index[i] < 16 ? t.val[1][index[i] - 8] : 0;
+    return r;
+}
+
+static inline uint8x16_t vqtbl1q_u8(uint8x16_t t, uint8x16_t index)
+{
+    uint8x16_t r;
+    int i;
+    for (i = 0; i < 16; i++)
+        r[i] = index[i] < 16 ? t[index[i]] : 0;
+    return r;
+}
+
+// ARMv8 AES: AESD is AddRoundKey, InvShiftRows, InvSubBytes; AESIMC is
+// InvMixColumns.
+
+static inline uint8_t HostGfMul(uint8_t a, uint8_t b)
+{
+    uint8_t r = 0;
+    while (b) {
+        if (b & 1)
+            r ^= a;
+        a = (uint8_t)((a << 1) ^ ((a & 0x80) ? 0x1b : 0));
+        b >>= 1;
+    }
+    return r;
+}
+
+static inline uint8_t HostInvSbox(uint8_t s)
+{
+    static uint8_t table[256];
+    static int ready = 0;
+    if (!ready) {
+        int x;
+        for (x = 0; x < 256; x++) {
+            // S(x) = affine(x^-1), with x^-1 = x^254.
+            uint8_t inv = 1, b, out;
+            int i;
+            for (i = 0; i < 254; i++)
+                inv = HostGfMul(inv, (uint8_t)x);
+            b = inv;
+            out = 0x63;
+            for (i = 0; i < 8; i++) {
+                int bit = ((b >> i) ^ (b >> ((i + 4) & 7)) ^ (b >> ((i + 5) & 7)) ^
+                           (b >> ((i + 6) & 7)) ^ (b >> ((i + 7) & 7))) & 1;
+                out ^= (uint8_t)(bit << i);
+            }
+            table[out] = (uint8_t)x;
+        }
+        ready = 1;
+    }
+    return table[s];
+}
+
+static inline uint8x16_t vaesdq_u8(uint8x16_t data, uint8x16_t key)
+{
+    uint8x16_t s = data ^ key, r;
+    int row, col;
+    for (col = 0; col < 4; col++)
+        for (row = 0; row < 4; row++)
+            r[row + 4 * col] = HostInvSbox(s[row + 4 * ((col - row) & 3)]);
+    return r;
+}
+
+static inline uint8x16_t vaesimcq_u8(uint8x16_t s)
+{
+    uint8x16_t r;
+    int col;
+    for (col = 0; col < 4; col++) {
+        uint8_t a0 = s[4 * col], a1 = s[4 * col + 1], a2 = s[4 * col + 2], a3 = s[4 * col + 3];
+        r[4 * col]     = HostGfMul(a0, 14) ^ HostGfMul(a1, 11) ^ HostGfMul(a2, 13) ^ HostGfMul(a3, 9);
+        r[4 * col + 1] = HostGfMul(a0, 9) ^ HostGfMul(a1, 14) ^ HostGfMul(a2, 11) ^ HostGfMul(a3, 13);
+        r[4 * col + 2] = HostGfMul(a0, 13) ^ HostGfMul(a1, 9) ^ HostGfMul(a2, 14) ^ HostGfMul(a3, 11);
+        r[4 * col + 3] = HostGfMul(a0, 11) ^ HostGfMul(a1, 13) ^ HostGfMul(a2, 9) ^ HostGfMul(a3, 14);
+    }
+    return r;
+}
+
+#endif  // HOST_ARM_NEON_H_